@@ -0,0 +1,67 @@
+#! /bin/bash
+
+# Compares /dev/calypso0 without the block cache (block_cache_kb=0) and with
+# it, for fio rewriting a few hot blocks the way a journal or a bitmap is,
+# with an fsync every FSYNC_EVERY writes. Reports the write IOPS and mean
+# latency, and the write amplification: blocks written to the native
+# partition per block written to the Calypso device
+#
+# Needs fio
+#
+# To execute:
+#   $ bash block_cache_fio.sh
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+CALYPSO_DEV=/dev/calypso0
+DISK=sda8
+TOTAL_BLOCK_COUNT=100000
+RUNTIME=30
+BLOCK_CACHE_KB=16384
+FSYNC_EVERY="1 32 256"
+
+# sectors written to the native partition, field 7 of its stat file
+function disk_sectors_written() {
+    awk '{ print $7 }' /sys/class/block/$DISK/stat
+}
+
+function run_fio() {
+    local block_cache_kb=$1
+    local fsync=$2
+
+    local sectors_before=$(disk_sectors_written)
+    # terse output has the KiB written in field 47, the write IOPS in field 49 and the mean write latency in us in field 81
+    local result=$(sudo fio --name=calypso --filename=$CALYPSO_DEV --rw=randwrite --bs=4k \
+        --random_distribution=zipf:1.2 --size=64m --fsync=$fsync --ioengine=psync \
+        --time_based --runtime=${RUNTIME} --output-format=terse)
+    sync
+    local sectors_after=$(disk_sectors_written)
+
+    echo "$result" | awk -F';' -v kb=$block_cache_kb -v fsync=$fsync -v sectors=$((sectors_after - sectors_before)) \
+        '{ printf "block_cache_kb=%s fsync=%s: write IOPS %s, mean latency %s us, write amplification %.2f\n", kb, fsync, $49, $81, (sectors / 8) / ($47 / 4) }'
+}
+
+function run_block_cache() {
+    local block_cache_kb=$1
+
+    if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+    then
+        sudo rmmod $CALYPSO_MODULE_NAME
+    fi
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 block_cache_kb=${block_cache_kb}
+
+    for fsync in $FSYNC_EVERY
+    do
+        run_fio $block_cache_kb $fsync
+    done
+    echo "block writes absorbed: $(cat $CALYPSO_SYSFS/block_cache_writes)," \
+        "blocks written back: $(cat $CALYPSO_SYSFS/block_cache_writebacks)"
+
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+echo "------- without and with the block cache -------"
+run_block_cache 0
+run_block_cache $BLOCK_CACHE_KB
@@ -0,0 +1,36 @@
+#! /bin/bash
+
+# Counts the cache misses of the host write hook while the host writes
+# randomly all over the native partition with Calypso loaded, so the
+# per-block state lookups dominate. Run it on two builds of the module
+# to compare them, e.g. before and after a change to the block state
+#
+# Needs fio and perf
+#
+# To execute:
+#   $ bash hook_cache_misses.sh [path to calypso_driver.ko]
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH=${1:-"../calypso_driver.ko"}
+
+DISK=/dev/sda8
+TOTAL_BLOCK_COUNT=100000
+# hidden data written first, so part of the host writes land on Calypso blocks
+HIDDEN_DATA_BLOCKS=50000
+RUNTIME=60
+
+if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+then
+    sudo rmmod $CALYPSO_MODULE_NAME
+fi
+sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1
+sudo dd if=/dev/urandom of=/dev/calypso0 bs=4096 count=$HIDDEN_DATA_BLOCKS oflag=direct status=none
+
+echo "------- Host random writes with $CALYPSO_MODULE_PATH -------"
+# the hook runs in the context of the process submitting the bio, so fio's misses include it
+sudo perf stat -e cache-references,cache-misses,L1-dcache-load-misses,LLC-load-misses -- \
+    fio --name=host --filename=$DISK --rw=randwrite --bs=4k --direct=1 \
+        --ioengine=psync --numjobs=4 --group_reporting \
+        --time_based --runtime=${RUNTIME} --output-format=terse > /dev/null
+
+sudo rmmod $CALYPSO_MODULE_NAME
@@ -0,0 +1,74 @@
+#! /bin/bash
+
+# Host throughput on the native partition without Calypso, with Calypso
+# loaded and its verbose messages off, and with them on through printk
+# and through the calypso_debug tracepoint, to see what the messages cost
+# the hook. Then 1 MiB sequential writes without and with Calypso, for
+# what checking every block of large writes costs the hook
+#
+# Needs fio
+#
+# To execute:
+#   $ bash host_throughput.sh
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+CALYPSO_TRACE_EVENT="/sys/kernel/debug/tracing/events/calypso/calypso_debug/enable"
+
+DISK=/dev/sda8
+TOTAL_BLOCK_COUNT=100000
+RUNTIME=30
+
+function run_fio() {
+    local label=$1
+    local rw=${2:-randwrite}
+    local bs=${3:-4k}
+
+    # terse output has the write bandwidth in KiB/s in field 48 and the IOPS in field 49
+    sudo fio --name=host --filename=$DISK --rw=$rw --bs=$bs --direct=1 \
+        --ioengine=libaio --iodepth=32 --numjobs=4 --group_reporting \
+        --time_based --runtime=${RUNTIME} --output-format=terse \
+        | awk -F';' -v label="$label" '{ print label ": " $48 " KiB/s, " $49 " IOPS" }'
+}
+
+function run_with_calypso() {
+    local label=$1
+    local debug_level=$2
+    local debug_backend=$3
+    local rw=$4
+    local bs=$5
+
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1
+    echo $debug_level | sudo tee $CALYPSO_SYSFS/debug_level > /dev/null
+    echo $debug_backend | sudo tee $CALYPSO_SYSFS/debug_backend > /dev/null
+    if [[ $debug_backend == trace ]]
+    then
+        echo 1 | sudo tee $CALYPSO_TRACE_EVENT > /dev/null
+    fi
+    run_fio "$label" $rw $bs
+    if [[ $debug_backend == trace ]]
+    then
+        echo 0 | sudo tee $CALYPSO_TRACE_EVENT > /dev/null
+    fi
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+then
+    sudo rmmod $CALYPSO_MODULE_NAME
+fi
+
+echo "------- Host random writes to $DISK -------"
+run_fio "without Calypso"
+run_with_calypso "Calypso, verbose messages off" 4 printk
+run_with_calypso "Calypso, verbose messages with printk" 7 printk
+run_with_calypso "Calypso, verbose messages with the tracepoint" 7 trace
+
+echo "------- Host 1 MiB sequential writes to $DISK -------"
+run_fio "without Calypso" write 1M
+run_with_calypso "Calypso, verbose messages off" 4 printk write 1M
+if [[ -e /sys/kernel/debug/tracing/trace ]]
+then
+    sudo sh -c "echo > /sys/kernel/debug/tracing/trace"
+fi
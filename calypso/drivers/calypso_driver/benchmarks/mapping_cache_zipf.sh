@@ -0,0 +1,59 @@
+#! /bin/bash
+
+# Measures the mapping cache of mapping_format=2 under zipfian random reads,
+# for several amounts of memory given to it. Reports the hit rate, how long
+# requests waited for a page to be read, and the read latency seen by fio
+#
+# Needs fio and jq
+#
+# To execute:
+#   $ bash mapping_cache_zipf.sh
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+# 4 GiB of hidden data, whose mappings take 4 MiB
+TOTAL_BLOCK_COUNT=1000000
+CACHE_SIZES_KB="64 256 1024 4096"
+ZIPF_THETA=1.2
+RUNTIME=60
+
+function run_workload() {
+    local cache_kb=$1
+    local hits misses
+
+    if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+    then
+        sudo rmmod $CALYPSO_MODULE_NAME
+    fi
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 mapping_format=2 mapping_cache_kb=${cache_kb}
+
+    # every block mapped, so the pages of mappings exist on disk
+    sudo dd if=/dev/urandom of=/dev/calypso0 bs=1M count=$((TOTAL_BLOCK_COUNT / 256)) oflag=direct status=none
+
+    hits=$(cat $CALYPSO_SYSFS/mapping_cache_hits)
+    misses=$(cat $CALYPSO_SYSFS/mapping_cache_misses)
+
+    sudo fio --name=zipf --filename=/dev/calypso0 --rw=randread --bs=4k --direct=1 \
+        --ioengine=libaio --iodepth=16 --random_distribution=zipf:${ZIPF_THETA} \
+        --time_based --runtime=${RUNTIME} --output-format=json > zipf_${cache_kb}.json
+
+    hits=$(( $(cat $CALYPSO_SYSFS/mapping_cache_hits) - hits ))
+    misses=$(( $(cat $CALYPSO_SYSFS/mapping_cache_misses) - misses ))
+
+    echo "mapping_cache_kb=${cache_kb}:" \
+        "hit rate $(echo "scale=4; $hits / ($hits + $misses)" | bc)," \
+        "average fault $(cat $CALYPSO_SYSFS/mapping_cache_fault_us) us," \
+        "read latency mean $(jq '.jobs[0].read.clat_ns.mean / 1000 | floor' zipf_${cache_kb}.json) us," \
+        "p99 $(jq '.jobs[0].read.clat_ns.percentile["99.000000"] / 1000 | floor' zipf_${cache_kb}.json) us," \
+        "IOPS $(jq '.jobs[0].read.iops | floor' zipf_${cache_kb}.json)"
+
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+echo "------- Mapping cache under zipf:${ZIPF_THETA} random reads -------"
+for cache_kb in $CACHE_SIZES_KB
+do
+    run_workload $cache_kb
+done
@@ -0,0 +1,42 @@
+#! /bin/bash
+
+# Times mkfs.ext4 on /dev/calypso0 and reports the free blocks it used up,
+# with the blocks written with zeros unmapped (zero_elision=1) and written
+# like any other block (zero_elision=0). lazy_itable_init=0 has mkfs zero
+# the inode tables itself, with write zeroes when the device supports them
+#
+# To execute:
+#   $ bash mkfs_zero_blocks.sh
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+TOTAL_BLOCK_COUNT=100000
+
+function run_mkfs() {
+    local zero_elision=$1
+
+    if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+    then
+        sudo rmmod $CALYPSO_MODULE_NAME
+    fi
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 zero_elision=${zero_elision}
+
+    local free_before=$(cat $CALYPSO_SYSFS/free_high_entropy_blocks)
+    local start=$(date +%s.%N)
+    sudo mkfs.ext4 -q -E nodiscard,lazy_itable_init=0,lazy_journal_init=0 /dev/calypso0
+    sync
+    local end=$(date +%s.%N)
+    local free_after=$(cat $CALYPSO_SYSFS/free_high_entropy_blocks)
+
+    echo "zero_elision=$zero_elision: $(echo "$end - $start" | bc) s," \
+        "$((free_before - free_after)) free blocks used," \
+        "$(cat $CALYPSO_SYSFS/zero_blocks) zero blocks unmapped"
+
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+echo "------- mkfs.ext4 with and without zero block elision -------"
+run_mkfs 0
+run_mkfs 1
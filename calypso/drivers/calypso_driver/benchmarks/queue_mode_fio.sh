@@ -0,0 +1,56 @@
+#! /bin/bash
+
+# Compares the throughput of /dev/calypso0 when bios are remapped as they
+# are submitted (queue_mode=0) and when they go through the blk-mq queue
+# (queue_mode=1), for 1, 4 and 16 fio jobs doing 4k random reads and writes
+#
+# Needs fio
+#
+# To execute:
+#   $ bash queue_mode_fio.sh
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+
+CALYPSO_DEV=/dev/calypso0
+TOTAL_BLOCK_COUNT=100000
+RUNTIME=30
+JOBS="1 4 16"
+
+function run_fio() {
+    local queue_mode=$1
+    local rw=$2
+    local numjobs=$3
+
+    # terse output has the read IOPS in field 8 and the write IOPS in field 49
+    sudo fio --name=calypso --filename=$CALYPSO_DEV --rw=$rw --bs=4k --direct=1 \
+        --ioengine=libaio --iodepth=32 --numjobs=$numjobs --group_reporting \
+        --time_based --runtime=${RUNTIME} --output-format=terse \
+        | awk -F';' -v mode=$queue_mode -v rw=$rw -v jobs=$numjobs \
+            '{ print "queue_mode=" mode, rw, jobs " jobs:", "read IOPS " $8 ", write IOPS " $49 }'
+}
+
+function run_queue_mode() {
+    local queue_mode=$1
+
+    if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+    then
+        sudo rmmod $CALYPSO_MODULE_NAME
+    fi
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 queue_mode=${queue_mode}
+
+    # every block mapped first, so reads do not allocate
+    sudo dd if=/dev/urandom of=$CALYPSO_DEV bs=4096 count=$TOTAL_BLOCK_COUNT oflag=direct status=none
+
+    for numjobs in $JOBS
+    do
+        run_fio $queue_mode randwrite $numjobs
+        run_fio $queue_mode randread $numjobs
+    done
+
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+echo "------- bio path vs blk-mq queue -------"
+run_queue_mode 0
+run_queue_mode 1
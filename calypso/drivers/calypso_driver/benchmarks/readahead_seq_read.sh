@@ -0,0 +1,54 @@
+#! /bin/bash
+
+# Sequential read throughput of /dev/calypso0 on an aged volume, whose
+# blocks were written in random order so they are scattered over the native
+# partition, without the read cache, with it but without readahead, and
+# with readahead. Caches are cleaned before every read
+#
+# Needs fio
+#
+# To execute:
+#   $ bash readahead_seq_read.sh
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+CALYPSO_DEV=/dev/calypso0
+TOTAL_BLOCK_COUNT=100000
+READ_CACHE_KB=65536
+
+function run_seq_read() {
+    local read_cache_kb=$1
+    local readahead_kb=$2
+
+    if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+    then
+        sudo rmmod $CALYPSO_MODULE_NAME
+    fi
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 \
+        read_cache_kb=${read_cache_kb} readahead_kb=${readahead_kb}
+
+    # ages the volume: every block written once, in random order
+    sudo fio --name=age --filename=$CALYPSO_DEV --rw=randwrite --bs=4k --direct=1 \
+        --ioengine=libaio --iodepth=32 --norandommap --randrepeat=0 \
+        --size=$((TOTAL_BLOCK_COUNT * 4))k --output-format=terse > /dev/null
+    bash ../clean_caches.sh > /dev/null
+
+    # 128k reads, one at a time, like a program reading a file
+    local result=$(sudo dd if=$CALYPSO_DEV of=/dev/null bs=128k count=$((TOTAL_BLOCK_COUNT / 32)) iflag=direct 2>&1 | tail -1)
+    echo "read_cache_kb=$read_cache_kb readahead_kb=$readahead_kb: $result"
+    if [ $read_cache_kb -gt 0 ]
+    then
+        echo "    blocks read ahead: $(cat $CALYPSO_SYSFS/readahead_blocks)," \
+            "read afterwards: $(cat $CALYPSO_SYSFS/readahead_hits)," \
+            "final window: $(cat $CALYPSO_SYSFS/readahead_window) blocks"
+    fi
+
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+echo "------- sequential reads of scattered blocks -------"
+run_seq_read 0 0
+run_seq_read $READ_CACHE_KB 0
+run_seq_read $READ_CACHE_KB 1024
@@ -0,0 +1,53 @@
+#! /bin/bash
+
+# Replays a host workload on the native partition with Calypso loaded and
+# reports how many Calypso blocks had to be relocated per GB the host wrote,
+# first with the old first-free-block placement and then with cold placement
+#
+# To record a workload on the host:
+#   $ sudo blktrace -d /dev/sda8 -o - | blkparse -i - -d host_workload.bin
+#
+# To execute:
+#   $ bash relocation_rate.sh host_workload.bin
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+TOTAL_BLOCK_COUNT=100000
+# hidden data written before the replay, so there is something to relocate
+HIDDEN_DATA_BLOCKS=50000
+
+WORKLOAD=$1
+
+if [[ -z $WORKLOAD ]]
+then
+    echo "usage: bash relocation_rate.sh <blktrace dump of the host workload>"
+    exit 1
+fi
+
+function run_workload() {
+    local cold_placement=$1
+
+    if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+    then
+        sudo rmmod $CALYPSO_MODULE_NAME
+    fi
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 cold_placement=${cold_placement}
+
+    sudo dd if=/dev/urandom of=/dev/calypso0 bs=4096 count=$HIDDEN_DATA_BLOCKS oflag=direct status=none
+
+    sudo fio --name=replay --read_iolog=$WORKLOAD --replay_redirect=$DISK --ioengine=libaio --direct=1 > /dev/null
+
+    echo "cold_placement=${cold_placement}:" \
+        "host bytes written $(cat $CALYPSO_SYSFS/host_bytes_written)," \
+        "relocations $(cat $CALYPSO_SYSFS/relocations)," \
+        "relocations per GB $(cat $CALYPSO_SYSFS/relocations_per_gb)"
+
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+echo "------- Relocations per GB written by the host -------"
+run_workload 0
+run_workload 1
@@ -0,0 +1,76 @@
+#! /bin/bash
+
+# Compares the bios Calypso splits requests into being submitted in the
+# order of the virtual blocks (sorted_submission=0) and sorted by sector
+# (sorted_submission=1), on an aged volume whose blocks are scattered over
+# the native partition. Reports the time of 1 MiB sequential reads and
+# writes and the distance the disk head travels, the sum of the sector
+# distances between consecutive dispatches to the native partition.
+#
+# Seeks only cost time on a rotational disk. Without one, the head travel
+# is what tells the two apart: DISK can be a partition of a loop device
+# over a file on a disk, with its queue marked as rotational
+#
+# Needs fio and blktrace
+#
+# To execute:
+#   $ bash sorted_submission_seeks.sh
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+
+CALYPSO_DEV=/dev/calypso0
+DISK=/dev/sda8
+TOTAL_BLOCK_COUNT=100000
+TRACE_DIR=$(mktemp -d)
+
+# sum of the sector distances between consecutive dispatches in the trace
+function head_travel() {
+    blkparse -q -i $TRACE_DIR/trace -a issue -f "%S\n" 2> /dev/null \
+        | awk 'NR > 1 { d = $1 - last; total += d < 0 ? -d : d } { last = $1 } END { print total + 0 }'
+}
+
+function run_sorted_submission() {
+    local sorted_submission=$1
+    local rw=$2
+
+    if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+    then
+        sudo rmmod $CALYPSO_MODULE_NAME
+    fi
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 sorted_submission=${sorted_submission}
+
+    # ages the volume: every block written once, in random order
+    sudo fio --name=age --filename=$CALYPSO_DEV --rw=randwrite --bs=4k --direct=1 \
+        --ioengine=libaio --iodepth=32 --norandommap --randrepeat=0 \
+        --size=$((TOTAL_BLOCK_COUNT * 4))k --output-format=terse > /dev/null
+    bash ../clean_caches.sh > /dev/null
+
+    sudo blktrace -d $DISK -o trace -D $TRACE_DIR &
+    local trace_pid=$!
+    sleep 1
+    local start=$(date +%s.%N)
+    if [ $rw == "read" ]
+    then
+        sudo dd if=$CALYPSO_DEV of=/dev/null bs=1M count=$((TOTAL_BLOCK_COUNT / 256)) iflag=direct status=none
+    else
+        sudo dd if=/dev/urandom of=$CALYPSO_DEV bs=1M count=$((TOTAL_BLOCK_COUNT / 256)) oflag=direct status=none
+    fi
+    local end=$(date +%s.%N)
+    sudo kill -INT $trace_pid
+    wait $trace_pid
+
+    echo "sorted_submission=$sorted_submission $rw: $(echo "$end - $start" | bc) s," \
+        "head travel $(head_travel) sectors"
+
+    rm -f $TRACE_DIR/trace.*
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+echo "------- bios of a request in virtual order vs sorted by sector -------"
+for rw in read write
+do
+    run_sorted_submission 0 $rw
+    run_sorted_submission 1 $rw
+done
+rm -rf $TRACE_DIR
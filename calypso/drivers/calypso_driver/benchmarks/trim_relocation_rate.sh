@@ -0,0 +1,58 @@
+#! /bin/bash
+
+# Fills a file system on Calypso, deletes most of it and then has the host
+# write all over the native partition, without and with fstrim on the
+# Calypso file system in between, and reports the relocations per GB the
+# host wrote in each case
+#
+# Needs fio
+#
+# To execute:
+#   $ bash trim_relocation_rate.sh
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="../calypso_driver.ko"
+CALYPSO_MODULE_MOUNTPOINT="/media/virtual_calypso"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+TOTAL_BLOCK_COUNT=100000
+# written to the Calypso file system and then deleted, in MiB
+DELETED_DATA_MB=300
+HOST_WRITE_SIZE=2G
+
+function run_workload() {
+    local trim=$1
+
+    if lsmod | grep "$CALYPSO_MODULE_NAME" &> /dev/null
+    then
+        sudo rmmod $CALYPSO_MODULE_NAME
+    fi
+    sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1
+
+    sudo mkfs.ext4 -q -E nodiscard /dev/calypso0
+    sudo mount /dev/calypso0 $CALYPSO_MODULE_MOUNTPOINT
+    sudo dd if=/dev/urandom of=$CALYPSO_MODULE_MOUNTPOINT/deleted.bin bs=1M count=$DELETED_DATA_MB status=none
+    sync
+    sudo rm $CALYPSO_MODULE_MOUNTPOINT/deleted.bin
+    sync
+    if [[ $trim == 1 ]]
+    then
+        sudo fstrim $CALYPSO_MODULE_MOUNTPOINT
+    fi
+
+    sudo fio --name=host --filename=$DISK --rw=randwrite --bs=4k --direct=1 \
+        --ioengine=libaio --iodepth=32 --size=$HOST_WRITE_SIZE > /dev/null
+
+    echo "fstrim=${trim}:" \
+        "discarded blocks $(cat $CALYPSO_SYSFS/discarded_blocks)," \
+        "relocations $(cat $CALYPSO_SYSFS/relocations)," \
+        "relocations per GB $(cat $CALYPSO_SYSFS/relocations_per_gb)"
+
+    sudo umount $CALYPSO_MODULE_MOUNTPOINT
+    sudo rmmod $CALYPSO_MODULE_NAME
+}
+
+echo "------- Relocations per GB written by the host, with deleted Calypso files -------"
+run_workload 0
+run_workload 1
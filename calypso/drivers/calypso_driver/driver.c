@@ -24,6 +24,7 @@
 #include <linux/device-mapper.h>
 
 #include <linux/delay.h>
+#include <linux/sort.h>
 
 #include "../../lib/mtwister.h"
  
@@ -40,11 +41,23 @@
 #include "../../lib/hkdf.h"
 #include "../../lib/disk_entropy.h"
 #include "../../lib/block_encryption.h"
+#include "../../lib/heatmap.h"
+#include "../../lib/block_reserve.h"
+#include "../../lib/mapping_cache.h"
+#include "../../lib/sysfs.h"
 
 /* Error codes: https://kdave.github.io/errno.h/ */
 
 
 static blk_qc_t calypso_make_request(struct request_queue *q, struct bio *bio);
+
+static blk_status_t calypso_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd);
+
+static int calypso_init_hctx(struct blk_mq_hw_ctx *hctx, void *driver_data, unsigned int hctx_idx);
+
+static void calypso_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx);
+
+static int calypso_map_queues(struct blk_mq_tag_set *set);
  
 static int calypso_dev_open(struct block_device *bdev, fmode_t mode);
 
@@ -52,14 +65,20 @@ static void calypso_dev_close(struct gendisk *disk, fmode_t mode);
 
 int calypso_dev_ioctl(struct block_device *bdev, fmode_t mode, unsigned cmd, unsigned long arg);
 
-static void calypso_update_mappings(unsigned long virtual_block_nr, unsigned long next_free_physical_block_nr);
+static int calypso_update_mappings(unsigned long virtual_block_nr, unsigned long next_free_physical_block_nr);
 
-static void calypso_reset_mapping(unsigned long previous_physical_block_nr);
+static int calypso_move_mapping(unsigned long virtual_block_nr, unsigned long from_physical_block_nr, unsigned long to_physical_block_nr);
+
+static void calypso_release_physical_block(unsigned long block);
 
 //static void calypso_print_bio_data(struct bio *bio);
 static void calypso_print_bio_data(void *data);
 
-static void calypso_bio_end_io(struct bio *bio);
+static void calypso_give_up_physical_block(unsigned long block);
+
+static void calypso_write_cached_block(unsigned long virtual_block_nr, struct bio *bio);
+
+static void calypso_submit_flushed_bio(struct bio *bio);
 
 
 static long blocks = CALYPSO_VIRTUAL_NR_BLOCKS_DEFAULT;
@@ -69,6 +88,64 @@ static bool is_clean_start = false;
 /* true for fresh install, false to retrieve metadata */
 module_param(is_clean_start, bool, 0);
 MODULE_PARM_DESC(is_clean_start, "Set to 1 for fresh install, 0 to retrieve metadata");
+/* Place Calypso blocks in block groups the host rarely writes to */
+static bool cold_placement = true;
+module_param(cold_placement, bool, 0);
+MODULE_PARM_DESC(cold_placement, "Set to 1 to prefer free blocks in groups with few host writes, 0 to take the first free block");
+/* Keep the mappings as extents, which is much smaller when hidden data is written sequentially */
+static int mapping_format = CALYPSO_MAPPINGS_ARRAY;
+module_param(mapping_format, int, 0);
+MODULE_PARM_DESC(mapping_format, "Set to 0 for one mapping per virtual block, 1 for extents of contiguous blocks, 2 for pages of mappings read when needed, 3 for only the written blocks");
+
+static unsigned int mapping_cache_kb = 4096;
+module_param(mapping_cache_kb, uint, 0);
+MODULE_PARM_DESC(mapping_cache_kb, "Memory for the pages of mappings kept in memory with mapping_format=2, in KiB");
+
+/* Only errors and warnings are printed by default, see lib/debug.h */
+static int debug_level = LOGLEVEL_WARNING;
+module_param(debug_level, int, 0);
+MODULE_PARM_DESC(debug_level, "Highest kernel log level printed, 5 or more for the verbose messages. Can be changed in /sys/kernel/calypso/debug_level");
+
+static int queue_mode = CALYPSO_QUEUE_BIO;
+module_param(queue_mode, int, 0);
+MODULE_PARM_DESC(queue_mode, "Set to 0 to remap bios as they are submitted, 1 to go through a blk-mq queue");
+
+static bool hw_queue_per_node = false;
+module_param(hw_queue_per_node, bool, 0);
+MODULE_PARM_DESC(hw_queue_per_node, "With queue_mode=1, set to 1 for one hardware queue per NUMA node instead of one per CPU");
+
+/* Unmap blocks written with zeros instead of giving them a physical block */
+static bool zero_elision = true;
+module_param(zero_elision, bool, 0);
+MODULE_PARM_DESC(zero_elision, "Set to 1 to unmap whole blocks written with zeros, which then read as zeros, 0 to write them like any other block");
+
+/* Plaintext blocks written to the Calypso device are only encrypted and written once per flush, see lib/block_cache.h */
+static unsigned int block_cache_kb = 0;
+module_param(block_cache_kb, uint, 0);
+MODULE_PARM_DESC(block_cache_kb, "Memory for the write-back cache of blocks written to the Calypso device, in KiB. 0 disables it");
+
+static unsigned int block_cache_flush_ms = 5000;
+module_param(block_cache_flush_ms, uint, 0);
+MODULE_PARM_DESC(block_cache_flush_ms, "How long blocks stay dirty in the write-back cache before they are written, in milliseconds");
+
+/* Data read from the Calypso device is kept for reads of the same blocks, see lib/read_cache.h */
+static unsigned int read_cache_kb = 0;
+module_param(read_cache_kb, uint, 0);
+MODULE_PARM_DESC(read_cache_kb, "Memory for the cache of blocks read from the Calypso device, in KiB. 0 disables it");
+
+/* The bios a request is split into reach the native device in the order of their sectors */
+static bool sorted_submission = true;
+module_param(sorted_submission, bool, 0);
+MODULE_PARM_DESC(sorted_submission, "Set to 1 to submit the bios a request is split into sorted by sector, 0 to submit them in the order of the virtual blocks");
+
+static unsigned int readahead_kb = 512;
+module_param(readahead_kb, uint, 0);
+MODULE_PARM_DESC(readahead_kb, "With read_cache_kb set, most read ahead of sequential reads into the read cache, in KiB. 0 disables it");
+
+/* Host writes over Calypso blocks wait for those blocks to be read, unless they are cached, see lib/relocation.h */
+static unsigned int relocation_max_inflight = CALYPSO_RELOCATION_MAX_INFLIGHT_DEFAULT;
+module_param(relocation_max_inflight, uint, 0);
+MODULE_PARM_DESC(relocation_max_inflight, "Most Calypso blocks the host is about to overwrite copied at the same time, the others wait in a queue. Pages for this many blocks are kept in reserve. At least 64");
 
 static blk_qc_t (*orig_request_fn)(struct request_queue *q, struct bio *bio) = NULL;
 
@@ -86,6 +163,42 @@ static struct block_device_operations calypso_fops =
     .ioctl = calypso_dev_ioctl,
 };
 
+/* Only used with queue_mode=1 */
+static struct blk_mq_ops calypso_mq_ops =
+{
+    .queue_rq = calypso_queue_rq,
+    .init_hctx = calypso_init_hctx,
+    .exit_hctx = calypso_exit_hctx,
+    .map_queues = calypso_map_queues,
+};
+
+/*
+ * State of a hardware queue. Dispatches of the same queue can still run
+ * concurrently, so it only holds hints and what is read-only after setup.
+ * The block cipher is set up for every block, the same for all queues
+ */
+struct calypso_hctx {
+    /* Where claims that miss the reserve start searching for a free block */
+    unsigned long next_free_block;
+};
+
+/*
+ * Driver data of a request, allocated by blk-mq along with its tag.
+ * Each bio of the request is remapped through a clone, and the request
+ * ends when the last clone completes
+ */
+struct calypso_cmd {
+    atomic_t pending;
+    blk_status_t status;
+};
+
+
+/* A block read ahead, sorted by where it is on the native device */
+struct calypso_readahead_block {
+    unsigned long virtual_block_nr;
+    calypso_block_t physical_block_nr;
+};
+
 
 struct trace_data {
 	atomic64_t request_counter_read;
@@ -104,39 +217,6 @@ static struct trace_data trace_data = {
 };
 
 
-static void calypso_bio_end_io(struct bio *bio)
-{
-    debug(KERN_DEBUG, __func__, "Inside bio_endio of request to be copied\n");
-
-    //calypso_print_bio_data(page_address(bio_page(bio)) + bio_offset(bio));
-    //calypso_print_bio_data(page_address(calypso_dev->pending_page));
-
-    /* Issue write request to copy data to next free block */
-    //calypso_print_bio_data(page_address(calypso_dev->pending_page));
-    new_bio_write_page(page_address(calypso_dev->pending_page), calypso_dev->physical_dev, calypso_get_sector_nr_from_block(calypso_dev->to_physical_block_pending_copy, 0));
-
-    //calypso_print_bio_data(bio_data(calypso_dev->pending_bio));
-    /* Finish processing the original write request that was going to override Calypso data */
-    struct request_queue *q = bio->bi_disk->queue;
-    //memcpy(bio_data(calypso_dev->pending_bio), calypso_dev->pending_data, 4095);
-    // TODO check if this is doing anything, maybe submit_bio with a different flag?
-    orig_request_fn(q, calypso_dev->pending_bio);
-    
-    //calypso_print_bio_data(bio);
-
-    /* Once we receive the response of our read request, we issue a write request to the next free block with the contents read from the previous block */
-    //new_bio_write_page(bio_data(bio), calypso_get_sector_nr_from_block(calypso_dev->to_physical_block_pending_copy, 0));
-
-    // TODO: this is not uncommented! the mappings need to be returned to normal
-    calypso_update_mappings(calypso_dev->physical_to_virtual_block_mapping[calypso_dev->from_physical_block_pending_copy], calypso_dev->to_physical_block_pending_copy);
-    calypso_reset_mapping(calypso_dev->from_physical_block_pending_copy);
-    calypso_dev->from_physical_block_pending_copy = -1;
-    calypso_dev->to_physical_block_pending_copy = -1;
-
-    bio_free_pages(bio);
-	bio_put(bio);
-}
-
 //static void calypso_print_bio_data(struct bio *bio)
 static void calypso_print_bio_data(void *data)
 {
@@ -160,31 +240,235 @@ static void calypso_update_bio_sector(struct bvec_iter *iter, sector_t new_secto
     iter->bi_sector = new_sector;
 }
 
+/*
+ * Splits the first nsectors sectors off a bio. The split is chained to the
+ * bio, which only ends once the split did, with the first error of either.
+ * Splits ending without I/O are just ended like any other bio
+ */
 struct bio *calypso_split_bio(struct bio *bio, sector_t nsectors)
 {
-    struct request_queue *q = bio->bi_disk->queue;
-    struct bio_set *bs = &(q->bio_split);
+    struct bio *split = bio_split(bio, nsectors, GFP_NOIO, &(calypso_dev->bio_set));
 
-    return bio_split(bio, nsectors, GFP_NOIO, bs);
+    bio_chain(split, bio);
+    return split;
 }
 
 struct bio *calypso_clone_bio(struct bio *bio)
 {
-    struct request_queue *q = bio->bi_disk->queue;
-    struct bio_set *bs = &(q->bio_split);
+    return bio_clone_fast(bio, GFP_NOIO, &(calypso_dev->bio_set));
+}
+
+/*
+ * Finds a free high entropy physical block to hold Calypso data
+ * free_block has the same meaning as in calypso_get_next_free_block()
+ *
+ * Returns 0 for success and -1 for error
+ */
+static int calypso_get_free_physical_block(unsigned long *free_block)
+{
+    if (cold_placement)
+        return calypso_heatmap_get_next_free_block(&(calypso_dev->heatmap), &(calypso_dev->block_state), calypso_dev->physical_nr_blocks, free_block);
+
+    return calypso_get_next_free_block(&(calypso_dev->block_state), calypso_dev->physical_nr_blocks, free_block);
+}
+
+/*
+ * Slow path: searches the block state for a free block and marks it as Calypso's
+ * Also used by the reserve refiller, so it has to be safe to run concurrently
+ *
+ * Returns 0 for success and -1 for error
+ */
+static int calypso_claim_free_physical_block(unsigned long *free_block)
+{
+    unsigned long flags;
+    int ret;
+
+    spin_lock_irqsave(&(calypso_dev->alloc_lock), flags);
+    /* the hook does not take the lock, so the host may have taken the block we found meanwhile */
+    do {
+        ret = calypso_get_free_physical_block(free_block);
+    } while (ret == 0 && !calypso_block_state_change(&(calypso_dev->block_state), *free_block, CALYPSO_BLOCK_FREE_HIGH_ENTROPY, CALYPSO_BLOCK_CALYPSO_DATA));
+    spin_unlock_irqrestore(&(calypso_dev->alloc_lock), flags);
+
+    return ret;
+}
 
-    return bio_clone_fast(bio, GFP_NOIO, bs);
+/* Gives back a claimed block that was never used, e.g. when the reserve is torn down, or that was discarded */
+static void calypso_release_physical_block(unsigned long block)
+{
+    /* unless the host wrote to it meanwhile, in which case it stays the host's */
+    calypso_block_state_change(&(calypso_dev->block_state), block, CALYPSO_BLOCK_CALYPSO_DATA, CALYPSO_BLOCK_FREE_HIGH_ENTROPY);
 }
 
-static void calypso_update_mappings(unsigned long virtual_block_nr, unsigned long next_free_physical_block_nr)
+/* A block being relocated was read, so the host writes to it can go on */
+static void calypso_give_up_physical_block(unsigned long block)
 {
-    calypso_dev->virtual_to_physical_block_mapping[virtual_block_nr] = next_free_physical_block_nr;
-    calypso_dev->physical_to_virtual_block_mapping[next_free_physical_block_nr] = virtual_block_nr;
+    calypso_block_state_change(&(calypso_dev->block_state), block, CALYPSO_BLOCK_CALYPSO_DATA, CALYPSO_BLOCK_HOST_USED);
 }
 
-static void calypso_reset_mapping(unsigned long previous_physical_block_nr)
+/*
+ * What a block written to the Calypso device becomes on the native device.
+ * calypso_encrypt_block() sets up its cipher from key for every block and
+ * does not use the one it is given. It encrypts data in place and copies
+ * it to result
+ */
+static void calypso_encrypt_request_block(unsigned char *result, unsigned char *data, unsigned char *key)
 {
-    calypso_dev->physical_to_virtual_block_mapping[previous_physical_block_nr] = -1;
+    calypso_encrypt_block(NULL, result, data, key);
+}
+
+/*
+ * Copy of a block the host is about to overwrite, from the block cache or
+ * the read cache rather than from disk. The block cache holds what was
+ * written to the Calypso device, maybe newer than the disk, which is what
+ * the copy has to keep anyway. It goes through the same transform as
+ * calypso_make_encrypted_request() applies to writes. The read cache holds
+ * what reads returned, the bytes on the native device, so they are copied
+ * as they are.
+ *
+ * Returns 0 for success and -ENOENT if the block is in neither cache
+ */
+static int calypso_snapshot_block(unsigned long virtual_block_nr, struct page *page)
+{
+    unsigned char *data;
+    unsigned char *key;
+    int ret = -ENOENT;
+
+    if (calypso_block_cache_enabled(&(calypso_dev->block_cache)))
+    {
+        data = kzalloc(CALYPSO_BLOCK_SIZE, GFP_NOIO);
+        /* the key of every request */
+        key = kzalloc(ENCRYPTION_KEY_LEN + 1, GFP_NOIO);
+        if (data && key)
+            ret = calypso_block_cache_peek(&(calypso_dev->block_cache), virtual_block_nr, data);
+        else
+            ret = -ENOMEM;
+        if (ret == 0)
+            calypso_encrypt_request_block(page_address(page), data, key);
+        kfree(key);
+        kfree(data);
+        if (ret != -ENOENT)
+            return ret;
+    }
+
+    if (calypso_read_cache_enabled(&(calypso_dev->read_cache)))
+        ret = calypso_read_cache_peek(&(calypso_dev->read_cache), virtual_block_nr, page_address(page));
+
+    return ret;
+}
+
+/*
+ * Allocates a physical block for Calypso data, already marked as allocated
+ * in the bitmaps. Takes it from this CPU's reserve when possible, without
+ * locking or scanning the bitmaps, and only claims one directly when the
+ * reserve is empty.
+ *
+ * Returns 0 for success and -1 for error
+ */
+static int calypso_alloc_physical_block(unsigned long *free_block)
+{
+    unsigned long start = *free_block;
+
+    if (calypso_block_reserve_pop(&(calypso_dev->reserve), free_block) == 0)
+        return 0;
+
+    atomic64_inc(&(calypso_dev->stats.reserve_misses));
+    if (calypso_claim_free_physical_block(free_block) == 0)
+        return 0;
+    /* the search started halfway through the partition, the free blocks may all be before it */
+    if (start == 0)
+        return -1;
+    *free_block = 0;
+    return calypso_claim_free_physical_block(free_block);
+}
+
+/*
+ * Allocates up to *nr physical blocks in a row for Calypso data, for
+ * copies written with a single bio. The first one is claimed from the
+ * block state, since the blocks after one from the reserve are usually in
+ * the reserve as well, and the blocks following it while they are free.
+ *
+ * Returns 0 with how many blocks were allocated in *nr, and -1 for error
+ */
+static int calypso_alloc_physical_extent(unsigned long *start, unsigned int *nr)
+{
+    unsigned int count;
+
+    if (calypso_claim_free_physical_block(start) != 0 && calypso_alloc_physical_block(start) != 0)
+        return -1;
+
+    for (count = 1; count < *nr && *start + count < calypso_dev->physical_nr_blocks; count++)
+    {
+        if (!calypso_block_state_change(&(calypso_dev->block_state), *start + count, CALYPSO_BLOCK_FREE_HIGH_ENTROPY, CALYPSO_BLOCK_CALYPSO_DATA))
+            break;
+    }
+    *nr = count;
+
+    return 0;
+}
+
+/*
+ * Mapping pages are written back in the background, so they take blocks
+ * straight from the bitmaps and leave the reserve to requests
+ */
+static int calypso_init_mapping_cache(void)
+{
+    int ret;
+
+    ret = calypso_mapping_cache_init(&(calypso_dev->mapping_cache), calypso_dev->virtual_nr_blocks, calypso_dev->physical_dev, calypso_dev->cipher, &(calypso_dev->reverse_index), calypso_claim_free_physical_block, calypso_release_physical_block);
+    if (ret != 0)
+        return ret;
+
+    /* Same key as the hidden metadata */
+    calypso_hkdf(calypso_dev->sym_enc_tfm, PASSWORD, sizeof(PASSWORD), calypso_dev->cipher, calypso_dev->mapping_cache.key);
+    return 0;
+}
+
+/*
+ * Retrieving the hidden metadata only gives the blocks storing each page
+ * of mappings. Every page is read once so the hook knows the blocks they
+ * map to, which the reverse index marks as Calypso's on the way.
+ */
+static int calypso_load_mapping_pages(void)
+{
+    return calypso_mapping_cache_load_reverse_index(&(calypso_dev->mapping_cache));
+}
+
+static int calypso_update_mappings(unsigned long virtual_block_nr, unsigned long next_free_physical_block_nr)
+{
+    return calypso_dev_set_mapping(calypso_dev, virtual_block_nr, next_free_physical_block_nr);
+}
+
+static int calypso_move_mapping(unsigned long virtual_block_nr, unsigned long from_physical_block_nr, unsigned long to_physical_block_nr)
+{
+    /* a read of the old block may return what the host wrote over it */
+    if (calypso_read_cache_enabled(&(calypso_dev->read_cache)))
+        calypso_read_cache_invalidate(&(calypso_dev->read_cache), virtual_block_nr, 1);
+    return calypso_dev_move_mapping(calypso_dev, virtual_block_nr, from_physical_block_nr, to_physical_block_nr);
+}
+
+/*
+ * Copies len bytes of the bio's data, starting at iter, to buf, or from
+ * buf when to_bio is set. The bytes of a block can be spread over more
+ * than one page of the bio
+ */
+static void calypso_copy_bio_data(struct bio *bio, struct bvec_iter iter, unsigned char *buf, unsigned int len, bool to_bio)
+{
+    struct bio_vec bvec;
+    struct bvec_iter i;
+    unsigned char *addr;
+
+    iter.bi_size = len;
+    __bio_for_each_segment(bvec, bio, i, iter)
+    {
+        addr = kmap_atomic(bvec.bv_page);
+        if (to_bio)
+            memcpy(addr + bvec.bv_offset, buf, bvec.bv_len);
+        else
+            memcpy(buf, addr + bvec.bv_offset, bvec.bv_len);
+        kunmap_atomic(addr);
+        buf += bvec.bv_len;
+    }
 }
 
 // TO TEST: 
@@ -192,11 +476,16 @@ static void calypso_reset_mapping(unsigned long previous_physical_block_nr)
 // $ sudo dd if=hello.txt count=1 seek=90 bs=4096 of=/dev/calypso0
 // $ sudo dd if=/dev/calypso0 count=1 skip=90 bs=4096
 // $ dmesg
+/*
+ * Encrypts or decrypts every block of the bio, which can span several
+ * consecutive physical blocks, and sends it to the native device
+ */
 static void calypso_make_encrypted_request(struct bio *bio)
 {
     unsigned char data[4096 + 1];
     unsigned char result[4096 + 1];
-    unsigned char hello_str[4096 + 1] = "HELOOOOOOOOOOOUUUUU XXXXXXX";
+    struct bvec_iter iter = bio->bi_iter;
+    unsigned int len;
 
     unsigned char *key = kzalloc(ENCRYPTION_KEY_LEN + 1, GFP_KERNEL);
     struct calypso_skcipher_def *cipher;
@@ -204,98 +493,166 @@ static void calypso_make_encrypted_request(struct bio *bio)
     if (!key)
     {
         debug(KERN_ERR, __func__, "Could not allocate key!\n");
-        return -ENOMEM;
+        bio->bi_status = BLK_STS_RESOURCE;
+        bio_endio(bio);
+        return;
     }
 
     debug_args(KERN_DEBUG, __func__, "~~~~~~ REQUEST SIZE: %lu\n", bio->bi_iter.bi_size);
 
-    if (bio_data_dir(bio) == WRITE)
-    {
-        /* Reads request data, encrypts it, and replaces the request data with the encrypted data */
-        memcpy(data, bio_data(bio), 4096);
-        debug_args(KERN_DEBUG, __func__, "~~~~~~ WRITE REQUEST BEFORE: %s\n", data);
-        // calypso_encrypt_block(cipher, data, result, key);
-        calypso_encrypt_block(cipher, result, data, key);
-        memcpy(bio_data(bio), result, 4096);
-        debug_args(KERN_DEBUG, __func__, "~~~~~~ WRITE REQUEST AFTER: %s\n", result);
-
-        // TODO: DEBUG
-        // This does not match the unencrypted block, so it is not ok!
-        calypso_decrypt_block(cipher, result, data, key);
-        debug_args(KERN_DEBUG, __func__, "~~~~~~ DEBUG DECRYPT ENCRYPTED DATA: %s\n", data);
-
-        // This matches the encrypted block above, so it's ok
-        // calypso_encrypt_block(cipher, hello_str, result, key);
-        calypso_encrypt_block(cipher, result, hello_str, key);
-        debug_args(KERN_DEBUG, __func__, "~~~~~~ DEBUG hello_str ENCRYPTED: %s\n", result);
-        // Is also wrong, but matches the decrypted data above
-        calypso_decrypt_block(cipher, result, data, key);
-        debug_args(KERN_DEBUG, __func__, "~~~~~~ DEBUG hello_str DECRYPTED: %s\n", data);
-    }
-    else
+    /* flushes have no data to encrypt */
+    while (bio_has_data(bio) && iter.bi_size > 0)
     {
-        /* Reads request data, decrypts it, and replaces the request data with the decrypted data */
-        memcpy(data, bio_data(bio), 4096);
-        debug_args(KERN_DEBUG, __func__, "~~~~~~ READ REQUEST BEFORE: %s\n", data);
-        calypso_decrypt_block(cipher, data, result, key);
-        memcpy(bio_data(bio), result, 4096);
-        debug_args(KERN_DEBUG, __func__, "~~~~~~ READ REQUEST AFTER: %s\n", result);
+        /* requests are made of whole blocks, see calypso_dev_set_queue_limits() */
+        len = min(iter.bi_size, (unsigned int)CALYPSO_BLOCK_SIZE);
+        memset(data, 0, sizeof(data));
+        calypso_copy_bio_data(bio, iter, data, len, false);
 
+        if (bio_data_dir(bio) == WRITE)
+        {
+            /* Reads request data, encrypts it, and replaces the request data with the encrypted data */
+            debug_args(KERN_DEBUG, __func__, "~~~~~~ WRITE REQUEST BEFORE: %s\n", data);
+            // calypso_encrypt_block(cipher, data, result, key);
+            calypso_encrypt_request_block(result, data, key);
+            debug_args(KERN_DEBUG, __func__, "~~~~~~ WRITE REQUEST AFTER: %s\n", result);
+        }
+        else
+        {
+            /* Reads request data, decrypts it, and replaces the request data with the decrypted data */
+            debug_args(KERN_DEBUG, __func__, "~~~~~~ READ REQUEST BEFORE: %s\n", data);
+            calypso_decrypt_block(cipher, data, result, key);
+            debug_args(KERN_DEBUG, __func__, "~~~~~~ READ REQUEST AFTER: %s\n", result);
+        }
+        calypso_copy_bio_data(bio, iter, result, len, true);
 
+        bio_advance_iter(bio, &iter, len);
     }
+
     generic_make_request(bio);
+
+    kfree(key);
 }
 
-void calypso_make_single_block_request(struct bio *bio, size_t i, unsigned int req_blocks_count_complete, unsigned int req_blocks_count_incomplete, sector_t physical_sector_nr)
+/*
+ * Queues relocations of the nr_blocks Calypso blocks in a row from block,
+ * which are read with as few bios as the relocations being read already
+ * allow. Once the bio is held, the other relocations are only started,
+ * and read meanwhile. Blocks still in memory are copied from there
+ * without holding the bio.
+ *
+ * Returns true if the bio is held
+ */
+static bool calypso_relocate_blocks(struct bio *bio, unsigned long block, unsigned int nr_blocks, bool held)
 {
-    struct bio *new_bio;
-    /* 
-     * If we have a request to a single block left, we don't need
-     * to split the bio further
-     */
-    if (req_blocks_count_complete == 0)
+    unsigned int nr_queued;
+    int ret;
+
+    while (nr_blocks > 0)
     {
-        // debug(KERN_INFO, __func__, "*** INCOMPLETE BLOCK\n");
-        // debug_args(KERN_INFO, __func__, "***** before bio_offset %lu\n", bio_offset(bio));
-        calypso_update_bio_sector(&(bio->bi_iter), physical_sector_nr);
-        // debug_args(KERN_INFO, __func__, "***** AFTER bio_offset %lu\n", bio_offset(bio));
-        calypso_make_encrypted_request(bio);
+        ret = calypso_relocation_queue(&(calypso_dev->relocation), block, nr_blocks, held ? NULL : bio, &nr_queued);
+        if (ret == 0 || ret == CALYPSO_RELOCATION_CAPTURED)
+            atomic64_add(nr_queued, &(calypso_dev->stats.relocations));
+        if (ret == 0 || ret == -EINPROGRESS)
+            held = true;
+        /* the block was read already, otherwise Calypso's data in them is lost */
+        else if (ret != -EEXIST)
+            debug_args(KERN_ERR, __func__, "Could not relocate blocks %lu to %lu before the host overwrites them\n", block, block + nr_queued - 1);
+        block += nr_queued;
+        nr_blocks -= nr_queued;
     }
-    else if (i < req_blocks_count_complete - 1)
-    {
-        // debug(KERN_INFO, __func__, "*** we need to split the bio\n");
-        //calypso_create_bio_read_req2(calypso_dev->physical_dev, physical_sector_nr, 4096, bio);
-        // debug_args(KERN_INFO, __func__, "***** bio bio_offset %lu\n", bio_offset(bio));
-        new_bio = calypso_split_bio(bio, 8);
-        // debug_args(KERN_INFO, __func__, "***** new_bio bio_offset %lu\n", bio_offset(new_bio));
-        calypso_update_bio_sector(&(new_bio->bi_iter), physical_sector_nr);
-        calypso_make_encrypted_request(new_bio);
-    }
-    else {
-        // debug(KERN_INFO, __func__, "*** no need to split bio further\n");
-        /* if there is an incomplete block, we still need to split once more */
-        if (req_blocks_count_incomplete > 0) {
-            // debug(KERN_INFO, __func__, "*** INCOMPLETE BLOCK after some complete blocks\n");
-            // debug_args(KERN_INFO, __func__, "***** bio bio_offset %lu\n", bio_offset(bio));
-            new_bio = calypso_split_bio(bio, 8);
-            // debug_args(KERN_INFO, __func__, "***** new_bio bio_offset %lu\n", bio_offset(new_bio));
-            calypso_update_bio_sector(&(new_bio->bi_iter), physical_sector_nr);
-            calypso_make_encrypted_request(new_bio);
+
+    return held;
+}
+
+/*
+ * Discards only tell the device the blocks are free, which may lose what
+ * they hold, so Calypso blocks in them are relocated all the same. The
+ * host does not take the free blocks in them, fstrim discards all of them
+ */
+static bool calypso_is_host_discard(struct bio *bio)
+{
+    return bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_SECURE_ERASE;
+}
+
+/*
+ * The host bio writes over the Calypso blocks from block on, before
+ * end_block. Relocates them, in runs of blocks in a row, and holds the bio
+ * until the first run that is still being read was. The held bio comes
+ * back through the hook, which holds it again for the next run not read
+ * yet, so it waits about as long as the slowest read rather than for every
+ * read in turn. Pages of mappings stored in the blocks are evacuated.
+ *
+ * Returns true if the bio is held
+ */
+static bool calypso_relocate_host_write(struct bio *bio, unsigned long block, unsigned long end_block)
+{
+    bool discard = calypso_is_host_discard(bio);
+    unsigned long virtual_block_nr;
+    unsigned long run_start = 0;
+    unsigned int run_nr = 0;
+    bool held = false;
+
+    for (; block < end_block; block = calypso_block_state_find_next(&(calypso_dev->block_state), block + 1, end_block, CALYPSO_BLOCK_CALYPSO_DATA))
+    {
+        virtual_block_nr = calypso_reverse_index_get(&(calypso_dev->reverse_index), block);
+        /* 
+         * physical block has corresponding virtual block, so it is in use by Calypso,
+         * thus calypso's data in that block needs to be copied to another block and 
+         * the mappings updated 
+         */
+        if (virtual_block_nr < calypso_dev->virtual_nr_blocks)
+        {
+            debug_args(KERN_INFO, __func__, "MOVING DATA out of block %lu, virtual block %lu\n", block, virtual_block_nr);
+            if (run_nr > 0 && run_start + run_nr == block && run_nr < CALYPSO_RELOCATION_MAX_BLOCKS)
+            {
+                run_nr++;
+                continue;
+            }
+            held = calypso_relocate_blocks(bio, run_start, run_nr, held);
+            run_start = block;
+            run_nr = 1;
+        }
+        /*
+         * Claimed but not holding anything yet, so the host now owns it and it cannot be handed out from the reserve.
+         * Unless a relocation is writing a copy to it, in which case the bio waits and relocates the copy afterwards
+         */
+        else if (virtual_block_nr == -1)
+        {
+            /* a discard leaves the block to Calypso, but still waits for a copy being written to it */
+            if (discard)
+            {
+                if (!held)
+                    held = calypso_relocation_hold(&(calypso_dev->relocation), block, bio);
+                continue;
+            }
+            calypso_block_reserve_invalidate(&(calypso_dev->reserve), block);
+            if (calypso_relocation_give_up_claimed(&(calypso_dev->relocation), block, held ? NULL : bio))
+                held = true;
+        }
+        /* physical block stores a page of the mapping table, which needs to be written somewhere else */
+        else if (calypso_mapping_cache_is_table_block(virtual_block_nr))
+        {
+            /* a held bio comes back through here, and the page is evacuated then */
+            if (held)
+                continue;
+            debug_args(KERN_INFO, __func__, "MOVING MAPPING PAGE out of block %lu\n", block);
+            /* the bio is resubmitted once the page is in memory */
+            if (calypso_mapping_cache_evacuate(&(calypso_dev->mapping_cache), calypso_mapping_cache_tag_to_page(virtual_block_nr), block, bio) == -EAGAIN)
+                held = true;
+            else
+                calypso_block_state_change(&(calypso_dev->block_state), block, CALYPSO_BLOCK_CALYPSO_DATA, CALYPSO_BLOCK_HOST_USED);
         }
-        // debug_args(KERN_INFO, __func__, "***** BEFORE bio_offset %lu\n", bio_offset(bio));
-        calypso_update_bio_sector(&(bio->bi_iter), physical_sector_nr);
-        // debug_args(KERN_INFO, __func__, "***** AFTER bio_offset %lu\n", bio_offset(bio));
-        calypso_make_encrypted_request(bio);
     }
-    // debug(KERN_INFO, __func__, "*** after generic_make_request\n");
+
+    return calypso_relocate_blocks(bio, run_start, run_nr, held);
 }
 
 static blk_qc_t hooked_physical_make_request_fn(struct request_queue *q, struct bio *bio)
 {
     // TODO: remember that these requests include the ones sent by calypso
-    int is_set;
     unsigned long physical_block_nr;
-    unsigned long virtual_block_nr;
+    unsigned long end_block_nr;
+    unsigned long owned_block_nr;
 
     // if (bio_data_dir(bio) == WRITE) 
     // {
@@ -334,7 +691,16 @@ static blk_qc_t hooked_physical_make_request_fn(struct request_queue *q, struct
                 /* we only need to care about writes because they change the physical blocks state */
                 if (bio_data_dir(bio) == WRITE)
                 { 
-                    atomic64_inc(&trace_data.request_counter_write);
+                    /* every block the bio writes to, even partly */
+                    end_block_nr = min(calypso_get_block_nr_from_sector(bio_end_sector(bio) + 7, calypso_dev->first_physical_sector), calypso_dev->physical_nr_blocks);
+                    /* a bio held for a relocation or a mapping page comes back through here, and is counted once */
+                    if (!calypso_is_host_discard(bio) && !(bio->bi_opf & REQ_CALYPSO_COUNTED))
+                    {
+                        bio->bi_opf |= REQ_CALYPSO_COUNTED;
+                        atomic64_inc(&trace_data.request_counter_write);
+                        atomic64_add(bio->bi_iter.bi_size, &(calypso_dev->stats.host_bytes_written));
+                        calypso_heatmap_record_write(&(calypso_dev->heatmap), physical_block_nr, max(end_block_nr - physical_block_nr, 1UL));
+                    }
                     debug_args(KERN_INFO , __func__, "Received %lld WRITE requests to /dev/sda8\n", atomic64_read(&trace_data.request_counter_write));
                     debug_args(KERN_INFO , __func__, "Request to sector %lld, block %lld\n", bio->bi_iter.bi_sector, bio->bi_iter.bi_sector / 8);
                     debug_args(KERN_INFO , __func__, "Only inside partition /dev/sda8 the block offset is  %lld\n", (bio->bi_iter.bi_sector / 8) - (calypso_dev->first_physical_sector / 8));
@@ -342,87 +708,24 @@ static blk_qc_t hooked_physical_make_request_fn(struct request_queue *q, struct
 
                     debug_args(KERN_INFO , __func__, "physical_block_nr: %lu\n", physical_block_nr);
 
-                    virtual_block_nr = calypso_dev->physical_to_virtual_block_mapping[physical_block_nr];
-                    debug(KERN_INFO , __func__, "WRITING TO AN UNALLOCATED BLOCK\n");
-                    debug_args(KERN_INFO , __func__, "virtual_block_nr: %lu\n", virtual_block_nr);
-                    
-                    /* 
-                    * Update bitmap since we had a write 
-                    * This should be done before getting next free block,
-                    * otherwise it will just pick the same block
-                    */
-                    // is_set = test_bit(physical_block_nr, calypso_dev->physical_blocks_bitmap);
-                    // if (!is_set)
-                    // {
-                    //     calypso_set_bit(calypso_dev->physical_blocks_bitmap, physical_block_nr);
-                    //     debug(KERN_INFO , __func__, "SET BIT AS ALLOCATED\n");
-                    // }
-                    is_set = test_bit(physical_block_nr, calypso_dev->high_entropy_blocks_bitmap);
-                    if (is_set)
-                    {
-                        calypso_update_bitmaps(calypso_dev->physical_blocks_bitmap, calypso_dev->high_entropy_blocks_bitmap, physical_block_nr);
-                        // calypso_clear_bit(calypso_dev->high_entropy_blocks_bitmap, physical_block_nr);
-                        debug(KERN_INFO , __func__, "SET BIT AS ALLOCATED\n");
-                    }
-
-                    /* 
-                     * physical block has corresponding virtual block, so it is in use by Calypso,
-                     * thus calypso's data in that block needs to be copied to another block and 
-                     * the mappings updated 
+                    /*
+                     * Update the state of the free blocks since we had a write, unless it is a discard.
+                     * This should be done before getting next free block,
+                     * otherwise it will just pick the same block
                      */
-                    if (virtual_block_nr >= 0 && virtual_block_nr < calypso_dev->virtual_nr_blocks)
+                    if (!calypso_is_host_discard(bio))
+                        calypso_block_state_set_free_range(&(calypso_dev->block_state), physical_block_nr, end_block_nr - physical_block_nr, CALYPSO_BLOCK_HOST_USED);
+
+                    /* Most host writes do not touch Calypso blocks, and the block state tells us a word of blocks at a time */
+                    owned_block_nr = calypso_block_state_find_next(&(calypso_dev->block_state), physical_block_nr, end_block_nr, CALYPSO_BLOCK_CALYPSO_DATA);
+                    if (owned_block_nr < end_block_nr)
                     {
-                        /* 
-                        * To test: 
-                        * Cleanup: 
-                        *   $ sudo dd if=text3.txt count=1 bs=4096 seek=12157 of=/dev/sda8
-                        *   $ sudo dd if=text3.txt count=1 bs=4096 seek=12158 of=/dev/sda8
-                        *
-                        *   $ sudo dd if=text.txt count=1 bs=4096 seek=100 of=/dev/calypso0
-                        * dmesg: block = x 12157 937500
-                        *   $ sudo dd if=testing/first_block.txt count=1 bs=4096 seek=12157 of=/dev/sda8
-                        * restart VM
-                        *   $ sudo dd if=/dev/sda8 count=1 bs=4096 skip=12157
-                        *   $ sudo dd if=/dev/sda8 count=1 bs=4096 skip=12158
-                        */
-
-                        /* Find next free block to replace this one */
-                        unsigned long physical_block_nr_to_move = 0;
-                        if (calypso_get_next_free_block(calypso_dev->high_entropy_blocks_bitmap, calypso_dev->physical_nr_blocks, &physical_block_nr_to_move) == -1) {
-                        // if (calypso_get_next_free_block(calypso_dev->physical_blocks_bitmap, calypso_dev->physical_nr_blocks, &physical_block_nr_to_move) == -1) {
-                            debug(KERN_ERR, __func__, "No more blocks to allocate in physical partition\n");
-                            bio_endio(bio);
-                            return;
-                        }
-                        // TODO: see if this makes sense, because it wasn't here before
-                        // calypso_clear_bit(calypso_dev->high_entropy_blocks_bitmap, physical_block_nr_to_move);
-                        calypso_update_bitmaps(calypso_dev->physical_blocks_bitmap, calypso_dev->high_entropy_blocks_bitmap, physical_block_nr_to_move);
-                        debug_args(KERN_INFO, __func__, "MOVING DATA to block %lu\n", physical_block_nr_to_move);
-                        debug_args(KERN_INFO, __func__, "COPYING FROM block %lu to block %lu\n", physical_block_nr, physical_block_nr_to_move);
-
-                        /* Move Calypso block to another physical block */
-                        // TODO change mappings
-                        //calypso_copy_block(calypso_dev->physical_dev, physical_block_nr, physical_block_nr_to_move);   
-                        calypso_dev->from_physical_block_pending_copy = physical_block_nr;
-                        calypso_dev->to_physical_block_pending_copy = physical_block_nr_to_move;
-                        debug(KERN_INFO, __func__, "COPIED DATA\n");
-
-                        calypso_dev->pending_bio = bio;
-                        // TODO: WHY 4095 INSTEAD OF 4096???
-                        memcpy(calypso_dev->pending_data, bio_data(bio), 4095);
-                        //calypso_print_bio_data(bio_data(calypso_dev->pending_bio));
-
-                        new_bio_read_page(calypso_get_sector_nr_from_block(calypso_dev->from_physical_block_pending_copy, 0), calypso_dev->physical_dev, calypso_dev->pending_page, calypso_bio_end_io);
-                        //struct bio *read_bio = calypso_clone_bio(bio);
-                        //read_bio->bi_opf = REQ_OP_READ;
-                        //submit_bio(read_bio);
-
-                        return 0;
-                    }        
-                    /* Write to this block is not mapped by Calypso, se we don't care about it because it is not going to overwrite Calypso's data */   
-                    else {
-                        debug(KERN_INFO, __func__, "WE DON'T CARE ABOUT THIS WRITE BECAUSE IT IS NOT MAPPED BY CALYPSO\n");
-                    }         
+                        /* the latencies are of host writes */
+                        if (!calypso_is_host_discard(bio))
+                            calypso_relocation_track_host_write(&(calypso_dev->relocation), bio);
+                        if (calypso_relocate_host_write(bio, owned_block_nr, end_block_nr))
+                            return 0;
+                    }
                 }
                 else
                 {
@@ -430,13 +733,6 @@ static blk_qc_t hooked_physical_make_request_fn(struct request_queue *q, struct
                     debug_args(KERN_INFO , __func__, "Received %lld READ requests to /dev/sda8\n", atomic64_read(&trace_data.request_counter_read));
                     debug_args(KERN_INFO , __func__, "Request to sector %lld, block %lld\n", bio->bi_iter.bi_sector, bio->bi_iter.bi_sector / 8);
                     debug_args(KERN_INFO , __func__, "Only inside partition /dev/sda8 the block offset is  %lld\n", (bio->bi_iter.bi_sector / 8) - (calypso_dev->first_physical_sector / 8));
-
-                    /*if ((bio->bi_iter.bi_sector / 8 - 6250496) == calypso_dev->from_physical_block_pending_copy)
-                    {
-                        debug(KERN_DEBUG, __func__, "----- **** READING BLOCK THAT NEEDS TO BE COPIED!!!!!\n");
-                        calypso_print_bio_data(bio);
-                        orig_request_fn(q, calypso_dev->pending_bio);
-                    }*/
                 }
             }
         }
@@ -451,6 +747,8 @@ static blk_qc_t hooked_physical_make_request_fn(struct request_queue *q, struct
         // }
     // }
     
+    /* the device below gets the bio as the host sent it */
+    bio->bi_opf &= ~REQ_CALYPSO_COUNTED;
     return orig_request_fn(q, bio);
 }
 
@@ -482,35 +780,212 @@ static void printBioFlagsValues(struct bio *bio)
     debug_args(KERN_DEBUG, __func__, "IS BIO BIO_USER_MAPPED: %u\n", bio_flagged(bio, BIO_USER_MAPPED));
 }
 
-/* 
- * Actual remapping of I/O requests
+/*
+ * Physical block a virtual block written by a request is mapped to, mapping
+ * it to a free block first if it is not mapped yet. run_len has the same
+ * meaning as in calypso_lookup_physical_run()
+ *
+ * Returns CALYPSO_UNMAPPED if the block could not be mapped
  */
-static void calypso_remap_io_request_to_physical_dev(struct bio *bio)
+static calypso_block_t calypso_map_virtual_block(unsigned long virtual_block_nr, unsigned long *run_len, unsigned long *next_free_physical_block_nr, struct calypso_hctx *hctx)
 {
-    /* This is where we know to which Calypso virtual block
-    the request was done */
-    sector_t req_start_sector = bio->bi_iter.bi_sector;
-    unsigned long virtual_block_nr = req_start_sector / 8;
-    sector_t physical_sector_nr;
+    calypso_block_t physical_block_nr = calypso_lookup_physical_run(calypso_dev, virtual_block_nr, run_len);
+
+    if (likely(calypso_is_block_mapped(calypso_dev, physical_block_nr)))
+        return physical_block_nr;
 
+    debug(KERN_INFO, __func__, "BLOCK IS NOT MAPPED\n");
     /* 
-     * We need to find if this virtual block is already mapped to a 
-     * physical block
+     * next_free_physical_block_nr starts with the previous value so that 
+     * we don't need to start from the beginning of the partition all over again.
+     * The block comes already set as allocated, so that we don't assign same free block more than once
      */
-    unsigned long physical_block_nr = calypso_dev->virtual_to_physical_block_mapping[virtual_block_nr];
-    unsigned long next_free_physical_block_nr = 0;
+    if (calypso_alloc_physical_block(next_free_physical_block_nr) == -1)
+    {
+        debug(KERN_ERR, __func__, "No more blocks to allocate in physical partition\n");
+        return CALYPSO_UNMAPPED;
+    }
+    debug_args(KERN_INFO, __func__, "remapping to NEXT FREE BLOCK %lu\n", *next_free_physical_block_nr);
+    if (hctx)
+        WRITE_ONCE(hctx->next_free_block, *next_free_physical_block_nr);
+
+    if (calypso_update_mappings(virtual_block_nr, *next_free_physical_block_nr) != 0)
+    {
+        debug(KERN_ERR, __func__, "Could not map virtual block\n");
+        calypso_release_physical_block(*next_free_physical_block_nr);
+        return CALYPSO_UNMAPPED;
+    }
+
+    *run_len = 1;
+    return *next_free_physical_block_nr;
+}
+
+/*
+ * Unmaps a virtual block and gives its physical block back to the free pool.
+ * Returns whether it was mapped
+ */
+static bool calypso_unmap_virtual_block(unsigned long virtual_block_nr)
+{
+    calypso_block_t physical_block_nr = calypso_dev_unmap(calypso_dev, virtual_block_nr);
+
+    if (!calypso_is_block_mapped(calypso_dev, physical_block_nr))
+        return false;
+    calypso_release_physical_block(physical_block_nr);
+    return true;
+}
+
+/*
+ * Whether the request writes the whole block starting at iter with zeros.
+ * Such blocks are unmapped instead of written, since unmapped blocks read
+ * as zeros. Most blocks with data are told apart by their first bytes
+ */
+static bool calypso_is_zero_write(struct bio *bio, struct bvec_iter iter)
+{
+    struct bio_vec bvec;
+    struct bvec_iter i;
+    unsigned char *addr;
+    bool zero = true;
+
+    /* empty flushes are writes as well */
+    if (iter.bi_size < CALYPSO_BLOCK_SIZE)
+        return false;
+    if (bio_op(bio) == REQ_OP_WRITE_ZEROES)
+        return true;
+    if (bio_op(bio) != REQ_OP_WRITE || !zero_elision)
+        return false;
+
+    iter.bi_size = CALYPSO_BLOCK_SIZE;
+    __bio_for_each_segment(bvec, bio, i, iter)
+    {
+        addr = kmap_atomic(bvec.bv_page);
+        zero = !memchr_inv(addr + bvec.bv_offset, 0, bvec.bv_len);
+        kunmap_atomic(addr);
+        if (!zero)
+            break;
+    }
+    return zero;
+}
 
-    /* There may be requests that fulfill an entire block and requests for only a part of the block */
-    unsigned int req_blocks_count_complete = bio->bi_iter.bi_size / 4096;
-    unsigned int req_blocks_count_incomplete = bio->bi_iter.bi_size % 4096;
-    size_t i = 0;
+/*
+ * Physical block for the block of the request starting at iter, or
+ * CALYPSO_ZERO_BLOCK if the block needs none: blocks the request fills
+ * with zeros are unmapped, and blocks that are not mapped are read as zeros.
+ * CALYPSO_CACHED_BLOCK if the block cache or the read cache served it.
+ * Other blocks written are mapped with calypso_map_virtual_block()
+ */
+static calypso_block_t calypso_map_request_block(struct bio *bio, struct bvec_iter iter, unsigned long *run_len, unsigned long *next_free_physical_block_nr, struct calypso_hctx *hctx)
+{
+    unsigned long virtual_block_nr = iter.bi_sector / 8;
+    struct calypso_block_cache *cache = &(calypso_dev->block_cache);
+    calypso_block_t physical_block_nr;
+
+    if (calypso_is_zero_write(bio, iter))
+    {
+        if (calypso_block_cache_enabled(cache))
+            calypso_block_cache_invalidate(cache, virtual_block_nr, 1);
+        calypso_unmap_virtual_block(virtual_block_nr);
+        atomic64_inc(&(calypso_dev->stats.zero_blocks));
+        *run_len = 1;
+        return CALYPSO_ZERO_BLOCK;
+    }
+
+    if (calypso_block_cache_enabled(cache))
+    {
+        *run_len = 1;
+        if (bio_op(bio) == REQ_OP_READ && calypso_block_cache_read(cache, virtual_block_nr, bio, iter) == 0)
+            return CALYPSO_CACHED_BLOCK;
+        /* FUA writes have to reach the native device before they end */
+        if (bio_op(bio) == REQ_OP_WRITE && calypso_block_cache_write(cache, virtual_block_nr, bio, iter, bio->bi_opf & REQ_FUA) == 0)
+            return CALYPSO_CACHED_BLOCK;
+    }
+
+    if (bio_op(bio) == REQ_OP_READ)
+    {
+        if (calypso_read_cache_enabled(&(calypso_dev->read_cache))
+            && calypso_read_cache_read(&(calypso_dev->read_cache), virtual_block_nr, bio, iter) == 0)
+        {
+            *run_len = 1;
+            return CALYPSO_CACHED_BLOCK;
+        }
+        physical_block_nr = calypso_lookup_physical_run(calypso_dev, virtual_block_nr, run_len);
+        if (!calypso_is_block_mapped(calypso_dev, physical_block_nr))
+            return CALYPSO_ZERO_BLOCK;
+        return physical_block_nr;
+    }
+
+    return calypso_map_virtual_block(virtual_block_nr, run_len, next_free_physical_block_nr, hctx);
+}
+
+/* Block the n-th block of a run starting at run_start needs to be at to extend it */
+static inline calypso_block_t calypso_run_block(calypso_block_t run_start, unsigned long n)
+{
+    /* runs of blocks without a physical block only need the same kind of block */
+    return run_start >= CALYPSO_CACHED_BLOCK ? run_start : run_start + n;
+}
+
+/*
+ * Submits the bios a request was split into, sorted by sector unless
+ * sorted_submission is off, so a disk goes over them in a single sweep
+ * instead of seeking back and forth in the order of the virtual blocks.
+ * The plug has them reach the native device's queue together, where
+ * they are only dispatched once all of them are there
+ */
+static void calypso_submit_runs(struct bio_list *runs)
+{
+    struct bio_list sorted;
+    struct bio **pos;
+    struct bio *bio;
+    struct blk_plug plug;
+
+    if (sorted_submission)
+    {
+        bio_list_init(&sorted);
+        while ((bio = bio_list_pop(runs)))
+        {
+            /* physical blocks are mostly allocated in order, so most bios go at the end */
+            if (!sorted.tail || sorted.tail->bi_iter.bi_sector <= bio->bi_iter.bi_sector)
+            {
+                bio_list_add(&sorted, bio);
+                continue;
+            }
+            for (pos = &(sorted.head); (*pos)->bi_iter.bi_sector <= bio->bi_iter.bi_sector; pos = &((*pos)->bi_next))
+                ;
+            bio->bi_next = *pos;
+            *pos = bio;
+        }
+        runs = &sorted;
+    }
+
+    blk_start_plug(&plug);
+    while ((bio = bio_list_pop(runs)))
+        calypso_make_encrypted_request(bio);
+    blk_finish_plug(&plug);
+}
+
+/* 
+ * Actual remapping of I/O requests
+ *
+ * Consecutive virtual blocks of the request that are mapped to consecutive
+ * physical blocks go to the native device in a single bio, so the request
+ * is only split where its physical blocks are not contiguous. The bios it
+ * is split into are chained to it, so it ends once all of them did.
+ * Runs of blocks that need no physical block end without any I/O
+ */
+static void calypso_remap_io_request_to_physical_dev(struct bio *bio, struct calypso_hctx *hctx)
+{
+    unsigned long next_free_physical_block_nr = hctx ? READ_ONCE(hctx->next_free_block) : 0;
+    /* start of the block being looked at, which the rest of the request also starts at after a split */
+    struct bvec_iter iter = bio->bi_iter;
+    calypso_block_t physical_block_nr, run_start;
+    unsigned long run_virtual_block_nr, run_len, run_blocks;
+    unsigned int run_sectors;
+    struct bio *run_bio;
+    struct bio_list runs;
+
+    bio_list_init(&runs);
 
     // debug(KERN_INFO, __func__, "----------- BEGINNING OF REQUEST TO CALYPSO -----------\n");
     // printBioFlagsValues(bio);
-    // debug_args(KERN_INFO, __func__, "Remapping requests from calypso device's block %lu to %s\n", virtual_block_nr, PHYSICAL_DISK_NAME);
-
-    // debug_args(KERN_INFO , __func__, "bio->bi_iter.bi_size %d, size in blocks %d \n", bio->bi_iter.bi_size, req_blocks_count_complete);
-    // debug_args(KERN_INFO , __func__, "req_start_sector %llu\n", req_start_sector);
 
     /* This needs to happen in every case */
     bio_set_dev(bio, calypso_dev->physical_dev);
@@ -518,91 +993,384 @@ static void calypso_remap_io_request_to_physical_dev(struct bio *bio)
     /* Set REQ_CALYPSO flag so that sda knows this request came from Calypso */
     bio->bi_opf |= REQ_CALYPSO;
 
-    /* 
-     * Since requests might refer to more than one block, we need a loop 
-     * to make these actions for each block in the request 
-     */
+    physical_block_nr = calypso_map_request_block(bio, iter, &run_len, &next_free_physical_block_nr, hctx);
     do {
-    //for (i = 0; i < req_blocks_count_complete; i++) {
-        // debug_args(KERN_INFO , __func__, "*** Block %ld of the request, >>> BLOCK nr %ld\n", i);
-        /* virtual block is mapped to physical block */
-        if (physical_block_nr >= 0 && physical_block_nr < calypso_dev->physical_nr_blocks) 
+        if (physical_block_nr == CALYPSO_UNMAPPED)
         {
-            debug_args(KERN_INFO, __func__, "BLOCK IS MAPPED to %lu\n", physical_block_nr);
-
-            /* First, we change the sector associated with the bio */
-            physical_sector_nr = calypso_get_sector_nr_from_block(physical_block_nr,  bio_offset(bio));
-            calypso_make_single_block_request(bio, i, req_blocks_count_complete, req_blocks_count_incomplete, physical_sector_nr);
+            /* the runs before it still need to be submitted, the request ends with them */
+            bio->bi_status = BLK_STS_RESOURCE;
+            bio_endio(bio);
+            break;
         }
-        /* Reads are treated the same way as writes */
-        else {
-            /* 
-            * If the block is mapped, we already issued the operation to that 
-            * physical block, if no, we need to find the next free 
-            * physical block and update the mapping to this virtual block
-            */
-            debug(KERN_INFO, __func__, "BLOCK IS NOT MAPPED\n");
-
-            /* 
-             * Find next free block
-             * next_free_physical_block_nr can start with the previous value so that 
-             * we don't need to start from the beginning of the bitmap all over again 
-             */
-            if (calypso_get_next_free_block(calypso_dev->high_entropy_blocks_bitmap, calypso_dev->physical_nr_blocks, &next_free_physical_block_nr) == -1) {
-            // if (calypso_get_next_free_block(calypso_dev->physical_blocks_bitmap, calypso_dev->physical_nr_blocks, &next_free_physical_block_nr) == -1) {
-                debug(KERN_ERR, __func__, "No more blocks to allocate in physical partition\n");
-                bio_endio(bio);
-                return;
-            }  
-            debug_args(KERN_INFO, __func__, "remapping to NEXT FREE BLOCK %lu\n", next_free_physical_block_nr);
-
-            /* We need to set that block as allocated so that we don't assign same free block more than once */
-            calypso_update_bitmaps(calypso_dev->physical_blocks_bitmap, calypso_dev->high_entropy_blocks_bitmap, next_free_physical_block_nr);
-            // calypso_clear_bit(calypso_dev->high_entropy_blocks_bitmap, next_free_physical_block_nr);
-            // calypso_set_bit(calypso_dev->physical_blocks_bitmap, next_free_physical_block_nr);
-            
-            /* Update mapping */
-            // ***** TODO which one is right?????
-            calypso_update_mappings(virtual_block_nr, next_free_physical_block_nr);
-            //calypso_update_mappings(virtual_block_nr+i, next_free_physical_block_nr);
-
-            physical_sector_nr = calypso_get_sector_nr_from_block(next_free_physical_block_nr, bio_offset(bio));
-            //calypso_update_bio_sector(&(bio->bi_iter), physical_sector_nr); 
-
-            if (bio_data_dir(bio) == WRITE)
-            {
-                /* To test: $ sudo dd if=text.txt count=1 bs=4096 seek=100 of=/dev/calypso0 */
-                debug(KERN_INFO, __func__, "REMAPPING WRITE\n");
-                //calypso_create_bio_write_req(calypso_dev->physical_dev, physical_sector_nr, 4096, bio);
-            }
+
+        /* Extends the run while the request's next block follows the last one on the native device */
+        run_virtual_block_nr = iter.bi_sector / 8;
+        run_start = physical_block_nr;
+        run_blocks = 1;
+        while (run_blocks * 8 < bio_sectors(bio))
+        {
+            bio_advance_iter(bio, &iter, CALYPSO_BLOCK_SIZE);
+            /* Blocks inside the same run do not need to be looked up again, unless they are written with zeros or could be cached */
+            if (--run_len > 0 && !calypso_is_zero_write(bio, iter) && !calypso_block_cache_enabled(&(calypso_dev->block_cache))
+                && !calypso_read_cache_enabled(&(calypso_dev->read_cache)))
+                physical_block_nr = calypso_run_block(run_start, run_blocks);
             else
+                physical_block_nr = calypso_map_request_block(bio, iter, &run_len, &next_free_physical_block_nr, hctx);
+            if (physical_block_nr != calypso_run_block(run_start, run_blocks))
+                break;
+            run_blocks++;
+        }
+
+        run_sectors = min_t(unsigned long, bio_sectors(bio), run_blocks * 8);
+        if (run_sectors < bio_sectors(bio))
+            run_bio = calypso_split_bio(bio, run_sectors);
+        else
+            run_bio = bio;
+
+        if (run_start == CALYPSO_CACHED_BLOCK)
+        {
+            debug_args(KERN_INFO, __func__, "%lu blocks served from memory\n", run_blocks);
+            bio_endio(run_bio);
+        }
+        else if (run_start == CALYPSO_ZERO_BLOCK)
+        {
+            debug_args(KERN_INFO, __func__, "%lu blocks need no physical block\n", run_blocks);
+            if (bio_op(run_bio) == REQ_OP_READ)
             {
-                /* To test: $ sudo dd if=/dev/calypso0 count=1 bs=4096 skip=200 */
-                debug(KERN_INFO, __func__, "REMAPPING READ\n");
-                // calypso_create_bio_read_req2(calypso_dev->physical_dev, physical_sector_nr, 4096, bio);
+                zero_fill_bio(run_bio);
+                atomic64_add(run_blocks, &(calypso_dev->stats.zero_filled_reads));
             }
-            calypso_make_single_block_request(bio, i, req_blocks_count_complete, req_blocks_count_incomplete, physical_sector_nr);
+            bio_endio(run_bio);
+        }
+        else
+        {
+            debug_args(KERN_INFO, __func__, "Remapping %lu blocks to %lu\n", run_blocks, (unsigned long)run_start);
+            calypso_update_bio_sector(&(run_bio->bi_iter), calypso_get_sector_nr_from_block(run_start, 0));
+            if (bio_op(run_bio) == REQ_OP_READ && calypso_read_cache_enabled(&(calypso_dev->read_cache)))
+                calypso_read_cache_fill_bio(&(calypso_dev->read_cache), run_virtual_block_nr, run_bio);
+            bio_list_add(&runs, run_bio);
         }
-        /* Advance to the next block of the request */
-        virtual_block_nr++;
-        physical_block_nr = calypso_dev->virtual_to_physical_block_mapping[virtual_block_nr];
-        i++;
-    } while (i < req_blocks_count_complete);
-    //bio_set_dev(bio, calypso_dev->physical_dev);
-    //direct_make_request(bio);
-    //orig_request_fn(bdev_get_queue(calypso_dev->physical_dev), bio);
-    //return orig_request_fn(bdev_get_queue(calypso_dev->physical_dev), bio);
+        /* physical_block_nr already has the block the rest of the request starts at */
+    } while (run_bio != bio);
 
-    /* Then, we send the bio's request to the underlying native device */
-    /*bio_set_dev(bio, calypso_dev->physical_dev);*/
-    //bio->bi_private = &(calypso_dev->major);
+    calypso_submit_runs(&runs);
+}
+
+/*
+ * The file system on the Calypso device no longer needs these blocks, so
+ * the physical blocks holding them go back to the free pool and the host
+ * overwriting them later costs no relocation
+ */
+static void calypso_discard_blocks(struct bio *bio)
+{
+    unsigned long virtual_block_nr = bio->bi_iter.bi_sector / 8;
+    unsigned long end = bio_end_sector(bio) / 8;
+
+    /* blocks written since the last flush may not even be mapped yet */
+    if (calypso_block_cache_enabled(&(calypso_dev->block_cache)) && end > virtual_block_nr)
+        calypso_block_cache_invalidate(&(calypso_dev->block_cache), virtual_block_nr, end - virtual_block_nr);
+
+    for (; virtual_block_nr < end; virtual_block_nr++)
+    {
+        /* sparse devices can be much bigger than what was written to them */
+        if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        {
+            virtual_block_nr = calypso_sparse_map_next(&(calypso_dev->sparse_map), virtual_block_nr, end);
+            if (virtual_block_nr >= end)
+                break;
+        }
+
+        if (calypso_unmap_virtual_block(virtual_block_nr))
+            atomic64_inc(&(calypso_dev->stats.discarded_blocks));
+    }
+
+    bio_endio(bio);
+}
 
-    /*trace_block_bio_remap(bdev_get_queue(calypso_dev->physical_dev), 
-                        bio,
-                        bio_dev(bio), 
-                        req_start_sector);*/
+static int calypso_readahead_block_cmp(const void *a, const void *b)
+{
+    calypso_block_t block_a = ((const struct calypso_readahead_block *)a)->physical_block_nr;
+    calypso_block_t block_b = ((const struct calypso_readahead_block *)b)->physical_block_nr;
 
-    /*return generic_make_request(bio);*/
+    return block_a < block_b ? -1 : block_a > block_b;
+}
+
+static void calypso_submit_readahead_bio(struct bio *bio)
+{
+    if (bio->bi_iter.bi_size == 0)
+    {
+        bio_put(bio);
+        return;
+    }
+    calypso_make_encrypted_request(bio);
+}
+
+/*
+ * Reads ahead of a sequential stream of reads into the read cache. The
+ * blocks are read at once and in the order they are on the native device,
+ * with the ones that are contiguous there in a single bio. Only blocks whose
+ * mappings are in memory are read ahead, so the stream waits for nothing
+ */
+static void calypso_read_ahead(unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    struct calypso_read_cache *cache = &(calypso_dev->read_cache);
+    struct calypso_readahead_block *blocks;
+    calypso_block_t physical_block_nr, next_physical_block_nr = CALYPSO_UNMAPPED;
+    unsigned long start, count, run_len, i, nr = 0;
+    struct bio *bio = NULL;
+    struct blk_plug plug;
+
+    if (!calypso_readahead_next(&(calypso_dev->readahead), virtual_block_nr, nr_blocks,
+                    atomic64_read(&(cache->readahead_blocks)), atomic64_read(&(cache->readahead_wasted)), &start, &count))
+        return;
+    if (start >= calypso_dev->virtual_nr_blocks)
+        return;
+    count = min(count, calypso_dev->virtual_nr_blocks - start);
+
+    blocks = kmalloc_array(count, sizeof(struct calypso_readahead_block), GFP_NOIO);
+    if (!blocks)
+        return;
+    if (calypso_dev_get_mappings(calypso_dev, start, count, NULL) != 0)
+    {
+        kfree(blocks);
+        return;
+    }
+    for (i = start; i < start + count; i++)
+    {
+        /* dirty blocks are newer than what the native device has */
+        if (calypso_read_cache_contains(cache, i)
+            || (calypso_block_cache_enabled(&(calypso_dev->block_cache)) && calypso_block_cache_contains_range(&(calypso_dev->block_cache), i, 1)))
+            continue;
+        physical_block_nr = calypso_lookup_physical_run(calypso_dev, i, &run_len);
+        if (!calypso_is_block_mapped(calypso_dev, physical_block_nr))
+            continue;
+        /* the host may have written over it, and the read of the copy comes after the remap */
+        if (calypso_relocation_pending(&(calypso_dev->relocation)) > 0
+            && calypso_relocation_contains(&(calypso_dev->relocation), physical_block_nr))
+            continue;
+        blocks[nr].virtual_block_nr = i;
+        blocks[nr].physical_block_nr = physical_block_nr;
+        nr++;
+    }
+    calypso_dev_put_mappings(calypso_dev, start, count);
+
+    sort(blocks, nr, sizeof(struct calypso_readahead_block), calypso_readahead_block_cmp, NULL);
+
+    blk_start_plug(&plug);
+    for (i = 0; i < nr; i++)
+    {
+        if (bio && (blocks[i].physical_block_nr != next_physical_block_nr || bio->bi_vcnt >= bio->bi_max_vecs))
+        {
+            calypso_submit_readahead_bio(bio);
+            bio = NULL;
+        }
+        if (!bio)
+        {
+            /* from a mempool with GFP_NOIO, so it does not fail */
+            bio = bio_alloc(GFP_NOIO, min_t(unsigned long, nr - i, BIO_MAX_PAGES));
+            bio_set_dev(bio, calypso_dev->physical_dev);
+            bio->bi_opf = REQ_OP_READ | REQ_RAHEAD | REQ_CALYPSO;
+            bio->bi_iter.bi_sector = calypso_get_sector_nr_from_block(blocks[i].physical_block_nr, 0);
+            bio->bi_private = cache;
+            bio->bi_end_io = calypso_read_cache_readahead_end_io;
+        }
+        /* blocks cached meanwhile leave a hole the bio cannot span */
+        if (calypso_read_cache_add_readahead(cache, blocks[i].virtual_block_nr, bio) != 0)
+        {
+            calypso_submit_readahead_bio(bio);
+            bio = NULL;
+        }
+        next_physical_block_nr = blocks[i].physical_block_nr + 1;
+    }
+    if (bio)
+        calypso_submit_readahead_bio(bio);
+    blk_finish_plug(&plug);
+
+    kfree(blocks);
+}
+
+/*
+ * Holds a request to virtual blocks whose physical blocks are being
+ * relocated, until they were remapped to their copies. The host may have
+ * written over the old blocks already, so reads would return its data and
+ * writes would be lost once the copy replaces the block. The request is
+ * submitted again afterwards and looks its blocks up anew.
+ * The mappings of the blocks need to be in memory.
+ *
+ * Returns true if the bio is held
+ */
+static bool calypso_hold_relocated_request(struct bio *bio, unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    unsigned long end = min(virtual_block_nr + nr_blocks, calypso_dev->virtual_nr_blocks);
+    calypso_block_t physical_block_nr;
+
+    /* most requests come while nothing is relocated */
+    if (calypso_relocation_pending(&(calypso_dev->relocation)) == 0)
+        return false;
+
+    for (; virtual_block_nr < end; virtual_block_nr++)
+    {
+        physical_block_nr = calypso_lookup_physical_block(calypso_dev, virtual_block_nr);
+        if (calypso_is_block_mapped(calypso_dev, physical_block_nr)
+            && calypso_relocation_hold(&(calypso_dev->relocation), physical_block_nr, bio))
+            return true;
+    }
+    return false;
+}
+
+static void _calypso_submit_bio(struct bio *bio, struct calypso_hctx *hctx)
+{
+    unsigned long virtual_block_nr = bio->bi_iter.bi_sector / 8;
+    unsigned long nr_blocks = (bio->bi_iter.bi_sector + max(bio_sectors(bio), 1U) - 1) / 8 - virtual_block_nr + 1;
+    struct calypso_block_cache *cache = &(calypso_dev->block_cache);
+    /* the bio may be gone once it is remapped */
+    bool is_read = bio_op(bio) == REQ_OP_READ;
+    int ret;
+
+    /* Empty flushes have no block to map, the native device flushes its own cache */
+    if (bio_sectors(bio) == 0)
+    {
+        bio_set_dev(bio, calypso_dev->physical_dev);
+        bio->bi_opf |= REQ_CALYPSO;
+        generic_make_request(bio);
+        return;
+    }
+
+    /*
+     * Zeroes are written by unmapping whole blocks. Part of a block would
+     * need the rest of it read and written back, so it is refused rather
+     * than sent to the native device without its offset in the block
+     */
+    if (bio_op(bio) == REQ_OP_WRITE_ZEROES && (!IS_ALIGNED(bio->bi_iter.bi_sector, 8) || !IS_ALIGNED(bio_sectors(bio), 8)))
+    {
+        debug_args(KERN_ERR, __func__, "Write zeroes of part of a block at sector %llu\n", (unsigned long long)bio->bi_iter.bi_sector);
+        bio->bi_status = BLK_STS_NOTSUPP;
+        bio_endio(bio);
+        return;
+    }
+
+    /* Data read before this request, or while it is written, is not what the blocks hold any more */
+    if (bio_op(bio) != REQ_OP_READ && calypso_read_cache_enabled(&(calypso_dev->read_cache)))
+        calypso_read_cache_invalidate_bio(&(calypso_dev->read_cache), virtual_block_nr, nr_blocks, bio);
+
+    /*
+     * Reads of blocks that were never written, like the probes of blkid or
+     * fsck on a new device, need neither mappings read from disk nor any I/O
+     */
+    if (bio_op(bio) == REQ_OP_READ && calypso_dev_is_range_unmapped(calypso_dev, virtual_block_nr, nr_blocks)
+        && !(calypso_block_cache_enabled(cache) && calypso_block_cache_contains_range(cache, virtual_block_nr, nr_blocks)))
+    {
+        zero_fill_bio(bio);
+        atomic64_add(nr_blocks, &(calypso_dev->stats.zero_filled_reads));
+        bio_endio(bio);
+        return;
+    }
+
+    /* 
+     * With paged mappings, the pages this request needs have to be in memory first.
+     * A bio left waiting is submitted to the Calypso device again once they are,
+     * which with the blk-mq queue makes it a request of its own
+     */
+    ret = calypso_dev_get_mappings(calypso_dev, virtual_block_nr, nr_blocks, bio);
+    if (ret == -EAGAIN)
+        return;
+    if (ret != 0)
+    {
+        bio->bi_status = BLK_STS_RESOURCE;
+        bio_endio(bio);
+        return;
+    }
+
+    if (calypso_hold_relocated_request(bio, virtual_block_nr, nr_blocks))
+    {
+        calypso_dev_put_mappings(calypso_dev, virtual_block_nr, nr_blocks);
+        return;
+    }
+
+    if (bio_op(bio) == REQ_OP_DISCARD)
+        calypso_discard_blocks(bio);
+    else
+        calypso_remap_io_request_to_physical_dev(bio, hctx);
+
+    calypso_dev_put_mappings(calypso_dev, virtual_block_nr, nr_blocks);
+
+    if (is_read && calypso_readahead_enabled(&(calypso_dev->readahead)))
+        calypso_read_ahead(virtual_block_nr, nr_blocks);
+}
+
+/*
+ * Remaps a bio to the native device, with the state of the hardware queue
+ * it came from, or NULL when it was submitted straight to the device.
+ * With the block cache, flushes and FUA writes first wait for the blocks
+ * written before them to be written back
+ */
+static void calypso_submit_bio(struct bio *bio, struct calypso_hctx *hctx)
+{
+    if (calypso_block_cache_enabled(&(calypso_dev->block_cache)) && op_is_flush(bio->bi_opf))
+    {
+        calypso_block_cache_flush_bio(&(calypso_dev->block_cache), bio);
+        return;
+    }
+
+    _calypso_submit_bio(bio, hctx);
+}
+
+/* Flushes and FUA writes carry on from the block cache worker once the blocks dirty before them were written */
+static void calypso_submit_flushed_bio(struct bio *bio)
+{
+    _calypso_submit_bio(bio, NULL);
+}
+
+/*
+ * Writes a block written back by the block cache. Called by the block cache
+ * worker, so it may wait for the mappings, unlike calypso_submit_bio()
+ */
+static void calypso_write_cached_block(unsigned long virtual_block_nr, struct bio *bio)
+{
+    unsigned long next_free_physical_block_nr = 0;
+    calypso_block_t physical_block_nr;
+    unsigned long run_len;
+    int ret;
+
+    /* the page of mappings is being read, the block cache tries again */
+    ret = calypso_dev_get_mappings(calypso_dev, virtual_block_nr, 1, NULL);
+    if (ret != 0)
+    {
+        bio->bi_status = ret == -EAGAIN ? BLK_STS_AGAIN : BLK_STS_RESOURCE;
+        bio_endio(bio);
+        return;
+    }
+
+    if (calypso_is_zero_write(bio, bio->bi_iter))
+    {
+        calypso_unmap_virtual_block(virtual_block_nr);
+        atomic64_inc(&(calypso_dev->stats.zero_blocks));
+        bio_endio(bio);
+        goto out;
+    }
+
+    physical_block_nr = calypso_map_virtual_block(virtual_block_nr, &run_len, &next_free_physical_block_nr, NULL);
+    if (physical_block_nr == CALYPSO_UNMAPPED)
+    {
+        bio->bi_status = BLK_STS_RESOURCE;
+        bio_endio(bio);
+        goto out;
+    }
+    /* the block is being relocated, the block cache writes it again once it was remapped */
+    if (calypso_relocation_pending(&(calypso_dev->relocation)) > 0
+        && calypso_relocation_contains(&(calypso_dev->relocation), physical_block_nr))
+    {
+        bio->bi_status = BLK_STS_AGAIN;
+        bio_endio(bio);
+        goto out;
+    }
+
+    bio_set_dev(bio, calypso_dev->physical_dev);
+    bio->bi_opf |= REQ_CALYPSO;
+    calypso_update_bio_sector(&(bio->bi_iter), calypso_get_sector_nr_from_block(physical_block_nr, 0));
+    calypso_make_encrypted_request(bio);
+out:
+    calypso_dev_put_mappings(calypso_dev, virtual_block_nr, 1);
 }
 
 /*
@@ -615,7 +1383,107 @@ static blk_qc_t calypso_make_request(struct request_queue *q, struct bio *bio)
 	// debug(KERN_INFO, __func__, "Processing requests...");
     
 	// return calypso_remap_io_request_to_physical_dev(req, bio);
-    calypso_remap_io_request_to_physical_dev(bio);
+    calypso_submit_bio(bio, NULL);
+    return 0;
+}
+
+static void calypso_cmd_put(struct request *rq)
+{
+    struct calypso_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    if (atomic_dec_and_test(&(cmd->pending)))
+        blk_mq_end_request(rq, READ_ONCE(cmd->status));
+}
+
+static void calypso_rq_bio_end_io(struct bio *clone)
+{
+    struct request *rq = clone->bi_private;
+    struct calypso_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    if (clone->bi_status != BLK_STS_OK)
+        WRITE_ONCE(cmd->status, clone->bi_status);
+    bio_put(clone);
+    calypso_cmd_put(rq);
+}
+
+/*
+ * Handle a request of the blk-mq queue. Its bios are remapped the same way
+ * as with the bio path, through clones, since they cannot be ended before
+ * blk-mq ends the request
+ */
+static blk_status_t calypso_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+    struct request *rq = bd->rq;
+    struct calypso_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    struct bio *bio, *clone;
+
+    blk_mq_start_request(rq);
+
+    /* held while the clones are submitted, so the request does not end under us */
+    atomic_set(&(cmd->pending), 1);
+    cmd->status = BLK_STS_OK;
+
+    /* flush requests have no bio of their own */
+    if (req_op(rq) == REQ_OP_FLUSH)
+    {
+        clone = bio_alloc(GFP_NOIO, 0);
+        clone->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH;
+        clone->bi_disk = rq->rq_disk;
+        clone->bi_private = rq;
+        clone->bi_end_io = calypso_rq_bio_end_io;
+        atomic_inc(&(cmd->pending));
+        calypso_submit_bio(clone, hctx->driver_data);
+    }
+
+    __rq_for_each_bio(bio, rq)
+    {
+        clone = calypso_clone_bio(bio);
+        if (!clone)
+        {
+            WRITE_ONCE(cmd->status, BLK_STS_RESOURCE);
+            break;
+        }
+        clone->bi_private = rq;
+        clone->bi_end_io = calypso_rq_bio_end_io;
+        atomic_inc(&(cmd->pending));
+        calypso_submit_bio(clone, hctx->driver_data);
+    }
+
+    calypso_cmd_put(rq);
+    return BLK_STS_OK;
+}
+
+static int calypso_init_hctx(struct blk_mq_hw_ctx *hctx, void *driver_data, unsigned int hctx_idx)
+{
+    struct calypso_hctx *calypso_hctx = kzalloc_node(sizeof(struct calypso_hctx), GFP_KERNEL, hctx->numa_node);
+
+    if (!calypso_hctx)
+    {
+        debug_args(KERN_ERR, __func__, "Could not allocate hardware queue %u\n", hctx_idx);
+        return -ENOMEM;
+    }
+    hctx->driver_data = calypso_hctx;
+
+    return 0;
+}
+
+static void calypso_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+    kfree(hctx->driver_data);
+    hctx->driver_data = NULL;
+}
+
+/* With a hardware queue per node, every CPU submits to the queue of its node */
+static int calypso_map_queues(struct blk_mq_tag_set *set)
+{
+    struct blk_mq_queue_map *map = &(set->map[HCTX_TYPE_DEFAULT]);
+    unsigned int cpu;
+
+    if (!hw_queue_per_node)
+        return blk_mq_map_queues(map);
+
+    for_each_possible_cpu(cpu)
+        map->mq_map[cpu] = cpu_to_node(cpu) % map->nr_queues;
     return 0;
 }
 
@@ -675,6 +1543,8 @@ int calypso_dev_ioctl(struct block_device *bdev, fmode_t mode,
  static int __init calypso_init(void)
 {
     int ret = 0;
+
+    calypso_debug_set_level(debug_level);
 	
 	debug_args(KERN_INFO, __func__, "Initializing Calypso...\n");
 
@@ -701,8 +1571,10 @@ int calypso_dev_ioctl(struct block_device *bdev, fmode_t mode,
     calypso_dev->virtual_nr_blocks = blocks; // capacity in blocks
     calypso_dev->capacity = blocks * 8; // capacity in sectors
 
-    //ret = calypso_dev_setup(calypso_dev, &calypso_fops, &calypso_fops_req);
-	ret = calypso_dev_no_queue_setup(calypso_dev, &calypso_fops, CALYPSO_DEV_NAME, &(calypso_dev->major), calypso_make_request);
+    if (queue_mode == CALYPSO_QUEUE_MQ)
+        ret = calypso_dev_setup(calypso_dev, &calypso_fops, &calypso_mq_ops, CALYPSO_DEV_NAME, &(calypso_dev->major), hw_queue_per_node ? nr_node_ids : nr_cpu_ids, sizeof(struct calypso_cmd));
+    else
+	    ret = calypso_dev_no_queue_setup(calypso_dev, &calypso_fops, CALYPSO_DEV_NAME, &(calypso_dev->major), calypso_make_request);
     if (ret != 0)
     {
         debug(KERN_ERR, __func__, "Unable to set up Calypso\n");
@@ -727,23 +1599,59 @@ int calypso_dev_ioctl(struct block_device *bdev, fmode_t mode,
     calypso_get_super_block_physical_dev(calypso_dev);
     calypso_dev->physical_nr_blocks = calypso_get_physical_block_count(calypso_dev);
     debug(KERN_INFO, __func__, "After get physical block count\n");
+    /* block numbers must stay below the values that stand for unmapped, zero and cached blocks */
+    if (calypso_dev->physical_nr_blocks >= CALYPSO_CACHED_BLOCK)
+    {
+        debug_args(KERN_ERR, __func__, "Physical device is too big for 32 bit mappings, it can have fewer than %llu blocks, build with CALYPSO_64BIT_MAPPINGS=1\n", (unsigned long long)CALYPSO_CACHED_BLOCK);
+        ret = -EFBIG;
+		goto error_after_bdev;
+    }
+    if (calypso_dev->virtual_nr_blocks > CALYPSO_METADATA_MAX_VIRTUAL_BLOCKS)
+    {
+        debug_args(KERN_ERR, __func__, "Calypso device can have at most %lu blocks\n", CALYPSO_METADATA_MAX_VIRTUAL_BLOCKS);
+        ret = -EFBIG;
+		goto error_after_bdev;
+    }
 
     /* Determine metadata sizes */
     calypso_dev->bitmap_data_len = calypso_calc_bitmap_metadata_size(calypso_dev->physical_nr_blocks);
     calypso_dev->mappings_data_len = calypso_calc_mappings_metadata_size(calypso_dev->virtual_nr_blocks);
     calypso_dev->metadata_nr_blocks = calypso_calc_metadata_size_in_blocks(calypso_dev->bitmap_data_len, calypso_dev->mappings_data_len);
+    if (mapping_format >= CALYPSO_MAPPINGS_EXTENTS && mapping_format <= CALYPSO_MAPPINGS_SPARSE)
+        calypso_dev->mapping_format = mapping_format;
+    else
+        calypso_dev->mapping_format = CALYPSO_MAPPINGS_ARRAY;
+    /* 
+     * Enough for metadata written with any format, in the worst case of one extent per block.
+     * No more blocks can be mapped than there are physical ones, which keeps this small for
+     * sparse devices bigger than the native partition. These do not fit the array either
+     */
+    calypso_dev->metadata_max_blocks = calypso_calc_metadata_size_in_blocks(calypso_dev->bitmap_data_len, calypso_calc_extents_metadata_size(min(calypso_dev->virtual_nr_blocks, calypso_dev->physical_nr_blocks)));
+    if (calypso_dev->mapping_format != CALYPSO_MAPPINGS_SPARSE)
+        calypso_dev->metadata_max_blocks = max(calypso_dev->metadata_max_blocks, calypso_dev->metadata_nr_blocks);
     debug_args(KERN_INFO, __func__, "calypso_dev->metadata_nr_blocks: %lu\n", calypso_dev->metadata_nr_blocks);
 
-    ret = calypso_dev_init_bitmaps(calypso_dev);
+    ret = calypso_dev_init_block_state(calypso_dev);
     if (ret != 0)
 		goto error_after_bdev;
-    debug(KERN_INFO, __func__, "After bitmaps\n");
+    debug(KERN_INFO, __func__, "After block state\n");
 
     ret = calypso_dev_init_mappings(calypso_dev);
     if (ret != 0)
-		goto error_after_bitmaps;
+		goto error_after_block_state;
     debug(KERN_INFO, __func__, "After mappings\n");
 
+    ret = calypso_heatmap_init(&(calypso_dev->heatmap), calypso_dev->physical_nr_groups, EXT4_BLOCKS_PER_GROUP(calypso_dev->physical_super_block));
+    if (ret != 0)
+		goto error_after_mappings;
+
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+    {
+        ret = calypso_init_mapping_cache();
+        if (ret != 0)
+            goto error_after_heatmap;
+    }
+
     /* 
      * We should always retrieve the bitmap to check the changes that may have happened during the time
      * Calypso was not active. Then, if a block was being used by calypso and was free, if it is occupied 
@@ -764,11 +1672,6 @@ int calypso_dev_ioctl(struct block_device *bdev, fmode_t mode,
     // calypso_hook_physical_make_request_fn();
     // debug(KERN_INFO, __func__, "After make_request_fn\n");
 
-    calypso_dev->from_physical_block_pending_copy = -1;
-    calypso_dev->to_physical_block_pending_copy = -1;
-    // TODO check if successful
-    calypso_dev->pending_data = kmalloc(4096, GFP_KERNEL);
-
     debug(KERN_INFO, __func__, "------------ CRYPTO_PART ------------\n");
     debug_args(KERN_INFO, __func__, "***** bitmap_data_len: %lu, mappings_data_len: %lu, metadata_nr_blocks: %lu\n", calypso_dev->bitmap_data_len, calypso_dev->mappings_data_len, calypso_dev->metadata_nr_blocks);
     // sudo dd if=hello.txt bs=4096 seek=36 count=1 of=/dev/calypso0
@@ -780,48 +1683,140 @@ int calypso_dev_ioctl(struct block_device *bdev, fmode_t mode,
     {
         // debug_args(KERN_INFO, __func__, "virtual blocks before: %lu\n", calypso_dev->virtual_nr_blocks);
         // calypso_retrieve_hidden_metadata(calypso_dev->bitmap_data_len, calypso_dev->mappings_data_len, calypso_dev->metadata_to_physical_block_mapping, calypso_dev->metadata_nr_blocks, calypso_dev->physical_dev, calypso_dev->physical_blocks_bitmap, calypso_dev->high_entropy_blocks_bitmap, calypso_dev->physical_nr_blocks, calypso_dev->sym_enc_tfm, calypso_dev->cipher, calypso_dev->virtual_nr_blocks, calypso_dev->virtual_to_physical_block_mapping, calypso_dev->physical_to_virtual_block_mapping);
-        calypso_retrieve_hidden_metadata(calypso_dev->bitmap_data_len, calypso_dev->mappings_data_len, calypso_dev->metadata_to_physical_block_mapping, calypso_dev->metadata_nr_blocks, calypso_dev->physical_dev, calypso_dev->physical_blocks_bitmap, calypso_dev->high_entropy_blocks_bitmap, calypso_dev->physical_nr_blocks, calypso_dev->sym_enc_tfm, calypso_dev->cipher, calypso_dev->virtual_nr_blocks, &(calypso_dev->virtual_nr_blocks), calypso_dev->virtual_to_physical_block_mapping, calypso_dev->physical_to_virtual_block_mapping);
+        calypso_retrieve_hidden_metadata(calypso_dev->bitmap_data_len, calypso_dev->mappings_data_len, calypso_dev->metadata_to_physical_block_mapping, calypso_dev->metadata_max_blocks, &(calypso_dev->metadata_nr_blocks), calypso_dev->physical_dev, &(calypso_dev->block_state), calypso_dev->physical_nr_blocks, calypso_dev->sym_enc_tfm, calypso_dev->cipher, calypso_dev->virtual_nr_blocks, &(calypso_dev->virtual_nr_blocks), calypso_dev);
         debug_args(KERN_INFO, __func__, "virtual blocks after: %lu\n", calypso_dev->virtual_nr_blocks);
+
+        if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        {
+            ret = calypso_load_mapping_pages();
+            if (ret != 0)
+                goto error_after_mapping_cache;
+        }
     }
     // else {
     // TODO: see if it should be done every time and if it should be done after calypso_retrieve_hidden_metadata
-    calypso_dev->free_high_entropy_blocks = classify_free_blocks_entropy(calypso_dev->physical_blocks_bitmap, calypso_dev->high_entropy_blocks_bitmap, calypso_dev->physical_nr_blocks);
+    calypso_dev->free_high_entropy_blocks = classify_free_blocks_entropy(&(calypso_dev->block_state));
     debug_args(KERN_INFO, __func__, "free_high_entropy_blocks: %lu\n", calypso_dev->free_high_entropy_blocks);
     // }
+    /* Needs the blocks fully classified, since it starts claiming them right away */
+    ret = calypso_block_reserve_init(&(calypso_dev->reserve), calypso_dev->physical_nr_blocks, calypso_claim_free_physical_block, calypso_release_physical_block);
+    if (ret != 0)
+        goto error_after_mapping_cache;
+
+    /* Pages can only be written back now that blocks can be claimed */
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        calypso_mapping_cache_set_limit(&(calypso_dev->mapping_cache), mapping_cache_kb * 1024UL / PAGE_SIZE);
+
+    /* Blocks are written back through the mappings and the reserve */
+    ret = calypso_block_cache_init(&(calypso_dev->block_cache), block_cache_kb * 1024UL / CALYPSO_BLOCK_SIZE, block_cache_flush_ms, calypso_write_cached_block, calypso_submit_flushed_bio);
+    if (ret != 0)
+        goto error_after_reserve;
+    calypso_read_cache_init(&(calypso_dev->read_cache), read_cache_kb * 1024UL / CALYPSO_BLOCK_SIZE);
+    /* Blocks are read ahead into the read cache */
+    calypso_readahead_init(&(calypso_dev->readahead), read_cache_kb > 0 ? readahead_kb * 1024UL / CALYPSO_BLOCK_SIZE : 0);
+
+    /* Copies claim blocks and update the mappings */
+    ret = calypso_relocation_init(&(calypso_dev->relocation), calypso_dev->physical_dev, &(calypso_dev->reverse_index), relocation_max_inflight, calypso_alloc_physical_extent, calypso_release_physical_block, calypso_move_mapping, calypso_give_up_physical_block,
+        calypso_block_cache_enabled(&(calypso_dev->block_cache)) || calypso_read_cache_enabled(&(calypso_dev->read_cache)) ? calypso_snapshot_block : NULL);
+    if (ret != 0)
+        goto error_after_block_cache;
+
+    ret = calypso_sysfs_init(calypso_dev);
+    if (ret != 0)
+        goto error_after_relocation;
+
     // TODO: CHANGE THIS TO BEFORE??
     calypso_hook_physical_make_request_fn();
 
     return ret;
 
-error_after_bitmaps:
-    calypso_dev_cleanup_bitmaps(calypso_dev);
+error_after_relocation:
+    calypso_relocation_cleanup(&(calypso_dev->relocation));
+error_after_block_cache:
+    calypso_read_cache_cleanup(&(calypso_dev->read_cache));
+    calypso_block_cache_cleanup(&(calypso_dev->block_cache));
+error_after_reserve:
+    calypso_block_reserve_cleanup(&(calypso_dev->reserve));
+error_after_mapping_cache:
+    calypso_mapping_cache_cleanup(&(calypso_dev->mapping_cache));
+error_after_heatmap:
+    calypso_heatmap_cleanup(&(calypso_dev->heatmap));
+error_after_mappings:
+    calypso_dev_cleanup_mappings(calypso_dev);
+error_after_block_state:
+    calypso_dev_cleanup_block_state(calypso_dev);
 error_after_bdev:
     calypso_dev_physical_cleanup(calypso_dev, CALYPSO_DEV_NAME, &(calypso_dev->major));
     return ret;
 }
 
 
+/*
+ * The hidden metadata takes as many blocks as the mappings being encoded
+ * need, which with extents or sparse mappings depends on how the hidden data
+ * was written. Metadata blocks no longer needed go back to the free pool.
+ */
+static void calypso_resize_hidden_metadata(void)
+{
+    unsigned long i;
+
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_EXTENTS)
+        calypso_dev->mappings_data_len = calypso_calc_extents_metadata_size(calypso_dev->extent_map.nr_extents);
+    else if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        calypso_dev->mappings_data_len = calypso_calc_pages_metadata_size(calypso_dev->mapping_cache.nr_pages);
+    else if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        calypso_dev->mappings_data_len = calypso_calc_sparse_metadata_size(atomic_long_read(&(calypso_dev->sparse_map.nr_entries)));
+    else
+        calypso_dev->mappings_data_len = calypso_calc_mappings_metadata_size(calypso_dev->virtual_nr_blocks);
+    calypso_dev->metadata_nr_blocks = calypso_calc_metadata_size_in_blocks(calypso_dev->bitmap_data_len, calypso_dev->mappings_data_len);
+
+    for (i = calypso_dev->metadata_nr_blocks; i < calypso_dev->metadata_max_blocks; i++)
+    {
+        if (calypso_dev->metadata_to_physical_block_mapping[i] == CALYPSO_UNMAPPED)
+            continue;
+        calypso_release_physical_block(calypso_dev->metadata_to_physical_block_mapping[i]);
+        calypso_dev->metadata_to_physical_block_mapping[i] = CALYPSO_UNMAPPED;
+    }
+    debug_args(KERN_INFO, __func__, "Hidden metadata takes %lu blocks\n", calypso_dev->metadata_nr_blocks);
+}
+
 /*
  * This is the unregistration and uninitialization section of the ram block
  * device driver
  */
 static void __exit calypso_cleanup(void)
 {
-    calypso_encode_hidden_metadata(calypso_dev->bitmap_data_len, calypso_dev->mappings_data_len, calypso_dev->metadata_to_physical_block_mapping, calypso_dev->metadata_nr_blocks, calypso_dev->physical_dev, calypso_dev->physical_blocks_bitmap, calypso_dev->high_entropy_blocks_bitmap, calypso_dev->physical_nr_blocks, calypso_dev->sym_enc_tfm, calypso_dev->cipher, calypso_dev->virtual_nr_blocks, calypso_dev->virtual_to_physical_block_mapping);
-
+    /* No more host writes queue copies, which would remap blocks after the mappings are persisted */
 	calypso_restore_physical_make_request_fn();
+    /* Copies in flight remap blocks, so they land before the mappings are persisted */
+    calypso_relocation_wait(&(calypso_dev->relocation));
+    /* Dirty blocks need physical blocks, so they are written before the reserve goes away */
+    calypso_block_cache_cleanup(&(calypso_dev->block_cache));
+    /* Reserved blocks go back to the free pool before the bitmap is persisted */
+    calypso_block_reserve_cleanup(&(calypso_dev->reserve));
+    /* The stored pages need to be up to date before the blocks storing them are persisted */
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        calypso_mapping_cache_flush(&(calypso_dev->mapping_cache));
+
+    calypso_resize_hidden_metadata();
+    calypso_encode_hidden_metadata(calypso_dev->bitmap_data_len, calypso_dev->mappings_data_len, calypso_dev->metadata_to_physical_block_mapping, calypso_dev->metadata_nr_blocks, calypso_dev->physical_dev, &(calypso_dev->block_state), calypso_dev->physical_nr_blocks, calypso_dev->sym_enc_tfm, calypso_dev->cipher, calypso_dev->virtual_nr_blocks, calypso_dev->mapping_format, calypso_dev->virtual_to_physical_block_mapping, &(calypso_dev->extent_map), &(calypso_dev->mapping_cache), &(calypso_dev->sparse_map));
+
+    calypso_relocation_cleanup(&(calypso_dev->relocation));
+
+    calypso_sysfs_cleanup();
 
     /* Free cryptograpic info */
     crypto_free_shash(calypso_dev->sym_enc_tfm);
     calypso_cleanup_block_encryption_key(calypso_dev->cipher);
 
-    // TODO put this in cleanup function
-    kfree(calypso_dev->pending_data);
-
     // calypso_persist_metadata(calypso_dev);
 
-    calypso_dev_cleanup_bitmaps(calypso_dev);
+    calypso_read_cache_cleanup(&(calypso_dev->read_cache));
+    calypso_mapping_cache_cleanup(&(calypso_dev->mapping_cache));
     calypso_dev_cleanup_mappings(calypso_dev);
+    /* after the mappings, the reverse index points to it */
+    calypso_dev_cleanup_block_state(calypso_dev);
+    calypso_heatmap_cleanup(&(calypso_dev->heatmap));
 
 	calypso_dev_physical_cleanup(calypso_dev, CALYPSO_DEV_NAME, &(calypso_dev->major));
 
@@ -0,0 +1,82 @@
+#!/usr/bin/env bats
+
+# With block_cache_kb set, rewrites of the same blocks only update the
+# cache until a flush, reads see the cached data, and the data survives
+# an fsync and reloading Calypso
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+TOTAL_BLOCK_COUNT=1000
+HOT_BLOCK_COUNT=16
+REWRITES=50
+
+HIDDEN_DATA_FILE=hidden_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks and a block cache" {
+    run setup_calypso
+    assert_success
+
+    # a flush interval long enough that only fsync writes the blocks back
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 block_cache_kb=1024 block_cache_flush_ms=600000
+    assert_success
+}
+
+@test "Rewrites of the same blocks only update the cache" {
+    for i in $(seq $REWRITES)
+    do
+        head -c $((HOT_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+        sudo dd if=$HIDDEN_DATA_FILE count=$HOT_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0 status=none
+    done
+
+    run cat $CALYPSO_SYSFS/block_cache_writes
+    assert_output "$((REWRITES * HOT_BLOCK_COUNT))"
+    run cat $CALYPSO_SYSFS/block_cache_dirty_blocks
+    assert_output "$HOT_BLOCK_COUNT"
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$HOT_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+}
+
+@test "fsync writes every dirty block back once" {
+    run sudo dd if=$HIDDEN_DATA_FILE count=0 of=/dev/calypso0 conv=fsync
+    assert_success
+
+    run cat $CALYPSO_SYSFS/block_cache_dirty_blocks
+    assert_output "0"
+    run cat $CALYPSO_SYSFS/block_cache_writebacks
+    assert_output "$HOT_BLOCK_COUNT"
+}
+
+@test "Cached blocks are persisted when Calypso is reloaded" {
+    head -c $((HOT_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$HOT_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0
+    assert_success
+
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=0
+    assert_success
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$HOT_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
@@ -0,0 +1,58 @@
+#!/usr/bin/env bats
+
+# The Calypso device takes I/O in whole 4 KiB blocks only, so a block is
+# never written in part
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+
+DISK=/dev/sda8
+
+TOTAL_BLOCK_COUNT=1000
+
+HIDDEN_DATA_FILE=hidden_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run setup_calypso
+    assert_success
+
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1
+    assert_success
+}
+
+@test "Calypso device has 4 KiB logical and physical blocks" {
+    run sudo blockdev --getss /dev/calypso0
+    assert_output "4096"
+    run sudo blockdev --getpbsz /dev/calypso0
+    assert_output "4096"
+}
+
+@test "512 byte direct I/O is rejected" {
+    run sudo dd if=/dev/urandom count=1 bs=512 seek=1 oflag=direct of=/dev/calypso0
+    assert_failure
+}
+
+@test "512 byte buffered writes go through the page cache in whole blocks" {
+    head -c $((8 * 512)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=8 bs=512 seek=8 conv=fsync of=/dev/calypso0
+    assert_success
+
+    run bash -c "sudo dd if=/dev/calypso0 count=1 bs=4096 skip=1 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
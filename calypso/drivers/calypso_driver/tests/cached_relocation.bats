@@ -0,0 +1,93 @@
+#!/usr/bin/env bats
+
+# Host writes over Calypso blocks that were just read, and are still in the
+# read cache, are not held: the copies are taken from the cache and written
+# once the host write went on. They still have to reach the disk, so the
+# blocks are read back after reloading Calypso without the read cache
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+FIRST_FREE_BLOCK=12157
+
+TOTAL_BLOCK_COUNT=1000
+OVERWRITTEN_BLOCK_COUNT=64
+READ_CACHE_KB=4096
+
+HIDDEN_DATA_FILE=hidden_data.bin
+HOST_DATA_FILE=host_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+# number of host writes over Calypso blocks the latency histogram counted
+host_write_count() {
+    awk '{ total += $2 } END { print total + 0 }' $CALYPSO_SYSFS/host_write_latency_us
+}
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks and a read cache" {
+    run setup_calypso
+    assert_success
+
+    # blocks are taken in order from the first free one, so we know which ones the host has to overwrite
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 cold_placement=0 read_cache_kb=${READ_CACHE_KB}
+    assert_success
+}
+
+@test "Write $OVERWRITTEN_BLOCK_COUNT blocks to Calypso and read them into the read cache" {
+    head -c $((OVERWRITTEN_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$OVERWRITTEN_BLOCK_COUNT bs=4096 oflag=direct of=/dev/calypso0
+    assert_success
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$OVERWRITTEN_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+}
+
+@test "The host overwrites them one block at a time" {
+    head -c $((OVERWRITTEN_BLOCK_COUNT * 4096)) /dev/urandom > $HOST_DATA_FILE
+    for block in $(seq 0 $((OVERWRITTEN_BLOCK_COUNT - 1)))
+    do
+        sudo dd if=$HOST_DATA_FILE count=1 bs=4096 skip=$block seek=$((FIRST_FREE_BLOCK + block)) oflag=direct of=$DISK status=none
+    done
+
+    for i in $(seq 50); do
+        [ "$(cat $CALYPSO_SYSFS/relocations_pending)" == "0" ] && break
+        sleep 0.1
+    done
+    run cat $CALYPSO_SYSFS/relocations
+    assert_output "$OVERWRITTEN_BLOCK_COUNT"
+    run host_write_count
+    assert_output "$OVERWRITTEN_BLOCK_COUNT"
+}
+
+@test "The host writes were not dropped" {
+    run bash -c "sudo dd if=$DISK count=$OVERWRITTEN_BLOCK_COUNT bs=4096 skip=$FIRST_FREE_BLOCK iflag=direct 2>/dev/null | cmp - $HOST_DATA_FILE"
+    assert_success
+    rm $HOST_DATA_FILE
+}
+
+@test "The copies taken from the read cache were written" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=0
+    assert_success
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$OVERWRITTEN_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
@@ -0,0 +1,69 @@
+#!/usr/bin/env bats
+
+# Discarding Calypso blocks gives the physical blocks holding them back to
+# the free pool, and discarded blocks are mapped again when written
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+TOTAL_BLOCK_COUNT=1000
+DISCARD_BLOCK_COUNT=64
+
+HIDDEN_DATA_FILE=hidden_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run setup_calypso
+    assert_success
+
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1
+    assert_success
+}
+
+@test "Calypso device advertises discard" {
+    run cat /sys/block/calypso0/queue/discard_granularity
+    assert_output "4096"
+}
+
+@test "Discarding written blocks gives them back to the free pool" {
+    free_before=$(cat $CALYPSO_SYSFS/free_high_entropy_blocks)
+
+    head -c $((DISCARD_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$DISCARD_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0
+    assert_success
+    [ $(cat $CALYPSO_SYSFS/free_high_entropy_blocks) -le $((free_before - DISCARD_BLOCK_COUNT)) ]
+
+    run sudo blkdiscard --offset 0 --length $((DISCARD_BLOCK_COUNT * 4096)) /dev/calypso0
+    assert_success
+
+    run cat $CALYPSO_SYSFS/discarded_blocks
+    assert_output "$DISCARD_BLOCK_COUNT"
+    # some blocks may be sitting in the per-CPU reserves
+    [ $(cat $CALYPSO_SYSFS/free_high_entropy_blocks) -ge $((free_before - 2 * 64 * $(nproc))) ]
+}
+
+@test "Discarded blocks can be written again" {
+    run sudo dd if=$HIDDEN_DATA_FILE count=$DISCARD_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0
+    assert_success
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$DISCARD_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
@@ -0,0 +1,88 @@
+#!/usr/bin/env bats
+
+# A host discard over free space, as fstrim sends, relocates the Calypso
+# blocks in it but leaves the other free blocks to Calypso. It is not
+# counted as written by the host either
+#
+# Needs a native disk that supports discard
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+FIRST_FREE_BLOCK=12157
+
+TOTAL_BLOCK_COUNT=1000
+HIDDEN_BLOCK_COUNT=64
+DISCARDED_BLOCK_COUNT=4096
+NEW_BLOCK_COUNT=256
+
+HIDDEN_DATA_FILE=hidden_data.bin
+NEW_DATA_FILE=new_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run setup_calypso
+    assert_success
+
+    # blocks are taken in order from the first free one, so we know which ones the discard covers
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 cold_placement=0
+    assert_success
+}
+
+@test "Write $HIDDEN_BLOCK_COUNT blocks to Calypso" {
+    head -c $((HIDDEN_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$HIDDEN_BLOCK_COUNT bs=4096 oflag=direct of=/dev/calypso0
+    assert_success
+}
+
+@test "The host discards $DISCARDED_BLOCK_COUNT free blocks over them" {
+    free_before=$(cat $CALYPSO_SYSFS/free_high_entropy_blocks)
+    written_before=$(cat $CALYPSO_SYSFS/host_bytes_written)
+
+    run sudo blkdiscard --offset $((FIRST_FREE_BLOCK * 4096)) --length $((DISCARDED_BLOCK_COUNT * 4096)) $DISK
+    assert_success
+
+    for i in $(seq 50); do
+        [ "$(cat $CALYPSO_SYSFS/relocations_pending)" == "0" ] && break
+        sleep 0.1
+    done
+    run cat $CALYPSO_SYSFS/relocations
+    assert_output "$HIDDEN_BLOCK_COUNT"
+    run cat $CALYPSO_SYSFS/host_bytes_written
+    assert_output "$written_before"
+    # only the copies and the per-CPU reserves took free blocks, not the discard
+    [ $(cat $CALYPSO_SYSFS/free_high_entropy_blocks) -ge $((free_before - HIDDEN_BLOCK_COUNT - 2 * 64 * $(nproc))) ]
+}
+
+@test "Calypso blocks are intact after the discard" {
+    run bash -c "sudo dd if=/dev/calypso0 count=$HIDDEN_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Calypso can still allocate $NEW_BLOCK_COUNT blocks" {
+    head -c $((NEW_BLOCK_COUNT * 4096)) /dev/urandom > $NEW_DATA_FILE
+    run sudo dd if=$NEW_DATA_FILE count=$NEW_BLOCK_COUNT bs=4096 seek=$HIDDEN_BLOCK_COUNT oflag=direct of=/dev/calypso0
+    assert_success
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$NEW_BLOCK_COUNT bs=4096 skip=$HIDDEN_BLOCK_COUNT iflag=direct 2>/dev/null | cmp - $NEW_DATA_FILE"
+    assert_success
+    rm $NEW_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
@@ -0,0 +1,83 @@
+#!/usr/bin/env bats
+
+# A single 1 MiB host write over 256 Calypso blocks relocates every one of
+# them, not just the block it starts at
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+FIRST_FREE_BLOCK=12157
+
+TOTAL_BLOCK_COUNT=1000
+OVERWRITTEN_BLOCK_COUNT=256
+
+HIDDEN_DATA_FILE=hidden_data.bin
+HOST_DATA_FILE=host_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+clean_caches() {
+    sync
+    sudo sh -c 'echo 3 > /proc/sys/vm/drop_caches'
+    sudo blockdev --flushbufs $DISK
+    sudo hdparm -F $DISK
+}
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run setup_calypso
+    assert_success
+
+    # blocks are taken in order from the first free one, so we know which ones the host has to overwrite
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 cold_placement=0
+    assert_success
+}
+
+@test "Write $OVERWRITTEN_BLOCK_COUNT blocks to Calypso" {
+    head -c $((OVERWRITTEN_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$OVERWRITTEN_BLOCK_COUNT bs=4096 oflag=direct of=/dev/calypso0
+    assert_success
+    clean_caches
+}
+
+@test "The host overwrites all of them with a single write" {
+    head -c $((OVERWRITTEN_BLOCK_COUNT * 4096)) /dev/urandom > $HOST_DATA_FILE
+    run sudo dd if=$HOST_DATA_FILE count=1 bs=$((OVERWRITTEN_BLOCK_COUNT * 4096)) seek=$((FIRST_FREE_BLOCK * 4096)) oflag=seek_bytes,direct of=$DISK
+    assert_success
+
+    for i in $(seq 50); do
+        [ "$(cat $CALYPSO_SYSFS/relocations_pending)" == "0" ] && break
+        sleep 0.1
+    done
+    run cat $CALYPSO_SYSFS/relocations
+    assert_output "$OVERWRITTEN_BLOCK_COUNT"
+}
+
+@test "The host write was not dropped" {
+    clean_caches
+
+    run bash -c "sudo dd if=$DISK count=$OVERWRITTEN_BLOCK_COUNT bs=4096 skip=$FIRST_FREE_BLOCK iflag=direct 2>/dev/null | cmp - $HOST_DATA_FILE"
+    assert_success
+    rm $HOST_DATA_FILE
+}
+
+@test "Calypso blocks are intact after the relocations" {
+    run bash -c "sudo dd if=/dev/calypso0 count=$OVERWRITTEN_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
@@ -0,0 +1,70 @@
+#!/usr/bin/env bats
+
+# With read_cache_kb set, reading the same blocks again is served from the
+# read cache, and writes and discards are never followed by stale data
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+TOTAL_BLOCK_COUNT=1000
+READ_BLOCK_COUNT=64
+
+HIDDEN_DATA_FILE=hidden_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks and a read cache" {
+    run setup_calypso
+    assert_success
+
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 read_cache_kb=1024
+    assert_success
+}
+
+@test "Reading the same blocks again hits the read cache" {
+    head -c $((READ_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$READ_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0
+    assert_success
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$READ_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    run cat $CALYPSO_SYSFS/read_cache_misses
+    assert_output "$READ_BLOCK_COUNT"
+
+    # the page cache of the Calypso device is dropped as well
+    run bash ../clean_caches.sh
+    run bash -c "sudo dd if=/dev/calypso0 count=$READ_BLOCK_COUNT bs=4096 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    run cat $CALYPSO_SYSFS/read_cache_hits
+    assert_output "$READ_BLOCK_COUNT"
+}
+
+@test "Writes and discards invalidate the read cache" {
+    head -c $((READ_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$READ_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0
+    assert_success
+    run bash -c "sudo dd if=/dev/calypso0 count=$READ_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+
+    run sudo blkdiscard --offset 0 --length $((READ_BLOCK_COUNT * 4096)) /dev/calypso0
+    assert_success
+    run bash -c "sudo dd if=/dev/calypso0 count=$READ_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - <(head -c $((READ_BLOCK_COUNT * 4096)) /dev/zero)"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
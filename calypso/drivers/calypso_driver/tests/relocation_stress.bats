@@ -0,0 +1,101 @@
+#!/usr/bin/env bats
+
+# Reads Calypso blocks over and over while the host overwrites the blocks
+# they are stored in, so mappings are looked up while relocations update them
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+
+DISK=/dev/sda8
+
+FIRST_FREE_BLOCK=12157
+
+TOTAL_BLOCK_COUNT=1000
+# Calypso blocks to write, read back and relocate
+STRESS_BLOCK_COUNT=64
+READERS=4
+READ_ROUNDS=50
+
+HIDDEN_DATA_FILE=hidden_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+clean_caches() {
+    sync
+    sudo sh -c 'echo 3 > /proc/sys/vm/drop_caches'
+    sudo blockdev --flushbufs $DISK
+    sudo hdparm -F $DISK
+}
+
+# Reads all the Calypso blocks READ_ROUNDS times, bypassing the page cache,
+# and prints how many times they did not match what was written
+read_calypso_blocks() {
+    local expected=$1
+    local mismatches=0
+    local i
+
+    for i in $(seq $READ_ROUNDS); do
+        actual=$(sudo dd if=/dev/calypso0 count=$STRESS_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | md5sum | cut -d ' ' -f 1)
+        if [ "$actual" != "$expected" ]; then
+            mismatches=$((mismatches + 1))
+        fi
+    done
+    echo $mismatches
+}
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run setup_calypso
+    assert_success
+
+    # blocks are taken in order from the first free one, so we know which ones the host has to overwrite
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} cold_placement=0
+    assert_success
+}
+
+@test "Write $STRESS_BLOCK_COUNT blocks to Calypso" {
+    head -c $((STRESS_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$STRESS_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0
+    assert_success
+    clean_caches
+}
+
+@test "Read Calypso blocks while the host overwrites them" {
+    expected=$(md5sum $HIDDEN_DATA_FILE | cut -d ' ' -f 1)
+
+    for i in $(seq $READERS); do
+        read_calypso_blocks $expected > reader_$i.txt &
+    done
+
+    # one block at a time, each overwrite relocates the Calypso block stored there
+    for block in $(seq $FIRST_FREE_BLOCK $((FIRST_FREE_BLOCK + STRESS_BLOCK_COUNT - 1))); do
+        sudo dd if=/dev/urandom count=1 bs=4096 seek=$block oflag=direct of=$DISK 2>/dev/null
+    done
+    wait
+
+    for i in $(seq $READERS); do
+        run cat reader_$i.txt
+        assert_output "0"
+        rm reader_$i.txt
+    done
+}
+
+@test "Calypso blocks are intact after the relocations" {
+    clean_caches
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$STRESS_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
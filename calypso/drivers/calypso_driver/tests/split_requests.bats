@@ -0,0 +1,61 @@
+#!/usr/bin/env bats
+
+# Requests whose blocks are scattered over the native partition are split
+# into one bio per run of contiguous blocks. They end only once every
+# split did, so large reads return all of their data
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+TOTAL_BLOCK_COUNT=1000
+SCATTERED_BLOCK_COUNT=512
+
+HIDDEN_DATA_FILE=hidden_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run setup_calypso
+    assert_success
+
+    # physical blocks handed out in order of the writes, not of the virtual blocks
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 cold_placement=0
+    assert_success
+}
+
+@test "Large reads of scattered blocks return all of their data" {
+    head -c $((SCATTERED_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    for block in $(seq 0 $((SCATTERED_BLOCK_COUNT - 1)) | shuf)
+    do
+        sudo dd if=$HIDDEN_DATA_FILE of=/dev/calypso0 bs=4096 count=1 skip=$block seek=$block oflag=direct status=none
+    done
+
+    run bash -c "sudo dd if=/dev/calypso0 bs=1M count=$((SCATTERED_BLOCK_COUNT / 256)) iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+}
+
+@test "Large writes over scattered blocks write all of their data" {
+    head -c $((SCATTERED_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE of=/dev/calypso0 bs=1M count=$((SCATTERED_BLOCK_COUNT / 256)) oflag=direct
+    assert_success
+
+    run bash -c "sudo dd if=/dev/calypso0 bs=4096 count=$SCATTERED_BLOCK_COUNT iflag=direct 2>/dev/null | cmp - $HIDDEN_DATA_FILE"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
@@ -0,0 +1,62 @@
+#!/usr/bin/env bats
+
+# Reads of blocks that were never written are served with zeros, without
+# taking any physical block, with every mapping format
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+TOTAL_BLOCK_COUNT=1000
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+function read_unwritten_device() {
+    local mapping_format=$1
+
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1 mapping_format=${mapping_format}
+    assert_success
+    free_before=$(cat $CALYPSO_SYSFS/free_high_entropy_blocks)
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$TOTAL_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - <(head -c $((TOTAL_BLOCK_COUNT * 4096)) /dev/zero)"
+    assert_success
+    # finds no file system, but must not map anything while probing
+    run sudo blkid -p /dev/calypso0
+
+    run cat $CALYPSO_SYSFS/free_high_entropy_blocks
+    assert_output "$free_before"
+    [ $(cat $CALYPSO_SYSFS/zero_filled_reads) -ge $TOTAL_BLOCK_COUNT ]
+
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
+
+@test "Setup Calypso" {
+    run setup_calypso
+    assert_success
+}
+
+@test "Reading an unwritten device takes no blocks with one mapping per block" {
+    read_unwritten_device 0
+}
+
+@test "Reading an unwritten device takes no blocks with extents" {
+    read_unwritten_device 1
+}
+
+@test "Reading an unwritten device takes no blocks with pages of mappings" {
+    read_unwritten_device 2
+}
+
+@test "Reading an unwritten device takes no blocks with sparse mappings" {
+    read_unwritten_device 3
+}
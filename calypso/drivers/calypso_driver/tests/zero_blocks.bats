@@ -0,0 +1,78 @@
+#!/usr/bin/env bats
+
+# Whole blocks written with zeros, with data or with write zeroes, are left
+# unmapped instead of taking a physical block, and read back as zeros
+
+CALYPSO_MODULE_NAME="calypso_driver"
+CALYPSO_MODULE_PATH="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_driver.ko"
+CALYPSO_BITMAP_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_bitmap.dat"
+CALYPSO_MAPPINGS_PERSISTENCE_FILE="/home/daniela/vboxshare/thesis/calypso/drivers/calypso_driver/calypso_mappings.dat"
+CALYPSO_SYSFS="/sys/kernel/calypso"
+
+DISK=/dev/sda8
+
+TOTAL_BLOCK_COUNT=1000
+ZERO_BLOCK_COUNT=64
+
+HIDDEN_DATA_FILE=hidden_data.bin
+
+load 'libs/bats-support/load'
+load 'libs/bats-assert/load'
+load 'setup_calypso'
+
+
+@test "Load Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run setup_calypso
+    assert_success
+
+    run sudo insmod $CALYPSO_MODULE_PATH blocks=${TOTAL_BLOCK_COUNT} is_clean_start=1
+    assert_success
+}
+
+@test "Calypso device advertises write zeroes" {
+    run cat /sys/block/calypso0/queue/write_zeroes_max_bytes
+    refute_output "0"
+}
+
+@test "Writing blocks of zeros takes no physical blocks" {
+    free_before=$(cat $CALYPSO_SYSFS/free_high_entropy_blocks)
+
+    run sudo dd if=/dev/zero count=$ZERO_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0
+    assert_success
+
+    run cat $CALYPSO_SYSFS/zero_blocks
+    assert_output "$ZERO_BLOCK_COUNT"
+    [ $(cat $CALYPSO_SYSFS/free_high_entropy_blocks) -eq $free_before ]
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$ZERO_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - <(head -c $((ZERO_BLOCK_COUNT * 4096)) /dev/zero)"
+    assert_success
+}
+
+@test "Write zeroes over written blocks gives them back to the free pool" {
+    free_before=$(cat $CALYPSO_SYSFS/free_high_entropy_blocks)
+
+    head -c $((ZERO_BLOCK_COUNT * 4096)) /dev/urandom > $HIDDEN_DATA_FILE
+    run sudo dd if=$HIDDEN_DATA_FILE count=$ZERO_BLOCK_COUNT bs=4096 seek=0 oflag=direct of=/dev/calypso0
+    assert_success
+    [ $(cat $CALYPSO_SYSFS/free_high_entropy_blocks) -le $((free_before - ZERO_BLOCK_COUNT)) ]
+
+    run sudo blkdiscard --zeroout --offset 0 --length $((ZERO_BLOCK_COUNT * 4096)) /dev/calypso0
+    assert_success
+
+    run cat $CALYPSO_SYSFS/zero_blocks
+    assert_output "$((2 * ZERO_BLOCK_COUNT))"
+    # some blocks may be sitting in the per-CPU reserves
+    [ $(cat $CALYPSO_SYSFS/free_high_entropy_blocks) -ge $((free_before - 2 * 64 * $(nproc))) ]
+
+    run bash -c "sudo dd if=/dev/calypso0 count=$ZERO_BLOCK_COUNT bs=4096 iflag=direct 2>/dev/null | cmp - <(head -c $((ZERO_BLOCK_COUNT * 4096)) /dev/zero)"
+    assert_success
+    rm $HIDDEN_DATA_FILE
+}
+
+@test "Unload Calypso with $TOTAL_BLOCK_COUNT blocks" {
+    run sudo rmmod $CALYPSO_MODULE_NAME
+    assert_success
+
+    rm -f $CALYPSO_BITMAP_PERSISTENCE_FILE
+    rm -f $CALYPSO_MAPPINGS_PERSISTENCE_FILE
+}
@@ -0,0 +1,460 @@
+/*
+ * Write-back cache of plaintext virtual blocks
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/delay.h>
+
+#include "debug.h"
+#include "block_cache.h"
+
+
+static struct calypso_cached_block *calypso_cached_block_alloc(struct calypso_block_cache *cache, unsigned long virtual_block_nr)
+{
+    struct calypso_cached_block *block = kmalloc(sizeof(struct calypso_cached_block), GFP_NOIO);
+
+    if (!block)
+        return NULL;
+    block->page = alloc_page(GFP_NOIO);
+    if (!block->page)
+    {
+        kfree(block);
+        return NULL;
+    }
+    block->cache = cache;
+    block->virtual_block_nr = virtual_block_nr;
+    block->writeback = false;
+
+    return block;
+}
+
+static void calypso_cached_block_free(struct calypso_cached_block *block)
+{
+    __free_page(block->page);
+    kfree(block);
+}
+
+/* Called with the lock held. Readers copy the data under the lock too, so the block can be freed right away */
+static void calypso_block_cache_drop(struct calypso_block_cache *cache, struct calypso_cached_block *block)
+{
+    xa_erase(&(cache->blocks), block->virtual_block_nr);
+    cache->nr_blocks--;
+    calypso_cached_block_free(block);
+}
+
+/* Copies a block between the bio, from iter on, and the page */
+static void calypso_block_cache_copy(struct bio *bio, struct bvec_iter iter, struct page *page, bool to_bio)
+{
+    unsigned char *data = page_address(page);
+    struct bio_vec bvec;
+    struct bvec_iter i;
+    unsigned char *addr;
+
+    iter.bi_size = CALYPSO_BLOCK_SIZE;
+    __bio_for_each_segment(bvec, bio, i, iter)
+    {
+        addr = kmap_atomic(bvec.bv_page);
+        if (to_bio)
+            memcpy(addr + bvec.bv_offset, data, bvec.bv_len);
+        else
+            memcpy(data, addr + bvec.bv_offset, bvec.bv_len);
+        kunmap_atomic(addr);
+        data += bvec.bv_len;
+    }
+}
+
+static void calypso_block_cache_end_io(struct bio *bio)
+{
+    struct calypso_cached_block *block = bio->bi_private;
+    struct calypso_block_cache *cache = block->cache;
+    unsigned long virtual_block_nr = block->virtual_block_nr;
+    blk_status_t status = bio->bi_status;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    block->writeback = false;
+    if (status != BLK_STS_OK)
+    {
+        /* written again by a later pass */
+        xa_set_mark(&(cache->blocks), virtual_block_nr, CALYPSO_BLOCK_DIRTY);
+        if (status == BLK_STS_AGAIN)
+            cache->writeback_again = true;
+        else if (cache->writeback_status == BLK_STS_OK)
+            cache->writeback_status = status;
+    }
+    /* not written again while it was being written back */
+    else if (!xa_get_mark(&(cache->blocks), virtual_block_nr, CALYPSO_BLOCK_DIRTY))
+        calypso_block_cache_drop(cache, block);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    if (status == BLK_STS_OK)
+        atomic64_inc(&(cache->writebacks));
+    else if (status != BLK_STS_AGAIN)
+        debug_args(KERN_ERR, __func__, "Could not write back virtual block %lu\n", virtual_block_nr);
+
+    __free_page(bio->bi_io_vec[0].bv_page);
+    bio_put(bio);
+    if (atomic_dec_and_test(&(cache->inflight)))
+        wake_up(&(cache->inflight_wait));
+}
+
+/*
+ * Writes a copy of every block dirty when it starts, so writes to a block
+ * can go on while it is written, and waits for all of them
+ */
+static void calypso_block_cache_write_back(struct calypso_block_cache *cache)
+{
+    struct calypso_cached_block *block;
+    unsigned long index;
+    struct page *io_page;
+    struct bio *bio;
+    unsigned long flags;
+
+    do {
+        WRITE_ONCE(cache->writeback_again, false);
+        index = 0;
+        for (;;)
+        {
+            io_page = alloc_page(GFP_NOIO);
+            if (!io_page)
+            {
+                WRITE_ONCE(cache->writeback_status, BLK_STS_RESOURCE);
+                break;
+            }
+
+            spin_lock_irqsave(&(cache->lock), flags);
+            block = xa_find(&(cache->blocks), &index, ULONG_MAX, CALYPSO_BLOCK_DIRTY);
+            /* the worker waits for its write backs, so this is only written again by the next pass */
+            while (block && block->writeback)
+            {
+                index++;
+                block = xa_find(&(cache->blocks), &index, ULONG_MAX, CALYPSO_BLOCK_DIRTY);
+            }
+            if (block)
+            {
+                xa_clear_mark(&(cache->blocks), index, CALYPSO_BLOCK_DIRTY);
+                block->writeback = true;
+                memcpy(page_address(io_page), page_address(block->page), PAGE_SIZE);
+            }
+            spin_unlock_irqrestore(&(cache->lock), flags);
+
+            if (!block)
+            {
+                __free_page(io_page);
+                break;
+            }
+
+            /* from a mempool with GFP_NOIO, so it does not fail */
+            bio = bio_alloc(GFP_NOIO, 1);
+            bio_add_page(bio, io_page, PAGE_SIZE, 0);
+            bio->bi_opf = REQ_OP_WRITE;
+            bio->bi_private = block;
+            bio->bi_end_io = calypso_block_cache_end_io;
+            atomic_inc(&(cache->inflight));
+            cache->write_block(index, bio);
+            index++;
+        }
+        wait_event(cache->inflight_wait, atomic_read(&(cache->inflight)) == 0);
+
+        /* e.g. the page of mappings of a block is being read */
+        if (READ_ONCE(cache->writeback_again))
+            msleep(1);
+    } while (READ_ONCE(cache->writeback_again));
+}
+
+static void calypso_block_cache_work(struct work_struct *work)
+{
+    struct calypso_block_cache *cache = container_of(to_delayed_work(work), struct calypso_block_cache, flush_work);
+    struct bio_list flushing;
+    struct bio *bio;
+    blk_status_t status;
+    unsigned long flags;
+
+    /* only the flushes that arrived so far are sure to find their blocks dirty */
+    spin_lock_irqsave(&(cache->lock), flags);
+    flushing = cache->flush_waiting;
+    bio_list_init(&(cache->flush_waiting));
+    cache->writeback_status = BLK_STS_OK;
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    calypso_block_cache_write_back(cache);
+    status = READ_ONCE(cache->writeback_status);
+
+    while ((bio = bio_list_pop(&flushing)))
+    {
+        if (status != BLK_STS_OK)
+        {
+            bio->bi_status = status;
+            bio_endio(bio);
+        }
+        else
+            cache->submit_flushed(bio);
+    }
+
+    /* blocks written during the pass are written back after another interval */
+    if (calypso_block_cache_nr_dirty(cache) > 0)
+        queue_delayed_work(cache->wq, &(cache->flush_work), cache->flush_interval);
+}
+
+/*
+ * Updates the cached copy of a block with the data of the bio from iter on,
+ * caching the block first if it is not. If write_through is set, the caller
+ * writes the block itself, and the copy is only kept if an older copy is
+ * being written back, which could otherwise land after the caller's write.
+ *
+ * Returns 0 if the write only needs the cache, -ENOSPC if the cache is
+ * full and -ENOENT if the block needs to be written by the caller
+ */
+int calypso_block_cache_write(struct calypso_block_cache *cache, unsigned long virtual_block_nr, struct bio *bio, struct bvec_iter iter, bool write_through)
+{
+    struct calypso_cached_block *block, *new_block = NULL;
+    unsigned long flags;
+    bool kick;
+    int ret = 0;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    block = xa_load(&(cache->blocks), virtual_block_nr);
+    if (!block && !write_through && cache->nr_blocks < cache->max_blocks)
+    {
+        spin_unlock_irqrestore(&(cache->lock), flags);
+        new_block = calypso_cached_block_alloc(cache, virtual_block_nr);
+        spin_lock_irqsave(&(cache->lock), flags);
+
+        /* it may have been cached meanwhile */
+        block = xa_load(&(cache->blocks), virtual_block_nr);
+        if (!block && new_block && cache->nr_blocks < cache->max_blocks
+            && !xa_is_err(xa_store(&(cache->blocks), virtual_block_nr, new_block, GFP_ATOMIC)))
+        {
+            block = new_block;
+            new_block = NULL;
+            cache->nr_blocks++;
+        }
+    }
+
+    if (!block)
+        ret = write_through ? -ENOENT : -ENOSPC;
+    else if (write_through && !block->writeback)
+    {
+        calypso_block_cache_drop(cache, block);
+        ret = -ENOENT;
+    }
+    else
+    {
+        calypso_block_cache_copy(bio, iter, block->page, false);
+        xa_set_mark(&(cache->blocks), virtual_block_nr, CALYPSO_BLOCK_DIRTY);
+        if (write_through)
+            ret = -ENOENT;
+    }
+    /* write back before writes start bypassing the cache */
+    kick = cache->nr_blocks >= cache->max_blocks - cache->max_blocks / 4;
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    if (new_block)
+        calypso_cached_block_free(new_block);
+
+    if (kick)
+        mod_delayed_work(cache->wq, &(cache->flush_work), 0);
+    else if (ret == 0)
+        queue_delayed_work(cache->wq, &(cache->flush_work), cache->flush_interval);
+    if (ret == 0)
+        atomic64_inc(&(cache->writes));
+
+    return ret;
+}
+
+/*
+ * Copies the cached copy of a block into the bio from iter on.
+ * Returns 0 if the block was cached and -ENOENT otherwise
+ */
+int calypso_block_cache_read(struct calypso_block_cache *cache, unsigned long virtual_block_nr, struct bio *bio, struct bvec_iter iter)
+{
+    struct calypso_cached_block *block;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    block = xa_load(&(cache->blocks), virtual_block_nr);
+    if (block)
+        calypso_block_cache_copy(bio, iter, block->page, true);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    return block ? 0 : -ENOENT;
+}
+
+/*
+ * Copies the cached copy of a block to data.
+ * Returns 0 if the block was cached and -ENOENT otherwise
+ */
+int calypso_block_cache_peek(struct calypso_block_cache *cache, unsigned long virtual_block_nr, void *data)
+{
+    struct calypso_cached_block *block;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    block = xa_load(&(cache->blocks), virtual_block_nr);
+    if (block)
+        memcpy(data, page_address(block->page), CALYPSO_BLOCK_SIZE);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    return block ? 0 : -ENOENT;
+}
+
+/*
+ * nr_blocks blocks from virtual_block_nr now read as zeros, e.g. because
+ * they were discarded. Copies being written back are kept with zeros, so
+ * they are written once more after the older data
+ */
+void calypso_block_cache_invalidate(struct calypso_block_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    struct calypso_cached_block *block;
+    unsigned long index = virtual_block_nr;
+    unsigned long last = virtual_block_nr + nr_blocks - 1;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    for (block = xa_find(&(cache->blocks), &index, last, XA_PRESENT); block; block = xa_find_after(&(cache->blocks), &index, last, XA_PRESENT))
+    {
+        if (!block->writeback)
+        {
+            calypso_block_cache_drop(cache, block);
+            continue;
+        }
+        clear_highpage(block->page);
+        xa_set_mark(&(cache->blocks), index, CALYPSO_BLOCK_DIRTY);
+    }
+    spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+/* Whether any of nr_blocks blocks from virtual_block_nr is cached */
+bool calypso_block_cache_contains_range(struct calypso_block_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    unsigned long index = virtual_block_nr;
+
+    return xa_find(&(cache->blocks), &index, virtual_block_nr + nr_blocks - 1, XA_PRESENT) != NULL;
+}
+
+/*
+ * Has the worker write back the dirty blocks and then pass the flush or
+ * FUA write to submit_flushed(), or end it with the error of a write back
+ */
+void calypso_block_cache_flush_bio(struct calypso_block_cache *cache, struct bio *bio)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    bio_list_add(&(cache->flush_waiting), bio);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    mod_delayed_work(cache->wq, &(cache->flush_work), 0);
+}
+
+unsigned long calypso_block_cache_nr_dirty(struct calypso_block_cache *cache)
+{
+    struct calypso_cached_block *block;
+    unsigned long index, nr_dirty = 0;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    xa_for_each_marked(&(cache->blocks), index, block, CALYPSO_BLOCK_DIRTY)
+        nr_dirty++;
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    return nr_dirty;
+}
+
+static unsigned long calypso_block_cache_count_objects(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    struct calypso_block_cache *cache = container_of(shrinker, struct calypso_block_cache, shrinker);
+
+    return READ_ONCE(cache->nr_blocks);
+}
+
+/* Blocks can only be freed once they are written back, which the worker does */
+static unsigned long calypso_block_cache_scan_objects(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    struct calypso_block_cache *cache = container_of(shrinker, struct calypso_block_cache, shrinker);
+
+    mod_delayed_work(cache->wq, &(cache->flush_work), 0);
+    return SHRINK_STOP;
+}
+
+/*
+ * Sets up a cache of up to max_blocks blocks, written back every
+ * flush_interval_ms. With max_blocks 0 the cache stays disabled
+ */
+int calypso_block_cache_init(struct calypso_block_cache *cache, unsigned long max_blocks, unsigned int flush_interval_ms,
+                    void (*write_block)(unsigned long virtual_block_nr, struct bio *bio),
+                    void (*submit_flushed)(struct bio *bio))
+{
+    int ret;
+
+    xa_init(&(cache->blocks));
+    spin_lock_init(&(cache->lock));
+    cache->nr_blocks = 0;
+    cache->max_blocks = 0;
+    cache->flush_interval = msecs_to_jiffies(flush_interval_ms);
+    bio_list_init(&(cache->flush_waiting));
+    atomic_set(&(cache->inflight), 0);
+    init_waitqueue_head(&(cache->inflight_wait));
+    cache->writeback_status = BLK_STS_OK;
+    cache->writeback_again = false;
+    cache->write_block = write_block;
+    cache->submit_flushed = submit_flushed;
+    atomic64_set(&(cache->writes), 0);
+    atomic64_set(&(cache->writebacks), 0);
+    cache->wq = NULL;
+
+    if (max_blocks == 0)
+        return 0;
+
+    cache->wq = alloc_workqueue("calypso_block_cache", WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+    if (!cache->wq)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate block cache workqueue\n");
+        return -ENOMEM;
+    }
+    INIT_DELAYED_WORK(&(cache->flush_work), calypso_block_cache_work);
+
+    cache->shrinker.count_objects = calypso_block_cache_count_objects;
+    cache->shrinker.scan_objects = calypso_block_cache_scan_objects;
+    cache->shrinker.seeks = DEFAULT_SEEKS;
+    ret = register_shrinker(&(cache->shrinker));
+    if (ret != 0)
+    {
+        debug(KERN_ERR, __func__, "Could not register block cache shrinker\n");
+        destroy_workqueue(cache->wq);
+        cache->wq = NULL;
+        return ret;
+    }
+
+    cache->max_blocks = max_blocks;
+    return 0;
+}
+
+/* Writes back the dirty blocks, so it needs blocks to still be claimable */
+void calypso_block_cache_cleanup(struct calypso_block_cache *cache)
+{
+    struct calypso_cached_block *block;
+    unsigned long index;
+
+    if (!cache->wq)
+        return;
+
+    unregister_shrinker(&(cache->shrinker));
+    cancel_delayed_work_sync(&(cache->flush_work));
+    cache->max_blocks = 0;
+
+    cache->writeback_status = BLK_STS_OK;
+    calypso_block_cache_write_back(cache);
+    destroy_workqueue(cache->wq);
+    cache->wq = NULL;
+
+    xa_for_each(&(cache->blocks), index, block)
+    {
+        if (xa_get_mark(&(cache->blocks), index, CALYPSO_BLOCK_DIRTY))
+            debug_args(KERN_ERR, __func__, "Virtual block %lu is lost\n", index);
+        calypso_cached_block_free(block);
+    }
+    xa_destroy(&(cache->blocks));
+    cache->nr_blocks = 0;
+}
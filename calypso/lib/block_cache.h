@@ -0,0 +1,91 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <linux/types.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <linux/wait.h>
+#include <linux/bio.h>
+
+#include "global.h"
+
+
+/* Blocks whose data is newer than what the native device has */
+#define CALYPSO_BLOCK_DIRTY XA_MARK_0
+
+struct calypso_block_cache;
+
+/* Plaintext of a virtual block */
+struct calypso_cached_block {
+    struct calypso_block_cache *cache;
+    unsigned long virtual_block_nr;
+    struct page *page;
+    /* a copy of the data, as it was when the block was last marked clean, is being written */
+    bool writeback;
+};
+
+/*
+ * Write-back cache of plaintext virtual blocks. Writes only update the
+ * cache, so blocks the file system on Calypso rewrites all the time, like
+ * its journal and bitmaps, are encrypted and written once per flush
+ * instead of once per write. Dirty blocks are written back by a worker
+ * every flush interval, on flushes and FUA writes, and on memory pressure.
+ * Blocks are dropped once written back, and writes bypass the cache while
+ * it is full.
+ */
+struct calypso_block_cache {
+    /* virtual block number -> struct calypso_cached_block */
+    struct xarray blocks;
+    unsigned long nr_blocks;
+    unsigned long max_blocks;
+    /* taken from bio completion as well */
+    spinlock_t lock;
+
+    struct workqueue_struct *wq;
+    struct delayed_work flush_work;
+    unsigned long flush_interval;
+    /* flushes and FUA writes waiting for the dirty blocks to be written */
+    struct bio_list flush_waiting;
+    /* write backs in flight, and the first error among them */
+    atomic_t inflight;
+    wait_queue_head_t inflight_wait;
+    blk_status_t writeback_status;
+    /* write backs that could not start yet, e.g. waiting for a page of mappings */
+    bool writeback_again;
+
+    struct shrinker shrinker;
+
+    /* Writes the block in the bio to the native device and ends the bio, or just ends it with an error */
+    void (*write_block)(unsigned long virtual_block_nr, struct bio *bio);
+    /* Carries on with a flush or FUA write once the blocks dirty before it were written */
+    void (*submit_flushed)(struct bio *bio);
+
+    /* block writes that only updated the cache, and blocks written back */
+    atomic64_t writes;
+    atomic64_t writebacks;
+};
+
+int calypso_block_cache_init(struct calypso_block_cache *cache, unsigned long max_blocks, unsigned int flush_interval_ms,
+                    void (*write_block)(unsigned long virtual_block_nr, struct bio *bio),
+                    void (*submit_flushed)(struct bio *bio));
+void calypso_block_cache_cleanup(struct calypso_block_cache *cache);
+
+int calypso_block_cache_write(struct calypso_block_cache *cache, unsigned long virtual_block_nr, struct bio *bio, struct bvec_iter iter, bool write_through);
+int calypso_block_cache_read(struct calypso_block_cache *cache, unsigned long virtual_block_nr, struct bio *bio, struct bvec_iter iter);
+int calypso_block_cache_peek(struct calypso_block_cache *cache, unsigned long virtual_block_nr, void *data);
+void calypso_block_cache_invalidate(struct calypso_block_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks);
+bool calypso_block_cache_contains_range(struct calypso_block_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks);
+
+void calypso_block_cache_flush_bio(struct calypso_block_cache *cache, struct bio *bio);
+
+unsigned long calypso_block_cache_nr_dirty(struct calypso_block_cache *cache);
+
+static inline bool calypso_block_cache_enabled(struct calypso_block_cache *cache)
+{
+    return cache->max_blocks > 0;
+}
+
+
+#endif
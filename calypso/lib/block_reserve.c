@@ -0,0 +1,187 @@
+/*
+ * Per-CPU reserve of pre-claimed free physical blocks, so the submission
+ * path can allocate without locks or bitmap scans
+ */
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/rcupdate.h>
+
+#include "debug.h"
+#include "block_reserve.h"
+
+
+static void calypso_block_reserve_refill(struct work_struct *work)
+{
+    struct calypso_block_reserve *reserve = container_of(work, struct calypso_block_reserve, refill_work);
+    struct calypso_reserve_ring *ring;
+    unsigned int cpu, head;
+    /* claim_block() searches from here, as in calypso_get_next_free_block() */
+    unsigned long block = 0;
+
+    for_each_online_cpu(cpu)
+    {
+        ring = per_cpu_ptr(reserve->rings, cpu);
+        head = ring->head;
+
+        while (head - smp_load_acquire(&(ring->tail)) < CALYPSO_RESERVE_RING_SIZE)
+        {
+            if (READ_ONCE(reserve->stopping))
+                return;
+            if (reserve->claim_block(&block) != 0)
+            {
+                debug(KERN_DEBUG, __func__, "No more free blocks to reserve\n");
+                return;
+            }
+            set_bit(block, reserve->reserved_bitmap);
+            ring->blocks[head & CALYPSO_RESERVE_RING_MASK] = block;
+            /* the block must be visible before the consumer sees the new head */
+            smp_store_release(&(ring->head), ++head);
+        }
+    }
+}
+
+int calypso_block_reserve_init(struct calypso_block_reserve *reserve, unsigned long nr_blocks,
+                    int (*claim_block)(unsigned long *block),
+                    void (*release_block)(unsigned long block))
+{
+    reserve->nr_blocks = nr_blocks;
+    reserve->claim_block = claim_block;
+    reserve->release_block = release_block;
+    reserve->stopping = false;
+
+    reserve->reserved_bitmap = bitmap_zalloc(nr_blocks, GFP_KERNEL);
+    if (!reserve->reserved_bitmap)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate memory for reserved blocks bitmap\n");
+        return -ENOMEM;
+    }
+
+    reserve->rings = alloc_percpu(struct calypso_reserve_ring);
+    if (!reserve->rings)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate memory for reserve rings\n");
+        goto error_after_bitmap;
+    }
+
+    reserve->refill_wq = alloc_workqueue("calypso_reserve", WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+    if (!reserve->refill_wq)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate reserve refill workqueue\n");
+        goto error_after_rings;
+    }
+    INIT_WORK(&(reserve->refill_work), calypso_block_reserve_refill);
+
+    /* Start with full rings so the first requests already take the fast path */
+    queue_work(reserve->refill_wq, &(reserve->refill_work));
+    flush_work(&(reserve->refill_work));
+
+    return 0;
+
+error_after_rings:
+    free_percpu(reserve->rings);
+    reserve->rings = NULL;
+error_after_bitmap:
+    bitmap_free(reserve->reserved_bitmap);
+    reserve->reserved_bitmap = NULL;
+    return -ENOMEM;
+}
+
+/*
+ * Gives every block still in the rings back to the free pool
+ * Must only be called when nobody can pop from the rings anymore
+ */
+static void calypso_block_reserve_drain(struct calypso_block_reserve *reserve)
+{
+    struct calypso_reserve_ring *ring;
+    unsigned int cpu;
+    unsigned long block;
+
+    for_each_possible_cpu(cpu)
+    {
+        ring = per_cpu_ptr(reserve->rings, cpu);
+        while (ring->tail != ring->head)
+        {
+            block = ring->blocks[ring->tail & CALYPSO_RESERVE_RING_MASK];
+            ring->tail++;
+            /* blocks the host wrote to while reserved are the host's now */
+            if (test_and_clear_bit(block, reserve->reserved_bitmap))
+                reserve->release_block(block);
+        }
+    }
+}
+
+void calypso_block_reserve_cleanup(struct calypso_block_reserve *reserve)
+{
+    if (!reserve->rings)
+        return;
+
+    WRITE_ONCE(reserve->stopping, true);
+    /* pops run with preemption disabled, so this waits for the ones in flight */
+    synchronize_rcu();
+
+    cancel_work_sync(&(reserve->refill_work));
+    destroy_workqueue(reserve->refill_wq);
+
+    calypso_block_reserve_drain(reserve);
+
+    free_percpu(reserve->rings);
+    reserve->rings = NULL;
+    bitmap_free(reserve->reserved_bitmap);
+    reserve->reserved_bitmap = NULL;
+}
+
+/*
+ * Fast path allocation from the ring of the current CPU
+ *
+ * Returns 0 for success and -1 if the ring is empty, in which case the
+ * caller needs to claim a block through the slow path
+ */
+int calypso_block_reserve_pop(struct calypso_block_reserve *reserve, unsigned long *block)
+{
+    struct calypso_reserve_ring *ring;
+    unsigned int head, tail;
+    unsigned long candidate;
+    int ret = -1;
+
+    if (!reserve->rings)
+        return -1;
+
+    ring = get_cpu_ptr(reserve->rings);
+    /* checked with preemption disabled so cleanup's synchronize_rcu() waits for us */
+    if (READ_ONCE(reserve->stopping))
+    {
+        put_cpu_ptr(reserve->rings);
+        return -1;
+    }
+    tail = ring->tail;
+    head = smp_load_acquire(&(ring->head));
+
+    while (tail != head)
+    {
+        candidate = ring->blocks[tail & CALYPSO_RESERVE_RING_MASK];
+        tail++;
+        if (test_and_clear_bit(candidate, reserve->reserved_bitmap))
+        {
+            *block = candidate;
+            ret = 0;
+            break;
+        }
+    }
+    smp_store_release(&(ring->tail), tail);
+
+    if (head - tail < CALYPSO_RESERVE_LOW_WATERMARK)
+        queue_work(reserve->refill_wq, &(reserve->refill_work));
+    put_cpu_ptr(reserve->rings);
+
+    return ret;
+}
+
+/*
+ * The host wrote to this block, so if it is sitting in a ring it must not
+ * be handed out. It stays in the ring and is skipped when popped.
+ */
+void calypso_block_reserve_invalidate(struct calypso_block_reserve *reserve, unsigned long block)
+{
+    if (reserve->reserved_bitmap && block < reserve->nr_blocks)
+        clear_bit(block, reserve->reserved_bitmap);
+}
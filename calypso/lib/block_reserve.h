@@ -0,0 +1,52 @@
+#ifndef BLOCK_RESERVE_H
+#define BLOCK_RESERVE_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/cache.h>
+
+
+/* Needs to be a power of two so positions can be masked instead of wrapped */
+#define CALYPSO_RESERVE_RING_SIZE 64
+#define CALYPSO_RESERVE_RING_MASK (CALYPSO_RESERVE_RING_SIZE - 1)
+/* The refiller is woken up when a ring has less blocks than this */
+#define CALYPSO_RESERVE_LOW_WATERMARK 16
+
+/*
+ * Single producer, single consumer ring of free physical blocks that were
+ * already claimed in the bitmaps. The refiller is the only one moving head
+ * and the CPU owning the ring is the only one moving tail, so neither
+ * needs a lock.
+ */
+struct calypso_reserve_ring {
+    unsigned long blocks[CALYPSO_RESERVE_RING_SIZE];
+    unsigned int head;
+    unsigned int tail ____cacheline_aligned;
+};
+
+struct calypso_block_reserve {
+    struct calypso_reserve_ring __percpu *rings;
+    /* Bit set while the block sits in a ring, cleared when it is handed out or the host writes to it */
+    unsigned long *reserved_bitmap;
+    unsigned long nr_blocks;
+
+    struct workqueue_struct *refill_wq;
+    struct work_struct refill_work;
+    bool stopping;
+
+    /* Slow path used by the refiller to claim a free block, and to give it back on teardown */
+    int (*claim_block)(unsigned long *block);
+    void (*release_block)(unsigned long block);
+};
+
+int calypso_block_reserve_init(struct calypso_block_reserve *reserve, unsigned long nr_blocks,
+                    int (*claim_block)(unsigned long *block),
+                    void (*release_block)(unsigned long block));
+void calypso_block_reserve_cleanup(struct calypso_block_reserve *reserve);
+
+int calypso_block_reserve_pop(struct calypso_block_reserve *reserve, unsigned long *block);
+void calypso_block_reserve_invalidate(struct calypso_block_reserve *reserve, unsigned long block);
+
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Packed state of the physical blocks of the native partition
+ */
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/atomic.h>
+
+#include "debug.h"
+#include "block_state.h"
+
+
+static unsigned long calypso_block_state_nr_words(unsigned long nr_blocks)
+{
+    return DIV_ROUND_UP(nr_blocks, CALYPSO_BLOCK_STATES_PER_LONG);
+}
+
+/* Every block starts as free with low entropy, until the host bitmaps and the entropy scan say otherwise */
+int calypso_block_state_init(struct calypso_block_state *state, unsigned long nr_blocks)
+{
+    /* the native partition can be big, so we cannot rely on contiguous memory */
+    state->words = kvcalloc(calypso_block_state_nr_words(nr_blocks), sizeof(unsigned long), GFP_KERNEL);
+    if (!state->words)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate memory for physical blocks state\n");
+        return -ENOMEM;
+    }
+    state->nr_blocks = nr_blocks;
+
+    return 0;
+}
+
+void calypso_block_state_cleanup(struct calypso_block_state *state)
+{
+    kvfree(state->words);
+    state->words = NULL;
+}
+
+static unsigned int calypso_block_state_shift(unsigned long block)
+{
+    return (block % CALYPSO_BLOCK_STATES_PER_LONG) * CALYPSO_BLOCK_STATE_BITS;
+}
+
+void calypso_block_state_set(struct calypso_block_state *state, unsigned long block, enum calypso_block_state_value value)
+{
+    unsigned long *word = &(state->words[block / CALYPSO_BLOCK_STATES_PER_LONG]);
+    unsigned int shift = calypso_block_state_shift(block);
+    unsigned long old, new;
+
+    do {
+        old = READ_ONCE(*word);
+        new = (old & ~(CALYPSO_BLOCK_STATE_MASK << shift)) | ((unsigned long)value << shift);
+    } while (cmpxchg(word, old, new) != old);
+}
+
+/*
+ * Sets the state of the block to "to" only if it is "from", so that
+ * updates racing on the same block cannot undo each other
+ *
+ * Returns true if the state was changed
+ */
+bool calypso_block_state_change(struct calypso_block_state *state, unsigned long block, enum calypso_block_state_value from, enum calypso_block_state_value to)
+{
+    unsigned long *word = &(state->words[block / CALYPSO_BLOCK_STATES_PER_LONG]);
+    unsigned int shift = calypso_block_state_shift(block);
+    unsigned long old, new;
+
+    do {
+        old = READ_ONCE(*word);
+        if (((old >> shift) & CALYPSO_BLOCK_STATE_MASK) != from)
+            return false;
+        new = (old & ~(CALYPSO_BLOCK_STATE_MASK << shift)) | ((unsigned long)to << shift);
+    } while (cmpxchg(word, old, new) != old);
+
+    return true;
+}
+
+/*
+ * Whole words are written at once, which is most of the range when loading
+ * the host bitmaps. Only used before anything else updates the state
+ */
+void calypso_block_state_set_range(struct calypso_block_state *state, unsigned long start, unsigned long nr, enum calypso_block_state_value value)
+{
+    unsigned long end = min(start + nr, state->nr_blocks);
+
+    for (; start < end && start % CALYPSO_BLOCK_STATES_PER_LONG; start++)
+        calypso_block_state_set(state, start, value);
+    for (; start + CALYPSO_BLOCK_STATES_PER_LONG <= end; start += CALYPSO_BLOCK_STATES_PER_LONG)
+        WRITE_ONCE(state->words[start / CALYPSO_BLOCK_STATES_PER_LONG], value * CALYPSO_BLOCK_STATE_ONES);
+    for (; start < end; start++)
+        calypso_block_state_set(state, start, value);
+}
+
+/*
+ * Sets the blocks of the range that are free, with low or high entropy,
+ * to value. Works on a word of blocks at a time and leaves words without
+ * a free block in the range alone, which most host writes are
+ */
+void calypso_block_state_set_free_range(struct calypso_block_state *state, unsigned long start, unsigned long nr, enum calypso_block_state_value value)
+{
+    unsigned long end = min(start + nr, state->nr_blocks);
+    unsigned long i, mask, old, new, free;
+
+    while (start < end)
+    {
+        i = start / CALYPSO_BLOCK_STATES_PER_LONG;
+        mask = ~0UL << calypso_block_state_shift(start);
+        if (end < (i + 1) * CALYPSO_BLOCK_STATES_PER_LONG)
+            mask &= (1UL << calypso_block_state_shift(end)) - 1;
+        do {
+            old = READ_ONCE(state->words[i]);
+            /* free states only have the lowest bit of their nibble, if any, set */
+            free = ~((old >> 1) | (old >> 2) | (old >> 3)) & CALYPSO_BLOCK_STATE_ONES & mask;
+            if (!free)
+                break;
+            new = (old & ~(free * CALYPSO_BLOCK_STATE_MASK)) | (free * value);
+        } while (cmpxchg(&(state->words[i]), old, new) != old);
+        start = (i + 1) * CALYPSO_BLOCK_STATES_PER_LONG;
+    }
+}
+
+/*
+ * Top bit of every nibble of word holding value, and no other bit.
+ * After the xor matching nibbles are zero. Adding 7 to the low three bits
+ * of a nibble sets its top bit if any of them was set, without carrying
+ * into the next nibble, so the top bit ends up clear only for zero nibbles
+ */
+static __always_inline unsigned long calypso_block_state_match(unsigned long word, enum calypso_block_state_value value)
+{
+    const unsigned long low_bits = CALYPSO_BLOCK_STATE_ONES * 0x7;
+
+    word ^= value * CALYPSO_BLOCK_STATE_ONES;
+    return ~(((word & low_bits) + low_bits) | word | low_bits);
+}
+
+/*
+ * First block from start on, and before end, in the given state.
+ * Compares a whole word of blocks at a time.
+ *
+ * Returns end if there is none
+ */
+unsigned long calypso_block_state_find_next(struct calypso_block_state *state, unsigned long start, unsigned long end, enum calypso_block_state_value value)
+{
+    unsigned long i, matches;
+
+    if (start >= end)
+        return end;
+
+    i = start / CALYPSO_BLOCK_STATES_PER_LONG;
+    matches = calypso_block_state_match(READ_ONCE(state->words[i]), value) & (~0UL << calypso_block_state_shift(start));
+    while (!matches)
+    {
+        i++;
+        if (i * CALYPSO_BLOCK_STATES_PER_LONG >= end)
+            return end;
+        matches = calypso_block_state_match(READ_ONCE(state->words[i]), value);
+    }
+
+    return min(i * CALYPSO_BLOCK_STATES_PER_LONG + __ffs(matches) / CALYPSO_BLOCK_STATE_BITS, end);
+}
+
+unsigned long calypso_block_state_count(struct calypso_block_state *state, enum calypso_block_state_value value)
+{
+    unsigned long nr_words = calypso_block_state_nr_words(state->nr_blocks);
+    unsigned long i, matches, count = 0;
+
+    for (i = 0; i < nr_words; i++)
+    {
+        matches = calypso_block_state_match(READ_ONCE(state->words[i]), value);
+        /* the end of the last word is padding */
+        if (i == nr_words - 1 && calypso_block_state_shift(state->nr_blocks))
+            matches &= (1UL << calypso_block_state_shift(state->nr_blocks)) - 1;
+        count += hweight_long(matches);
+    }
+
+    return count;
+}
+
+/*
+ * Sets the bit of every block that is not free for the host, which is the
+ * bitmap persisted with the hidden metadata to detect changes between runs
+ */
+void calypso_block_state_used_bitmap(struct calypso_block_state *state, unsigned long *bitmap)
+{
+    unsigned long nr_words = calypso_block_state_nr_words(state->nr_blocks);
+    unsigned long i, word, used;
+
+    bitmap_zero(bitmap, state->nr_blocks);
+    for (i = 0; i < nr_words; i++)
+    {
+        word = READ_ONCE(state->words[i]);
+        /* states from CALYPSO_BLOCK_HOST_USED on have the second or third bit set */
+        used = ((word >> 1) | (word >> 2)) & CALYPSO_BLOCK_STATE_ONES;
+        while (used)
+        {
+            __set_bit(i * CALYPSO_BLOCK_STATES_PER_LONG + __ffs(used) / CALYPSO_BLOCK_STATE_BITS, bitmap);
+            used &= used - 1;
+        }
+    }
+}
+
+size_t calypso_block_state_memory_bytes(struct calypso_block_state *state)
+{
+    if (!state->words)
+        return 0;
+    return calypso_block_state_nr_words(state->nr_blocks) * sizeof(unsigned long);
+}
@@ -0,0 +1,72 @@
+#ifndef BLOCK_STATE_H
+#define BLOCK_STATE_H
+
+#include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/compiler.h>
+
+
+/* What a physical block of the native partition holds */
+enum calypso_block_state_value {
+    /* not used by the host, but encrypted data written to it would stand out */
+    CALYPSO_BLOCK_FREE_LOW_ENTROPY = 0,
+    /* not used by the host and already looks random, so Calypso can use it */
+    CALYPSO_BLOCK_FREE_HIGH_ENTROPY = 1,
+    CALYPSO_BLOCK_HOST_USED = 2,
+    /* claimed by Calypso for hidden data or for a page of mappings */
+    CALYPSO_BLOCK_CALYPSO_DATA = 3,
+    /* holds the hidden metadata */
+    CALYPSO_BLOCK_CALYPSO_METADATA = 4,
+};
+
+/* A nibble per block keeps every state of a block within a single word */
+#define CALYPSO_BLOCK_STATE_BITS 4
+#define CALYPSO_BLOCK_STATE_MASK ((1UL << CALYPSO_BLOCK_STATE_BITS) - 1)
+#define CALYPSO_BLOCK_STATES_PER_LONG (BITS_PER_LONG / CALYPSO_BLOCK_STATE_BITS)
+/* 0x1111...1, multiplied by a state it repeats it in every nibble of a word */
+#define CALYPSO_BLOCK_STATE_ONES (~0UL / CALYPSO_BLOCK_STATE_MASK)
+
+/*
+ * State of every physical block, packed so the hook reads a single word
+ * per host write and allocation scans look at 16 blocks per load. Updates
+ * are atomic on the word, so they need no lock of their own.
+ */
+struct calypso_block_state {
+    unsigned long *words;
+    unsigned long nr_blocks;
+};
+
+int calypso_block_state_init(struct calypso_block_state *state, unsigned long nr_blocks);
+void calypso_block_state_cleanup(struct calypso_block_state *state);
+
+void calypso_block_state_set(struct calypso_block_state *state, unsigned long block, enum calypso_block_state_value value);
+void calypso_block_state_set_range(struct calypso_block_state *state, unsigned long start, unsigned long nr, enum calypso_block_state_value value);
+void calypso_block_state_set_free_range(struct calypso_block_state *state, unsigned long start, unsigned long nr, enum calypso_block_state_value value);
+bool calypso_block_state_change(struct calypso_block_state *state, unsigned long block, enum calypso_block_state_value from, enum calypso_block_state_value to);
+
+unsigned long calypso_block_state_find_next(struct calypso_block_state *state, unsigned long start, unsigned long end, enum calypso_block_state_value value);
+unsigned long calypso_block_state_count(struct calypso_block_state *state, enum calypso_block_state_value value);
+void calypso_block_state_used_bitmap(struct calypso_block_state *state, unsigned long *bitmap);
+
+size_t calypso_block_state_memory_bytes(struct calypso_block_state *state);
+
+static __always_inline enum calypso_block_state_value calypso_block_state_get(struct calypso_block_state *state, unsigned long block)
+{
+    unsigned long word = READ_ONCE(state->words[block / CALYPSO_BLOCK_STATES_PER_LONG]);
+
+    return (word >> ((block % CALYPSO_BLOCK_STATES_PER_LONG) * CALYPSO_BLOCK_STATE_BITS)) & CALYPSO_BLOCK_STATE_MASK;
+}
+
+/* Blocks the host file system sees as free */
+static __always_inline bool calypso_block_state_is_free(enum calypso_block_state_value value)
+{
+    return value <= CALYPSO_BLOCK_FREE_HIGH_ENTROPY;
+}
+
+#define calypso_block_state_for_each(state, block, value) \
+    for (block = calypso_block_state_find_next(state, 0, (state)->nr_blocks, value); \
+        block < (state)->nr_blocks; \
+        block = calypso_block_state_find_next(state, block + 1, (state)->nr_blocks, value))
+
+
+#endif
@@ -177,7 +177,7 @@ void calypso_unpad_last_block_metadata_string(char *string, unsigned int str_len
 }
 
 int calypso_get_first_block_num_random_to_read(MTRand r, unsigned char *metadata, 
-        unsigned long *metadata_to_physical_block_mapping, struct file *metadata_file, 
+        calypso_block_t *metadata_to_physical_block_mapping, struct file *metadata_file, 
         unsigned char *read_metadata_block, unsigned int bitmap_data_len, 
         unsigned long total_physical_blocks, unsigned long seed, 
         unsigned long *first_block_num, unsigned long *first_random_num, 
@@ -249,7 +249,7 @@ int calypso_get_first_block_num_random_to_read(MTRand r, unsigned char *metadata
 }
 
 
-int calypso_get_first_block_num_random_to_write(unsigned long *metadata_to_physical_block_mapping, unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, unsigned long total_physical_blocks, unsigned char *seed_str, unsigned long *first_block_num, unsigned long *first_random_num)
+int calypso_get_first_block_num_random_to_write(calypso_block_t *metadata_to_physical_block_mapping, struct calypso_block_state *block_state, unsigned long total_physical_blocks, unsigned char *seed_str, unsigned long *first_block_num, unsigned long *first_random_num)
 {
     unsigned long random_num, random_physical_block;
     unsigned long seed;
@@ -257,10 +257,10 @@ int calypso_get_first_block_num_random_to_write(unsigned long *metadata_to_physi
 
     /* First block number is already assigned */
     random_physical_block = metadata_to_physical_block_mapping[0];
-    if (random_physical_block < MAX_UNSIGNED_LONG)
+    if (random_physical_block != CALYPSO_UNMAPPED)
     {
         // do nothing!
-        debug_args(KERN_INFO, __func__, "FIRST BLOCK WAS ALREADY ASSIGNED! %lu, %lu, %lu\n", random_physical_block, MAX_UNSIGNED_LONG, (unsigned long)(-1));
+        debug_args(KERN_INFO, __func__, "FIRST BLOCK WAS ALREADY ASSIGNED! %lu\n", random_physical_block);
     }
     /* Still hasn't assigned a first block */
     else
@@ -281,7 +281,7 @@ int calypso_get_first_block_num_random_to_write(unsigned long *metadata_to_physi
         debug_args(KERN_INFO, __func__, "---> (*first_random_num) %lu\n", (*first_random_num));
 
         // while (test_bit(random_physical_block, bitmap))
-        while (!test_bit(random_physical_block, high_entropy_blocks_bitmap))
+        while (calypso_block_state_get(block_state, random_physical_block) != CALYPSO_BLOCK_FREE_HIGH_ENTROPY)
         {
             random_num = genRandLong(&r);
             debug_args(KERN_INFO, __func__, "--while--> random_num: %lu\n", random_num);
@@ -306,7 +306,7 @@ int calypso_get_first_block_num_random_to_write(unsigned long *metadata_to_physi
         }
 
         metadata_to_physical_block_mapping[0] = random_physical_block;
-        calypso_update_bitmaps(physical_blocks_bitmap, high_entropy_blocks_bitmap, random_physical_block);
+        calypso_block_state_set(block_state, random_physical_block, CALYPSO_BLOCK_CALYPSO_METADATA);
         // calypso_set_bit(bitmap, random_physical_block);
     }
   
@@ -348,12 +348,219 @@ unsigned long calypso_calc_metadata_size_in_blocks(loff_t bitmap_data_len, unsig
 
 unsigned long calypso_calc_mappings_metadata_size(unsigned long total_virtual_blocks)
 {
-    /* Each mapping takes a block number which is an unsigned int,
+    /* Each mapping is stored as a block number in hexadecimal,
     so the total size occupied by the mappings is 
-    8 bytes * total_virtual_blocks */   
-    debug_args(KERN_INFO, __func__, "total_virtual_blocks: %lu; sizeof(unsigned long): %d\n", total_virtual_blocks, sizeof(unsigned long));
+    CALYPSO_MAPPING_STR_LEN bytes * total_virtual_blocks */   
+    debug_args(KERN_INFO, __func__, "total_virtual_blocks: %lu; mapping length: %lu\n", total_virtual_blocks, (unsigned long)CALYPSO_MAPPING_STR_LEN);
 
-    return sizeof(unsigned long) * total_virtual_blocks;
+    return CALYPSO_MAPPING_STR_LEN * total_virtual_blocks;
+}
+
+/* 8 bytes for the number of extents, then virtual start, physical start and length of each one */
+unsigned long calypso_calc_extents_metadata_size(unsigned long nr_extents)
+{
+    return 8 + 3 * CALYPSO_MAPPING_STR_LEN * nr_extents;
+}
+
+/* Only the block storing each page of the mapping table, the pages themselves are already on disk */
+unsigned long calypso_calc_pages_metadata_size(unsigned long nr_pages)
+{
+    return CALYPSO_MAPPING_STR_LEN * nr_pages;
+}
+
+/* 8 bytes for the number of mappings, then each written virtual block and its physical block */
+unsigned long calypso_calc_sparse_metadata_size(unsigned long nr_mappings)
+{
+    return 8 + 2 * CALYPSO_MAPPING_STR_LEN * nr_mappings;
+}
+
+static void calypso_encode_mapping_value(unsigned char *dest, unsigned long long value)
+{
+    char value_str[CALYPSO_MAPPING_STR_LEN + 1];
+
+    snprintf(value_str, CALYPSO_MAPPING_STR_LEN + 1, "%.*llx", (int)CALYPSO_MAPPING_STR_LEN, value);
+    memcpy(dest, value_str, CALYPSO_MAPPING_STR_LEN);
+}
+
+static int calypso_decode_mapping_value(unsigned char *src, unsigned long long *value)
+{
+    char value_str[CALYPSO_MAPPING_STR_LEN + 1];
+
+    memcpy(value_str, src, CALYPSO_MAPPING_STR_LEN);
+    value_str[CALYPSO_MAPPING_STR_LEN] = '\0';
+    return kstrtoull(value_str, 16, value);
+}
+
+static void calypso_encode_extents(unsigned char *mappings, struct calypso_extent_map *extent_map)
+{
+    struct calypso_extent *extent;
+    char nr_extents_str[8+1];
+    unsigned long offset = 8;
+
+    snprintf(nr_extents_str, 8+1, "%.8lx", extent_map->nr_extents);
+    memcpy(mappings, nr_extents_str, 8);
+
+    calypso_extent_map_for_each(extent_map, extent)
+    {
+        calypso_encode_mapping_value(mappings + offset, extent->virtual_start);
+        calypso_encode_mapping_value(mappings + offset + CALYPSO_MAPPING_STR_LEN, extent->physical_start);
+        calypso_encode_mapping_value(mappings + offset + 2 * CALYPSO_MAPPING_STR_LEN, extent->len);
+        offset += 3 * CALYPSO_MAPPING_STR_LEN;
+    }
+}
+
+static void calypso_encode_pages(unsigned char *mappings, struct calypso_mapping_cache *mapping_cache)
+{
+    unsigned long page_nr;
+
+    for (page_nr = 0; page_nr < mapping_cache->nr_pages; page_nr++)
+        calypso_encode_mapping_value(mappings + CALYPSO_MAPPING_STR_LEN * page_nr, mapping_cache->directory[page_nr]);
+}
+
+/*
+ * The pages are only read when needed, so unlike the other formats these
+ * mappings can not be converted and need Calypso loaded with paged mappings
+ */
+static int calypso_decode_pages(unsigned char *mappings, unsigned long total_physical_blocks, 
+        struct calypso_blk_device *calypso_dev)
+{
+    struct calypso_mapping_cache *mapping_cache = &(calypso_dev->mapping_cache);
+    unsigned long long block;
+    unsigned long page_nr;
+
+    if (calypso_dev->mapping_format != CALYPSO_MAPPINGS_PAGED)
+    {
+        debug(KERN_ERR, __func__, "Mappings were stored as pages, load Calypso with mapping_format=2\n");
+        return -EINVAL;
+    }
+
+    for (page_nr = 0; page_nr < mapping_cache->nr_pages; page_nr++)
+    {
+        if (calypso_decode_mapping_value(mappings + CALYPSO_MAPPING_STR_LEN * page_nr, &block) != 0)
+        {
+            debug_args(KERN_ERR, __func__, "Could not decode block of mapping page %lu\n", page_nr);
+            return -EINVAL;
+        }
+        if (block >= total_physical_blocks)
+            continue;
+        mapping_cache->directory[page_nr] = block;
+        calypso_block_state_set(&(calypso_dev->block_state), block, CALYPSO_BLOCK_CALYPSO_DATA);
+    }
+    return 0;
+}
+
+static void calypso_encode_sparse(unsigned char *mappings, struct calypso_sparse_map *sparse_map)
+{
+    char nr_mappings_str[8+1];
+    unsigned long virtual;
+    unsigned long offset = 8;
+    void *entry;
+
+    snprintf(nr_mappings_str, 8+1, "%.8lx", atomic_long_read(&(sparse_map->nr_entries)));
+    memcpy(mappings, nr_mappings_str, 8);
+
+    calypso_sparse_map_for_each(sparse_map, virtual, entry)
+    {
+        calypso_encode_mapping_value(mappings + offset, virtual);
+        calypso_encode_mapping_value(mappings + offset + CALYPSO_MAPPING_STR_LEN, xa_to_value(entry));
+        offset += 2 * CALYPSO_MAPPING_STR_LEN;
+    }
+}
+
+/*
+ * Decoded through calypso_dev_load_mapping(), so they can be loaded into any
+ * mapping format, and the blocks are marked as Calypso's
+ */
+static int calypso_decode_sparse(unsigned char *mappings, unsigned long virtual_nr_blocks, 
+        unsigned long total_physical_blocks, struct calypso_blk_device *calypso_dev)
+{
+    char nr_mappings_str[8+1];
+    unsigned long nr_mappings, i;
+    unsigned long long virtual, physical;
+    unsigned long offset = 8;
+    int ret;
+
+    memcpy(nr_mappings_str, mappings, 8);
+    nr_mappings_str[8] = '\0';
+    ret = kstrtoul(nr_mappings_str, 16, &nr_mappings);
+    /* there can not be more mappings than mapped blocks, which is what the metadata is sized for */
+    if (ret != 0 || nr_mappings > min(virtual_nr_blocks, total_physical_blocks))
+    {
+        debug_args(KERN_ERR, __func__, "Invalid number of mappings %s\n", nr_mappings_str);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nr_mappings; i++)
+    {
+        if (calypso_decode_mapping_value(mappings + offset, &virtual) != 0
+            || calypso_decode_mapping_value(mappings + offset + CALYPSO_MAPPING_STR_LEN, &physical) != 0)
+        {
+            debug_args(KERN_ERR, __func__, "Could not decode mapping %lu\n", i);
+            return -EINVAL;
+        }
+        offset += 2 * CALYPSO_MAPPING_STR_LEN;
+
+        if (virtual >= virtual_nr_blocks || physical >= total_physical_blocks)
+        {
+            debug_args(KERN_ERR, __func__, "Mapping %lu is out of bounds\n", i);
+            return -EINVAL;
+        }
+        ret = calypso_dev_load_mapping(calypso_dev, virtual, physical);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * Extents are decoded block by block, so they can be loaded into either
+ * mapping format
+ */
+static int calypso_decode_extents(unsigned char *mappings, unsigned long virtual_nr_blocks, 
+        unsigned long total_physical_blocks, struct calypso_blk_device *calypso_dev)
+{
+    char nr_extents_str[8+1];
+    unsigned long nr_extents, i, block;
+    unsigned long long virtual_start, physical_start, len;
+    unsigned long offset = 8;
+    int ret;
+
+    memcpy(nr_extents_str, mappings, 8);
+    nr_extents_str[8] = '\0';
+    ret = kstrtoul(nr_extents_str, 16, &nr_extents);
+    /* there can not be more extents than mapped blocks, which is what the metadata is sized for */
+    if (ret != 0 || nr_extents > min(virtual_nr_blocks, total_physical_blocks))
+    {
+        debug_args(KERN_ERR, __func__, "Invalid number of extents %s\n", nr_extents_str);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nr_extents; i++)
+    {
+        if (calypso_decode_mapping_value(mappings + offset, &virtual_start) != 0
+            || calypso_decode_mapping_value(mappings + offset + CALYPSO_MAPPING_STR_LEN, &physical_start) != 0
+            || calypso_decode_mapping_value(mappings + offset + 2 * CALYPSO_MAPPING_STR_LEN, &len) != 0)
+        {
+            debug_args(KERN_ERR, __func__, "Could not decode extent %lu\n", i);
+            return -EINVAL;
+        }
+        offset += 3 * CALYPSO_MAPPING_STR_LEN;
+
+        if (virtual_start + len > virtual_nr_blocks || physical_start + len > total_physical_blocks)
+        {
+            debug_args(KERN_ERR, __func__, "Extent %lu is out of bounds\n", i);
+            return -EINVAL;
+        }
+
+        debug_args(KERN_DEBUG, __func__, "MAPPED virtual: %llu; physical: %llu; len: %llu\n", virtual_start, physical_start, len);
+        for (block = 0; block < len; block++)
+        {
+            ret = calypso_dev_load_mapping(calypso_dev, virtual_start + block, physical_start + block);
+            if (ret != 0)
+                return ret;
+        }
+    }
+    return 0;
 }
 
 loff_t calypso_calc_bitmap_metadata_size(unsigned long total_physical_blocks)
@@ -375,7 +582,7 @@ loff_t calypso_calc_bitmap_metadata_size(unsigned long total_physical_blocks)
     return bitmap_data_len;
 }
 
-int calypso_retrieve_data_block(unsigned char *metadata, unsigned long *metadata_to_physical_block_mapping, struct file *metadata_file, unsigned char *read_metadata_block, unsigned long bitmap_data_len, unsigned long block_index, unsigned long total_physical_blocks, unsigned long *cur_block_num, struct calypso_skcipher_def *cipher, unsigned char *key)
+int calypso_retrieve_data_block(unsigned char *metadata, calypso_block_t *metadata_to_physical_block_mapping, struct file *metadata_file, unsigned char *read_metadata_block, unsigned long bitmap_data_len, unsigned long block_index, unsigned long total_physical_blocks, unsigned long *cur_block_num, struct calypso_skcipher_def *cipher, unsigned char *key)
 {   
     int ret; 
 
@@ -469,15 +676,19 @@ error_incoherent_block:
     return ret;
 }
 
+/*
+ * n_metadata_blocks is how many blocks metadata_to_physical_block_mapping
+ * has room for, the amount actually read is returned in n_metadata_blocks_ptr
+ */
 int calypso_retrieve_hidden_metadata(unsigned long bitmap_data_len, 
-        unsigned long mappings_data_len, unsigned long *metadata_to_physical_block_mapping, 
-        unsigned long n_metadata_blocks, struct block_device *physical_dev, 
-        unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap,
+        unsigned long mappings_data_len, calypso_block_t *metadata_to_physical_block_mapping, 
+        unsigned long n_metadata_blocks, unsigned long *n_metadata_blocks_ptr, 
+        struct block_device *physical_dev, 
+        struct calypso_block_state *block_state,
         unsigned long total_physical_blocks, 
         struct crypto_shash *sym_enc_tfm, struct calypso_skcipher_def *cipher, 
         unsigned long virtual_nr_blocks, unsigned long *virtual_nr_blocks_ptr,
-        unsigned long *virtual_to_physical_block_mapping, 
-        unsigned long *physical_to_virtual_block_mapping)
+        struct calypso_blk_device *calypso_dev)
 {
     struct file *metadata_file = calypso_open_file(PHYSICAL_DISK_NAME, O_CREAT|O_RDWR, 0755);
 
@@ -540,28 +751,33 @@ int calypso_retrieve_hidden_metadata(unsigned long bitmap_data_len,
     /* Retrieve number of Calypso blocks. This can be here since we have already read the first block. */
     char virtual_blocks_str[8+1];
     unsigned long virtual_blocks;
+    unsigned long metadata_format;
     memcpy(virtual_blocks_str, metadata, 8);
     virtual_blocks_str[8] = '\0';
     // debug_args(KERN_DEBUG, __func__, "$$$$$ virtual_blocks_str before %s; chars: %c; %c; %c; %c; %c; %c; %c; %c; %c; %c; \n", virtual_blocks_str, virtual_blocks_str[0], virtual_blocks_str[1], virtual_blocks_str[2], virtual_blocks_str[3], virtual_blocks_str[4], virtual_blocks_str[5], virtual_blocks_str[6], virtual_blocks_str[7], virtual_blocks_str[8], virtual_blocks_str[9]);
-    ret = kstrtoul(virtual_blocks_str, 16, virtual_nr_blocks_ptr);
+    ret = kstrtoul(virtual_blocks_str, 16, &virtual_blocks);
     if (ret != 0)
     {
         debug_args(KERN_ERR, __func__, "Error passing virtual_blocks_str into an unsigned long with code %d\n", ret);
         goto full_cleanup;
     }
+    metadata_format = virtual_blocks & CALYPSO_METADATA_FORMAT_MASK;
+    (*virtual_nr_blocks_ptr) = virtual_blocks & ~CALYPSO_METADATA_FORMAT_MASK;
 
     /* This needs to go on until the last block which will return cur_block_num == -1 */
     // IMPORTANT!! FOR SOME REASON, PRINTS HERE BLOCK THE SYSTEM
-    while (cur_block_num != -1 && ret == 0)
+    while (cur_block_num != -1 && ret == 0 && iter < n_metadata_blocks)
     {
         ret = calypso_retrieve_data_block(metadata, metadata_to_physical_block_mapping, metadata_file, read_metadata_block, bitmap_data_len, iter, total_physical_blocks, &cur_block_num, cipher, key);
         iter++;
     }
-    if (iter != n_metadata_blocks)
+    /* Only mappings stored as an array have a known length */
+    if (cur_block_num != -1 || (metadata_format == 0 && iter != calypso_calc_metadata_size_in_blocks(bitmap_data_len, mappings_data_len)))
     {
-        debug_args(KERN_ERR, __func__, "Did not successfully retrieve %lu metadata blocks\n", n_metadata_blocks);
+        debug_args(KERN_ERR, __func__, "Did not successfully retrieve metadata, read %u blocks\n", iter);
         goto full_cleanup;
     }
+    (*n_metadata_blocks_ptr) = iter;
 
     /* We've read the whole file, so we can close it */
     calypso_close_file(metadata_file);
@@ -587,7 +803,8 @@ int calypso_retrieve_hidden_metadata(unsigned long bitmap_data_len,
     // debug(KERN_DEBUG, __func__, "BEFORE RETRIEVING BITMAPS!!\n");
     bitmap_from_arr32(prev_bitmap, (u32 *)(metadata + 8), total_physical_blocks);
     /* Check differences between previous and updated bitmap */
-    bitmap_xor(res_bitmap, prev_bitmap, physical_blocks_bitmap, total_physical_blocks);
+    calypso_block_state_used_bitmap(block_state, res_bitmap);
+    bitmap_xor(res_bitmap, prev_bitmap, res_bitmap, total_physical_blocks);
 
     bitmap_for_each_set_region(res_bitmap, res_rs, res_re, 0, total_physical_blocks)
 	{
@@ -601,19 +818,33 @@ int calypso_retrieve_hidden_metadata(unsigned long bitmap_data_len,
 
     /* Retrieve data from persisted mappings */
     unsigned long virtual;
-    char physical_str[8+1];
-    unsigned long physical;
+    unsigned long long physical;
     loff_t offset = 8 + bitmap_data_len; /* initial position to read mappings */
-    debug_args(KERN_DEBUG, __func__, "XXXX before physical_str: %s; offset :%lu\n", physical_str, offset);
     // debug(KERN_DEBUG, __func__, "BEFORE RETRIEVING VIRTUAL MAPPINGS!!\n");
+    if (metadata_format == CALYPSO_EXTENT_METADATA_FLAG)
+    {
+        ret = calypso_decode_extents(metadata + offset, virtual_nr_blocks, total_physical_blocks, calypso_dev);
+        if (ret != 0)
+            goto full_cleanup;
+    }
+    else if (metadata_format == CALYPSO_PAGED_METADATA_FLAG)
+    {
+        ret = calypso_decode_pages(metadata + offset, total_physical_blocks, calypso_dev);
+        if (ret != 0)
+            goto full_cleanup;
+    }
+    else if (metadata_format == CALYPSO_SPARSE_METADATA_FLAG)
+    {
+        ret = calypso_decode_sparse(metadata + offset, virtual_nr_blocks, total_physical_blocks, calypso_dev);
+        if (ret != 0)
+            goto full_cleanup;
+    }
     // TODO: change from virtual_nr_blocks to this virtual_nr_blocks_ptr ??????
-    for (virtual = 0; virtual < virtual_nr_blocks; virtual++)
+    for (virtual = 0; metadata_format == 0 && virtual < virtual_nr_blocks; virtual++)
     {
-        memcpy(physical_str, metadata + offset, 8);
-        physical_str[8] = '\0';
-        offset += 8;
-        ret = kstrtoul(physical_str, 16, &physical);
-        debug_args(KERN_DEBUG, __func__, "XXXX virtual: %lu; physical: %lu; physical_str: %s\n", virtual, physical, physical_str);
+        ret = calypso_decode_mapping_value(metadata + offset, &physical);
+        offset += CALYPSO_MAPPING_STR_LEN;
+        debug_args(KERN_DEBUG, __func__, "XXXX virtual: %lu; physical: %llu\n", virtual, physical);
         if (ret != 0)
         {
             debug_args(KERN_ERR, __func__, "Error passing physical_str into an unsigned long with code %d\n", ret);
@@ -623,23 +854,21 @@ int calypso_retrieve_hidden_metadata(unsigned long bitmap_data_len,
         /* We only set the mappings if they are not the default value */
         // TODO: CHANGE BACK
         // if (physical < MAX_UNSIGNED_LONG && physical != 0)
-        if (physical < MAX_UNSIGNED_LONG)
+        if (physical < total_physical_blocks)
         {
-            debug_args(KERN_DEBUG, __func__, "MAPPED virtual: %lu; physical: %lu\n", virtual, physical);
-            virtual_to_physical_block_mapping[virtual] = physical;
-            physical_to_virtual_block_mapping[physical] = virtual;
-            // debug_args(KERN_DEBUG, __func__, "SET BIT IN READ physical: %lu\n", physical);
-            calypso_update_bitmaps(physical_blocks_bitmap, high_entropy_blocks_bitmap, physical);
+            debug_args(KERN_DEBUG, __func__, "MAPPED virtual: %lu; physical: %llu\n", virtual, physical);
+            /* marks the block as Calypso's as well */
+            calypso_dev_load_mapping(calypso_dev, virtual, physical);
         }
     }
 
     unsigned long i;
-    for (i = 0; i < n_metadata_blocks; i++)
+    for (i = 0; i < (*n_metadata_blocks_ptr); i++)
     {
-        if (metadata_to_physical_block_mapping[i] < MAX_UNSIGNED_LONG)
+        if (metadata_to_physical_block_mapping[i] < total_physical_blocks)
         {
             // debug_args(KERN_DEBUG, __func__, "SET BIT IN READ physical 2: %lu\n", metadata_to_physical_block_mapping[i]);
-            calypso_update_bitmaps(physical_blocks_bitmap, high_entropy_blocks_bitmap, metadata_to_physical_block_mapping[i]);
+            calypso_block_state_set(block_state, metadata_to_physical_block_mapping[i], CALYPSO_BLOCK_CALYPSO_METADATA);
         }
     }
 
@@ -656,7 +885,7 @@ error_after_metadata_bitmap:
 }
 
 // We are going to begin by encoding and deconding a single metadata block
-int calypso_encode_data_block(unsigned long metadata_blocks_num, unsigned long *metadata_to_physical_block_mapping, unsigned char *metadata_to_write, unsigned long bitmap_data_len, unsigned long mappings_data_len, unsigned long block_index, struct block_device *physical_dev, unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, unsigned long total_physical_blocks, unsigned long *cur_block_num, bool is_last_block, struct calypso_skcipher_def *cipher, unsigned char *key)
+int calypso_encode_data_block(unsigned long metadata_blocks_num, calypso_block_t *metadata_to_physical_block_mapping, unsigned char *metadata_to_write, unsigned long bitmap_data_len, unsigned long mappings_data_len, unsigned long block_index, struct block_device *physical_dev, struct calypso_block_state *block_state, unsigned long total_physical_blocks, unsigned long *cur_block_num, bool is_last_block, struct calypso_skcipher_def *cipher, unsigned char *key)
 {   
     int ret;
     unsigned char metadata[METADATA_BYTES_LEN + 1];
@@ -687,6 +916,9 @@ int calypso_encode_data_block(unsigned long metadata_blocks_num, unsigned long *
     if (!is_last_block)
     {
         next_block = metadata_to_physical_block_mapping[block_index + 1];
+        /* unassigned entries are CALYPSO_UNMAPPED, which may be narrower than -1UL */
+        if (next_block == CALYPSO_UNMAPPED)
+            next_block = -1UL;
     }
 
     /* if it is the last block, then the value is -1 but it can't be accessed */  
@@ -700,10 +932,10 @@ int calypso_encode_data_block(unsigned long metadata_blocks_num, unsigned long *
         if (!is_last_block) 
         {
             next_block = 0;
-            calypso_get_next_free_block(high_entropy_blocks_bitmap, total_physical_blocks, &next_block);
+            calypso_get_next_free_block(block_state, total_physical_blocks, &next_block);
             // calypso_set_bit(bitmap, next_block);
             // calypso_clear_bit(bitmap, next_block);
-            calypso_update_bitmaps(physical_blocks_bitmap, high_entropy_blocks_bitmap, next_block);
+            calypso_block_state_set(block_state, next_block, CALYPSO_BLOCK_CALYPSO_METADATA);
             metadata_to_physical_block_mapping[block_index + 1] = next_block;
             debug_args(KERN_INFO, __func__, "NEXT BLOCK IS %lu BECAUSE IT WAS NOT PREVIOUSLY ASSIGNED!\n", next_block);
         }
@@ -717,7 +949,7 @@ int calypso_encode_data_block(unsigned long metadata_blocks_num, unsigned long *
     }
     else 
     {
-        debug_args(KERN_INFO, __func__, "NEXT BLOCK WAS PREVIOUSLY ASSIGNED! %d; %lu\n", block_index + 1, metadata_to_physical_block_mapping[block_index + 1]);
+        debug_args(KERN_INFO, __func__, "NEXT BLOCK WAS PREVIOUSLY ASSIGNED! %d; %lu\n", block_index + 1, (unsigned long)metadata_to_physical_block_mapping[block_index + 1]);
     }
     
     /* if the next block value was already assigned, we already retrieve it from metadata_to_physical_block_mapping */
@@ -783,15 +1015,18 @@ int calypso_encode_data_block(unsigned long metadata_blocks_num, unsigned long *
     return ret;
 }
 
-// void calypso_encode_hidden_metadata(unsigned long *metadata_to_physical_block_mapping, unsigned long n_metadata_blocks, struct block_device *physical_dev, unsigned long *bitmap, unsigned long total_physical_blocks, struct crypto_shash *sym_enc_tfm, struct calypso_skcipher_def *cipher)
+// void calypso_encode_hidden_metadata(calypso_block_t *metadata_to_physical_block_mapping, unsigned long n_metadata_blocks, struct block_device *physical_dev, unsigned long *bitmap, unsigned long total_physical_blocks, struct crypto_shash *sym_enc_tfm, struct calypso_skcipher_def *cipher)
 int calypso_encode_hidden_metadata(unsigned long bitmap_data_len, 
-        unsigned long mappings_data_len, unsigned long *metadata_to_physical_block_mapping, 
+        unsigned long mappings_data_len, calypso_block_t *metadata_to_physical_block_mapping, 
         unsigned long n_metadata_blocks, struct block_device *physical_dev, 
-        unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, 
+        struct calypso_block_state *block_state, 
         unsigned long total_physical_blocks, 
         struct crypto_shash *sym_enc_tfm, struct calypso_skcipher_def *cipher, 
-        unsigned long virtual_nr_blocks,
-        unsigned long *virtual_to_physical_block_mapping)
+        unsigned long virtual_nr_blocks, enum calypso_mapping_format mapping_format, 
+        calypso_block_t *virtual_to_physical_block_mapping, 
+        struct calypso_extent_map *extent_map, 
+        struct calypso_mapping_cache *mapping_cache, 
+        struct calypso_sparse_map *sparse_map)
 {
     unsigned long i;
     int ret;
@@ -802,6 +1037,7 @@ int calypso_encode_hidden_metadata(unsigned long bitmap_data_len,
     unsigned long metadata_bytes_len = (unsigned long)METADATA_BYTES_LEN;
 
     unsigned int res_rs, res_re;
+    unsigned long *used_bitmap;
 
     unsigned char *key = kzalloc(ENCRYPTION_KEY_LEN + 1, GFP_KERNEL);
     if (!key)
@@ -825,11 +1061,29 @@ int calypso_encode_hidden_metadata(unsigned long bitmap_data_len,
         ret = -ENOMEM;
         goto full_cleanup_encode_metadata;
     }
-    bitmap_to_arr32(bitmap_data, physical_blocks_bitmap, total_physical_blocks);
+    used_bitmap = bitmap_alloc(total_physical_blocks, GFP_KERNEL);
+    if (!used_bitmap)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate memory for used blocks bitmap\n");
+        kfree(bitmap_data);
+        ret = -ENOMEM;
+        goto full_cleanup_encode_metadata;
+    }
+    calypso_block_state_used_bitmap(block_state, used_bitmap);
+    bitmap_to_arr32(bitmap_data, used_bitmap, total_physical_blocks);
+    bitmap_free(used_bitmap);
 
     /* Store number of Calypso blocks in first block of metadata */
     char virtual_nr_blocks_str[8+1];
-    snprintf(virtual_nr_blocks_str, 8+1, "%.8lx", virtual_nr_blocks);
+    /* The flags tell the other formats apart from the per block mappings when retrieving */
+    if (mapping_format == CALYPSO_MAPPINGS_EXTENTS)
+        snprintf(virtual_nr_blocks_str, 8+1, "%.8lx", virtual_nr_blocks | CALYPSO_EXTENT_METADATA_FLAG);
+    else if (mapping_format == CALYPSO_MAPPINGS_PAGED)
+        snprintf(virtual_nr_blocks_str, 8+1, "%.8lx", virtual_nr_blocks | CALYPSO_PAGED_METADATA_FLAG);
+    else if (mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        snprintf(virtual_nr_blocks_str, 8+1, "%.8lx", virtual_nr_blocks | CALYPSO_SPARSE_METADATA_FLAG);
+    else
+        snprintf(virtual_nr_blocks_str, 8+1, "%.8lx", virtual_nr_blocks);
     // debug_args(KERN_DEBUG, __func__, "# virtual_nr_blocks_str: %s\n", virtual_nr_blocks_str);
     memcpy(metadata, virtual_nr_blocks_str, 8);
     // debug_args(KERN_DEBUG, __func__, "# metadata: %s\n", metadata);
@@ -838,13 +1092,16 @@ int calypso_encode_hidden_metadata(unsigned long bitmap_data_len,
     memcpy(metadata + 8, (unsigned char*)bitmap_data, bitmap_data_len);
 
     unsigned long virtual;
-    char physical_str[8+1];
-    for (virtual = 0; virtual < virtual_nr_blocks; virtual++)
+    if (mapping_format == CALYPSO_MAPPINGS_EXTENTS)
+        calypso_encode_extents(metadata + 8 + bitmap_data_len, extent_map);
+    else if (mapping_format == CALYPSO_MAPPINGS_PAGED)
+        calypso_encode_pages(metadata + 8 + bitmap_data_len, mapping_cache);
+    else if (mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        calypso_encode_sparse(metadata + 8 + bitmap_data_len, sparse_map);
+    for (virtual = 0; mapping_format == CALYPSO_MAPPINGS_ARRAY && virtual < virtual_nr_blocks; virtual++)
     {
-        snprintf(physical_str, 8+1, "%.8lx", virtual_to_physical_block_mapping[virtual]);
-        memcpy(metadata + 8 + bitmap_data_len + 8 * virtual, physical_str, 8);
-        debug_args(KERN_DEBUG, __func__, "ENCODING virtual: %lu; physical: %lu\n", virtual, virtual_to_physical_block_mapping[virtual]);
-        debug_args(KERN_DEBUG, __func__, "ENCODING2 physical in hex: %.8s\n", metadata + bitmap_data_len + 8 * virtual);
+        calypso_encode_mapping_value(metadata + 8 + bitmap_data_len + CALYPSO_MAPPING_STR_LEN * virtual, virtual_to_physical_block_mapping[virtual]);
+        debug_args(KERN_DEBUG, __func__, "ENCODING virtual: %lu; physical: %lu\n", virtual, (unsigned long)virtual_to_physical_block_mapping[virtual]);
     }
     
 
@@ -853,15 +1110,15 @@ int calypso_encode_hidden_metadata(unsigned long bitmap_data_len,
     // calypso_hkdf(sym_enc_tfm, PASSWORD, sizeof(PASSWORD), cipher);
     calypso_hkdf(sym_enc_tfm, PASSWORD, sizeof(PASSWORD), cipher, key);
 
-    ret = calypso_get_first_block_num_random_to_write(metadata_to_physical_block_mapping, physical_blocks_bitmap, high_entropy_blocks_bitmap, total_physical_blocks, SEED, &first_block_num, &first_random_num);
+    ret = calypso_get_first_block_num_random_to_write(metadata_to_physical_block_mapping, block_state, total_physical_blocks, SEED, &first_block_num, &first_random_num);
     cur_block_num = first_block_num;
     /* First iteration is done outside */
-    calypso_encode_data_block(n_metadata_blocks, metadata_to_physical_block_mapping, metadata, bitmap_data_len, mappings_data_len, 0UL, physical_dev, physical_blocks_bitmap, high_entropy_blocks_bitmap, total_physical_blocks, &cur_block_num, n_metadata_blocks == 1, cipher, key);
+    calypso_encode_data_block(n_metadata_blocks, metadata_to_physical_block_mapping, metadata, bitmap_data_len, mappings_data_len, 0UL, physical_dev, block_state, total_physical_blocks, &cur_block_num, n_metadata_blocks == 1, cipher, key);
 
     // TODO this needs to go until there is no more metadata to be saved, and next_block needs to be set to -1
     for (i = 1; i < n_metadata_blocks; i++)
     {
-        calypso_encode_data_block(n_metadata_blocks, metadata_to_physical_block_mapping, metadata, bitmap_data_len, mappings_data_len, i, physical_dev, physical_blocks_bitmap, high_entropy_blocks_bitmap, total_physical_blocks, &cur_block_num, (n_metadata_blocks - 1) == i, cipher, key);
+        calypso_encode_data_block(n_metadata_blocks, metadata_to_physical_block_mapping, metadata, bitmap_data_len, mappings_data_len, i, physical_dev, block_state, total_physical_blocks, &cur_block_num, (n_metadata_blocks - 1) == i, cipher, key);
     }
 
     kfree(bitmap_data);
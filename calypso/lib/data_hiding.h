@@ -27,6 +27,19 @@ is no metadata to recover and assigns new blocks to hide the metadata */
 
 #define UNSIGNED_LONG_LEN 8
 
+/*
+ * The top bits of the stored number of Calypso blocks tell how the mappings
+ * that follow it are stored: as extents, as the blocks storing each page
+ * of the mapping table, as pairs of written virtual and physical blocks, or,
+ * with none set, as one mapping per virtual block
+ */
+#define CALYPSO_METADATA_FORMAT_MASK 0xC0000000UL
+#define CALYPSO_EXTENT_METADATA_FLAG 0x80000000UL
+#define CALYPSO_PAGED_METADATA_FLAG 0x40000000UL
+#define CALYPSO_SPARSE_METADATA_FLAG 0xC0000000UL
+/* So the biggest number of Calypso blocks the metadata can hold is */
+#define CALYPSO_METADATA_MAX_VIRTUAL_BLOCKS (CALYPSO_METADATA_FORMAT_MASK ^ 0xFFFFFFFFUL)
+
 #define SALT_BYTES_LEN 16
 #define HMAC_BYTES_LEN 32
 
@@ -67,39 +80,45 @@ void calypso_unpad_last_block_metadata_string(char *string, unsigned int str_len
 void calypso_generate_random_number(u8 *random_num_buf, unsigned long len);
 
 int calypso_get_first_block_num_random_to_read(MTRand r, unsigned char *metadata, 
-        unsigned long *metadata_to_physical_block_mapping, struct file *metadata_file, 
+        calypso_block_t *metadata_to_physical_block_mapping, struct file *metadata_file, 
         unsigned char *read_metadata_block, unsigned int bitmap_data_len, 
         unsigned long total_physical_blocks, unsigned long seed, 
         unsigned long *first_block_num, unsigned long *first_random_num, 
         unsigned long *cur_block_num, struct calypso_skcipher_def *cipher, 
         unsigned char *key);
-int calypso_get_first_block_num_random_to_write(unsigned long *metadata_to_physical_block_mapping, unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, unsigned long total_physical_blocks, unsigned char *seed_str, unsigned long *first_block_num, unsigned long *first_random_num);
+int calypso_get_first_block_num_random_to_write(calypso_block_t *metadata_to_physical_block_mapping, struct calypso_block_state *block_state, unsigned long total_physical_blocks, unsigned char *seed_str, unsigned long *first_block_num, unsigned long *first_random_num);
 
 unsigned long calypso_calc_metadata_size_in_blocks(loff_t bitmap_data_len, unsigned long mappings_data_len);
 unsigned long calypso_calc_mappings_metadata_size(unsigned long total_virtual_blocks);
+unsigned long calypso_calc_extents_metadata_size(unsigned long nr_extents);
+unsigned long calypso_calc_pages_metadata_size(unsigned long nr_pages);
+unsigned long calypso_calc_sparse_metadata_size(unsigned long nr_mappings);
 loff_t calypso_calc_bitmap_metadata_size(unsigned long total_physical_blocks);
 
-int calypso_encode_data_block(unsigned long metadata_blocks_num, unsigned long *metadata_to_physical_block_mapping, unsigned char *metadata_to_write, unsigned long bitmap_data_len, unsigned long mappings_data_len, unsigned long block_index, struct block_device *physical_dev, unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, unsigned long total_physical_blocks, unsigned long *cur_block_num, bool is_last_block, struct calypso_skcipher_def *cipher, unsigned char *key);
-int calypso_retrieve_data_block(unsigned char *metadata, unsigned long *metadata_to_physical_block_mapping, struct file *metadata_file, unsigned char *read_metadata_block, unsigned long bitmap_data_len, unsigned long block_index, unsigned long total_physical_blocks, unsigned long *cur_block_num, struct calypso_skcipher_def *cipher, unsigned char *key);
+int calypso_encode_data_block(unsigned long metadata_blocks_num, calypso_block_t *metadata_to_physical_block_mapping, unsigned char *metadata_to_write, unsigned long bitmap_data_len, unsigned long mappings_data_len, unsigned long block_index, struct block_device *physical_dev, struct calypso_block_state *block_state, unsigned long total_physical_blocks, unsigned long *cur_block_num, bool is_last_block, struct calypso_skcipher_def *cipher, unsigned char *key);
+int calypso_retrieve_data_block(unsigned char *metadata, calypso_block_t *metadata_to_physical_block_mapping, struct file *metadata_file, unsigned char *read_metadata_block, unsigned long bitmap_data_len, unsigned long block_index, unsigned long total_physical_blocks, unsigned long *cur_block_num, struct calypso_skcipher_def *cipher, unsigned char *key);
 
 int calypso_encode_hidden_metadata(unsigned long bitmap_data_len, 
-        unsigned long mappings_data_len, unsigned long *metadata_to_physical_block_mapping, 
+        unsigned long mappings_data_len, calypso_block_t *metadata_to_physical_block_mapping, 
         unsigned long n_metadata_blocks, struct block_device *physical_dev, 
-        unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap,
+        struct calypso_block_state *block_state,
         unsigned long total_physical_blocks, 
         struct crypto_shash *sym_enc_tfm, struct calypso_skcipher_def *cipher, 
-        unsigned long virtual_nr_blocks,
-        unsigned long *virtual_to_physical_block_mapping);
+        unsigned long virtual_nr_blocks, enum calypso_mapping_format mapping_format, 
+        calypso_block_t *virtual_to_physical_block_mapping, 
+        struct calypso_extent_map *extent_map, 
+        struct calypso_mapping_cache *mapping_cache, 
+        struct calypso_sparse_map *sparse_map);
 
 int calypso_retrieve_hidden_metadata(unsigned long bitmap_data_len, 
-        unsigned long mappings_data_len, unsigned long *metadata_to_physical_block_mapping, 
-        unsigned long n_metadata_blocks, struct block_device *physical_dev, 
-        unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap,
+        unsigned long mappings_data_len, calypso_block_t *metadata_to_physical_block_mapping, 
+        unsigned long n_metadata_blocks, unsigned long *n_metadata_blocks_ptr, 
+        struct block_device *physical_dev, 
+        struct calypso_block_state *block_state,
         unsigned long total_physical_blocks, 
         struct crypto_shash *sym_enc_tfm, struct calypso_skcipher_def *cipher, 
         unsigned long virtual_nr_blocks, unsigned long *virtual_nr_blocks_ptr,
-        unsigned long *virtual_to_physical_block_mapping, 
-        unsigned long *physical_to_virtual_block_mapping);
+        struct calypso_blk_device *calypso_dev);
 
 
 #endif
\ No newline at end of file
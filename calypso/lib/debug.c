@@ -0,0 +1,62 @@
+/*
+ * Runtime switch of the verbose debug messages
+ *
+ * usage:
+ *      $ echo 7 | sudo tee /sys/kernel/calypso/debug_level
+ *      $ echo trace | sudo tee /sys/kernel/calypso/debug_backend
+ *      $ echo 1 | sudo tee /sys/kernel/debug/tracing/events/calypso/calypso_debug/enable
+ *      $ sudo cat /sys/kernel/debug/tracing/trace_pipe
+ */
+#include <linux/kernel.h>
+#include <linux/jump_label.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+
+#include "debug.h"
+
+#define CREATE_TRACE_POINTS
+#include "debug_trace.h"
+
+/* Longer messages are cut, the longest ones print a few numbers after the function name */
+#define CALYPSO_DEBUG_TRACE_MSG_LEN 256
+
+
+DEFINE_STATIC_KEY_FALSE(calypso_debug_enabled);
+/* Highest level printed, only errors and warnings while below CALYPSO_DEBUG_VERBOSE_LEVEL */
+int calypso_debug_level = LOGLEVEL_WARNING;
+int calypso_debug_backend = CALYPSO_DEBUG_PRINTK;
+
+static DEFINE_MUTEX(calypso_debug_lock);
+
+/* Patches the verbose messages in or out, so it can sleep */
+void calypso_debug_set_level(int level)
+{
+    mutex_lock(&calypso_debug_lock);
+    WRITE_ONCE(calypso_debug_level, clamp(level, LOGLEVEL_EMERG, LOGLEVEL_DEBUG));
+    if (calypso_debug_level >= CALYPSO_DEBUG_VERBOSE_LEVEL)
+        static_branch_enable(&calypso_debug_enabled);
+    else
+        static_branch_disable(&calypso_debug_enabled);
+    mutex_unlock(&calypso_debug_lock);
+}
+
+/* Formats the message for the calypso_debug tracepoint, only if it is enabled */
+void calypso_debug_trace(int level, const char *func, const char *fmt, ...)
+{
+    char msg[CALYPSO_DEBUG_TRACE_MSG_LEN];
+    va_list args;
+    int len;
+
+    if (!trace_calypso_debug_enabled())
+        return;
+
+    va_start(args, fmt);
+    len = vscnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    /* the trace output ends each event with its own newline */
+    if (len > 0 && msg[len - 1] == '\n')
+        msg[len - 1] = '\0';
+
+    trace_calypso_debug(level, func, msg);
+}
@@ -1,12 +1,63 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <linux/kernel.h>
+#include <linux/printk.h>
+#include <linux/jump_label.h>
+
 #include "global.h"
 
+/*
+ * Errors and warnings are always printed. Messages from KERN_NOTICE on are
+ * verbose: they are called per bio and per host write, so they are behind
+ * a static key, off by default, and cost a single patched jump until
+ * enabled through /sys/kernel/calypso/debug_level.
+ * Building with CALYPSO_NO_VERBOSE_DEBUG=1 leaves them out altogether
+ */
+#define CALYPSO_DEBUG_VERBOSE_LEVEL LOGLEVEL_NOTICE
+
+/* Where verbose messages go */
+enum calypso_debug_backend {
+    CALYPSO_DEBUG_PRINTK = 0,
+    /* the calypso:calypso_debug tracepoint, into the ftrace ring buffer,
+    much cheaper than the log buffer under load. Formats nothing while the
+    event is not enabled in tracefs */
+    CALYPSO_DEBUG_TRACE = 1,
+};
+
+DECLARE_STATIC_KEY_FALSE(calypso_debug_enabled);
+extern int calypso_debug_level;
+extern int calypso_debug_backend;
+
+void calypso_debug_set_level(int level);
+__printf(3, 4) void calypso_debug_trace(int level, const char *func, const char *fmt, ...);
+
+/* The level of a constant KERN_* string, which the compiler folds */
+#define calypso_debug_level_of(kern_lvl) (printk_get_level(kern_lvl) - '0')
+
+#ifdef CALYPSO_NO_VERBOSE_DEBUG
+#define calypso_debug_verbose(kern_lvl, func, fmt, ...) no_printk(kern_lvl "%s: [%s] " fmt, CALYPSO_DEV_NAME, func, ##__VA_ARGS__)
+#else
+#define calypso_debug_verbose(kern_lvl, func, fmt, ...) \
+    do { \
+        if (static_branch_unlikely(&calypso_debug_enabled) && calypso_debug_level_of(kern_lvl) <= READ_ONCE(calypso_debug_level)) \
+        { \
+            if (READ_ONCE(calypso_debug_backend) == CALYPSO_DEBUG_TRACE) \
+                calypso_debug_trace(calypso_debug_level_of(kern_lvl), func, fmt, ##__VA_ARGS__); \
+            else \
+                printk(kern_lvl "%s: [%s] " fmt, CALYPSO_DEV_NAME, func, ##__VA_ARGS__); \
+        } \
+    } while (0)
+#endif
+
 /* debug messages */
-#define debug_args(kern_lvl, func, fmt, ...) printk(kern_lvl "%s: [%s] " fmt, CALYPSO_DEV_NAME, func, ##__VA_ARGS__);
-#define debug(kern_lvl, func, fmt) printk(kern_lvl "%s: [%s] " fmt, CALYPSO_DEV_NAME, func);
-// #define debug_args(kern_lvl, func, fmt, ...) trace_printk("%s: [%s] " fmt, CALYPSO_DEV_NAME, func, ##__VA_ARGS__);
-// #define debug(kern_lvl, func, fmt) trace_printk("%s: [%s] " fmt, CALYPSO_DEV_NAME, func);
+#define debug_args(kern_lvl, func, fmt, ...) \
+    do { \
+        if (calypso_debug_level_of(kern_lvl) < CALYPSO_DEBUG_VERBOSE_LEVEL) \
+            printk(kern_lvl "%s: [%s] " fmt, CALYPSO_DEV_NAME, func, ##__VA_ARGS__); \
+        else \
+            calypso_debug_verbose(kern_lvl, func, fmt, ##__VA_ARGS__); \
+    } while (0)
+#define debug(kern_lvl, func, fmt) debug_args(kern_lvl, func, fmt)
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,43 @@
+/*
+ * Tracepoint for the verbose debug messages sent to the ftrace ring buffer
+ *
+ * usage:
+ *      $ echo 1 | sudo tee /sys/kernel/debug/tracing/events/calypso/calypso_debug/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM calypso
+
+#if !defined(DEBUG_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define DEBUG_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(calypso_debug,
+
+    TP_PROTO(int level, const char *func, const char *msg),
+
+    TP_ARGS(level, func, msg),
+
+    TP_STRUCT__entry(
+        __field(int, level)
+        __string(func, func)
+        __string(msg, msg)
+    ),
+
+    TP_fast_assign(
+        __entry->level = level;
+        __assign_str(func, func);
+        __assign_str(msg, msg);
+    ),
+
+    TP_printk("<%d> [%s] %s", __entry->level, __get_str(func), __get_str(msg))
+);
+
+#endif
+
+/* Found through -I in the drivers' Makefiles, as the header is not under include/trace */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE debug_trace
+#include <trace/define_trace.h>
@@ -65,36 +65,28 @@ int shannon_entropy(unsigned char *block)
     return entropy;
 }
 
-unsigned long classify_free_blocks_entropy(unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, unsigned long nbits)
+/* Every free block starts as low entropy, the ones that look random are promoted */
+unsigned long classify_free_blocks_entropy(struct calypso_block_state *block_state)
 {
-    unsigned int i;
     unsigned char block[4096 + 1];
     int entropy;
     unsigned long offset_within_file;
     unsigned long cur_block;
-    unsigned int rs, re, start = 0;
-    unsigned int bytes_in_region;
     unsigned long free_high_entropy_blocks = 0;
 
     struct file *metadata_file = calypso_open_file(PHYSICAL_DISK_NAME, O_CREAT|O_RDWR, 0755);
 
-    // bitmap_for_each_clear_region(physical_blocks_bitmap, rs, re, start, 12200)
-    bitmap_for_each_clear_region(physical_blocks_bitmap, rs, re, start, nbits)
-	{
-        bytes_in_region = re - rs;
-        for (i = 0; i < bytes_in_region; i++)
+    calypso_block_state_for_each(block_state, cur_block, CALYPSO_BLOCK_FREE_LOW_ENTROPY)
+    {
+        offset_within_file = cur_block * 4096;
+        calypso_read_file_with_offset(metadata_file, offset_within_file, block, 4096);
+        entropy = shannon_entropy(block) / FIXED_POINT_FACTOR;
+        if (entropy >= ENTROPY_THRESHOLD)
         {
-            cur_block = rs + i;
-            offset_within_file = cur_block * 4096;
-            calypso_read_file_with_offset(metadata_file, offset_within_file, block, 4096);
-            entropy = shannon_entropy(block) / FIXED_POINT_FACTOR;
-            if (entropy >= ENTROPY_THRESHOLD)
-            {
-                free_high_entropy_blocks++;
-                bitmap_set(high_entropy_blocks_bitmap, cur_block, 1);
-            }
-        } 
+            free_high_entropy_blocks++;
+            calypso_block_state_set(block_state, cur_block, CALYPSO_BLOCK_FREE_HIGH_ENTROPY);
+        }
     }
 
     return free_high_entropy_blocks;
-}
\ No newline at end of file
+}
@@ -1,6 +1,8 @@
 #ifndef DISK_ENTROPY_H
 #define DISK_ENTROPY_H
 
+#include "block_state.h"
+
 
 #define ENCRYPTED_THRESHOLD 7
 // #define ENCRYPTED_THRESHOLD 7.174
@@ -22,7 +24,7 @@ int shannon_entropy(unsigned char *block);
 /**
  * @returns the number of free blocks with high entropy
  */
-unsigned long classify_free_blocks_entropy(unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, unsigned long nbits);
+unsigned long classify_free_blocks_entropy(struct calypso_block_state *block_state);
 
 
 #endif
\ No newline at end of file
@@ -30,7 +30,7 @@ void write_to_output_buffer(sector_t sector_off, unsigned int sectors,
 {
 	memcpy(data_to_output + sector_off * DISK_SECTOR_SIZE, read_data_buf,
 		sectors * DISK_SECTOR_SIZE);
-	debug(KERN_INFO, __func__, "Finished writing read data to output buffer\n")
+	debug(KERN_INFO, __func__, "Finished writing read data to output buffer\n");
 }
 
 // TODO: should we just open and close the disk in read or write or keep it opened
@@ -0,0 +1,303 @@
+/*
+ * Extent based virtual to physical block mappings
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+
+#include "debug.h"
+#include "extent_map.h"
+
+
+void calypso_extent_map_init(struct calypso_extent_map *map)
+{
+    map->root = RB_ROOT;
+    spin_lock_init(&(map->lock));
+    seqcount_init(&(map->seq));
+    map->nr_extents = 0;
+}
+
+void calypso_extent_map_cleanup(struct calypso_extent_map *map)
+{
+    struct calypso_extent *extent, *next;
+
+    rbtree_postorder_for_each_entry_safe(extent, next, &(map->root), node)
+        kfree(extent);
+    map->root = RB_ROOT;
+    map->nr_extents = 0;
+}
+
+static unsigned long calypso_extent_end(struct calypso_extent *extent)
+{
+    return extent->virtual_start + extent->len;
+}
+
+/*
+ * Extent with the biggest virtual_start that is not after virtual_block_nr.
+ * The rbtree code writes child pointers with WRITE_ONCE(), so walking down
+ * without the lock never loops, it just might miss an extent being moved
+ */
+static struct calypso_extent *calypso_extent_map_find_le(struct calypso_extent_map *map, unsigned long virtual_block_nr)
+{
+    struct rb_node *node = rcu_dereference_raw(map->root.rb_node);
+    struct calypso_extent *extent, *found = NULL;
+
+    while (node)
+    {
+        extent = rb_entry(node, struct calypso_extent, node);
+        if (virtual_block_nr < READ_ONCE(extent->virtual_start))
+            node = rcu_dereference_raw(node->rb_left);
+        else
+        {
+            found = extent;
+            node = rcu_dereference_raw(node->rb_right);
+        }
+    }
+    return found;
+}
+
+/* Extent with the smallest virtual_start after virtual_block_nr */
+static struct calypso_extent *calypso_extent_map_find_gt(struct calypso_extent_map *map, unsigned long virtual_block_nr)
+{
+    struct rb_node *node = rcu_dereference_raw(map->root.rb_node);
+    struct calypso_extent *extent, *found = NULL;
+
+    while (node)
+    {
+        extent = rb_entry(node, struct calypso_extent, node);
+        if (virtual_block_nr < READ_ONCE(extent->virtual_start))
+        {
+            found = extent;
+            node = rcu_dereference_raw(node->rb_left);
+        }
+        else
+            node = rcu_dereference_raw(node->rb_right);
+    }
+    return found;
+}
+
+static void calypso_extent_map_insert(struct calypso_extent_map *map, struct calypso_extent *new_extent)
+{
+    struct rb_node **link = &(map->root.rb_node);
+    struct rb_node *parent = NULL;
+    struct calypso_extent *extent;
+
+    while (*link)
+    {
+        parent = *link;
+        extent = rb_entry(parent, struct calypso_extent, node);
+        if (new_extent->virtual_start < extent->virtual_start)
+            link = &(parent->rb_left);
+        else
+            link = &(parent->rb_right);
+    }
+    /* the extent is filled in before lookups can find it */
+    rb_link_node_rcu(&(new_extent->node), parent, link);
+    rb_insert_color(&(new_extent->node), &(map->root));
+    map->nr_extents++;
+}
+
+static void calypso_extent_map_erase(struct calypso_extent_map *map, struct calypso_extent *extent)
+{
+    rb_erase(&(extent->node), &(map->root));
+    map->nr_extents--;
+}
+
+/*
+ * Looks up the physical block of virtual_block_nr. run_len is set to the
+ * number of blocks from virtual_block_nr on that are mapped to consecutive
+ * physical blocks, or, if it is not mapped, to the number of blocks until
+ * the next mapped one.
+ *
+ * Returns 0 if the block is mapped and -1 otherwise
+ */
+int calypso_extent_map_lookup(struct calypso_extent_map *map, unsigned long virtual_block_nr, unsigned long *physical_block_nr, unsigned long *run_len)
+{
+    struct calypso_extent *extent;
+    unsigned long physical, len;
+    unsigned int seq;
+    int ret;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&(map->seq));
+        ret = -1;
+        extent = calypso_extent_map_find_le(map, virtual_block_nr);
+        if (extent && virtual_block_nr < calypso_extent_end(extent))
+        {
+            physical = extent->physical_start + (virtual_block_nr - extent->virtual_start);
+            len = calypso_extent_end(extent) - virtual_block_nr;
+            ret = 0;
+        }
+        else
+        {
+            extent = calypso_extent_map_find_gt(map, virtual_block_nr);
+            len = extent ? extent->virtual_start - virtual_block_nr : ULONG_MAX;
+        }
+    } while (read_seqcount_retry(&(map->seq), seq));
+    rcu_read_unlock();
+
+    if (ret == 0)
+        *physical_block_nr = physical;
+    *run_len = len;
+
+    return ret;
+}
+
+/*
+ * Takes virtual_block_nr out of the extent holding it, splitting the extent
+ * in two if the block is in its middle. spare is used for the second half
+ * and set to NULL if it was consumed
+ */
+static void calypso_extent_map_punch(struct calypso_extent_map *map, struct calypso_extent *extent, unsigned long virtual_block_nr, struct calypso_extent **spare)
+{
+    unsigned long offset = virtual_block_nr - extent->virtual_start;
+    struct calypso_extent *tail;
+
+    if (extent->len == 1)
+    {
+        calypso_extent_map_erase(map, extent);
+        kfree_rcu(extent, rcu);
+    }
+    else if (offset == 0)
+    {
+        /* the key changes, but no other extent starts between the old and new start */
+        extent->virtual_start++;
+        extent->physical_start++;
+        extent->len--;
+    }
+    else if (offset == extent->len - 1)
+    {
+        extent->len--;
+    }
+    else
+    {
+        tail = *spare;
+        *spare = NULL;
+        tail->virtual_start = virtual_block_nr + 1;
+        tail->physical_start = extent->physical_start + offset + 1;
+        tail->len = extent->len - offset - 1;
+        extent->len = offset;
+        calypso_extent_map_insert(map, tail);
+    }
+}
+
+/*
+ * Maps virtual_block_nr to physical_block_nr, splitting the extent it
+ * was in and merging it with its neighbours when they are physically
+ * contiguous. Can be called from bio completion.
+ *
+ * Returns 0 for success and -ENOMEM if the extents could not be allocated,
+ * in which case the previous mapping is kept
+ */
+int calypso_extent_map_set(struct calypso_extent_map *map, unsigned long virtual_block_nr, unsigned long physical_block_nr)
+{
+    struct calypso_extent *extent, *prev, *next;
+    /* a split and an insertion are the most a single update needs */
+    struct calypso_extent *spare[2];
+    struct rb_node *node;
+    unsigned long flags;
+
+    spare[0] = kmalloc(sizeof(struct calypso_extent), GFP_ATOMIC);
+    spare[1] = kmalloc(sizeof(struct calypso_extent), GFP_ATOMIC);
+    if (!spare[0] || !spare[1])
+    {
+        debug_args(KERN_ERR, __func__, "Could not allocate extents to map virtual block %lu\n", virtual_block_nr);
+        kfree(spare[0]);
+        kfree(spare[1]);
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&(map->lock), flags);
+    write_seqcount_begin(&(map->seq));
+
+    extent = calypso_extent_map_find_le(map, virtual_block_nr);
+    if (extent && virtual_block_nr < calypso_extent_end(extent))
+    {
+        if (extent->physical_start + (virtual_block_nr - extent->virtual_start) == physical_block_nr)
+            goto unlock;
+        calypso_extent_map_punch(map, extent, virtual_block_nr, &spare[0]);
+    }
+
+    /* virtual_block_nr is not mapped now, so look for the extents right before and after it */
+    prev = calypso_extent_map_find_le(map, virtual_block_nr);
+    node = prev ? rb_next(&(prev->node)) : rb_first(&(map->root));
+    next = rb_entry_safe(node, struct calypso_extent, node);
+
+    if (prev && calypso_extent_end(prev) != virtual_block_nr)
+        prev = NULL;
+    if (prev && prev->physical_start + prev->len != physical_block_nr)
+        prev = NULL;
+    if (next && (next->virtual_start != virtual_block_nr + 1 || next->physical_start != physical_block_nr + 1))
+        next = NULL;
+
+    if (prev && next)
+    {
+        prev->len += 1 + next->len;
+        calypso_extent_map_erase(map, next);
+        kfree_rcu(next, rcu);
+    }
+    else if (prev)
+    {
+        prev->len++;
+    }
+    else if (next)
+    {
+        next->virtual_start--;
+        next->physical_start--;
+        next->len++;
+    }
+    else
+    {
+        extent = spare[1];
+        spare[1] = NULL;
+        extent->virtual_start = virtual_block_nr;
+        extent->physical_start = physical_block_nr;
+        extent->len = 1;
+        calypso_extent_map_insert(map, extent);
+    }
+
+unlock:
+    write_seqcount_end(&(map->seq));
+    spin_unlock_irqrestore(&(map->lock), flags);
+    kfree(spare[0]);
+    kfree(spare[1]);
+
+    return 0;
+}
+
+/*
+ * Unmaps virtual_block_nr, splitting the extent it was in if needed. Can
+ * be called from bio completion.
+ *
+ * Returns 0 for success and -ENOMEM if the extent could not be split, in
+ * which case the block stays mapped
+ */
+int calypso_extent_map_clear(struct calypso_extent_map *map, unsigned long virtual_block_nr)
+{
+    struct calypso_extent *extent;
+    struct calypso_extent *spare;
+    unsigned long flags;
+
+    spare = kmalloc(sizeof(struct calypso_extent), GFP_ATOMIC);
+    if (!spare)
+    {
+        debug_args(KERN_ERR, __func__, "Could not allocate extent to unmap virtual block %lu\n", virtual_block_nr);
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&(map->lock), flags);
+    write_seqcount_begin(&(map->seq));
+    extent = calypso_extent_map_find_le(map, virtual_block_nr);
+    if (extent && virtual_block_nr < calypso_extent_end(extent))
+        calypso_extent_map_punch(map, extent, virtual_block_nr, &spare);
+    write_seqcount_end(&(map->seq));
+    spin_unlock_irqrestore(&(map->lock), flags);
+
+    kfree(spare);
+    return 0;
+}
+
+size_t calypso_extent_map_memory_bytes(struct calypso_extent_map *map)
+{
+    return map->nr_extents * sizeof(struct calypso_extent);
+}
@@ -0,0 +1,57 @@
+#ifndef EXTENT_MAP_H
+#define EXTENT_MAP_H
+
+#include <linux/types.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+
+
+/*
+ * Run of virtual blocks mapped to consecutive physical blocks:
+ * virtual_start + i -> physical_start + i, for i < len
+ */
+struct calypso_extent {
+    struct rb_node node;
+    unsigned long virtual_start;
+    unsigned long physical_start;
+    unsigned long len;
+    /* lookups may still be walking a removed extent */
+    struct rcu_head rcu;
+};
+
+/*
+ * Virtual to physical block mappings stored as extents ordered by their
+ * first virtual block. Hidden volumes written sequentially need a handful
+ * of extents instead of one entry per block.
+ */
+struct calypso_extent_map {
+    struct rb_root root;
+    /* mappings are updated from bio completion, so the lock needs to be irq safe */
+    spinlock_t lock;
+    /*
+     * Lookups do not take the lock. They walk the tree under RCU and retry
+     * if an update changed it meanwhile
+     */
+    seqcount_t seq;
+    unsigned long nr_extents;
+};
+
+void calypso_extent_map_init(struct calypso_extent_map *map);
+void calypso_extent_map_cleanup(struct calypso_extent_map *map);
+
+int calypso_extent_map_lookup(struct calypso_extent_map *map, unsigned long virtual_block_nr, unsigned long *physical_block_nr, unsigned long *run_len);
+int calypso_extent_map_set(struct calypso_extent_map *map, unsigned long virtual_block_nr, unsigned long physical_block_nr);
+int calypso_extent_map_clear(struct calypso_extent_map *map, unsigned long virtual_block_nr);
+
+size_t calypso_extent_map_memory_bytes(struct calypso_extent_map *map);
+
+/* Only safe while no mappings are being updated, e.g. when encoding metadata on cleanup */
+#define calypso_extent_map_for_each(map, extent) \
+    for (extent = rb_entry_safe(rb_first(&(map)->root), struct calypso_extent, node); \
+        extent; \
+        extent = rb_entry_safe(rb_next(&(extent)->node), struct calypso_extent, node))
+
+
+#endif
@@ -177,7 +177,7 @@ unsigned long calypso_get_physical_block_count(struct calypso_blk_device *calyps
  * This function iterates through each of those
  * block bitmaps
  */
-void calypso_iterate_set_regions_bitmap(const unsigned long *orig_bitmap, unsigned long *res_bitmap, unsigned int nbits, ext4_fsblk_t block_offset)
+void calypso_iterate_set_regions_bitmap(const unsigned long *orig_bitmap, struct calypso_block_state *block_state, unsigned int nbits, ext4_fsblk_t block_offset)
 {
 	unsigned int rs, re, start = 0; /* region start, region end */
 	unsigned int set_nbits;
@@ -185,11 +185,11 @@ void calypso_iterate_set_regions_bitmap(const unsigned long *orig_bitmap, unsign
 	{
 		set_nbits = re - rs;
 		//debug_args(KERN_DEBUG, __func__, "rs : %lu; re: %lu; start: %lu; nbits: %lu; set_nbits: %lu\n", block_offset + rs, block_offset + re, start, nbits, set_nbits);
-		bitmap_set(res_bitmap, block_offset + rs, set_nbits);
+		calypso_block_state_set_range(block_state, block_offset + rs, set_nbits, CALYPSO_BLOCK_HOST_USED);
 	}
 }
 
-void calypso_bitmap_helper(const char *ptr, unsigned long *res_bitmap, unsigned int numchars, ext4_fsblk_t block_offset)
+void calypso_bitmap_helper(const char *ptr, struct calypso_block_state *block_state, unsigned int numchars, ext4_fsblk_t block_offset)
 {
 	size_t longs;
 	const unsigned char *orig_bitmap = ptr;
@@ -198,7 +198,7 @@ void calypso_bitmap_helper(const char *ptr, unsigned long *res_bitmap, unsigned
 	if (longs) {
 		BUG_ON(longs >= INT_MAX / BITS_PER_LONG);
 		calypso_iterate_set_regions_bitmap((unsigned long *)orig_bitmap, 
-				res_bitmap,
+				block_state,
 				longs * BITS_PER_LONG,
 				block_offset);
 		numchars -= longs * sizeof(long);
@@ -230,7 +230,7 @@ void calypso_get_fs_blocks_bitmap(struct calypso_blk_device *calypso_dev)
 
 		block_offset = ext4_group_first_block_no(calypso_dev->physical_super_block, i);
 		calypso_bitmap_helper(bitmap_bh->b_data,
-					calypso_dev->physical_blocks_bitmap,
+					&(calypso_dev->block_state),
 				    bits_per_group ,
 					block_offset);
 		//calypso_iterate_each_bitmap((unsigned long *)bitmap_bh, bitmap, block_offset);
@@ -24,7 +24,7 @@ void calypso_copy_block(struct block_device *physical_dev, unsigned long from_bl
 void calypso_print_free_blocks_bitmap(struct block_device *physical_dev, unsigned int nblocks, unsigned long *bitmap);
 
 void calypso_iterate_each_bitmap(const unsigned long *orig_bitmap, unsigned long *res_bitmap, unsigned int nbits, ext4_fsblk_t block_offset);
-void calypso_bitmap_helper(const char *ptr, unsigned long *res_bitmap, unsigned int numchars, ext4_fsblk_t block_offset);
+void calypso_bitmap_helper(const char *ptr, struct calypso_block_state *block_state, unsigned int numchars, ext4_fsblk_t block_offset);
 void calypso_get_fs_blocks_bitmap(struct calypso_blk_device *calypso_dev);
 
 unsigned int calypso_iterate_partition_blocks_groups(struct block_device *physical_dev);
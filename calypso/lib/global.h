@@ -1,6 +1,7 @@
 #ifndef GLOBAL_H
 #define GLOBAL_H
 
+#include <linux/types.h>
 
 #define CALYPSO_DEV_NAME "calypso"
 
@@ -13,6 +14,8 @@
 
 #define DISK_SECTOR_SIZE 512
 #define KERNEL_SECTOR_SIZE 512
+/* Blocks of the Calypso device, the same as the blocks of the native ext4 partition */
+#define CALYPSO_BLOCK_SIZE 4096
 
 // TODO: check if max unsigned long value is 4294967295 or 18446744073709551615
 // -1 in unsigned long is 18446744073709551615, but I am afraid some things stop working, chane after tests
@@ -20,5 +23,47 @@
 
 #define BLOCKS_IN_A_GB 262144
 
+/* Marks the bios Calypso sends to the physical device, so the hook lets them through */
+#define __REQ_CALYPSO   29
+#define REQ_CALYPSO		(1ULL << __REQ_CALYPSO)
+
+/* Marks host bios the hook already counted, which come back through it after being held */
+#define __REQ_CALYPSO_COUNTED   30
+#define REQ_CALYPSO_COUNTED		(1ULL << __REQ_CALYPSO_COUNTED)
+
+/*
+ * Entries of the virtual to physical and metadata to physical mappings.
+ * 32 bits address native partitions of up to 16 TiB with 4 KiB blocks and
+ * halve the memory taken by the mappings; build with
+ * CALYPSO_64BIT_MAPPINGS=1 for bigger partitions
+ */
+#ifdef CALYPSO_64BIT_MAPPINGS
+typedef u64 calypso_block_t;
+#else
+typedef u32 calypso_block_t;
+#endif
+
+/* 
+ * Value of entries that do not map to any physical block. It is bigger than
+ * any valid block number, so a single comparison with the number of physical
+ * blocks tells if an entry is mapped
+ */
+#define CALYPSO_UNMAPPED ((calypso_block_t)~0)
+
+/*
+ * Stands for a block of a request that needs no physical block, e.g. one
+ * written with zeros, which is left unmapped. Never stored in the mappings
+ */
+#define CALYPSO_ZERO_BLOCK ((calypso_block_t)~0 - 1)
+
+/*
+ * Stands for a block of a request served by the block cache, without I/O.
+ * The lowest of these values, so physical devices need fewer blocks
+ */
+#define CALYPSO_CACHED_BLOCK ((calypso_block_t)~0 - 2)
+
+/* Hexadecimal characters taken by each mapping in the hidden metadata */
+#define CALYPSO_MAPPING_STR_LEN (2 * sizeof(calypso_block_t))
+
 
 #endif
\ No newline at end of file
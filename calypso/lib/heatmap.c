@@ -0,0 +1,134 @@
+/*
+ * Host write heatmap used to place Calypso blocks where the native
+ * file system is less likely to overwrite them
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+
+#include "debug.h"
+#include "heatmap.h"
+
+
+int calypso_heatmap_init(struct calypso_heatmap *heatmap, unsigned long nr_groups, unsigned long blocks_per_group)
+{
+    if (nr_groups == 0 || blocks_per_group == 0)
+    {
+        debug(KERN_ERR, __func__, "Physical device has no block groups\n");
+        return -EINVAL;
+    }
+
+    heatmap->group_writes = kcalloc(nr_groups, sizeof(atomic_t), GFP_KERNEL);
+    if (!heatmap->group_writes)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate memory for host write heatmap\n");
+        return -ENOMEM;
+    }
+    heatmap->nr_groups = nr_groups;
+    heatmap->blocks_per_group = blocks_per_group;
+    atomic_long_set(&heatmap->total_writes, 0);
+    atomic_set(&heatmap->writes_since_decay, 0);
+    atomic_long_set(&heatmap->frontier_group, 0);
+    heatmap->next_group = 0;
+
+    debug_args(KERN_DEBUG, __func__, "Tracking host writes in %lu groups of %lu blocks\n", nr_groups, blocks_per_group);
+    return 0;
+}
+
+void calypso_heatmap_cleanup(struct calypso_heatmap *heatmap)
+{
+    if (heatmap->group_writes)
+    {
+        kfree(heatmap->group_writes);
+        heatmap->group_writes = NULL;
+    }
+}
+
+static void calypso_heatmap_decay(struct calypso_heatmap *heatmap)
+{
+    unsigned long group;
+
+    /* Races with concurrent increments only lose a few writes, which is fine for a heuristic */
+    for (group = 0; group < heatmap->nr_groups; group++)
+        atomic_set(&heatmap->group_writes[group], atomic_read(&heatmap->group_writes[group]) >> 1);
+    atomic_long_set(&heatmap->total_writes, atomic_long_read(&heatmap->total_writes) >> 1);
+}
+
+/*
+ * Called from the hook on the physical device for every host write,
+ * so it only does a couple of atomic operations
+ */
+void calypso_heatmap_record_write(struct calypso_heatmap *heatmap, unsigned long physical_block_nr, unsigned int nr_blocks)
+{
+    unsigned long group = physical_block_nr / heatmap->blocks_per_group;
+
+    if (!heatmap->group_writes || group >= heatmap->nr_groups)
+        return;
+
+    atomic_add(nr_blocks, &heatmap->group_writes[group]);
+    atomic_long_add(nr_blocks, &heatmap->total_writes);
+    atomic_long_set(&heatmap->frontier_group, group);
+
+    /* Only the writer that crosses the threshold does the decay */
+    if (atomic_add_return(nr_blocks, &heatmap->writes_since_decay) >= CALYPSO_HEATMAP_DECAY_WRITES
+        && atomic_xchg(&heatmap->writes_since_decay, 0) >= CALYPSO_HEATMAP_DECAY_WRITES)
+    {
+        calypso_heatmap_decay(heatmap);
+    }
+}
+
+static bool calypso_heatmap_is_near_frontier(unsigned long group, unsigned long frontier)
+{
+    unsigned long distance = group > frontier ? group - frontier : frontier - group;
+
+    return distance <= CALYPSO_HEATMAP_FRONTIER_GROUPS;
+}
+
+/*
+ * Same contract as calypso_get_next_free_block(), but prefers free blocks in
+ * groups that received at most the average amount of host writes and that are
+ * away from the host's allocation frontier. If no such block is found within
+ * CALYPSO_HEATMAP_MAX_GROUPS_SCANNED groups, the first free block is returned.
+ *
+ * Returns 0 for success and -1 if there are no free blocks
+ */
+int calypso_heatmap_get_next_free_block(struct calypso_heatmap *heatmap, struct calypso_block_state *block_state, unsigned long last_block, unsigned long *free_block)
+{
+    unsigned long i, group, first, end, block;
+    unsigned long scanned = min(heatmap->nr_groups, (unsigned long)CALYPSO_HEATMAP_MAX_GROUPS_SCANNED);
+    unsigned long frontier = atomic_long_read(&heatmap->frontier_group);
+    unsigned long average = atomic_long_read(&heatmap->total_writes) / heatmap->nr_groups;
+
+    for (i = 0; i < scanned; i++)
+    {
+        group = (heatmap->next_group + i) % heatmap->nr_groups;
+        if (atomic_read(&heatmap->group_writes[group]) > average)
+            continue;
+        if (calypso_heatmap_is_near_frontier(group, frontier))
+            continue;
+
+        first = group * heatmap->blocks_per_group;
+        if (first >= last_block)
+            continue;
+        end = min(first + heatmap->blocks_per_group, last_block);
+
+        block = calypso_block_state_find_next(block_state, first, end, CALYPSO_BLOCK_FREE_HIGH_ENTROPY);
+        if (block < end)
+        {
+            /* keep allocating from this group while it stays cold */
+            heatmap->next_group = group;
+            *free_block = block;
+            return 0;
+        }
+    }
+    /* Next search starts on groups we have not looked at yet */
+    heatmap->next_group = (heatmap->next_group + scanned) % heatmap->nr_groups;
+
+    block = calypso_block_state_find_next(block_state, 0, last_block, CALYPSO_BLOCK_FREE_HIGH_ENTROPY);
+    if (block >= last_block)
+    {
+        debug(KERN_ERR, __func__, "Could not find next free block\n");
+        return -1;
+    }
+    *free_block = block;
+    return 0;
+}
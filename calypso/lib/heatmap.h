@@ -0,0 +1,52 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+
+#include "block_state.h"
+
+
+/*
+ * After this many host writes every group counter is halved, so the heatmap
+ * follows what the native file system is writing to lately instead of
+ * accumulating its whole history
+ */
+#define CALYPSO_HEATMAP_DECAY_WRITES 65536
+
+/* Groups this close to the group the host last wrote to are not used for Calypso data */
+#define CALYPSO_HEATMAP_FRONTIER_GROUPS 2
+
+/* Bounds the work done by a single allocation before falling back to a linear search */
+#define CALYPSO_HEATMAP_MAX_GROUPS_SCANNED 64
+
+/*
+ * Per block group count of the host writes seen by the hook on the
+ * physical device. Calypso blocks placed in hot groups, or right next to
+ * where the host is currently allocating, are the ones most likely to be
+ * overwritten and thus relocated.
+ */
+struct calypso_heatmap {
+    atomic_t *group_writes;
+    unsigned long nr_groups;
+    unsigned long blocks_per_group;
+
+    /* sum of group_writes, decayed with them */
+    atomic_long_t total_writes;
+    /* host writes since the last decay */
+    atomic_t writes_since_decay;
+    /* last block group the host wrote to */
+    atomic_long_t frontier_group;
+    /* where the next search for a cold group starts */
+    unsigned long next_group;
+};
+
+int calypso_heatmap_init(struct calypso_heatmap *heatmap, unsigned long nr_groups, unsigned long blocks_per_group);
+void calypso_heatmap_cleanup(struct calypso_heatmap *heatmap);
+
+void calypso_heatmap_record_write(struct calypso_heatmap *heatmap, unsigned long physical_block_nr, unsigned int nr_blocks);
+
+int calypso_heatmap_get_next_free_block(struct calypso_heatmap *heatmap, struct calypso_block_state *block_state, unsigned long last_block, unsigned long *free_block);
+
+
+#endif
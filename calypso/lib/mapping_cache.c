@@ -0,0 +1,855 @@
+/*
+ * Demand paged virtual to physical block mappings
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/ktime.h>
+#include <linux/blkdev.h>
+
+#include "debug.h"
+#include "mapping_cache.h"
+
+
+static struct calypso_mapping_page *calypso_mapping_page_alloc(struct calypso_mapping_cache *cache, unsigned long page_nr)
+{
+    struct calypso_mapping_page *page;
+
+    page = kzalloc(sizeof(struct calypso_mapping_page), GFP_ATOMIC);
+    if (!page)
+        return NULL;
+
+    page->entries = (calypso_block_t *)__get_free_page(GFP_ATOMIC);
+    if (!page->entries)
+    {
+        kfree(page);
+        return NULL;
+    }
+    page->cache = cache;
+    page->page_nr = page_nr;
+    INIT_LIST_HEAD(&(page->lru));
+    INIT_LIST_HEAD(&(page->work_list));
+    INIT_LIST_HEAD(&(page->pending_updates));
+    bio_list_init(&(page->waiting));
+
+    return page;
+}
+
+static void calypso_mapping_page_free(struct calypso_mapping_page *page)
+{
+    struct calypso_mapping_update *update, *tmp;
+
+    list_for_each_entry_safe(update, tmp, &(page->pending_updates), list)
+        kfree(update);
+    free_page((unsigned long)page->entries);
+    kfree(page);
+}
+
+static void calypso_mapping_page_free_rcu(struct rcu_head *rcu)
+{
+    calypso_mapping_page_free(container_of(rcu, struct calypso_mapping_page, rcu));
+}
+
+/* Called with the lock held, once the page is out of the LRU */
+static void calypso_mapping_cache_drop_page(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page)
+{
+    xa_erase(&(cache->pages), page->page_nr);
+    /* lookups of unpinned pages may still be reading it */
+    call_rcu(&(page->rcu), calypso_mapping_page_free_rcu);
+}
+
+static void calypso_mapping_cache_mark_uptodate(struct calypso_mapping_page *page)
+{
+    /* entries need to be visible before lookups see the page as up to date */
+    smp_mb__before_atomic();
+    set_bit(CALYPSO_PAGE_UPTODATE, &(page->flags));
+}
+
+/*
+ * Called with the lock held whenever a page is used. A page that was
+ * evicted but not written back yet goes back to the LRU, and the worker
+ * leaves it alone
+ */
+static void calypso_mapping_cache_touch(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page)
+{
+    if (test_and_clear_bit(CALYPSO_PAGE_EVICTING, &(page->flags)))
+    {
+        list_add_tail(&(page->lru), &(cache->lru));
+        cache->nr_resident++;
+    }
+    else
+        list_move_tail(&(page->lru), &(cache->lru));
+}
+
+/*
+ * Called with the lock held. Takes least recently used pages out of memory
+ * until the cache is within its limit. Clean pages are freed right away
+ * and dirty ones are handed to the worker to be written back first.
+ *
+ * Returns true if the worker needs to run
+ */
+static bool calypso_mapping_cache_shrink(struct calypso_mapping_cache *cache)
+{
+    struct calypso_mapping_page *page, *tmp;
+    bool queued = false;
+
+    list_for_each_entry_safe(page, tmp, &(cache->lru), lru)
+    {
+        if (cache->nr_resident <= cache->max_resident)
+            break;
+        /* in use or still being read */
+        if (page->pins || !test_bit(CALYPSO_PAGE_UPTODATE, &(page->flags)))
+            continue;
+
+        list_del_init(&(page->lru));
+        cache->nr_resident--;
+        if (test_bit(CALYPSO_PAGE_DIRTY, &(page->flags)))
+        {
+            set_bit(CALYPSO_PAGE_EVICTING, &(page->flags));
+            if (list_empty(&(page->work_list)))
+                list_add_tail(&(page->work_list), &(cache->evicted));
+            queued = true;
+        }
+        else
+            calypso_mapping_cache_drop_page(cache, page);
+    }
+    return queued;
+}
+
+/*
+ * Called with the lock held. Adds a page to the cache, which is ready to
+ * use if it was never written, and otherwise needs to be read from
+ * *stored_block, which is set to CALYPSO_UNMAPPED in the first case
+ */
+static struct calypso_mapping_page *calypso_mapping_cache_add_page(struct calypso_mapping_cache *cache, unsigned long page_nr, calypso_block_t *stored_block)
+{
+    struct calypso_mapping_page *page;
+    unsigned long i;
+
+    page = calypso_mapping_page_alloc(cache, page_nr);
+    if (!page)
+        return NULL;
+
+    if (xa_is_err(xa_store(&(cache->pages), page_nr, page, GFP_ATOMIC)))
+    {
+        calypso_mapping_page_free(page);
+        return NULL;
+    }
+    list_add_tail(&(page->lru), &(cache->lru));
+    cache->nr_resident++;
+
+    *stored_block = cache->directory[page_nr];
+    if (*stored_block == CALYPSO_UNMAPPED)
+    {
+        for (i = 0; i < CALYPSO_MAPPING_PAGE_ENTRIES; i++)
+            page->entries[i] = CALYPSO_UNMAPPED;
+        calypso_mapping_cache_mark_uptodate(page);
+    }
+    return page;
+}
+
+static void calypso_mapping_cache_read_end_io(struct bio *bio)
+{
+    struct calypso_mapping_page *page = bio->bi_private;
+    struct calypso_mapping_cache *cache = page->cache;
+    unsigned long flags;
+
+    page->io_status = bio->bi_status;
+    bio_put(bio);
+
+    /* decryption sleeps, so it is left to the worker */
+    spin_lock_irqsave(&(cache->lock), flags);
+    list_add_tail(&(page->work_list), &(cache->loaded));
+    spin_unlock_irqrestore(&(cache->lock), flags);
+    queue_work(cache->wq, &(cache->work));
+}
+
+/* Starts reading a page from the block it is stored in, the worker finishes it. Can sleep */
+static void calypso_mapping_cache_read_page(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page, unsigned long block)
+{
+    struct bio *bio;
+    unsigned long flags;
+
+    page->fault_start_ns = ktime_get_ns();
+    page->io_page = alloc_page(GFP_NOIO);
+    bio = bio_alloc(GFP_NOIO, 1);
+    if (!page->io_page || !bio)
+    {
+        debug_args(KERN_ERR, __func__, "Could not allocate read of mapping page %lu\n", page->page_nr);
+        if (bio)
+            bio_put(bio);
+        page->io_status = BLK_STS_RESOURCE;
+        spin_lock_irqsave(&(cache->lock), flags);
+        list_add_tail(&(page->work_list), &(cache->loaded));
+        spin_unlock_irqrestore(&(cache->lock), flags);
+        queue_work(cache->wq, &(cache->work));
+        return;
+    }
+
+    bio_set_dev(bio, cache->physical_dev);
+    bio->bi_iter.bi_sector = block * 8;
+    bio->bi_opf = REQ_OP_READ | REQ_CALYPSO;
+    bio_add_page(bio, page->io_page, PAGE_SIZE, 0);
+    bio->bi_private = page;
+    bio->bi_end_io = calypso_mapping_cache_read_end_io;
+    submit_bio(bio);
+}
+
+/* Resubmits the bios that waited for a page, or fails them if it could not be read */
+static void calypso_mapping_cache_resume(struct bio_list *waiting, blk_status_t status)
+{
+    struct bio *bio;
+
+    while ((bio = bio_list_pop(waiting)))
+    {
+        if (status != BLK_STS_OK)
+        {
+            bio->bi_status = status;
+            bio_endio(bio);
+        }
+        else
+            generic_make_request(bio);
+    }
+}
+
+/*
+ * Runs in the worker once a page was read: decrypts it, applies the
+ * updates that arrived meanwhile and lets the bios waiting for it go on
+ */
+static void calypso_mapping_cache_finish_read(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page)
+{
+    struct calypso_mapping_update *update, *tmp;
+    struct bio_list waiting;
+    blk_status_t status = page->io_status;
+    unsigned long flags;
+
+    if (status == BLK_STS_OK)
+        calypso_decrypt_block(cache->cipher, page_address(page->io_page), (u8 *)page->entries, cache->key);
+    if (page->io_page)
+        __free_page(page->io_page);
+    page->io_page = NULL;
+
+    atomic64_inc(&(cache->faults));
+    atomic64_add(ktime_get_ns() - page->fault_start_ns, &(cache->fault_ns));
+
+    bio_list_init(&waiting);
+    spin_lock_irqsave(&(cache->lock), flags);
+    bio_list_merge(&waiting, &(page->waiting));
+    bio_list_init(&(page->waiting));
+    if (status == BLK_STS_OK)
+    {
+        list_for_each_entry_safe(update, tmp, &(page->pending_updates), list)
+        {
+            page->entries[update->virtual_block_nr % CALYPSO_MAPPING_PAGE_ENTRIES] = update->physical_block_nr;
+            set_bit(CALYPSO_PAGE_DIRTY, &(page->flags));
+            list_del(&(update->list));
+            kfree(update);
+        }
+        calypso_mapping_cache_mark_uptodate(page);
+    }
+    else
+    {
+        debug_args(KERN_ERR, __func__, "Could not read mapping page %lu, its pending updates are lost\n", page->page_nr);
+        /* the next request needing it reads it again */
+        list_del_init(&(page->lru));
+        cache->nr_resident--;
+        calypso_mapping_cache_drop_page(cache, page);
+    }
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    calypso_mapping_cache_resume(&waiting, status);
+}
+
+static int calypso_mapping_cache_sync_io(struct calypso_mapping_cache *cache, struct page *io_page, unsigned long block, unsigned int op)
+{
+    struct bio *bio;
+    int ret;
+
+    bio = bio_alloc(GFP_NOIO, 1);
+    if (!bio)
+        return -ENOMEM;
+
+    bio_set_dev(bio, cache->physical_dev);
+    bio->bi_iter.bi_sector = block * 8;
+    bio->bi_opf = op | REQ_CALYPSO;
+    bio_add_page(bio, io_page, PAGE_SIZE, 0);
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+
+    return ret;
+}
+
+/*
+ * Writes a page to a newly claimed block and only then gives up the one it
+ * was stored in, so a stored copy of the page exists at all times. The
+ * hook sees the new block as Calypso's from before it is written.
+ *
+ * Returns 0 for success and a negative error code otherwise, in which case
+ * the page is left dirty
+ */
+static int calypso_mapping_cache_write_page(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page)
+{
+    struct page *io_page;
+    unsigned long block = 0;
+    calypso_block_t old_block;
+    unsigned long flags;
+    int ret;
+
+    io_page = alloc_page(GFP_NOIO);
+    if (!io_page)
+        return -ENOMEM;
+
+    if (cache->claim_block(&block) != 0)
+    {
+        debug_args(KERN_ERR, __func__, "No free block to write mapping page %lu\n", page->page_nr);
+        __free_page(io_page);
+        return -ENOSPC;
+    }
+
+    /* updates from now on make the page dirty again */
+    spin_lock_irqsave(&(cache->lock), flags);
+    clear_bit(CALYPSO_PAGE_DIRTY, &(page->flags));
+    memcpy(page_address(io_page), page->entries, PAGE_SIZE);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    calypso_encrypt_block(cache->cipher, page_address(io_page), page_address(io_page), cache->key);
+
+    ret = calypso_reverse_index_set(cache->reverse_index, block, CALYPSO_TABLE_PAGE_TAG | page->page_nr);
+    if (ret == 0)
+        ret = calypso_mapping_cache_sync_io(cache, io_page, block, REQ_OP_WRITE);
+    __free_page(io_page);
+    if (ret != 0)
+    {
+        debug_args(KERN_ERR, __func__, "Could not write mapping page %lu\n", page->page_nr);
+        calypso_reverse_index_clear(cache->reverse_index, block);
+        cache->release_block(block);
+        set_bit(CALYPSO_PAGE_DIRTY, &(page->flags));
+        return ret;
+    }
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    old_block = cache->directory[page->page_nr];
+    cache->directory[page->page_nr] = block;
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    /* unmapped if the host took the old block while this was being written */
+    if (old_block != CALYPSO_UNMAPPED)
+    {
+        calypso_reverse_index_clear(cache->reverse_index, old_block);
+        cache->release_block(old_block);
+    }
+    atomic64_inc(&(cache->writebacks));
+
+    return 0;
+}
+
+static void calypso_mapping_cache_work(struct work_struct *work)
+{
+    struct calypso_mapping_cache *cache = container_of(work, struct calypso_mapping_cache, work);
+    struct calypso_mapping_page *page;
+    unsigned long block;
+    unsigned long flags;
+    int ret;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    while (!list_empty(&(cache->faulted)))
+    {
+        page = list_first_entry(&(cache->faulted), struct calypso_mapping_page, work_list);
+        list_del_init(&(page->work_list));
+        /* pages are only written back once they were read, so this is still where it is stored */
+        block = cache->directory[page->page_nr];
+        spin_unlock_irqrestore(&(cache->lock), flags);
+
+        calypso_mapping_cache_read_page(cache, page, block);
+
+        spin_lock_irqsave(&(cache->lock), flags);
+    }
+
+    while (!list_empty(&(cache->loaded)))
+    {
+        page = list_first_entry(&(cache->loaded), struct calypso_mapping_page, work_list);
+        list_del_init(&(page->work_list));
+        spin_unlock_irqrestore(&(cache->lock), flags);
+
+        calypso_mapping_cache_finish_read(cache, page);
+
+        spin_lock_irqsave(&(cache->lock), flags);
+    }
+
+    while (!list_empty(&(cache->evicted)))
+    {
+        page = list_first_entry(&(cache->evicted), struct calypso_mapping_page, work_list);
+        list_del_init(&(page->work_list));
+        /* used again after it was evicted */
+        if (!test_bit(CALYPSO_PAGE_EVICTING, &(page->flags)))
+            continue;
+        spin_unlock_irqrestore(&(cache->lock), flags);
+
+        ret = calypso_mapping_cache_write_page(cache, page);
+
+        spin_lock_irqsave(&(cache->lock), flags);
+        if (ret != 0)
+        {
+            /* keep it in memory, it is tried again on its next eviction */
+            calypso_mapping_cache_touch(cache, page);
+            continue;
+        }
+        /* not used while it was written, and not evicted again either */
+        if (test_bit(CALYPSO_PAGE_EVICTING, &(page->flags)) && list_empty(&(page->work_list)))
+            calypso_mapping_cache_drop_page(cache, page);
+    }
+    spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+/*
+ * Pins the mapping pages of nr_blocks blocks from virtual_block_nr until
+ * calypso_mapping_cache_put_range(). If one of them is not in memory, no
+ * page is kept pinned, the bio waits for it to be read and is resubmitted
+ * afterwards, and -EAGAIN is returned. Without a bio, the read is only
+ * started and the caller tries again later. Can also return -ENOMEM
+ */
+int calypso_mapping_cache_get_range(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks, struct bio *bio)
+{
+    struct calypso_mapping_page *page;
+    unsigned long first_page, last_page, page_nr, i;
+    calypso_block_t stored_block = CALYPSO_UNMAPPED;
+    /* bios resubmitted after waiting for a page were already counted as a miss */
+    bool resubmitted = bio && (bio->bi_opf & REQ_CALYPSO);
+    bool queued;
+    unsigned long flags;
+    int ret = 0;
+
+    if (nr_blocks == 0 || virtual_block_nr >= cache->virtual_nr_blocks)
+        return 0;
+    first_page = virtual_block_nr / CALYPSO_MAPPING_PAGE_ENTRIES;
+    last_page = (min(virtual_block_nr + nr_blocks, cache->virtual_nr_blocks) - 1) / CALYPSO_MAPPING_PAGE_ENTRIES;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    for (page_nr = first_page; page_nr <= last_page; page_nr++)
+    {
+        page = xa_load(&(cache->pages), page_nr);
+        if (!page)
+        {
+            page = calypso_mapping_cache_add_page(cache, page_nr, &stored_block);
+            if (!page)
+            {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+        else
+            calypso_mapping_cache_touch(cache, page);
+
+        if (!test_bit(CALYPSO_PAGE_UPTODATE, &(page->flags)))
+        {
+            if (bio)
+            {
+                bio->bi_opf |= REQ_CALYPSO;
+                bio_list_add(&(page->waiting), bio);
+            }
+            ret = -EAGAIN;
+            break;
+        }
+        page->pins++;
+    }
+
+    if (ret != 0)
+    {
+        for (i = first_page; i < page_nr; i++)
+            ((struct calypso_mapping_page *)xa_load(&(cache->pages), i))->pins--;
+    }
+    /* only once the pages are pinned, so none of them is evicted */
+    queued = calypso_mapping_cache_shrink(cache);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    if (queued)
+        queue_work(cache->wq, &(cache->work));
+    if (ret == -EAGAIN)
+    {
+        if (!resubmitted)
+            atomic64_inc(&(cache->misses));
+        /* only the request that added the page reads it, the others just wait */
+        if (stored_block != CALYPSO_UNMAPPED)
+            calypso_mapping_cache_read_page(cache, page, stored_block);
+    }
+    else if (ret == 0 && !resubmitted)
+        atomic64_inc(&(cache->hits));
+
+    return ret;
+}
+
+/*
+ * Whether none of nr_blocks blocks from virtual_block_nr is mapped, as far
+ * as can be told without reading any page: pages that were never written
+ * have no mappings, and pages in memory are checked entry by entry.
+ * Pages only on disk may have mappings, so they make it return false
+ */
+bool calypso_mapping_cache_is_range_unmapped(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    struct calypso_mapping_page *page;
+    unsigned long end, i;
+    unsigned long flags;
+    bool unmapped = true;
+
+    end = min(virtual_block_nr + nr_blocks, cache->virtual_nr_blocks);
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    for (i = virtual_block_nr; unmapped && i < end; i++)
+    {
+        page = xa_load(&(cache->pages), i / CALYPSO_MAPPING_PAGE_ENTRIES);
+        if (page && test_bit(CALYPSO_PAGE_UPTODATE, &(page->flags)))
+            unmapped = page->entries[i % CALYPSO_MAPPING_PAGE_ENTRIES] == CALYPSO_UNMAPPED;
+        else if (page)
+            unmapped = false;
+        /* the whole page is unmapped, so skip the rest of it */
+        else if (cache->directory[i / CALYPSO_MAPPING_PAGE_ENTRIES] == CALYPSO_UNMAPPED)
+            i = round_up(i + 1, CALYPSO_MAPPING_PAGE_ENTRIES) - 1;
+        else
+            unmapped = false;
+    }
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    return unmapped;
+}
+
+void calypso_mapping_cache_put_range(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    struct calypso_mapping_page *page;
+    unsigned long first_page, last_page, page_nr;
+    bool queued;
+    unsigned long flags;
+
+    if (nr_blocks == 0 || virtual_block_nr >= cache->virtual_nr_blocks)
+        return;
+    first_page = virtual_block_nr / CALYPSO_MAPPING_PAGE_ENTRIES;
+    last_page = (min(virtual_block_nr + nr_blocks, cache->virtual_nr_blocks) - 1) / CALYPSO_MAPPING_PAGE_ENTRIES;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    for (page_nr = first_page; page_nr <= last_page; page_nr++)
+    {
+        page = xa_load(&(cache->pages), page_nr);
+        page->pins--;
+    }
+    /* pages pinned when the cache was full could not be evicted then */
+    queued = calypso_mapping_cache_shrink(cache);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    if (queued)
+        queue_work(cache->wq, &(cache->work));
+}
+
+/*
+ * Maps virtual_block_nr to physical_block_nr. If the page is being read, or
+ * not in memory at all, the update is kept until it is read. Never sleeps,
+ * so it can be called from bio completion or with other locks held.
+ * A page that has to be read is returned in *fault, for the caller to
+ * start its read with calypso_mapping_cache_read_fault() or
+ * calypso_mapping_cache_queue_fault() once it dropped its locks. Without
+ * fault, the read is left to the worker.
+ *
+ * Returns 0 for success and -ENOMEM otherwise
+ */
+int calypso_mapping_cache_set(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr, unsigned long physical_block_nr, struct calypso_mapping_page **fault)
+{
+    struct calypso_mapping_page *page;
+    struct calypso_mapping_update *update;
+    unsigned long page_nr = virtual_block_nr / CALYPSO_MAPPING_PAGE_ENTRIES;
+    calypso_block_t stored_block = CALYPSO_UNMAPPED;
+    bool queued = false;
+    unsigned long flags;
+
+    if (fault)
+        *fault = NULL;
+
+    update = kmalloc(sizeof(struct calypso_mapping_update), GFP_ATOMIC);
+    if (!update)
+        return -ENOMEM;
+    update->virtual_block_nr = virtual_block_nr;
+    update->physical_block_nr = physical_block_nr;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    page = xa_load(&(cache->pages), page_nr);
+    if (!page)
+    {
+        page = calypso_mapping_cache_add_page(cache, page_nr, &stored_block);
+        if (!page)
+        {
+            spin_unlock_irqrestore(&(cache->lock), flags);
+            kfree(update);
+            return -ENOMEM;
+        }
+    }
+    else
+        calypso_mapping_cache_touch(cache, page);
+
+    if (test_bit(CALYPSO_PAGE_UPTODATE, &(page->flags)))
+    {
+        WRITE_ONCE(page->entries[virtual_block_nr % CALYPSO_MAPPING_PAGE_ENTRIES], physical_block_nr);
+        set_bit(CALYPSO_PAGE_DIRTY, &(page->flags));
+        kfree(update);
+    }
+    else
+        list_add_tail(&(update->list), &(page->pending_updates));
+    /* only the update that added the page has it read */
+    if (stored_block != CALYPSO_UNMAPPED && fault)
+        *fault = page;
+    else if (stored_block != CALYPSO_UNMAPPED)
+    {
+        list_add_tail(&(page->work_list), &(cache->faulted));
+        queued = true;
+    }
+    queued |= calypso_mapping_cache_shrink(cache);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    if (queued)
+        queue_work(cache->wq, &(cache->work));
+
+    return 0;
+}
+
+/* Starts the read of a page calypso_mapping_cache_set() returned. Can sleep */
+void calypso_mapping_cache_read_fault(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page)
+{
+    unsigned long block;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    block = cache->directory[page->page_nr];
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    calypso_mapping_cache_read_page(cache, page, block);
+}
+
+/* Leaves the read of a page calypso_mapping_cache_set() returned to the worker, from where it cannot sleep */
+void calypso_mapping_cache_queue_fault(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    list_add_tail(&(page->work_list), &(cache->faulted));
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    queue_work(cache->wq, &(cache->work));
+}
+
+/*
+ * The host is about to overwrite physical_block_nr, which stores page_nr.
+ * The block is given up and the page made dirty so it is written somewhere
+ * else, which needs the page in memory first.
+ *
+ * Returns 0 if the host bio can go on, and -EAGAIN if it waits for the page
+ * to be read and is resubmitted afterwards
+ */
+int calypso_mapping_cache_evacuate(struct calypso_mapping_cache *cache, unsigned long page_nr, unsigned long physical_block_nr, struct bio *bio)
+{
+    struct calypso_mapping_page *page;
+    calypso_block_t stored_block = CALYPSO_UNMAPPED;
+    bool queued = false;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    /* the page was written somewhere else meanwhile */
+    if (page_nr >= cache->nr_pages || cache->directory[page_nr] != physical_block_nr)
+    {
+        spin_unlock_irqrestore(&(cache->lock), flags);
+        return 0;
+    }
+
+    page = xa_load(&(cache->pages), page_nr);
+    if (page && test_bit(CALYPSO_PAGE_UPTODATE, &(page->flags)))
+    {
+        calypso_mapping_cache_touch(cache, page);
+        set_bit(CALYPSO_PAGE_DIRTY, &(page->flags));
+        cache->directory[page_nr] = CALYPSO_UNMAPPED;
+        spin_unlock_irqrestore(&(cache->lock), flags);
+
+        /* the host owns the block now, so it is not released to the free pool */
+        calypso_reverse_index_clear(cache->reverse_index, physical_block_nr);
+        return 0;
+    }
+
+    if (!page)
+    {
+        page = calypso_mapping_cache_add_page(cache, page_nr, &stored_block);
+        if (!page)
+        {
+            spin_unlock_irqrestore(&(cache->lock), flags);
+            debug_args(KERN_ERR, __func__, "Could not read mapping page %lu before the host overwrites it\n", page_nr);
+            return 0;
+        }
+    }
+    bio_list_add(&(page->waiting), bio);
+    queued = calypso_mapping_cache_shrink(cache);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    if (queued)
+        queue_work(cache->wq, &(cache->work));
+    if (stored_block != CALYPSO_UNMAPPED)
+        calypso_mapping_cache_read_page(cache, page, stored_block);
+
+    return -EAGAIN;
+}
+
+/*
+ * The hook needs every physical block Calypso uses from the start, so each
+ * stored page is read once to fill the reverse index. Pages are not kept,
+ * so loading does not go over the memory limit either.
+ *
+ * Returns 0 for success and a negative error code otherwise
+ */
+int calypso_mapping_cache_load_reverse_index(struct calypso_mapping_cache *cache)
+{
+    struct page *io_page;
+    calypso_block_t *entries;
+    unsigned long page_nr, i;
+    int ret = 0;
+
+    io_page = alloc_page(GFP_KERNEL);
+    if (!io_page)
+        return -ENOMEM;
+    entries = page_address(io_page);
+
+    for (page_nr = 0; page_nr < cache->nr_pages; page_nr++)
+    {
+        if (cache->directory[page_nr] == CALYPSO_UNMAPPED)
+            continue;
+
+        ret = calypso_reverse_index_load(cache->reverse_index, cache->directory[page_nr], CALYPSO_TABLE_PAGE_TAG | page_nr);
+        if (ret == 0)
+            ret = calypso_mapping_cache_sync_io(cache, io_page, cache->directory[page_nr], REQ_OP_READ);
+        if (ret != 0)
+        {
+            debug_args(KERN_ERR, __func__, "Could not load mapping page %lu\n", page_nr);
+            break;
+        }
+        calypso_decrypt_block(cache->cipher, (u8 *)entries, (u8 *)entries, cache->key);
+
+        for (i = 0; i < CALYPSO_MAPPING_PAGE_ENTRIES && page_nr * CALYPSO_MAPPING_PAGE_ENTRIES + i < cache->virtual_nr_blocks; i++)
+        {
+            if (entries[i] == CALYPSO_UNMAPPED)
+                continue;
+            ret = calypso_reverse_index_load(cache->reverse_index, entries[i], page_nr * CALYPSO_MAPPING_PAGE_ENTRIES + i);
+            if (ret != 0)
+                debug_args(KERN_ERR, __func__, "Mapping of virtual block %lu is out of range\n", page_nr * CALYPSO_MAPPING_PAGE_ENTRIES + i);
+        }
+        ret = 0;
+    }
+    __free_page(io_page);
+
+    return ret;
+}
+
+/* Writes back every dirty page, before the directory is persisted on cleanup */
+void calypso_mapping_cache_flush(struct calypso_mapping_cache *cache)
+{
+    struct calypso_mapping_page *page;
+    unsigned long page_nr;
+
+    flush_workqueue(cache->wq);
+
+    xa_for_each(&(cache->pages), page_nr, page)
+    {
+        if (!test_bit(CALYPSO_PAGE_UPTODATE, &(page->flags)) || !test_bit(CALYPSO_PAGE_DIRTY, &(page->flags)))
+            continue;
+        if (calypso_mapping_cache_write_page(cache, page) != 0)
+            debug_args(KERN_ERR, __func__, "Mappings of page %lu are lost\n", page_nr);
+    }
+}
+
+/*
+ * The cache is unbounded until this is called, so mappings set while the
+ * hidden metadata is loaded are not written back before blocks can be claimed
+ */
+void calypso_mapping_cache_set_limit(struct calypso_mapping_cache *cache, unsigned long max_pages)
+{
+    unsigned long flags;
+    bool queued;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    cache->max_resident = max_t(unsigned long, max_pages, CALYPSO_MAPPING_CACHE_MIN_PAGES);
+    queued = calypso_mapping_cache_shrink(cache);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    if (queued)
+        queue_work(cache->wq, &(cache->work));
+}
+
+int calypso_mapping_cache_init(struct calypso_mapping_cache *cache, unsigned long virtual_nr_blocks,
+                    struct block_device *physical_dev, struct calypso_skcipher_def *cipher,
+                    struct calypso_reverse_index *reverse_index,
+                    int (*claim_block)(unsigned long *block),
+                    void (*release_block)(unsigned long block))
+{
+    unsigned long i;
+
+    cache->virtual_nr_blocks = virtual_nr_blocks;
+    cache->nr_pages = DIV_ROUND_UP(virtual_nr_blocks, CALYPSO_MAPPING_PAGE_ENTRIES);
+    cache->physical_dev = physical_dev;
+    cache->cipher = cipher;
+    cache->reverse_index = reverse_index;
+    cache->claim_block = claim_block;
+    cache->release_block = release_block;
+
+    cache->directory = vmalloc(cache->nr_pages * sizeof(calypso_block_t));
+    if (!cache->directory)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate memory for mapping pages directory\n");
+        return -ENOMEM;
+    }
+    for (i = 0; i < cache->nr_pages; i++)
+        cache->directory[i] = CALYPSO_UNMAPPED;
+
+    cache->wq = alloc_workqueue("calypso_mapping_cache", WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+    if (!cache->wq)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate mapping cache workqueue\n");
+        vfree(cache->directory);
+        cache->directory = NULL;
+        return -ENOMEM;
+    }
+    INIT_WORK(&(cache->work), calypso_mapping_cache_work);
+
+    xa_init(&(cache->pages));
+    INIT_LIST_HEAD(&(cache->lru));
+    INIT_LIST_HEAD(&(cache->faulted));
+    INIT_LIST_HEAD(&(cache->loaded));
+    INIT_LIST_HEAD(&(cache->evicted));
+    spin_lock_init(&(cache->lock));
+    cache->nr_resident = 0;
+    cache->max_resident = ULONG_MAX;
+
+    atomic64_set(&(cache->hits), 0);
+    atomic64_set(&(cache->misses), 0);
+    atomic64_set(&(cache->faults), 0);
+    atomic64_set(&(cache->fault_ns), 0);
+    atomic64_set(&(cache->writebacks), 0);
+
+    return 0;
+}
+
+/* Only once there is no I/O left, after calypso_mapping_cache_flush() */
+void calypso_mapping_cache_cleanup(struct calypso_mapping_cache *cache)
+{
+    struct calypso_mapping_page *page;
+    unsigned long page_nr;
+
+    if (!cache->directory)
+        return;
+
+    destroy_workqueue(cache->wq);
+    xa_for_each(&(cache->pages), page_nr, page)
+        calypso_mapping_page_free(page);
+    xa_destroy(&(cache->pages));
+    /* pages dropped earlier may still be waiting for their grace period */
+    rcu_barrier();
+
+    vfree(cache->directory);
+    cache->directory = NULL;
+}
+
+size_t calypso_mapping_cache_memory_bytes(struct calypso_mapping_cache *cache)
+{
+    return cache->nr_pages * sizeof(calypso_block_t)
+        + READ_ONCE(cache->nr_resident) * (PAGE_SIZE + sizeof(struct calypso_mapping_page));
+}
@@ -0,0 +1,167 @@
+#ifndef MAPPING_CACHE_H
+#define MAPPING_CACHE_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/bio.h>
+#include <linux/rcupdate.h>
+
+#include "global.h"
+#include "block_encryption.h"
+#include "reverse_index.h"
+
+
+/* Each page of the mapping table fills exactly one hidden block */
+#define CALYPSO_MAPPING_PAGE_ENTRIES (PAGE_SIZE / sizeof(calypso_block_t))
+
+/*
+ * Reverse index values of physical blocks storing a page of the table are
+ * the page number with this tag, so the hook can tell them apart from data
+ * blocks. -1 has the bit above it set as well, so it is never mistaken for one
+ */
+#define CALYPSO_TABLE_PAGE_TAG (1UL << (BITS_PER_LONG - 2))
+#define calypso_mapping_cache_is_table_block(value) (((value) >> (BITS_PER_LONG - 2)) == 1)
+#define calypso_mapping_cache_tag_to_page(value) ((value) & ~CALYPSO_TABLE_PAGE_TAG)
+
+/* Never go below this, so a request across two pages can always be served */
+#define CALYPSO_MAPPING_CACHE_MIN_PAGES 2
+
+enum calypso_mapping_page_flags {
+    /* entries can be used, otherwise the page is still being read */
+    CALYPSO_PAGE_UPTODATE = 0,
+    /* entries differ from what is stored on disk */
+    CALYPSO_PAGE_DIRTY = 1,
+    /* out of the LRU and waiting to be written back before being freed */
+    CALYPSO_PAGE_EVICTING = 2,
+};
+
+/* Mapping update that arrived while its page was being read */
+struct calypso_mapping_update {
+    struct list_head list;
+    unsigned long virtual_block_nr;
+    unsigned long physical_block_nr;
+};
+
+struct calypso_mapping_cache;
+
+struct calypso_mapping_page {
+    struct calypso_mapping_cache *cache;
+    unsigned long page_nr;
+    calypso_block_t *entries;
+    unsigned long flags;
+    /* requests currently looking up entries of this page, which keep it resident */
+    unsigned int pins;
+
+    struct list_head lru;
+    /* in the faulted, loaded or evicted list of the cache, for the worker */
+    struct list_head work_list;
+    /* bios waiting for the page to be read */
+    struct bio_list waiting;
+    struct list_head pending_updates;
+
+    /* read in flight */
+    struct page *io_page;
+    blk_status_t io_status;
+    u64 fault_start_ns;
+
+    struct rcu_head rcu;
+};
+
+/*
+ * Virtual to physical block mappings kept in hidden blocks as pages of
+ * CALYPSO_MAPPING_PAGE_ENTRIES entries, of which at most max_resident
+ * are held in memory. Pages are read when a request needs them and
+ * written to a new block when they are evicted dirty.
+ */
+struct calypso_mapping_cache {
+    /* page number -> physical block it is stored in, CALYPSO_UNMAPPED if it was never written */
+    calypso_block_t *directory;
+    unsigned long nr_pages;
+    unsigned long virtual_nr_blocks;
+
+    /* resident pages, looked up under RCU */
+    struct xarray pages;
+    /* least recently used first */
+    struct list_head lru;
+    unsigned long nr_resident;
+    unsigned long max_resident;
+    /* updated from bio completion, so it needs to be irq safe */
+    spinlock_t lock;
+
+    struct workqueue_struct *wq;
+    struct work_struct work;
+    /* pages needed from where the read cannot be started, to be read */
+    struct list_head faulted;
+    /* pages whose read completed, to be decrypted */
+    struct list_head loaded;
+    /* dirty pages out of the LRU, to be written back */
+    struct list_head evicted;
+
+    struct block_device *physical_dev;
+    struct calypso_skcipher_def *cipher;
+    unsigned char key[ENCRYPTION_KEY_LEN + 1];
+    struct calypso_reverse_index *reverse_index;
+
+    /* Blocks for pages written back, and the blocks they leave behind */
+    int (*claim_block)(unsigned long *block);
+    void (*release_block)(unsigned long block);
+
+    /* requests whose pages were all in memory, and requests that had to wait */
+    atomic64_t hits;
+    atomic64_t misses;
+    /* pages read, and the time from starting each read until the page could be used */
+    atomic64_t faults;
+    atomic64_t fault_ns;
+    atomic64_t writebacks;
+};
+
+int calypso_mapping_cache_init(struct calypso_mapping_cache *cache, unsigned long virtual_nr_blocks,
+                    struct block_device *physical_dev, struct calypso_skcipher_def *cipher,
+                    struct calypso_reverse_index *reverse_index,
+                    int (*claim_block)(unsigned long *block),
+                    void (*release_block)(unsigned long block));
+void calypso_mapping_cache_cleanup(struct calypso_mapping_cache *cache);
+
+void calypso_mapping_cache_set_limit(struct calypso_mapping_cache *cache, unsigned long max_pages);
+int calypso_mapping_cache_load_reverse_index(struct calypso_mapping_cache *cache);
+void calypso_mapping_cache_flush(struct calypso_mapping_cache *cache);
+
+int calypso_mapping_cache_get_range(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks, struct bio *bio);
+void calypso_mapping_cache_put_range(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks);
+bool calypso_mapping_cache_is_range_unmapped(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks);
+
+int calypso_mapping_cache_set(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr, unsigned long physical_block_nr, struct calypso_mapping_page **fault);
+void calypso_mapping_cache_read_fault(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page);
+void calypso_mapping_cache_queue_fault(struct calypso_mapping_cache *cache, struct calypso_mapping_page *page);
+int calypso_mapping_cache_evacuate(struct calypso_mapping_cache *cache, unsigned long page_nr, unsigned long physical_block_nr, struct bio *bio);
+
+size_t calypso_mapping_cache_memory_bytes(struct calypso_mapping_cache *cache);
+
+/*
+ * Physical block of virtual_block_nr, or CALYPSO_UNMAPPED if its page is
+ * not in memory. Requests pin the pages they need with
+ * calypso_mapping_cache_get_range() first, so for them it is always resident
+ */
+static inline calypso_block_t calypso_mapping_cache_get(struct calypso_mapping_cache *cache, unsigned long virtual_block_nr)
+{
+    struct calypso_mapping_page *page;
+    calypso_block_t physical_block_nr = CALYPSO_UNMAPPED;
+
+    rcu_read_lock();
+    page = xa_load(&(cache->pages), virtual_block_nr / CALYPSO_MAPPING_PAGE_ENTRIES);
+    if (page && test_bit(CALYPSO_PAGE_UPTODATE, &(page->flags)))
+    {
+        /* pairs with the barrier before the page is marked up to date */
+        smp_rmb();
+        physical_block_nr = READ_ONCE(page->entries[virtual_block_nr % CALYPSO_MAPPING_PAGE_ENTRIES]);
+    }
+    rcu_read_unlock();
+
+    return physical_block_nr;
+}
+
+
+#endif
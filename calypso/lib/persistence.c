@@ -11,33 +11,33 @@
 
 void calypso_write_mappings_to_file(struct file *metadata_file, struct calypso_blk_device *calypso_dev) {
     unsigned long virtual;
-    char physical_str[8+1];
+    char physical_str[CALYPSO_MAPPING_STR_LEN + 1];
     for (virtual = 0; virtual < calypso_dev->virtual_nr_blocks; virtual++)
     {
-        snprintf(physical_str, 8+1, "%.8lx", calypso_dev->virtual_to_physical_block_mapping[virtual]);
-        calypso_write_file(metadata_file, physical_str, 8);
+        snprintf(physical_str, CALYPSO_MAPPING_STR_LEN + 1, "%.*llx", (int)CALYPSO_MAPPING_STR_LEN, (unsigned long long)calypso_lookup_physical_block(calypso_dev, virtual));
+        calypso_write_file(metadata_file, physical_str, CALYPSO_MAPPING_STR_LEN);
     }
 }
 
 void calypso_read_mappings(struct file *metadata_file, struct calypso_blk_device *calypso_dev)
 {
     unsigned long virtual = 0;
-    char physical_str[8];
-    unsigned long physical;
+    char physical_str[CALYPSO_MAPPING_STR_LEN + 1];
+    unsigned long long physical;
     loff_t offset = 0;
 
     while (virtual < calypso_dev->virtual_nr_blocks)
     {
-        calypso_read_file_with_offset(metadata_file, offset, physical_str, 8);
-        offset += 8;
-        kstrtoul(physical_str, 16, &physical);
+        calypso_read_file_with_offset(metadata_file, offset, physical_str, CALYPSO_MAPPING_STR_LEN);
+        physical_str[CALYPSO_MAPPING_STR_LEN] = '\0';
+        offset += CALYPSO_MAPPING_STR_LEN;
+        kstrtoull(physical_str, 16, &physical);
         /* We only set the mappings if they are not the default value */
-        if (physical < MAX_UNSIGNED_LONG)
+        if (calypso_is_block_mapped(calypso_dev, physical))
         {
             debug(KERN_DEBUG, __func__, "MAPPED!\n");
-            debug_args(KERN_DEBUG, __func__, "virtual: %lu; physical: %lu\n", virtual, physical);
-            calypso_dev->virtual_to_physical_block_mapping[virtual] = physical;
-            calypso_dev->physical_to_virtual_block_mapping[physical] = virtual;
+            debug_args(KERN_DEBUG, __func__, "virtual: %lu; physical: %llu\n", virtual, physical);
+            calypso_dev_load_mapping(calypso_dev, virtual, physical);
         }
         virtual++;
     }
@@ -51,9 +51,20 @@ void calypso_write_bitmap_to_file(struct file *metadata_file, struct calypso_blk
     loff_t bitmap_data_len = calypso_dev->physical_nr_blocks / 8 + remainder;
 
     u32 *buf = kzalloc(bitmap_data_len, GFP_KERNEL);
-    bitmap_to_arr32(buf, calypso_dev->physical_blocks_bitmap, calypso_dev->physical_nr_blocks);
+    unsigned long *used_bitmap = bitmap_alloc(calypso_dev->physical_nr_blocks, GFP_KERNEL);
+    if (!buf || !used_bitmap)
+    {
+        debug(KERN_ERR, __func__, "Could not allocate memory for used blocks bitmap\n");
+        kfree(buf);
+        bitmap_free(used_bitmap);
+        return;
+    }
+
+    calypso_block_state_used_bitmap(&(calypso_dev->block_state), used_bitmap);
+    bitmap_to_arr32(buf, used_bitmap, calypso_dev->physical_nr_blocks);
     calypso_write_file(metadata_file, (char *)buf, bitmap_data_len);
 
+    bitmap_free(used_bitmap);
     kfree(buf);
 }
 
@@ -80,8 +91,9 @@ int calypso_read_bitmap(char *bitmap_data, loff_t bitmap_len, struct calypso_blk
     }
 
     bitmap_from_arr32(prev_bitmap, (u32 *)bitmap_data, calypso_dev->physical_nr_blocks);
+    calypso_block_state_used_bitmap(&(calypso_dev->block_state), res_bitmap);
 
-    if (bitmap_equal(prev_bitmap, calypso_dev->physical_blocks_bitmap, calypso_dev->physical_nr_blocks))
+    if (bitmap_equal(prev_bitmap, res_bitmap, calypso_dev->physical_nr_blocks))
     {
         debug(KERN_DEBUG, __func__, "BITMAPS ARE EQUAL!\n");
     }
@@ -89,7 +101,7 @@ int calypso_read_bitmap(char *bitmap_data, loff_t bitmap_len, struct calypso_blk
         debug(KERN_DEBUG, __func__, "BITMAPS ARE NOT EQUAL!\n");
 
     /* Check differences between previous and updated bitmap */
-    bitmap_xor(res_bitmap, prev_bitmap, calypso_dev->physical_blocks_bitmap, calypso_dev->physical_nr_blocks);
+    bitmap_xor(res_bitmap, prev_bitmap, res_bitmap, calypso_dev->physical_nr_blocks);
 
     bitmap_for_each_set_region(res_bitmap, res_rs, res_re, 0, calypso_dev->physical_nr_blocks)
 	{
@@ -157,16 +169,16 @@ void calypso_retrieve_bitmap(struct calypso_blk_device *calypso_dev)
 void calypso_set_mapped_bits(struct calypso_blk_device *calypso_dev)
 {
     size_t i;
-    unsigned long physical_block;
+    calypso_block_t physical_block;
 
     for (i = 0; i < calypso_dev->virtual_nr_blocks; i++)
     {
-        physical_block = calypso_dev->virtual_to_physical_block_mapping[i];
+        physical_block = calypso_lookup_physical_block(calypso_dev, i);
         /* block is mapped */
-        if (physical_block < MAX_UNSIGNED_LONG)
+        if (calypso_is_block_mapped(calypso_dev, physical_block))
         {
-            debug_args(KERN_DEBUG, __func__, "Set physical block %lu in use by Calypso in bitmap\n", physical_block);
-            calypso_set_bit(calypso_dev->physical_blocks_bitmap, physical_block);
+            debug_args(KERN_DEBUG, __func__, "Set physical block %lu in use by Calypso in bitmap\n", (unsigned long)physical_block);
+            calypso_block_state_set(&(calypso_dev->block_state), physical_block, CALYPSO_BLOCK_CALYPSO_DATA);
         }
     }
 }
@@ -0,0 +1,407 @@
+/*
+ * LRU cache of the data returned by reads of virtual blocks
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+
+#include "debug.h"
+#include "read_cache.h"
+
+
+/* A read that missed or a write, with the completion of its bio it stands in for */
+struct calypso_read_fill {
+    struct calypso_read_cache *cache;
+    unsigned long virtual_block_nr;
+    unsigned long nr_blocks;
+    /* the data of the bio, which the native device consumes as it completes it */
+    struct bvec_iter iter;
+    bio_end_io_t *end_io;
+    void *private;
+};
+
+
+static void calypso_read_block_free(struct calypso_read_block *block)
+{
+    if (block->page)
+        __free_page(block->page);
+    kfree(block);
+}
+
+/* Called with the lock held */
+static void calypso_read_cache_drop(struct calypso_read_cache *cache, struct calypso_read_block *block)
+{
+    xa_erase(&(cache->blocks), block->virtual_block_nr);
+    list_del(&(block->lru));
+    cache->nr_blocks--;
+    if (block->readahead)
+        atomic64_inc(&(cache->readahead_wasted));
+    calypso_read_block_free(block);
+}
+
+/* Copies a block between the bio, from iter on, and the page */
+static void calypso_read_cache_copy(struct bio *bio, struct bvec_iter iter, struct page *page, bool to_bio)
+{
+    unsigned char *data = page_address(page);
+    struct bio_vec bvec;
+    struct bvec_iter i;
+    unsigned char *addr;
+
+    iter.bi_size = CALYPSO_BLOCK_SIZE;
+    __bio_for_each_segment(bvec, bio, i, iter)
+    {
+        addr = kmap_atomic(bvec.bv_page);
+        if (to_bio)
+            memcpy(addr + bvec.bv_offset, data, bvec.bv_len);
+        else
+            memcpy(data, addr + bvec.bv_offset, bvec.bv_len);
+        kunmap_atomic(addr);
+        data += bvec.bv_len;
+    }
+}
+
+/*
+ * Copies the cached data of a block into the bio from iter on.
+ * Returns 0 on a hit and -ENOENT on a miss
+ */
+int calypso_read_cache_read(struct calypso_read_cache *cache, unsigned long virtual_block_nr, struct bio *bio, struct bvec_iter iter)
+{
+    struct calypso_read_block *block;
+    unsigned long flags;
+    bool hit;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    block = xa_load(&(cache->blocks), virtual_block_nr);
+    hit = block && !block->filler;
+    if (hit)
+    {
+        calypso_read_cache_copy(bio, iter, block->page, true);
+        list_move(&(block->lru), &(cache->lru));
+        if (block->readahead)
+        {
+            block->readahead = false;
+            atomic64_inc(&(cache->readahead_hits));
+        }
+    }
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    atomic64_inc(hit ? &(cache->hits) : &(cache->misses));
+    return hit ? 0 : -ENOENT;
+}
+
+/*
+ * Copies the cached data of a block to data, without counting it as a
+ * read. Returns 0 if the block is cached and -ENOENT otherwise
+ */
+int calypso_read_cache_peek(struct calypso_read_cache *cache, unsigned long virtual_block_nr, void *data)
+{
+    struct calypso_read_block *block;
+    unsigned long flags;
+    bool cached;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    block = xa_load(&(cache->blocks), virtual_block_nr);
+    cached = block && !block->filler;
+    if (cached)
+        memcpy(data, page_address(block->page), CALYPSO_BLOCK_SIZE);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    return cached ? 0 : -ENOENT;
+}
+
+static void calypso_read_cache_end_io(struct bio *bio)
+{
+    struct calypso_read_fill *fill = bio->bi_private;
+    struct calypso_read_cache *cache = fill->cache;
+    struct bvec_iter iter = fill->iter;
+    struct calypso_read_block *block;
+    unsigned long i;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    for (i = 0; i < fill->nr_blocks; i++)
+    {
+        block = xa_load(&(cache->blocks), fill->virtual_block_nr + i);
+        /* evicted or invalidated meanwhile, or filled by another read */
+        if (block && block->filler == fill)
+        {
+            if (bio->bi_status == BLK_STS_OK)
+            {
+                calypso_read_cache_copy(bio, iter, block->page, false);
+                block->filler = NULL;
+            }
+            else
+                calypso_read_cache_drop(cache, block);
+        }
+        bio_advance_iter(bio, &iter, CALYPSO_BLOCK_SIZE);
+    }
+    spin_unlock_irqrestore(&(cache->lock), flags);
+
+    bio->bi_end_io = fill->end_io;
+    bio->bi_private = fill->private;
+    kfree(fill);
+    bio_endio(bio);
+}
+
+/*
+ * Adds a block to be filled by a read, making room for it. Returns false
+ * if the block is already cached or being read. Called with the lock held
+ */
+static bool calypso_read_cache_insert(struct calypso_read_cache *cache, struct calypso_read_block *block)
+{
+    struct calypso_read_block *victim;
+
+    if (xa_load(&(cache->blocks), block->virtual_block_nr)
+        || xa_is_err(xa_store(&(cache->blocks), block->virtual_block_nr, block, GFP_ATOMIC)))
+        return false;
+
+    list_add(&(block->lru), &(cache->lru));
+    if (++cache->nr_blocks > cache->max_blocks)
+    {
+        victim = list_last_entry(&(cache->lru), struct calypso_read_block, lru);
+        calypso_read_cache_drop(cache, victim);
+    }
+    return true;
+}
+
+/*
+ * Has the blocks of a read bio from virtual_block_nr on cached once it
+ * completes. Blocks already in the cache, or being read by another bio,
+ * are left to it. The least recently read blocks make room for them
+ */
+void calypso_read_cache_fill_bio(struct calypso_read_cache *cache, unsigned long virtual_block_nr, struct bio *bio)
+{
+    unsigned long nr_blocks = bio_sectors(bio) / 8;
+    struct calypso_read_fill *fill;
+    struct calypso_read_block *block;
+    unsigned long i, nr_filled = 0;
+    bool inserted;
+    unsigned long flags;
+
+    fill = kmalloc(sizeof(struct calypso_read_fill), GFP_NOIO);
+    if (!fill)
+        return;
+
+    for (i = 0; i < nr_blocks; i++)
+    {
+        block = kmalloc(sizeof(struct calypso_read_block), GFP_NOIO);
+        if (!block)
+            break;
+        block->page = alloc_page(GFP_NOIO);
+        if (!block->page)
+        {
+            kfree(block);
+            break;
+        }
+        block->virtual_block_nr = virtual_block_nr + i;
+        block->filler = fill;
+        block->readahead = false;
+
+        spin_lock_irqsave(&(cache->lock), flags);
+        inserted = calypso_read_cache_insert(cache, block);
+        spin_unlock_irqrestore(&(cache->lock), flags);
+        if (!inserted)
+        {
+            calypso_read_block_free(block);
+            continue;
+        }
+        nr_filled++;
+    }
+
+    if (nr_filled == 0)
+    {
+        kfree(fill);
+        return;
+    }
+
+    fill->cache = cache;
+    fill->virtual_block_nr = virtual_block_nr;
+    fill->nr_blocks = nr_blocks;
+    fill->iter = bio->bi_iter;
+    fill->end_io = bio->bi_end_io;
+    fill->private = bio->bi_private;
+    bio->bi_end_io = calypso_read_cache_end_io;
+    bio->bi_private = fill;
+}
+
+/*
+ * nr_blocks blocks from virtual_block_nr no longer have the data last read,
+ * or a read in flight may not return it. Reads in flight do not cache them
+ */
+void calypso_read_cache_invalidate(struct calypso_read_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    struct calypso_read_block *block;
+    unsigned long index = virtual_block_nr;
+    unsigned long last = virtual_block_nr + nr_blocks - 1;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    for (block = xa_find(&(cache->blocks), &index, last, XA_PRESENT); block; block = xa_find_after(&(cache->blocks), &index, last, XA_PRESENT))
+        calypso_read_cache_drop(cache, block);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+static void calypso_read_cache_write_end_io(struct bio *bio)
+{
+    struct calypso_read_fill *fill = bio->bi_private;
+
+    /* reads that started while the bio was being written may have returned the old data */
+    calypso_read_cache_invalidate(fill->cache, fill->virtual_block_nr, fill->nr_blocks);
+
+    bio->bi_end_io = fill->end_io;
+    bio->bi_private = fill->private;
+    kfree(fill);
+    bio_endio(bio);
+}
+
+/*
+ * Invalidates the blocks a bio writes or discards, now and once it
+ * completes. If it cannot wait for the bio, the blocks are only
+ * invalidated now
+ */
+void calypso_read_cache_invalidate_bio(struct calypso_read_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks, struct bio *bio)
+{
+    struct calypso_read_fill *fill;
+
+    calypso_read_cache_invalidate(cache, virtual_block_nr, nr_blocks);
+
+    fill = kmalloc(sizeof(struct calypso_read_fill), GFP_NOIO);
+    if (!fill)
+        return;
+    fill->cache = cache;
+    fill->virtual_block_nr = virtual_block_nr;
+    fill->nr_blocks = nr_blocks;
+    fill->end_io = bio->bi_end_io;
+    fill->private = bio->bi_private;
+    bio->bi_end_io = calypso_read_cache_write_end_io;
+    bio->bi_private = fill;
+}
+
+/* Whether a block is cached or being read */
+bool calypso_read_cache_contains(struct calypso_read_cache *cache, unsigned long virtual_block_nr)
+{
+    return xa_load(&(cache->blocks), virtual_block_nr) != NULL;
+}
+
+/*
+ * Adds a page for a block to a readahead bio, which then fills the block
+ * once it completes in calypso_read_cache_readahead_end_io(). The bio
+ * reads into pages of its own, so they stay valid if the block is
+ * invalidated or evicted meanwhile.
+ * Returns -EEXIST if the block is already cached or being read, and
+ * -ENOMEM if there is no memory or no room left in the bio
+ */
+int calypso_read_cache_add_readahead(struct calypso_read_cache *cache, unsigned long virtual_block_nr, struct bio *bio)
+{
+    struct calypso_read_block *block;
+    struct page *page;
+    unsigned long flags;
+    bool inserted;
+
+    block = kmalloc(sizeof(struct calypso_read_block), GFP_NOIO);
+    if (!block)
+        return -ENOMEM;
+    page = alloc_page(GFP_NOIO);
+    if (!page)
+    {
+        kfree(block);
+        return -ENOMEM;
+    }
+    block->virtual_block_nr = virtual_block_nr;
+    block->page = NULL;
+    block->filler = bio;
+    block->readahead = true;
+
+    spin_lock_irqsave(&(cache->lock), flags);
+    inserted = calypso_read_cache_insert(cache, block);
+    spin_unlock_irqrestore(&(cache->lock), flags);
+    if (!inserted)
+    {
+        __free_page(page);
+        kfree(block);
+        return -EEXIST;
+    }
+
+    if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE)
+    {
+        /* it may have been evicted already */
+        spin_lock_irqsave(&(cache->lock), flags);
+        block = xa_load(&(cache->blocks), virtual_block_nr);
+        if (block && block->filler == bio)
+            calypso_read_cache_drop(cache, block);
+        spin_unlock_irqrestore(&(cache->lock), flags);
+        __free_page(page);
+        return -ENOMEM;
+    }
+    set_page_private(page, virtual_block_nr);
+
+    atomic64_inc(&(cache->readahead_blocks));
+    return 0;
+}
+
+/* Hands the pages of a readahead bio to the blocks still waiting for them */
+void calypso_read_cache_readahead_end_io(struct bio *bio)
+{
+    struct calypso_read_cache *cache = bio->bi_private;
+    struct calypso_read_block *block;
+    struct bio_vec *bvec;
+    struct bvec_iter_all iter_all;
+    struct page *page;
+    unsigned long flags;
+
+    bio_for_each_segment_all(bvec, bio, iter_all)
+    {
+        page = bvec->bv_page;
+
+        spin_lock_irqsave(&(cache->lock), flags);
+        block = xa_load(&(cache->blocks), page_private(page));
+        if (block && block->filler == bio)
+        {
+            if (bio->bi_status == BLK_STS_OK)
+            {
+                set_page_private(page, 0);
+                block->page = page;
+                block->filler = NULL;
+                page = NULL;
+            }
+            else
+                calypso_read_cache_drop(cache, block);
+        }
+        spin_unlock_irqrestore(&(cache->lock), flags);
+
+        if (page)
+        {
+            set_page_private(page, 0);
+            __free_page(page);
+        }
+    }
+    bio_put(bio);
+}
+
+/* Sets up a cache of up to max_blocks blocks. With max_blocks 0 it stays disabled */
+void calypso_read_cache_init(struct calypso_read_cache *cache, unsigned long max_blocks)
+{
+    xa_init(&(cache->blocks));
+    INIT_LIST_HEAD(&(cache->lru));
+    spin_lock_init(&(cache->lock));
+    cache->nr_blocks = 0;
+    cache->max_blocks = max_blocks;
+    atomic64_set(&(cache->hits), 0);
+    atomic64_set(&(cache->misses), 0);
+    atomic64_set(&(cache->readahead_blocks), 0);
+    atomic64_set(&(cache->readahead_hits), 0);
+    atomic64_set(&(cache->readahead_wasted), 0);
+}
+
+/* Reads have to be over, their completion looks the blocks up */
+void calypso_read_cache_cleanup(struct calypso_read_cache *cache)
+{
+    struct calypso_read_block *block, *next;
+
+    list_for_each_entry_safe(block, next, &(cache->lru), lru)
+        calypso_read_block_free(block);
+    xa_destroy(&(cache->blocks));
+    INIT_LIST_HEAD(&(cache->lru));
+    cache->nr_blocks = 0;
+    cache->max_blocks = 0;
+}
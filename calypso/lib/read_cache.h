@@ -0,0 +1,69 @@
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+#include <linux/types.h>
+#include <linux/xarray.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/bio.h>
+
+#include "global.h"
+
+
+/* Data a read of a virtual block returned */
+struct calypso_read_block {
+    unsigned long virtual_block_nr;
+    /* NULL until a readahead bio fills it */
+    struct page *page;
+    /* the read that will fill the page, NULL once it did */
+    void *filler;
+    /* read ahead and not read by anyone yet */
+    bool readahead;
+    /* least recently read last */
+    struct list_head lru;
+};
+
+/*
+ * LRU cache of the data reads of virtual blocks returned, so reading the
+ * same hidden data again, e.g. after clean_caches.sh dropped the page cache
+ * of the file system on Calypso, needs neither I/O nor decryption.
+ * A block is cached when a read that missed completes, unless it was
+ * invalidated meanwhile by a write, a discard or a relocation
+ */
+struct calypso_read_cache {
+    /* virtual block number -> struct calypso_read_block */
+    struct xarray blocks;
+    struct list_head lru;
+    unsigned long nr_blocks;
+    unsigned long max_blocks;
+    /* taken from bio completion as well */
+    spinlock_t lock;
+
+    atomic64_t hits;
+    atomic64_t misses;
+    /* blocks read ahead, and how many of them were read afterwards or dropped unread */
+    atomic64_t readahead_blocks;
+    atomic64_t readahead_hits;
+    atomic64_t readahead_wasted;
+};
+
+void calypso_read_cache_init(struct calypso_read_cache *cache, unsigned long max_blocks);
+void calypso_read_cache_cleanup(struct calypso_read_cache *cache);
+
+int calypso_read_cache_read(struct calypso_read_cache *cache, unsigned long virtual_block_nr, struct bio *bio, struct bvec_iter iter);
+int calypso_read_cache_peek(struct calypso_read_cache *cache, unsigned long virtual_block_nr, void *data);
+void calypso_read_cache_fill_bio(struct calypso_read_cache *cache, unsigned long virtual_block_nr, struct bio *bio);
+void calypso_read_cache_invalidate(struct calypso_read_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks);
+void calypso_read_cache_invalidate_bio(struct calypso_read_cache *cache, unsigned long virtual_block_nr, unsigned long nr_blocks, struct bio *bio);
+bool calypso_read_cache_contains(struct calypso_read_cache *cache, unsigned long virtual_block_nr);
+
+int calypso_read_cache_add_readahead(struct calypso_read_cache *cache, unsigned long virtual_block_nr, struct bio *bio);
+void calypso_read_cache_readahead_end_io(struct bio *bio);
+
+static inline bool calypso_read_cache_enabled(struct calypso_read_cache *cache)
+{
+    return cache->max_blocks > 0;
+}
+
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Detection of sequential reads and of how far ahead of them to read
+ */
+#include <linux/kernel.h>
+
+#include "readahead.h"
+
+
+/*
+ * The window grows when at most an eighth of the blocks read ahead since
+ * it was last adapted were wasted, and shrinks when more than a quarter were
+ */
+static void calypso_readahead_adapt(struct calypso_readahead *ra, u64 readahead_blocks, u64 readahead_wasted)
+{
+    u64 blocks = readahead_blocks - ra->last_blocks;
+    u64 wasted = readahead_wasted - ra->last_wasted;
+
+    if (blocks < ra->window)
+        return;
+
+    if (wasted * 4 > blocks)
+        ra->window = max_t(unsigned long, ra->window / 2, CALYPSO_READAHEAD_MIN_BLOCKS);
+    else if (wasted * 8 <= blocks)
+        ra->window = min(ra->window * 2, ra->max_window);
+    ra->last_blocks = readahead_blocks;
+    ra->last_wasted = readahead_wasted;
+}
+
+/*
+ * Follows a read of nr_blocks blocks from virtual_block_nr. readahead_blocks
+ * and readahead_wasted are the blocks read ahead so far and those dropped
+ * unread. Returns true with the count blocks from start to read ahead when
+ * the read continues a sequential stream that less than half a window is
+ * left read ahead of
+ */
+bool calypso_readahead_next(struct calypso_readahead *ra, unsigned long virtual_block_nr, unsigned long nr_blocks,
+                    u64 readahead_blocks, u64 readahead_wasted, unsigned long *start, unsigned long *count)
+{
+    unsigned long end = virtual_block_nr + nr_blocks;
+    struct calypso_readahead_stream *stream = NULL;
+    bool ret = false;
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&(ra->lock), flags);
+    for (i = 0; i < CALYPSO_READAHEAD_STREAMS; i++)
+    {
+        if (ra->streams[i].nr_reads > 0 && ra->streams[i].next_block == virtual_block_nr)
+        {
+            stream = &(ra->streams[i]);
+            break;
+        }
+    }
+
+    if (!stream)
+    {
+        stream = &(ra->streams[ra->next_stream]);
+        ra->next_stream = (ra->next_stream + 1) % CALYPSO_READAHEAD_STREAMS;
+        stream->ahead_block = end;
+        stream->nr_reads = 0;
+    }
+    stream->next_block = end;
+    stream->nr_reads++;
+    if (stream->ahead_block < end)
+        stream->ahead_block = end;
+
+    if (stream->nr_reads >= CALYPSO_READAHEAD_TRIGGER)
+    {
+        calypso_readahead_adapt(ra, readahead_blocks, readahead_wasted);
+        if (stream->ahead_block < end + ra->window / 2)
+        {
+            *start = stream->ahead_block;
+            *count = end + ra->window - stream->ahead_block;
+            stream->ahead_block += *count;
+            ret = true;
+        }
+    }
+    spin_unlock_irqrestore(&(ra->lock), flags);
+
+    return ret;
+}
+
+/* Reads ahead up to max_window blocks. With max_window 0 it stays disabled */
+void calypso_readahead_init(struct calypso_readahead *ra, unsigned long max_window)
+{
+    memset(ra->streams, 0, sizeof(ra->streams));
+    ra->next_stream = 0;
+    ra->max_window = max_window > 0 ? max_t(unsigned long, max_window, CALYPSO_READAHEAD_MIN_BLOCKS) : 0;
+    ra->window = min_t(unsigned long, 2 * CALYPSO_READAHEAD_MIN_BLOCKS, ra->max_window);
+    ra->last_blocks = 0;
+    ra->last_wasted = 0;
+    spin_lock_init(&(ra->lock));
+}
@@ -0,0 +1,59 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+
+#include "global.h"
+
+
+/* Sequential reads followed at the same time, e.g. files read in parallel */
+#define CALYPSO_READAHEAD_STREAMS 8
+
+/* Reads in a row that make a stream sequential */
+#define CALYPSO_READAHEAD_TRIGGER 2
+
+#define CALYPSO_READAHEAD_MIN_BLOCKS 4
+
+struct calypso_readahead_stream {
+    /* block a sequential read would start at */
+    unsigned long next_block;
+    /* first block not read ahead yet */
+    unsigned long ahead_block;
+    unsigned int nr_reads;
+};
+
+/*
+ * Detects sequential streams among the reads of virtual blocks, and tells
+ * how far ahead of them to read. Blocks of hidden files are scattered over
+ * the native partition, so without it a sequential read is a series of
+ * small dependent random reads. The window grows while the blocks read
+ * ahead are read before the read cache evicts them, and shrinks when many
+ * are wasted
+ */
+struct calypso_readahead {
+    struct calypso_readahead_stream streams[CALYPSO_READAHEAD_STREAMS];
+    /* stream replaced by the next new one */
+    unsigned int next_stream;
+
+    unsigned long window;
+    unsigned long max_window;
+
+    /* blocks read ahead and wasted when the window was last adapted */
+    u64 last_blocks;
+    u64 last_wasted;
+
+    spinlock_t lock;
+};
+
+void calypso_readahead_init(struct calypso_readahead *ra, unsigned long max_window);
+bool calypso_readahead_next(struct calypso_readahead *ra, unsigned long virtual_block_nr, unsigned long nr_blocks,
+                    u64 readahead_blocks, u64 readahead_wasted, unsigned long *start, unsigned long *count);
+
+static inline bool calypso_readahead_enabled(struct calypso_readahead *ra)
+{
+    return ra->max_window > 0;
+}
+
+
+#endif
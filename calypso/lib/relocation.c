@@ -0,0 +1,679 @@
+/*
+ * Copies of Calypso blocks the host is about to overwrite
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
+
+#include "debug.h"
+#include "relocation.h"
+
+
+/* A timed host write, with the completion of its bio it stands in for */
+struct calypso_relocation_host_write {
+    struct calypso_relocation_engine *engine;
+    u64 start_ns;
+    bio_end_io_t *end_io;
+    void *private;
+};
+
+
+/* Forgets a relocation once its copies were written, or could not be */
+static void calypso_relocation_end(struct calypso_relocation *relocation)
+{
+    struct calypso_relocation_engine *engine = relocation->engine;
+    unsigned int nr_blocks = relocation->nr_blocks;
+    bool start = false;
+    unsigned long flags;
+    unsigned int i;
+
+    for (i = 0; i < nr_blocks; i++)
+    {
+        if (!relocation->pages[i])
+            continue;
+        set_page_private(relocation->pages[i], 0);
+        mempool_free(relocation->pages[i], engine->page_pool);
+    }
+
+    spin_lock_irqsave(&(engine->lock), flags);
+    for (i = 0; i < nr_blocks; i++)
+    {
+        xa_erase(&(engine->relocations), relocation->from_block + i);
+        /* unless the block was given back, and another relocation copies to it now */
+        if (relocation->to_blocks[i] != -1)
+            xa_cmpxchg(&(engine->relocations), relocation->to_blocks[i], relocation, NULL, GFP_ATOMIC);
+    }
+    engine->inflight -= nr_blocks;
+    /* the blocks were remapped, so the requests held find the copies now, and host writes to the copies relocate them */
+    if (!bio_list_empty(&(relocation->calypso_bios)))
+    {
+        bio_list_merge(&(engine->remapped), &(relocation->calypso_bios));
+        start = true;
+    }
+    if (!list_empty(&(engine->queued)))
+        start = true;
+    spin_unlock_irqrestore(&(engine->lock), flags);
+
+    mempool_free(relocation, engine->relocation_pool);
+
+    /* the queued ones are started by the worker, which can wait for memory, and it resubmits the requests held */
+    if (start)
+        queue_work(engine->wq, &(engine->work));
+
+    /* only now, since the cleanup destroys the pools and the worker once there are none left */
+    spin_lock_irqsave(&(engine->lock), flags);
+    engine->nr_pending -= nr_blocks;
+    if (engine->nr_pending == 0)
+        wake_up_all(&(engine->idle));
+    spin_unlock_irqrestore(&(engine->lock), flags);
+}
+
+/* Remaps the i-th block of the relocation to its copy, if it was written */
+static void calypso_relocation_move(struct calypso_relocation *relocation, unsigned int i, blk_status_t status)
+{
+    struct calypso_relocation_engine *engine = relocation->engine;
+    unsigned long from_block = relocation->from_block + i;
+    int ret;
+
+    if (status != BLK_STS_OK)
+    {
+        debug_args(KERN_ERR, __func__, "Could not write the copy of block %lu, virtual block %lu is lost\n", from_block, relocation->virtual_block_nrs[i]);
+        engine->release_block(relocation->to_blocks[i]);
+        return;
+    }
+
+    /* Calypso requests to the old block are held until the relocation ends, and then see the new one */
+    ret = engine->move_mapping(relocation->virtual_block_nrs[i], from_block, relocation->to_blocks[i]);
+    if (ret == -EAGAIN)
+        engine->release_block(relocation->to_blocks[i]);
+    else if (ret != 0)
+        debug_args(KERN_ERR, __func__, "Could not remap relocated block %lu\n", from_block);
+}
+
+static void calypso_relocation_write_end_io(struct bio *bio)
+{
+    struct calypso_relocation *relocation = bio->bi_private;
+    struct bvec_iter_all iter_all;
+    struct bio_vec *bvec;
+
+    bio_for_each_segment_all(bvec, bio, iter_all)
+        calypso_relocation_move(relocation, page_private(bvec->bv_page), bio->bi_status);
+    bio_put(bio);
+
+    if (atomic_dec_and_test(&(relocation->pending_writes)))
+        calypso_relocation_end(relocation);
+}
+
+/* Writes the copies of the blocks from first on, whose destinations are in a row */
+static void calypso_relocation_write_run(struct calypso_relocation *relocation, unsigned int first, unsigned int nr_blocks)
+{
+    struct bio *bio = bio_alloc(GFP_NOIO, nr_blocks);
+    unsigned int i;
+
+    bio_set_dev(bio, relocation->engine->physical_dev);
+    bio->bi_iter.bi_sector = relocation->to_blocks[first] * 8;
+    bio->bi_opf = REQ_OP_WRITE | REQ_CALYPSO;
+    for (i = first; i < first + nr_blocks; i++)
+        bio_add_page(bio, relocation->pages[i], PAGE_SIZE, 0);
+    bio->bi_private = relocation;
+    bio->bi_end_io = calypso_relocation_write_end_io;
+
+    atomic_inc(&(relocation->pending_writes));
+    submit_bio(bio);
+}
+
+/*
+ * Registers the blocks the copies from first on are written to, so that
+ * host writes to them wait until they were remapped rather than being
+ * overwritten by the copies. Stops at the first one the host took since
+ * it was claimed, or that could not be registered.
+ *
+ * Returns how many were registered
+ */
+static unsigned int calypso_relocation_register_copies(struct calypso_relocation *relocation, unsigned int first, unsigned int nr_blocks)
+{
+    struct calypso_relocation_engine *engine = relocation->engine;
+    unsigned long flags;
+    unsigned int i;
+
+    /* calypso_relocation_give_up_claimed() hands the blocks to the host under the same lock */
+    spin_lock_irqsave(&(engine->lock), flags);
+    for (i = first; i < first + nr_blocks; i++)
+    {
+        if (!calypso_reverse_index_is_owned(engine->reverse_index, relocation->to_blocks[i]))
+            break;
+        if (xa_err(xa_store(&(engine->relocations), relocation->to_blocks[i], relocation, GFP_ATOMIC)) != 0)
+            break;
+    }
+    spin_unlock_irqrestore(&(engine->lock), flags);
+
+    return i - first;
+}
+
+/*
+ * Runs in the worker once the blocks were read, or taken from memory: lets
+ * the host writes go, claims runs of free blocks in a row for the copies
+ * and writes each run with a single bio. Calypso requests to the blocks
+ * wait for the remap, so they never see what the host wrote over them
+ */
+static void calypso_relocation_write(struct calypso_relocation *relocation)
+{
+    struct calypso_relocation_engine *engine = relocation->engine;
+    struct bio_list host_bios;
+    struct bio *bio;
+    unsigned long start;
+    unsigned long flags;
+    unsigned int i, j, nr, registered;
+    bool stolen;
+
+    spin_lock_irqsave(&(engine->lock), flags);
+    relocation->copied = true;
+    bio_list_init(&host_bios);
+    bio_list_merge(&host_bios, &(relocation->host_bios));
+    bio_list_init(&(relocation->host_bios));
+    spin_unlock_irqrestore(&(engine->lock), flags);
+
+    if (relocation->status != BLK_STS_OK)
+        debug_args(KERN_ERR, __func__, "Could not read blocks %lu to %lu, their virtual blocks are lost\n", relocation->from_block, relocation->from_block + relocation->nr_blocks - 1);
+
+    /* the host writes to the old blocks are on their way */
+    for (i = 0; i < relocation->nr_blocks; i++)
+        engine->give_up_block(relocation->from_block + i);
+    while ((bio = bio_list_pop(&host_bios)))
+        generic_make_request(bio);
+
+    if (relocation->status != BLK_STS_OK)
+    {
+        calypso_relocation_end(relocation);
+        return;
+    }
+
+    /* held until every write was submitted */
+    atomic_set(&(relocation->pending_writes), 1);
+    for (i = 0; i < relocation->nr_blocks; i += nr)
+    {
+        nr = relocation->nr_blocks - i;
+        start = 0;
+        if (engine->claim_extent(&start, &nr) != 0)
+        {
+            for (j = i; j < relocation->nr_blocks; j++)
+                debug_args(KERN_ERR, __func__, "No more blocks to copy block %lu to, virtual block %lu is lost\n", relocation->from_block + j, relocation->virtual_block_nrs[j]);
+            break;
+        }
+        for (j = 0; j < nr; j++)
+            relocation->to_blocks[i + j] = start + j;
+
+        registered = calypso_relocation_register_copies(relocation, i, nr);
+        if (registered < nr)
+        {
+            /* the rest are claimed again, unless registering failed for lack of memory. The host keeps the block it took */
+            stolen = !calypso_reverse_index_is_owned(engine->reverse_index, relocation->to_blocks[i + registered]);
+            for (j = i + registered; j < i + nr; j++)
+            {
+                engine->release_block(relocation->to_blocks[j]);
+                relocation->to_blocks[j] = -1;
+            }
+            if (registered == 0 && !stolen)
+            {
+                for (j = i; j < relocation->nr_blocks; j++)
+                    debug_args(KERN_ERR, __func__, "Could not copy block %lu, virtual block %lu is lost\n", relocation->from_block + j, relocation->virtual_block_nrs[j]);
+                break;
+            }
+            nr = registered;
+        }
+        if (nr > 0)
+            calypso_relocation_write_run(relocation, i, nr);
+    }
+
+    if (atomic_dec_and_test(&(relocation->pending_writes)))
+        calypso_relocation_end(relocation);
+}
+
+static void calypso_relocation_read_end_io(struct bio *bio)
+{
+    struct calypso_relocation *relocation = bio->bi_private;
+    struct calypso_relocation_engine *engine = relocation->engine;
+    unsigned long flags;
+
+    relocation->status = bio->bi_status;
+    bio_put(bio);
+
+    /* the host writes are resubmitted from process context */
+    spin_lock_irqsave(&(engine->lock), flags);
+    list_add_tail(&(relocation->list), &(engine->read));
+    spin_unlock_irqrestore(&(engine->lock), flags);
+    queue_work(engine->wq, &(engine->work));
+}
+
+/* Takes pages for the copies and reads the blocks into them with a single bio */
+static void calypso_relocation_read(struct calypso_relocation *relocation)
+{
+    struct calypso_relocation_engine *engine = relocation->engine;
+    struct bio *bio = bio_alloc(GFP_NOIO, relocation->nr_blocks);
+    unsigned int i;
+
+    bio_set_dev(bio, engine->physical_dev);
+    bio->bi_iter.bi_sector = relocation->from_block * 8;
+    bio->bi_opf = REQ_OP_READ | REQ_CALYPSO;
+    for (i = 0; i < relocation->nr_blocks; i++)
+    {
+        relocation->pages[i] = mempool_alloc(engine->page_pool, GFP_NOIO);
+        /* tells the completion of a write which block a page is the copy of */
+        set_page_private(relocation->pages[i], i);
+        bio_add_page(bio, relocation->pages[i], PAGE_SIZE, 0);
+    }
+    bio->bi_private = relocation;
+    bio->bi_end_io = calypso_relocation_read_end_io;
+    submit_bio(bio);
+}
+
+/* A relocation starts when its blocks fit in the blocks left to copy, or when nothing else is copied */
+static bool calypso_relocation_can_start(struct calypso_relocation_engine *engine, unsigned int nr_blocks)
+{
+    return engine->inflight == 0 || engine->inflight + nr_blocks <= engine->max_inflight;
+}
+
+/*
+ * Submits again the Calypso requests whose blocks were remapped, writes
+ * the blocks that were read, then starts queued relocations while there
+ * is room
+ */
+static void calypso_relocation_work(struct work_struct *work)
+{
+    struct calypso_relocation_engine *engine = container_of(work, struct calypso_relocation_engine, work);
+    struct calypso_relocation *relocation, *tmp;
+    struct bio_list remapped;
+    struct bio *bio;
+    unsigned long flags;
+    LIST_HEAD(read);
+    LIST_HEAD(start);
+
+    bio_list_init(&remapped);
+    spin_lock_irqsave(&(engine->lock), flags);
+    bio_list_merge(&remapped, &(engine->remapped));
+    bio_list_init(&(engine->remapped));
+    list_splice_init(&(engine->read), &read);
+    while (!list_empty(&(engine->queued)))
+    {
+        relocation = list_first_entry(&(engine->queued), struct calypso_relocation, list);
+        if (!calypso_relocation_can_start(engine, relocation->nr_blocks))
+            break;
+        list_move_tail(&(relocation->list), &start);
+        engine->inflight += relocation->nr_blocks;
+    }
+    spin_unlock_irqrestore(&(engine->lock), flags);
+
+    while ((bio = bio_list_pop(&remapped)))
+        generic_make_request(bio);
+
+    list_for_each_entry_safe(relocation, tmp, &read, list)
+    {
+        list_del(&(relocation->list));
+        calypso_relocation_write(relocation);
+    }
+    list_for_each_entry_safe(relocation, tmp, &start, list)
+    {
+        list_del(&(relocation->list));
+        calypso_relocation_read(relocation);
+    }
+}
+
+/*
+ * Fills pages with the blocks from the first of the relocation on that
+ * are in memory, stopping at the first that is not. Only takes pages
+ * that are there without waiting, so the host write is never slower
+ * than reading the blocks would have been.
+ *
+ * Returns how many blocks were captured
+ */
+static unsigned int calypso_relocation_snapshot(struct calypso_relocation *relocation, unsigned int nr_blocks)
+{
+    struct calypso_relocation_engine *engine = relocation->engine;
+    struct page *page;
+    unsigned int i;
+
+    if (!engine->snapshot_block)
+        return 0;
+
+    for (i = 0; i < nr_blocks; i++)
+    {
+        page = mempool_alloc(engine->page_pool, GFP_NOWAIT);
+        if (!page)
+            break;
+        if (engine->snapshot_block(relocation->virtual_block_nrs[i], page) != 0)
+        {
+            mempool_free(page, engine->page_pool);
+            break;
+        }
+        set_page_private(page, i);
+        relocation->pages[i] = page;
+    }
+
+    return i;
+}
+
+/* Gives back the pages of the blocks from first on, which the relocation does not copy */
+static void calypso_relocation_drop_pages(struct calypso_relocation *relocation, unsigned int first, unsigned int nr_blocks)
+{
+    unsigned int i;
+
+    for (i = first; i < nr_blocks; i++)
+    {
+        if (!relocation->pages[i])
+            break;
+        set_page_private(relocation->pages[i], 0);
+        mempool_free(relocation->pages[i], relocation->engine->page_pool);
+        relocation->pages[i] = NULL;
+    }
+}
+
+/*
+ * The host bio is about to overwrite the nr_blocks Calypso blocks in a
+ * row from from_block. Relocates as many of them as are not being
+ * relocated already, up to CALYPSO_RELOCATION_MAX_BLOCKS, and sets
+ * *nr_queued to how many it looked at. Holds the bio, unless it is NULL,
+ * until the blocks were read and resubmits it afterwards. When the first
+ * blocks are in memory, and there is room to copy them now, only those
+ * are relocated and the bio is not held at all.
+ *
+ * Returns 0 if a relocation of *nr_queued blocks was queued,
+ * CALYPSO_RELOCATION_CAPTURED if their copies were taken from memory and
+ * the bio can go on, -EINPROGRESS if the first block is being read
+ * already and the bio waits for it, -EEXIST if it was already read and
+ * the bio can go on, or another error if the blocks could not be relocated
+ */
+int calypso_relocation_queue(struct calypso_relocation_engine *engine, unsigned long from_block, unsigned int nr_blocks,
+                    struct bio *bio, unsigned int *nr_queued)
+{
+    struct calypso_relocation *relocation, *existing;
+    unsigned int nr_captured;
+    bool start = false;
+    bool captured = false;
+    unsigned long flags;
+    unsigned int i, j;
+    int ret = 0;
+
+    nr_blocks = min_t(unsigned int, nr_blocks, CALYPSO_RELOCATION_MAX_BLOCKS);
+    relocation = mempool_alloc(engine->relocation_pool, GFP_NOIO);
+    relocation->engine = engine;
+    relocation->from_block = from_block;
+    for (i = 0; i < nr_blocks; i++)
+    {
+        relocation->virtual_block_nrs[i] = calypso_reverse_index_get(engine->reverse_index, from_block + i);
+        relocation->to_blocks[i] = -1;
+        relocation->pages[i] = NULL;
+    }
+    bio_list_init(&(relocation->host_bios));
+    bio_list_init(&(relocation->calypso_bios));
+    relocation->copied = false;
+    relocation->status = BLK_STS_OK;
+    atomic_set(&(relocation->pending_writes), 0);
+    INIT_LIST_HEAD(&(relocation->list));
+    /* before the lock, since the block may have to be encrypted */
+    nr_captured = calypso_relocation_snapshot(relocation, nr_blocks);
+
+    spin_lock_irqsave(&(engine->lock), flags);
+    /* the relocation stops at the first block another one has */
+    for (i = 0; i < nr_blocks; i++)
+    {
+        if (xa_load(&(engine->relocations), from_block + i))
+            break;
+    }
+    if (i == 0)
+    {
+        existing = xa_load(&(engine->relocations), from_block);
+        /* a copy just remapped, which the bio relocates once the relocation writing it ended */
+        if (from_block < existing->from_block || from_block >= existing->from_block + existing->nr_blocks)
+        {
+            if (bio)
+                bio_list_add(&(existing->calypso_bios), bio);
+            ret = -EINPROGRESS;
+        }
+        else if (existing->copied)
+            ret = -EEXIST;
+        else
+        {
+            if (bio)
+                bio_list_add(&(existing->host_bios), bio);
+            ret = -EINPROGRESS;
+        }
+        spin_unlock_irqrestore(&(engine->lock), flags);
+        calypso_relocation_drop_pages(relocation, 0, nr_blocks);
+        mempool_free(relocation, engine->relocation_pool);
+        *nr_queued = 1;
+        return ret;
+    }
+
+    /* the blocks captured are copied now or not at all, as queued relocations do not hold pages */
+    nr_captured = min(nr_captured, i);
+    if (nr_captured > 0 && list_empty(&(engine->queued)) && calypso_relocation_can_start(engine, nr_captured))
+    {
+        i = nr_captured;
+        captured = true;
+    }
+
+    *nr_queued = i;
+    relocation->nr_blocks = i;
+    for (j = 0; j < i; j++)
+    {
+        ret = xa_err(xa_store(&(engine->relocations), from_block + j, relocation, GFP_ATOMIC));
+        if (ret != 0)
+        {
+            while (j-- > 0)
+                xa_erase(&(engine->relocations), from_block + j);
+            spin_unlock_irqrestore(&(engine->lock), flags);
+            calypso_relocation_drop_pages(relocation, 0, nr_blocks);
+            mempool_free(relocation, engine->relocation_pool);
+            return ret;
+        }
+    }
+    engine->nr_pending += i;
+    if (captured)
+    {
+        /* the worker writes the copies as if the blocks had just been read */
+        relocation->copied = true;
+        engine->inflight += i;
+        list_add_tail(&(relocation->list), &(engine->read));
+    }
+    else
+    {
+        if (bio)
+            bio_list_add(&(relocation->host_bios), bio);
+        if (list_empty(&(engine->queued)) && calypso_relocation_can_start(engine, i))
+        {
+            engine->inflight += i;
+            start = true;
+        }
+        else
+            list_add_tail(&(relocation->list), &(engine->queued));
+    }
+    spin_unlock_irqrestore(&(engine->lock), flags);
+
+    calypso_relocation_drop_pages(relocation, captured ? i : 0, nr_blocks);
+
+    if (captured)
+    {
+        queue_work(engine->wq, &(engine->work));
+        return CALYPSO_RELOCATION_CAPTURED;
+    }
+    if (start)
+        calypso_relocation_read(relocation);
+
+    return 0;
+}
+
+/*
+ * Holds a Calypso request to block, which is mapped to it, if the block is
+ * being relocated. The request is submitted again once the block was
+ * remapped to its copy, or the copy failed, and looks the block up again.
+ *
+ * Returns true if the request is held
+ */
+bool calypso_relocation_hold(struct calypso_relocation_engine *engine, unsigned long block, struct bio *bio)
+{
+    struct calypso_relocation *relocation;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(engine->lock), flags);
+    relocation = xa_load(&(engine->relocations), block);
+    if (relocation)
+        bio_list_add(&(relocation->calypso_bios), bio);
+    spin_unlock_irqrestore(&(engine->lock), flags);
+
+    return relocation != NULL;
+}
+
+/*
+ * Hands block, claimed by Calypso but not holding anything, to the host
+ * bio writing over it, unless a copy is being written to it. The bio is
+ * then held, unless it is NULL, until the copy was remapped, and comes
+ * back to relocate it.
+ *
+ * Returns true if a copy is being written to the block
+ */
+bool calypso_relocation_give_up_claimed(struct calypso_relocation_engine *engine, unsigned long block, struct bio *bio)
+{
+    struct calypso_relocation *relocation;
+    unsigned long flags;
+
+    spin_lock_irqsave(&(engine->lock), flags);
+    relocation = xa_load(&(engine->relocations), block);
+    if (!relocation)
+        engine->give_up_block(block);
+    else if (bio)
+        bio_list_add(&(relocation->calypso_bios), bio);
+    spin_unlock_irqrestore(&(engine->lock), flags);
+
+    return relocation != NULL;
+}
+
+/* Whether block is being relocated, so what it holds may be the host's already */
+bool calypso_relocation_contains(struct calypso_relocation_engine *engine, unsigned long block)
+{
+    unsigned long flags;
+    bool found;
+
+    spin_lock_irqsave(&(engine->lock), flags);
+    found = xa_load(&(engine->relocations), block) != NULL;
+    spin_unlock_irqrestore(&(engine->lock), flags);
+
+    return found;
+}
+
+/* Waits for the relocations queued or in flight, whose copies remap blocks, and for the host writes being timed */
+void calypso_relocation_wait(struct calypso_relocation_engine *engine)
+{
+    wait_event(engine->idle, calypso_relocation_pending(engine) == 0 && atomic_read(&(engine->tracked_writes)) == 0);
+}
+
+static void calypso_relocation_host_write_end_io(struct bio *bio)
+{
+    struct calypso_relocation_host_write *host_write = bio->bi_private;
+    struct calypso_relocation_engine *engine = host_write->engine;
+    u64 us = div_u64(ktime_get_ns() - host_write->start_ns, NSEC_PER_USEC);
+    unsigned int bucket = us > 0 ? min_t(unsigned int, ilog2(us), CALYPSO_RELOCATION_LATENCY_BUCKETS - 1) : 0;
+
+    atomic64_inc(&(engine->host_write_latency[bucket]));
+
+    bio->bi_end_io = host_write->end_io;
+    bio->bi_private = host_write->private;
+    kfree(host_write);
+    bio_endio(bio);
+
+    if (atomic_dec_and_test(&(engine->tracked_writes)))
+        wake_up_all(&(engine->idle));
+}
+
+/*
+ * Times the host bio, which writes over Calypso blocks, from now until it
+ * completes. A bio held for a relocation comes back through the hook and
+ * keeps being timed from the first time
+ */
+void calypso_relocation_track_host_write(struct calypso_relocation_engine *engine, struct bio *bio)
+{
+    struct calypso_relocation_host_write *host_write;
+
+    if (bio->bi_end_io == calypso_relocation_host_write_end_io)
+        return;
+
+    /* the write is not timed rather than held for memory */
+    host_write = kmalloc(sizeof(struct calypso_relocation_host_write), GFP_NOWAIT);
+    if (!host_write)
+        return;
+
+    host_write->engine = engine;
+    host_write->start_ns = ktime_get_ns();
+    host_write->end_io = bio->bi_end_io;
+    host_write->private = bio->bi_private;
+    atomic_inc(&(engine->tracked_writes));
+    bio->bi_private = host_write;
+    bio->bi_end_io = calypso_relocation_host_write_end_io;
+}
+
+/* Copies up to max_inflight blocks at a time, and at least CALYPSO_RELOCATION_MAX_BLOCKS. Without snapshot_block, every block is read */
+int calypso_relocation_init(struct calypso_relocation_engine *engine, struct block_device *physical_dev,
+                    struct calypso_reverse_index *reverse_index, unsigned int max_inflight,
+                    int (*claim_extent)(unsigned long *start, unsigned int *nr),
+                    void (*release_block)(unsigned long block),
+                    int (*move_mapping)(unsigned long virtual_block_nr, unsigned long from_block, unsigned long to_block),
+                    void (*give_up_block)(unsigned long block),
+                    int (*snapshot_block)(unsigned long virtual_block_nr, struct page *page))
+{
+    unsigned int i;
+
+    xa_init(&(engine->relocations));
+    engine->nr_pending = 0;
+    INIT_LIST_HEAD(&(engine->queued));
+    INIT_LIST_HEAD(&(engine->read));
+    bio_list_init(&(engine->remapped));
+    engine->inflight = 0;
+    /* a relocation takes pages for all of its blocks at once, so one of the largest always fits */
+    engine->max_inflight = max_t(unsigned int, max_inflight, CALYPSO_RELOCATION_MAX_BLOCKS);
+    spin_lock_init(&(engine->lock));
+    init_waitqueue_head(&(engine->idle));
+    engine->physical_dev = physical_dev;
+    engine->reverse_index = reverse_index;
+    for (i = 0; i < CALYPSO_RELOCATION_LATENCY_BUCKETS; i++)
+        atomic64_set(&(engine->host_write_latency[i]), 0);
+    atomic_set(&(engine->tracked_writes), 0);
+    engine->claim_extent = claim_extent;
+    engine->release_block = release_block;
+    engine->move_mapping = move_mapping;
+    engine->give_up_block = give_up_block;
+    engine->snapshot_block = snapshot_block;
+
+    /* in flight there is at least a block per relocation */
+    engine->relocation_pool = mempool_create_kmalloc_pool(engine->max_inflight, sizeof(struct calypso_relocation));
+    if (!engine->relocation_pool)
+        goto error;
+    engine->page_pool = mempool_create_page_pool(engine->max_inflight, 0);
+    if (!engine->page_pool)
+        goto error_after_relocation_pool;
+
+    engine->wq = alloc_workqueue("calypso_relocation", WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+    if (!engine->wq)
+        goto error_after_page_pool;
+    INIT_WORK(&(engine->work), calypso_relocation_work);
+
+    return 0;
+
+error_after_page_pool:
+    mempool_destroy(engine->page_pool);
+error_after_relocation_pool:
+    mempool_destroy(engine->relocation_pool);
+error:
+    debug(KERN_ERR, __func__, "Could not allocate relocation engine\n");
+    return -ENOMEM;
+}
+
+/* Lets the relocations in flight finish, so the host must not be able to queue more */
+void calypso_relocation_cleanup(struct calypso_relocation_engine *engine)
+{
+    calypso_relocation_wait(engine);
+    destroy_workqueue(engine->wq);
+    mempool_destroy(engine->page_pool);
+    mempool_destroy(engine->relocation_pool);
+    xa_destroy(&(engine->relocations));
+}
@@ -0,0 +1,136 @@
+#ifndef RELOCATION_H
+#define RELOCATION_H
+
+#include <linux/types.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/mempool.h>
+#include <linux/wait.h>
+#include <linux/bio.h>
+
+#include "global.h"
+#include "reverse_index.h"
+
+
+#define CALYPSO_RELOCATION_MAX_INFLIGHT_DEFAULT 256
+
+/* Most blocks in a row a relocation reads with a single bio */
+#define CALYPSO_RELOCATION_MAX_BLOCKS 64
+
+/* Returned when the blocks were copied from memory and the host write can go on */
+#define CALYPSO_RELOCATION_CAPTURED 1
+
+/* Latencies of host writes over Calypso blocks, in powers of two of microseconds */
+#define CALYPSO_RELOCATION_LATENCY_BUCKETS 20
+
+struct calypso_relocation_engine;
+
+/* Copy of Calypso blocks in a row the host is about to overwrite */
+struct calypso_relocation {
+    struct calypso_relocation_engine *engine;
+    unsigned long from_block;
+    unsigned int nr_blocks;
+    unsigned long virtual_block_nrs[CALYPSO_RELOCATION_MAX_BLOCKS];
+    /* claimed in as few runs of blocks in a row as the free blocks allow, -1 until then */
+    unsigned long to_blocks[CALYPSO_RELOCATION_MAX_BLOCKS];
+    /* from the engine's pool while in flight, with their index as private */
+    struct page *pages[CALYPSO_RELOCATION_MAX_BLOCKS];
+    /* host writes to the blocks, held until they were read */
+    struct bio_list host_bios;
+    /* Calypso requests to the blocks, and host writes to their copies, held until the blocks were remapped */
+    struct bio_list calypso_bios;
+    /* the blocks were read, or taken from memory, so later host writes to them can go on */
+    bool copied;
+    blk_status_t status;
+    /* write bios of the copies in flight */
+    atomic_t pending_writes;
+    /* in the queue, or read and waiting for the worker */
+    struct list_head list;
+};
+
+/*
+ * Copies the Calypso blocks the host is about to overwrite somewhere else.
+ * Blocks in a row are read with a single bio, the host writes to them are
+ * let go as soon as they were, and the copies are written to runs of
+ * newly claimed blocks in a row, one bio per run, after which the virtual
+ * blocks are remapped. Up to max_inflight blocks are copied at once and
+ * the other relocations wait in a queue, so a host write over many
+ * Calypso blocks neither waits for them one at a time nor pins a page for
+ * each. Host writes to a block being copied wait for that copy instead of
+ * starting another one. Calypso requests to a block being copied wait
+ * until it was remapped and are then looked up again, since the host may
+ * have written over the old block already. Host writes to a block a copy
+ * is written to wait until it was remapped as well, and relocate it then.
+ * Blocks whose data is still in memory, in one of the caches of the
+ * Calypso device, are not read at all: their copies are taken from there
+ * and the host write goes on right away.
+ */
+struct calypso_relocation_engine {
+    /* from block, and the block its copy is written to -> struct calypso_relocation, until the copies are written */
+    struct xarray relocations;
+    /* blocks queued or in flight */
+    unsigned long nr_pending;
+    /* relocations waiting for a slot */
+    struct list_head queued;
+    /* relocations whose blocks were read, for the worker to write */
+    struct list_head read;
+    /* requests whose blocks were remapped, for the worker to submit again */
+    struct bio_list remapped;
+    /* blocks being copied */
+    unsigned int inflight;
+    unsigned int max_inflight;
+    /* taken from bio completion as well */
+    spinlock_t lock;
+    wait_queue_head_t idle;
+
+    /* hold enough for max_inflight blocks, so copies in flight never wait for memory */
+    mempool_t *relocation_pool;
+    mempool_t *page_pool;
+
+    struct workqueue_struct *wq;
+    struct work_struct work;
+
+    struct block_device *physical_dev;
+    struct calypso_reverse_index *reverse_index;
+
+    /* host writes over Calypso blocks, by how long they took from the hook to their completion */
+    atomic64_t host_write_latency[CALYPSO_RELOCATION_LATENCY_BUCKETS];
+    /* host writes being timed, whose completion comes through the engine */
+    atomic_t tracked_writes;
+
+    /* Claims up to *nr free blocks in a row, and sets *nr to how many it did */
+    int (*claim_extent)(unsigned long *start, unsigned int *nr);
+    void (*release_block)(unsigned long block);
+    /* Remaps the virtual block, or returns -EAGAIN if it was remapped meanwhile */
+    int (*move_mapping)(unsigned long virtual_block_nr, unsigned long from_block, unsigned long to_block);
+    /* The block was read, or held nothing, and the host owns it from now on */
+    void (*give_up_block)(unsigned long block);
+    /* Fills the page with what the virtual block reads as on disk, or returns -ENOENT if it is not in memory. Can be NULL */
+    int (*snapshot_block)(unsigned long virtual_block_nr, struct page *page);
+};
+
+int calypso_relocation_init(struct calypso_relocation_engine *engine, struct block_device *physical_dev,
+                    struct calypso_reverse_index *reverse_index, unsigned int max_inflight,
+                    int (*claim_extent)(unsigned long *start, unsigned int *nr),
+                    void (*release_block)(unsigned long block),
+                    int (*move_mapping)(unsigned long virtual_block_nr, unsigned long from_block, unsigned long to_block),
+                    void (*give_up_block)(unsigned long block),
+                    int (*snapshot_block)(unsigned long virtual_block_nr, struct page *page));
+void calypso_relocation_cleanup(struct calypso_relocation_engine *engine);
+
+int calypso_relocation_queue(struct calypso_relocation_engine *engine, unsigned long from_block, unsigned int nr_blocks,
+                    struct bio *bio, unsigned int *nr_queued);
+void calypso_relocation_wait(struct calypso_relocation_engine *engine);
+void calypso_relocation_track_host_write(struct calypso_relocation_engine *engine, struct bio *bio);
+bool calypso_relocation_hold(struct calypso_relocation_engine *engine, unsigned long block, struct bio *bio);
+bool calypso_relocation_give_up_claimed(struct calypso_relocation_engine *engine, unsigned long block, struct bio *bio);
+bool calypso_relocation_contains(struct calypso_relocation_engine *engine, unsigned long block);
+
+static inline unsigned long calypso_relocation_pending(struct calypso_relocation_engine *engine)
+{
+    return READ_ONCE(engine->nr_pending);
+}
+
+
+#endif
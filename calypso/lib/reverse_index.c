@@ -0,0 +1,141 @@
+/*
+ * Sparse physical to virtual block index
+ */
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/slab.h>
+
+#include "global.h"
+#include "debug.h"
+#include "reverse_index.h"
+
+
+/* Blocks are marked as Calypso's in block_state when they get an entry */
+int calypso_reverse_index_init(struct calypso_reverse_index *index, struct calypso_block_state *block_state)
+{
+    /* entries are updated from bio completion, so the lock needs to be irq safe */
+    xa_init_flags(&(index->physical_to_virtual), XA_FLAGS_LOCK_IRQ);
+    index->block_state = block_state;
+    index->nr_blocks = block_state->nr_blocks;
+    atomic_long_set(&(index->nr_entries), 0);
+
+    return 0;
+}
+
+void calypso_reverse_index_cleanup(struct calypso_reverse_index *index)
+{
+    if (index->block_state)
+    {
+        xa_destroy(&(index->physical_to_virtual));
+        index->block_state = NULL;
+    }
+}
+
+/*
+ * Records that physical_block_nr holds virtual_block_nr. The block must
+ * have been claimed, so it is CALYPSO_BLOCK_CALYPSO_DATA already.
+ *
+ * Returns -EBUSY if the host took the block meanwhile, in which case it
+ * has no entry
+ */
+int calypso_reverse_index_set(struct calypso_reverse_index *index, unsigned long physical_block_nr, unsigned long virtual_block_nr)
+{
+    unsigned long flags;
+    void *old;
+
+    if (physical_block_nr >= index->nr_blocks)
+        return -EINVAL;
+
+    /* callers may hold a mapping lock with interrupts off, which xa_store_irq() would turn back on */
+    xa_lock_irqsave(&(index->physical_to_virtual), flags);
+    old = __xa_store(&(index->physical_to_virtual), physical_block_nr, xa_mk_value(virtual_block_nr), GFP_ATOMIC);
+    xa_unlock_irqrestore(&(index->physical_to_virtual), flags);
+    if (xa_is_err(old))
+    {
+        debug_args(KERN_ERR, __func__, "Could not store reverse mapping of physical block %lu\n", physical_block_nr);
+        return xa_err(old);
+    }
+    if (!old)
+        atomic_long_inc(&(index->nr_entries));
+
+    /* the hook hands claimed blocks without an entry to the host, so check it did not after the entry was stored */
+    if (!calypso_block_state_change(index->block_state, physical_block_nr, CALYPSO_BLOCK_CALYPSO_DATA, CALYPSO_BLOCK_CALYPSO_DATA))
+    {
+        debug_args(KERN_ERR, __func__, "Physical block %lu was taken by the host before it was mapped\n", physical_block_nr);
+        calypso_reverse_index_clear(index, physical_block_nr);
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+/* Marks physical_block_nr as Calypso's and records it, for mappings loaded from the hidden metadata */
+int calypso_reverse_index_load(struct calypso_reverse_index *index, unsigned long physical_block_nr, unsigned long virtual_block_nr)
+{
+    if (physical_block_nr >= index->nr_blocks)
+        return -EINVAL;
+
+    calypso_block_state_set(index->block_state, physical_block_nr, CALYPSO_BLOCK_CALYPSO_DATA);
+    return calypso_reverse_index_set(index, physical_block_nr, virtual_block_nr);
+}
+
+void calypso_reverse_index_clear(struct calypso_reverse_index *index, unsigned long physical_block_nr)
+{
+    unsigned long flags;
+    void *old;
+
+    if (physical_block_nr >= index->nr_blocks)
+        return;
+
+    /* the block stays Calypso's until the caller releases it or hands it to the host */
+    xa_lock_irqsave(&(index->physical_to_virtual), flags);
+    old = __xa_erase(&(index->physical_to_virtual), physical_block_nr);
+    xa_unlock_irqrestore(&(index->physical_to_virtual), flags);
+    if (old)
+        atomic_long_dec(&(index->nr_entries));
+}
+
+/*
+ * Returns the virtual block stored in physical_block_nr,
+ * or -1 if the block is not used by Calypso
+ */
+unsigned long calypso_reverse_index_get(struct calypso_reverse_index *index, unsigned long physical_block_nr)
+{
+    void *entry;
+
+    if (physical_block_nr >= index->nr_blocks || !calypso_reverse_index_is_owned(index, physical_block_nr))
+        return -1;
+
+    entry = xa_load(&(index->physical_to_virtual), physical_block_nr);
+    if (!entry)
+        return -1;
+
+    return xa_to_value(entry);
+}
+
+/*
+ * The xarray does not report its own size, so we count the leaf nodes its
+ * entries fall in. Interior nodes are about 1/XA_CHUNK_SIZE of the leaves
+ * and are accounted as such.
+ */
+size_t calypso_reverse_index_memory_bytes(struct calypso_reverse_index *index)
+{
+    unsigned long physical_block_nr;
+    unsigned long last_chunk = ULONG_MAX;
+    unsigned long leaves = 0;
+    void *entry;
+
+    if (!index->block_state)
+        return 0;
+
+    xa_for_each(&(index->physical_to_virtual), physical_block_nr, entry)
+    {
+        if ((physical_block_nr >> XA_CHUNK_SHIFT) != last_chunk)
+        {
+            last_chunk = physical_block_nr >> XA_CHUNK_SHIFT;
+            leaves++;
+        }
+    }
+
+    return (leaves + DIV_ROUND_UP(leaves, XA_CHUNK_SIZE)) * sizeof(struct xa_node);
+}
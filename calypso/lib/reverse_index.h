@@ -0,0 +1,41 @@
+#ifndef REVERSE_INDEX_H
+#define REVERSE_INDEX_H
+
+#include <linux/types.h>
+#include <linux/xarray.h>
+#include <linux/bitops.h>
+
+#include "block_state.h"
+
+
+/*
+ * Physical to virtual block mappings. Only physical blocks holding Calypso
+ * data have an entry, so memory grows with the amount of hidden data
+ * instead of with the size of the native partition.
+ */
+struct calypso_reverse_index {
+    /* physical block number -> xa_mk_value(virtual block number) */
+    struct xarray physical_to_virtual;
+    /* blocks with an entry are CALYPSO_BLOCK_CALYPSO_DATA, so any other state is a fast negative check */
+    struct calypso_block_state *block_state;
+    unsigned long nr_blocks;
+    atomic_long_t nr_entries;
+};
+
+int calypso_reverse_index_init(struct calypso_reverse_index *index, struct calypso_block_state *block_state);
+void calypso_reverse_index_cleanup(struct calypso_reverse_index *index);
+
+int calypso_reverse_index_set(struct calypso_reverse_index *index, unsigned long physical_block_nr, unsigned long virtual_block_nr);
+int calypso_reverse_index_load(struct calypso_reverse_index *index, unsigned long physical_block_nr, unsigned long virtual_block_nr);
+void calypso_reverse_index_clear(struct calypso_reverse_index *index, unsigned long physical_block_nr);
+unsigned long calypso_reverse_index_get(struct calypso_reverse_index *index, unsigned long physical_block_nr);
+
+size_t calypso_reverse_index_memory_bytes(struct calypso_reverse_index *index);
+
+static __always_inline bool calypso_reverse_index_is_owned(struct calypso_reverse_index *index, unsigned long physical_block_nr)
+{
+    return calypso_block_state_get(index->block_state, physical_block_nr) == CALYPSO_BLOCK_CALYPSO_DATA;
+}
+
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Sparse virtual to physical block mappings
+ */
+#include <linux/kernel.h>
+
+#include "debug.h"
+#include "sparse_map.h"
+
+
+void calypso_sparse_map_init(struct calypso_sparse_map *map)
+{
+    /* mappings are updated from bio completion, so the lock needs to be irq safe */
+    xa_init_flags(&(map->virtual_to_physical), XA_FLAGS_LOCK_IRQ);
+    atomic_long_set(&(map->nr_entries), 0);
+}
+
+void calypso_sparse_map_cleanup(struct calypso_sparse_map *map)
+{
+    xa_destroy(&(map->virtual_to_physical));
+    atomic_long_set(&(map->nr_entries), 0);
+}
+
+/*
+ * Maps virtual_block_nr to physical_block_nr. Can be called from bio completion.
+ *
+ * Returns 0 for success and a negative error code otherwise, in which case
+ * the previous mapping is kept
+ */
+int calypso_sparse_map_set(struct calypso_sparse_map *map, unsigned long virtual_block_nr, unsigned long physical_block_nr)
+{
+    unsigned long flags;
+    void *old;
+
+    /* callers hold a mapping lock with interrupts off, which xa_store_irq() would turn back on */
+    xa_lock_irqsave(&(map->virtual_to_physical), flags);
+    old = __xa_store(&(map->virtual_to_physical), virtual_block_nr, xa_mk_value(physical_block_nr), GFP_ATOMIC);
+    xa_unlock_irqrestore(&(map->virtual_to_physical), flags);
+    if (xa_is_err(old))
+    {
+        debug_args(KERN_ERR, __func__, "Could not map virtual block %lu\n", virtual_block_nr);
+        return xa_err(old);
+    }
+    if (!old)
+        atomic_long_inc(&(map->nr_entries));
+
+    return 0;
+}
+
+/* Unmaps virtual_block_nr, which gives back its memory once the rest of its chunk is unmapped too */
+void calypso_sparse_map_clear(struct calypso_sparse_map *map, unsigned long virtual_block_nr)
+{
+    unsigned long flags;
+    void *old;
+
+    xa_lock_irqsave(&(map->virtual_to_physical), flags);
+    old = __xa_erase(&(map->virtual_to_physical), virtual_block_nr);
+    xa_unlock_irqrestore(&(map->virtual_to_physical), flags);
+    if (old)
+        atomic_long_dec(&(map->nr_entries));
+}
+
+/* Counted the same way as in calypso_reverse_index_memory_bytes() */
+size_t calypso_sparse_map_memory_bytes(struct calypso_sparse_map *map)
+{
+    unsigned long virtual_block_nr;
+    unsigned long last_chunk = ULONG_MAX;
+    unsigned long leaves = 0;
+    void *entry;
+
+    xa_for_each(&(map->virtual_to_physical), virtual_block_nr, entry)
+    {
+        if ((virtual_block_nr >> XA_CHUNK_SHIFT) != last_chunk)
+        {
+            last_chunk = virtual_block_nr >> XA_CHUNK_SHIFT;
+            leaves++;
+        }
+    }
+
+    return (leaves + DIV_ROUND_UP(leaves, XA_CHUNK_SIZE)) * sizeof(struct xa_node);
+}
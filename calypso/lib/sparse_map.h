@@ -0,0 +1,53 @@
+#ifndef SPARSE_MAP_H
+#define SPARSE_MAP_H
+
+#include <linux/types.h>
+#include <linux/xarray.h>
+#include <linux/atomic.h>
+
+
+/*
+ * Virtual to physical block mappings of only the blocks that were written.
+ * Unwritten ranges of the virtual device take no memory, so it can be
+ * made much bigger than the hidden data it is expected to hold.
+ */
+struct calypso_sparse_map {
+    /* virtual block number -> xa_mk_value(physical block number) */
+    struct xarray virtual_to_physical;
+    atomic_long_t nr_entries;
+};
+
+void calypso_sparse_map_init(struct calypso_sparse_map *map);
+void calypso_sparse_map_cleanup(struct calypso_sparse_map *map);
+
+int calypso_sparse_map_set(struct calypso_sparse_map *map, unsigned long virtual_block_nr, unsigned long physical_block_nr);
+void calypso_sparse_map_clear(struct calypso_sparse_map *map, unsigned long virtual_block_nr);
+size_t calypso_sparse_map_memory_bytes(struct calypso_sparse_map *map);
+
+/* Returns 0 if the block is mapped and -1 otherwise */
+static inline int calypso_sparse_map_lookup(struct calypso_sparse_map *map, unsigned long virtual_block_nr, unsigned long *physical_block_nr)
+{
+    void *entry = xa_load(&(map->virtual_to_physical), virtual_block_nr);
+
+    if (!entry)
+        return -1;
+    *physical_block_nr = xa_to_value(entry);
+    return 0;
+}
+
+/* First mapped virtual block from virtual_block_nr on and before end, or end if there is none */
+static inline unsigned long calypso_sparse_map_next(struct calypso_sparse_map *map, unsigned long virtual_block_nr, unsigned long end)
+{
+    unsigned long index = virtual_block_nr;
+
+    if (virtual_block_nr >= end || !xa_find(&(map->virtual_to_physical), &index, end - 1, XA_PRESENT))
+        return end;
+    return index;
+}
+
+/* Only safe while no mappings are being updated, e.g. when encoding metadata on cleanup */
+#define calypso_sparse_map_for_each(map, virtual_block_nr, entry) \
+    xa_for_each(&(map)->virtual_to_physical, virtual_block_nr, entry)
+
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * Statistics and tunables of Calypso exposed through sysfs
+ *
+ * usage:
+ *      $ cat /sys/kernel/calypso/relocations_per_gb
+ */
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/math64.h>
+
+#include "global.h"
+#include "debug.h"
+#include "virtual_device.h"
+#include "sysfs.h"
+
+
+static struct kobject *calypso_kobj = NULL;
+
+/* sysfs callbacks have no private data, so we keep the device we report on */
+static struct calypso_blk_device *sysfs_calypso_dev = NULL;
+
+
+static ssize_t host_bytes_written_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->stats.host_bytes_written));
+}
+
+static ssize_t relocations_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->stats.relocations));
+}
+
+static ssize_t reserve_misses_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->stats.reserve_misses));
+}
+
+static ssize_t discarded_blocks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->stats.discarded_blocks));
+}
+
+static ssize_t zero_blocks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->stats.zero_blocks));
+}
+
+static ssize_t zero_filled_reads_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->stats.zero_filled_reads));
+}
+
+static ssize_t reverse_index_entries_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&sysfs_calypso_dev->reverse_index.nr_entries));
+}
+
+/* Blocks Calypso can still hide data in, counted a word of block states at a time */
+static ssize_t free_high_entropy_blocks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", calypso_block_state_count(&sysfs_calypso_dev->block_state, CALYPSO_BLOCK_FREE_HIGH_ENTROPY));
+}
+
+/* RAM used by the block mappings, including the reverse index */
+static ssize_t mapping_memory_bytes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%zu\n", calypso_dev_mappings_memory_bytes(sysfs_calypso_dev));
+}
+
+/* Only counted when mapping_format=1 */
+static ssize_t mapping_extents_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    if (sysfs_calypso_dev->mapping_format != CALYPSO_MAPPINGS_EXTENTS)
+        return sprintf(buf, "0\n");
+    return sprintf(buf, "%lu\n", READ_ONCE(sysfs_calypso_dev->extent_map.nr_extents));
+}
+
+/* Only counted when mapping_format=2, per request, a miss being a request that waited for a page */
+static ssize_t mapping_cache_hits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->mapping_cache.hits));
+}
+
+static ssize_t mapping_cache_misses_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->mapping_cache.misses));
+}
+
+static ssize_t mapping_cache_resident_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(sysfs_calypso_dev->mapping_cache.nr_resident));
+}
+
+static ssize_t mapping_cache_writebacks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->mapping_cache.writebacks));
+}
+
+/* Average time from a page being missed until it can be used, in microseconds */
+static ssize_t mapping_cache_fault_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    u64 faults = atomic64_read(&sysfs_calypso_dev->mapping_cache.faults);
+    u64 fault_ns = atomic64_read(&sysfs_calypso_dev->mapping_cache.fault_ns);
+
+    if (faults == 0)
+        return sprintf(buf, "0\n");
+    return sprintf(buf, "%llu\n", div64_u64(fault_ns, faults * NSEC_PER_USEC));
+}
+
+/* Only counted when block_cache_kb is set, block writes that only updated the cache */
+static ssize_t block_cache_writes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->block_cache.writes));
+}
+
+static ssize_t block_cache_writebacks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->block_cache.writebacks));
+}
+
+static ssize_t block_cache_dirty_blocks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", calypso_block_cache_nr_dirty(&sysfs_calypso_dev->block_cache));
+}
+
+/* Only counted when read_cache_kb is set */
+static ssize_t read_cache_hits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->read_cache.hits));
+}
+
+static ssize_t read_cache_misses_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->read_cache.misses));
+}
+
+/* Blocks read ahead into the read cache, and those read afterwards */
+static ssize_t readahead_blocks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->read_cache.readahead_blocks));
+}
+
+static ssize_t readahead_hits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", atomic64_read(&sysfs_calypso_dev->read_cache.readahead_hits));
+}
+
+/* Current readahead window, in blocks */
+static ssize_t readahead_window_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(sysfs_calypso_dev->readahead.window));
+}
+
+/* Blocks the host is about to overwrite whose copies are queued or in flight */
+static ssize_t relocations_pending_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", calypso_relocation_pending(&(sysfs_calypso_dev->relocation)));
+}
+
+/*
+ * Host writes over Calypso blocks by how long they took, one line per
+ * bucket: the least microseconds it counts, up to where the next one
+ * starts, and how many writes took that long
+ */
+static ssize_t host_write_latency_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    ssize_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < CALYPSO_RELOCATION_LATENCY_BUCKETS; i++)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%lu %lld\n", i > 0 ? 1UL << i : 0,
+                    atomic64_read(&(sysfs_calypso_dev->relocation.host_write_latency[i])));
+    return len;
+}
+
+/* Relocations per GB the host wrote, in thousandths so we do not need floating point */
+static ssize_t relocations_per_gb_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    u64 bytes = atomic64_read(&sysfs_calypso_dev->stats.host_bytes_written);
+    u64 relocations = atomic64_read(&sysfs_calypso_dev->stats.relocations);
+    u64 per_gb_milli = 0;
+
+    if (bytes > 0)
+        per_gb_milli = div64_u64(relocations * BYTES_IN_A_GB * 1000, bytes);
+
+    return sprintf(buf, "%llu.%03llu\n", per_gb_milli / 1000, per_gb_milli % 1000);
+}
+
+/* Highest kernel log level printed, from 5 (KERN_NOTICE) on the verbose messages are switched on */
+static ssize_t debug_level_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(calypso_debug_level));
+}
+
+static ssize_t debug_level_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    int level;
+
+    if (kstrtoint(buf, 10, &level) != 0)
+        return -EINVAL;
+    calypso_debug_set_level(level);
+    return count;
+}
+
+/* printk or trace, for the calypso_debug tracepoint */
+static ssize_t debug_backend_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%s\n", READ_ONCE(calypso_debug_backend) == CALYPSO_DEBUG_TRACE ? "trace" : "printk");
+}
+
+static ssize_t debug_backend_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    if (sysfs_streq(buf, "trace"))
+        WRITE_ONCE(calypso_debug_backend, CALYPSO_DEBUG_TRACE);
+    else if (sysfs_streq(buf, "printk"))
+        WRITE_ONCE(calypso_debug_backend, CALYPSO_DEBUG_PRINTK);
+    else
+        return -EINVAL;
+    return count;
+}
+
+static struct kobj_attribute host_bytes_written_attr = __ATTR_RO(host_bytes_written);
+static struct kobj_attribute relocations_attr = __ATTR_RO(relocations);
+static struct kobj_attribute relocations_per_gb_attr = __ATTR_RO(relocations_per_gb);
+static struct kobj_attribute reserve_misses_attr = __ATTR_RO(reserve_misses);
+static struct kobj_attribute discarded_blocks_attr = __ATTR_RO(discarded_blocks);
+static struct kobj_attribute zero_blocks_attr = __ATTR_RO(zero_blocks);
+static struct kobj_attribute zero_filled_reads_attr = __ATTR_RO(zero_filled_reads);
+static struct kobj_attribute reverse_index_entries_attr = __ATTR_RO(reverse_index_entries);
+static struct kobj_attribute free_high_entropy_blocks_attr = __ATTR_RO(free_high_entropy_blocks);
+static struct kobj_attribute mapping_memory_bytes_attr = __ATTR_RO(mapping_memory_bytes);
+static struct kobj_attribute mapping_extents_attr = __ATTR_RO(mapping_extents);
+static struct kobj_attribute mapping_cache_hits_attr = __ATTR_RO(mapping_cache_hits);
+static struct kobj_attribute mapping_cache_misses_attr = __ATTR_RO(mapping_cache_misses);
+static struct kobj_attribute mapping_cache_resident_pages_attr = __ATTR_RO(mapping_cache_resident_pages);
+static struct kobj_attribute mapping_cache_writebacks_attr = __ATTR_RO(mapping_cache_writebacks);
+static struct kobj_attribute mapping_cache_fault_us_attr = __ATTR_RO(mapping_cache_fault_us);
+static struct kobj_attribute block_cache_writes_attr = __ATTR_RO(block_cache_writes);
+static struct kobj_attribute block_cache_writebacks_attr = __ATTR_RO(block_cache_writebacks);
+static struct kobj_attribute block_cache_dirty_blocks_attr = __ATTR_RO(block_cache_dirty_blocks);
+static struct kobj_attribute read_cache_hits_attr = __ATTR_RO(read_cache_hits);
+static struct kobj_attribute read_cache_misses_attr = __ATTR_RO(read_cache_misses);
+static struct kobj_attribute readahead_blocks_attr = __ATTR_RO(readahead_blocks);
+static struct kobj_attribute readahead_hits_attr = __ATTR_RO(readahead_hits);
+static struct kobj_attribute readahead_window_attr = __ATTR_RO(readahead_window);
+static struct kobj_attribute relocations_pending_attr = __ATTR_RO(relocations_pending);
+static struct kobj_attribute host_write_latency_us_attr = __ATTR_RO(host_write_latency_us);
+static struct kobj_attribute debug_level_attr = __ATTR_RW(debug_level);
+static struct kobj_attribute debug_backend_attr = __ATTR_RW(debug_backend);
+
+static struct attribute *calypso_attrs[] = {
+    &host_bytes_written_attr.attr,
+    &relocations_attr.attr,
+    &relocations_per_gb_attr.attr,
+    &reserve_misses_attr.attr,
+    &discarded_blocks_attr.attr,
+    &zero_blocks_attr.attr,
+    &zero_filled_reads_attr.attr,
+    &reverse_index_entries_attr.attr,
+    &free_high_entropy_blocks_attr.attr,
+    &mapping_memory_bytes_attr.attr,
+    &mapping_extents_attr.attr,
+    &mapping_cache_hits_attr.attr,
+    &mapping_cache_misses_attr.attr,
+    &mapping_cache_resident_pages_attr.attr,
+    &mapping_cache_writebacks_attr.attr,
+    &mapping_cache_fault_us_attr.attr,
+    &block_cache_writes_attr.attr,
+    &block_cache_writebacks_attr.attr,
+    &block_cache_dirty_blocks_attr.attr,
+    &read_cache_hits_attr.attr,
+    &read_cache_misses_attr.attr,
+    &readahead_blocks_attr.attr,
+    &readahead_hits_attr.attr,
+    &readahead_window_attr.attr,
+    &relocations_pending_attr.attr,
+    &host_write_latency_us_attr.attr,
+    &debug_level_attr.attr,
+    &debug_backend_attr.attr,
+    NULL    /* need to NULL terminate the list of attributes */
+};
+
+static struct attribute_group calypso_attr_group = {
+    .attrs = calypso_attrs,
+};
+
+
+int calypso_sysfs_init(struct calypso_blk_device *calypso_dev)
+{
+    int ret;
+
+    sysfs_calypso_dev = calypso_dev;
+
+    calypso_kobj = kobject_create_and_add(CALYPSO_SYSFS_DIR, kernel_kobj);
+    if (!calypso_kobj)
+    {
+        debug(KERN_ERR, __func__, "kobject_create_and_add failure\n");
+        return -ENOMEM;
+    }
+
+    ret = sysfs_create_group(calypso_kobj, &calypso_attr_group);
+    if (ret != 0)
+    {
+        debug_args(KERN_ERR, __func__, "sysfs_create_group failure with code %d\n", ret);
+        kobject_put(calypso_kobj);
+        calypso_kobj = NULL;
+        return ret;
+    }
+
+    debug_args(KERN_INFO, __func__, "/sys/kernel/%s created\n", CALYPSO_SYSFS_DIR);
+    return 0;
+}
+
+void calypso_sysfs_cleanup(void)
+{
+    if (calypso_kobj)
+    {
+        kobject_put(calypso_kobj);
+        calypso_kobj = NULL;
+    }
+    sysfs_calypso_dev = NULL;
+}
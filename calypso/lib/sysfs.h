@@ -0,0 +1,37 @@
+#ifndef SYSFS_H
+#define SYSFS_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+
+#include "global.h"
+
+
+/* Attributes live in /sys/kernel/calypso/ */
+#define CALYPSO_SYSFS_DIR CALYPSO_DEV_NAME
+
+#define BYTES_IN_A_GB (BLOCKS_IN_A_GB * 4096ULL)
+
+/* Counters exposed to userspace, updated from the I/O paths */
+struct calypso_stats {
+    /* bytes written by the host to the physical partition */
+    atomic64_t host_bytes_written;
+    /* Calypso blocks that had to be copied away because the host overwrote them */
+    atomic64_t relocations;
+    /* allocations that found the per-CPU reserve empty and had to search the bitmaps */
+    atomic64_t reserve_misses;
+    /* blocks given back to the free pool because the file system on Calypso discarded them */
+    atomic64_t discarded_blocks;
+    /* whole blocks written with zeros, which are unmapped instead of written */
+    atomic64_t zero_blocks;
+    /* blocks read that were not mapped, which are served with zeros and no I/O */
+    atomic64_t zero_filled_reads;
+};
+
+struct calypso_blk_device;
+
+int calypso_sysfs_init(struct calypso_blk_device *calypso_dev);
+void calypso_sysfs_cleanup(void);
+
+
+#endif
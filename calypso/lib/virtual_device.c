@@ -9,43 +9,26 @@
 #include "virtual_device.h"
 
 
-int calypso_dev_init_bitmaps(struct calypso_blk_device *calypso_dev)
+int calypso_dev_init_block_state(struct calypso_blk_device *calypso_dev)
 {
     if (calypso_dev)
     {
-        calypso_dev->high_entropy_blocks_bitmap = bitmap_zalloc(calypso_dev->physical_nr_blocks, GFP_KERNEL);
-        if (!calypso_dev->high_entropy_blocks_bitmap)
-        {
-            debug(KERN_ERR, __func__, "Could not allocate memory for high entropy blocks bitmap\n");
-            return -ENOMEM;
-        }
-
         debug_args(KERN_DEBUG, __func__, "virtual dev has %ld blocks\n", calypso_dev->virtual_nr_blocks);
         debug_args(KERN_DEBUG, __func__, "physical dev has %ld blocks\n", calypso_dev->physical_nr_blocks);
-        calypso_dev->physical_blocks_bitmap = bitmap_zalloc(calypso_dev->physical_nr_blocks, GFP_KERNEL);
-        if (!calypso_dev->physical_blocks_bitmap)
-        {
-            debug(KERN_ERR, __func__, "Could not allocate memory for physical bitmap\n");
+        if (calypso_block_state_init(&(calypso_dev->block_state), calypso_dev->physical_nr_blocks) != 0)
             return -ENOMEM;
-        }
     }
-    debug(KERN_DEBUG, __func__, "Allocated bitmaps successfully\n");
+    debug(KERN_DEBUG, __func__, "Allocated physical blocks state successfully\n");
     return 0;
 }
 
-void calypso_dev_cleanup_bitmaps(struct calypso_blk_device *calypso_dev)
+void calypso_dev_cleanup_block_state(struct calypso_blk_device *calypso_dev)
 {
     if (calypso_dev)
-    {
-        if (calypso_dev->high_entropy_blocks_bitmap)
-            bitmap_free(calypso_dev->high_entropy_blocks_bitmap);
-
-        if (calypso_dev->physical_blocks_bitmap)
-            bitmap_free(calypso_dev->physical_blocks_bitmap);
-    }
+        calypso_block_state_cleanup(&(calypso_dev->block_state));
 }
 
-static void _calypso_set_mapping_to_value(unsigned long *mappings, unsigned long value, unsigned long size)
+static void _calypso_set_mapping_to_value(calypso_block_t *mappings, calypso_block_t value, unsigned long size)
 {
     unsigned long i;
     for (i = 0; i < size; i++)
@@ -57,29 +40,39 @@ int calypso_dev_init_mappings(struct calypso_blk_device *calypso_dev)
     if (calypso_dev)
     {
         /* since this is a big allocations, we cannot rely on contiguous memory */
-        calypso_dev->metadata_to_physical_block_mapping = vmalloc(calypso_dev->metadata_nr_blocks * sizeof(unsigned long));
+        calypso_dev->metadata_to_physical_block_mapping = vmalloc(calypso_dev->metadata_max_blocks * sizeof(calypso_block_t));
         if (!calypso_dev->metadata_to_physical_block_mapping)
         {
             debug(KERN_ERR, __func__, "Could not allocate memory for metadata to physical mappings vector\n");
             return -ENOMEM;
         }
-        _calypso_set_mapping_to_value(calypso_dev->metadata_to_physical_block_mapping, -1, calypso_dev->metadata_nr_blocks);
+        _calypso_set_mapping_to_value(calypso_dev->metadata_to_physical_block_mapping, CALYPSO_UNMAPPED, calypso_dev->metadata_max_blocks);
 
-        calypso_dev->virtual_to_physical_block_mapping = vmalloc(calypso_dev->virtual_nr_blocks * sizeof(unsigned long));
-        if (!calypso_dev->virtual_to_physical_block_mapping)
+        if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_EXTENTS)
         {
-            debug(KERN_ERR, __func__, "Could not allocate memory for virtual to physical mappings vector\n");
-            return -ENOMEM;
+            calypso_extent_map_init(&(calypso_dev->extent_map));
+        }
+        else if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        {
+            calypso_sparse_map_init(&(calypso_dev->sparse_map));
+        }
+        /* the mapping cache needs the block allocator, so the driver sets it up */
+        else if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_ARRAY)
+        {
+            calypso_dev->virtual_to_physical_block_mapping = vmalloc(calypso_dev->virtual_nr_blocks * sizeof(calypso_block_t));
+            if (!calypso_dev->virtual_to_physical_block_mapping)
+            {
+                debug(KERN_ERR, __func__, "Could not allocate memory for virtual to physical mappings vector\n");
+                return -ENOMEM;
+            }
+            _calypso_set_mapping_to_value(calypso_dev->virtual_to_physical_block_mapping, CALYPSO_UNMAPPED, calypso_dev->virtual_nr_blocks);
         }
-        _calypso_set_mapping_to_value(calypso_dev->virtual_to_physical_block_mapping, -1, calypso_dev->virtual_nr_blocks);
 
-        calypso_dev->physical_to_virtual_block_mapping = vmalloc(calypso_dev->physical_nr_blocks * sizeof(unsigned long));
-        if (!calypso_dev->physical_to_virtual_block_mapping)
+        if (calypso_reverse_index_init(&(calypso_dev->reverse_index), &(calypso_dev->block_state)) != 0)
         {
-            debug(KERN_ERR, __func__, "Could not allocate memory for physical to virtual mappings vector\n");
+            debug(KERN_ERR, __func__, "Could not allocate memory for physical to virtual mappings index\n");
             return -ENOMEM;
         }
-        _calypso_set_mapping_to_value(calypso_dev->physical_to_virtual_block_mapping, -1, calypso_dev->physical_nr_blocks);
     }
     return 0;
 }
@@ -94,11 +87,223 @@ void calypso_dev_cleanup_mappings(struct calypso_blk_device *calypso_dev)
         if (calypso_dev->virtual_to_physical_block_mapping)
             vfree(calypso_dev->virtual_to_physical_block_mapping);
 
-        if (calypso_dev->physical_to_virtual_block_mapping)
-            vfree(calypso_dev->physical_to_virtual_block_mapping);
+        if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_EXTENTS)
+            calypso_extent_map_cleanup(&(calypso_dev->extent_map));
+
+        if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+            calypso_sparse_map_cleanup(&(calypso_dev->sparse_map));
+
+        calypso_reverse_index_cleanup(&(calypso_dev->reverse_index));
     }
 }
 
+/* Memory taken by the mapping structures, reported in sysfs */
+size_t calypso_dev_mappings_memory_bytes(struct calypso_blk_device *calypso_dev)
+{
+    size_t bytes = calypso_reverse_index_memory_bytes(&(calypso_dev->reverse_index));
+
+    bytes += calypso_block_state_memory_bytes(&(calypso_dev->block_state));
+
+    if (calypso_dev->metadata_to_physical_block_mapping)
+        bytes += calypso_dev->metadata_max_blocks * sizeof(calypso_block_t);
+    if (calypso_dev->virtual_to_physical_block_mapping)
+        bytes += calypso_dev->virtual_nr_blocks * sizeof(calypso_block_t);
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_EXTENTS)
+        bytes += calypso_extent_map_memory_bytes(&(calypso_dev->extent_map));
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        bytes += calypso_mapping_cache_memory_bytes(&(calypso_dev->mapping_cache));
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        bytes += calypso_sparse_map_memory_bytes(&(calypso_dev->sparse_map));
+
+    return bytes;
+}
+
+/*
+ * Called with the mapping lock of virtual_block_nr held. A page of paged
+ * mappings that has to be read is returned in *fault, and its read is
+ * started once the lock is dropped. The reverse index goes first, so the
+ * mapping is left alone if the host took the block
+ */
+static int _calypso_dev_set_mapping(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long physical_block_nr, struct calypso_mapping_page **fault)
+{
+    int ret;
+
+    ret = calypso_reverse_index_set(&(calypso_dev->reverse_index), physical_block_nr, virtual_block_nr);
+    if (ret != 0)
+        return ret;
+
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_EXTENTS)
+        ret = calypso_extent_map_set(&(calypso_dev->extent_map), virtual_block_nr, physical_block_nr);
+    else if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        ret = calypso_mapping_cache_set(&(calypso_dev->mapping_cache), virtual_block_nr, physical_block_nr, fault);
+    else if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        ret = calypso_sparse_map_set(&(calypso_dev->sparse_map), virtual_block_nr, physical_block_nr);
+    else
+        WRITE_ONCE(calypso_dev->virtual_to_physical_block_mapping[virtual_block_nr], physical_block_nr);
+
+    if (ret != 0)
+        calypso_reverse_index_clear(&(calypso_dev->reverse_index), physical_block_nr);
+
+    return ret;
+}
+
+/*
+ * Maps virtual_block_nr to physical_block_nr in whichever structure holds
+ * the mappings and in the reverse index. Can sleep, to start reading the
+ * page of a paged mapping
+ *
+ * Returns 0 for success and a negative error code otherwise
+ */
+int calypso_dev_set_mapping(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long physical_block_nr)
+{
+    struct calypso_mapping_page *fault = NULL;
+    spinlock_t *lock;
+    unsigned long flags;
+    int ret;
+
+    if (virtual_block_nr >= calypso_dev->virtual_nr_blocks)
+        return -EINVAL;
+
+    lock = calypso_dev_mapping_lock(calypso_dev, virtual_block_nr);
+    spin_lock_irqsave(lock, flags);
+    ret = _calypso_dev_set_mapping(calypso_dev, virtual_block_nr, physical_block_nr, &fault);
+    spin_unlock_irqrestore(lock, flags);
+
+    if (fault)
+        calypso_mapping_cache_read_fault(&(calypso_dev->mapping_cache), fault);
+
+    return ret;
+}
+
+/*
+ * Maps virtual_block_nr to physical_block_nr, a block loaded from the
+ * hidden metadata rather than claimed, which is marked as Calypso's first
+ *
+ * Returns 0 for success and a negative error code otherwise
+ */
+int calypso_dev_load_mapping(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long physical_block_nr)
+{
+    if (physical_block_nr >= calypso_dev->block_state.nr_blocks)
+        return -EINVAL;
+
+    calypso_block_state_set(&(calypso_dev->block_state), physical_block_nr, CALYPSO_BLOCK_CALYPSO_DATA);
+    return calypso_dev_set_mapping(calypso_dev, virtual_block_nr, physical_block_nr);
+}
+
+/*
+ * Moves virtual_block_nr from from_physical_block_nr to to_physical_block_nr
+ * after its data was copied, and forgets about the block it leaves behind.
+ * Can be called from bio completion.
+ *
+ * Returns -EAGAIN if the block was mapped somewhere else while it was being
+ * copied, in which case the newer mapping is kept and the caller still owns
+ * to_physical_block_nr
+ */
+int calypso_dev_move_mapping(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long from_physical_block_nr, unsigned long to_physical_block_nr)
+{
+    struct calypso_mapping_page *fault = NULL;
+    spinlock_t *lock;
+    unsigned long flags;
+    int ret;
+
+    if (virtual_block_nr >= calypso_dev->virtual_nr_blocks)
+        return -EINVAL;
+
+    lock = calypso_dev_mapping_lock(calypso_dev, virtual_block_nr);
+    spin_lock_irqsave(lock, flags);
+    /* the page of a paged mapping might not be in memory, but then the reverse index tells the same */
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        ret = calypso_reverse_index_get(&(calypso_dev->reverse_index), from_physical_block_nr) == virtual_block_nr ? 0 : -EAGAIN;
+    else
+        ret = calypso_lookup_physical_block(calypso_dev, virtual_block_nr) == from_physical_block_nr ? 0 : -EAGAIN;
+    if (ret == 0)
+        ret = _calypso_dev_set_mapping(calypso_dev, virtual_block_nr, to_physical_block_nr, &fault);
+    if (ret == 0)
+        calypso_reverse_index_clear(&(calypso_dev->reverse_index), from_physical_block_nr);
+    spin_unlock_irqrestore(lock, flags);
+
+    /* the page is read from the mapping cache's worker, since this cannot sleep */
+    if (fault)
+        calypso_mapping_cache_queue_fault(&(calypso_dev->mapping_cache), fault);
+
+    return ret;
+}
+
+/*
+ * Forgets the mapping of virtual_block_nr, in whichever structure holds
+ * the mappings and in the reverse index. With paged mappings, its page
+ * needs to be in memory. Can be called from bio completion.
+ *
+ * Returns the physical block it was mapped to, which the caller now owns,
+ * or CALYPSO_UNMAPPED if it was not mapped or could not be unmapped
+ */
+calypso_block_t calypso_dev_unmap(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr)
+{
+    struct calypso_mapping_page *fault = NULL;
+    calypso_block_t physical_block_nr;
+    spinlock_t *lock;
+    unsigned long flags;
+    int ret = 0;
+
+    if (virtual_block_nr >= calypso_dev->virtual_nr_blocks)
+        return CALYPSO_UNMAPPED;
+
+    lock = calypso_dev_mapping_lock(calypso_dev, virtual_block_nr);
+    spin_lock_irqsave(lock, flags);
+    physical_block_nr = calypso_lookup_physical_block(calypso_dev, virtual_block_nr);
+    if (!calypso_is_block_mapped(calypso_dev, physical_block_nr))
+        goto unlock;
+
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_EXTENTS)
+        ret = calypso_extent_map_clear(&(calypso_dev->extent_map), virtual_block_nr);
+    else if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        ret = calypso_mapping_cache_set(&(calypso_dev->mapping_cache), virtual_block_nr, CALYPSO_UNMAPPED, &fault);
+    else if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        calypso_sparse_map_clear(&(calypso_dev->sparse_map), virtual_block_nr);
+    else
+        WRITE_ONCE(calypso_dev->virtual_to_physical_block_mapping[virtual_block_nr], CALYPSO_UNMAPPED);
+
+    if (ret == 0)
+        calypso_reverse_index_clear(&(calypso_dev->reverse_index), physical_block_nr);
+    else
+        physical_block_nr = CALYPSO_UNMAPPED;
+unlock:
+    spin_unlock_irqrestore(lock, flags);
+
+    /* the page was not in memory after all, and this cannot sleep */
+    if (fault)
+        calypso_mapping_cache_queue_fault(&(calypso_dev->mapping_cache), fault);
+
+    return physical_block_nr;
+}
+
+/*
+ * Whether none of nr_blocks virtual blocks from virtual_block_nr is mapped,
+ * so a read of them can be served with zeros. It needs no mappings from
+ * disk, and sees either the old or the new mapping of a block being updated
+ */
+bool calypso_dev_is_range_unmapped(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    unsigned long end = min(virtual_block_nr + nr_blocks, calypso_dev->virtual_nr_blocks);
+    unsigned long run_len;
+
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        return calypso_mapping_cache_is_range_unmapped(&(calypso_dev->mapping_cache), virtual_block_nr, nr_blocks);
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+        return calypso_sparse_map_next(&(calypso_dev->sparse_map), virtual_block_nr, end) >= end;
+
+    /* with extents, run_len skips to the next mapped block */
+    while (virtual_block_nr < end)
+    {
+        if (calypso_is_block_mapped(calypso_dev, calypso_lookup_physical_run(calypso_dev, virtual_block_nr, &run_len)))
+            return false;
+        if (run_len >= end - virtual_block_nr)
+            break;
+        virtual_block_nr += run_len;
+    }
+    return true;
+}
+
 void calypso_set_physical_partition_sector_ranges(struct calypso_blk_device *calypso_dev)
 {
     calypso_dev->first_physical_sector = get_start_sect(calypso_dev->physical_dev);
@@ -139,17 +344,17 @@ unsigned long calypso_get_free_blocks_group(unsigned long *bitmap, unsigned long
  * 
  * Returns 0 for success and -1 for error
  */
-int calypso_get_next_free_block(unsigned long *bitmap, unsigned long last_block, unsigned long *free_block)
+int calypso_get_next_free_block(struct calypso_block_state *block_state, unsigned long last_block, unsigned long *free_block)
 {   
     unsigned long initial_value = *free_block;
     // *free_block = find_next_zero_bit(bitmap, last_block, *free_block);
-    *free_block = find_next_bit(bitmap, last_block, *free_block);
+    *free_block = calypso_block_state_find_next(block_state, *free_block, last_block, CALYPSO_BLOCK_FREE_HIGH_ENTROPY);
 
     /* 
      * block 0 is never going to be free on a partition formatted with ext4,
      * so we do not have to worry about the next free block being 0 
      */
-    if (*free_block == initial_value) {
+    if (*free_block == initial_value || *free_block >= last_block) {
         debug(KERN_ERR, __func__, "Could not find next free block\n");
         return -1;
     }
@@ -168,20 +373,30 @@ void calypso_clear_bit(unsigned long *bitmap, unsigned long start)
     bitmap_clear(bitmap, start, 1);
 }
 
-void calypso_update_bitmaps(unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, unsigned long start)
-{
-    bitmap_set(physical_blocks_bitmap, start, 1);
-    bitmap_clear(high_entropy_blocks_bitmap, start, 1);
-}
-
 int calypso_dev_init(struct calypso_blk_device **calypso_dev)
 {
+    int i;
+
     (*calypso_dev) = kzalloc(sizeof(struct calypso_blk_device), GFP_KERNEL);
 	if (!(*calypso_dev)) {
         debug(KERN_WARNING, __func__, "Unable to allocate bytes for Calypso device\n");
         return -ENOMEM;
     }
     debug(KERN_INFO, __func__, "Allocated memory for device struct\n");
+    spin_lock_init(&((*calypso_dev)->alloc_lock));
+    for (i = 0; i < CALYPSO_MAPPING_LOCKS; i++)
+        spin_lock_init(&((*calypso_dev)->mapping_locks[i]));
+
+    /*
+     * Of our own rather than the native device's, which it splits its own
+     * bios from. Bios allocated while remapping are only submitted once
+     * make_request_fn returns, so the rescuer keeps the pool from running dry
+     */
+    if (bioset_init(&((*calypso_dev)->bio_set), BIO_POOL_SIZE, 0, BIOSET_NEED_RESCUER) != 0)
+    {
+        debug(KERN_WARNING, __func__, "Unable to allocate the bio set\n");
+        return -ENOMEM;
+    }
 
     return 0;
 }
@@ -211,12 +426,45 @@ void calypso_print_queue_data(struct request_queue *queue)
     //blk_queue_max_segment_size(queue, 512);
 }
 
+/* Limits of the queue of either kind */
+static void calypso_dev_set_queue_limits(struct request_queue *queue)
+{
+    /*
+     * Blocks are mapped, encrypted and relocated whole, so the smallest
+     * I/O the device takes is a block. Otherwise writing part of a block
+     * would need to read, decrypt and merge the rest of it first.
+     * Sector numbers stay in 512 byte units
+     */
+    blk_queue_logical_block_size(queue, CALYPSO_BLOCK_SIZE);
+    blk_queue_physical_block_size(queue, CALYPSO_BLOCK_SIZE);
+    blk_queue_io_min(queue, CALYPSO_BLOCK_SIZE);
+
+    /* only whole blocks can go back to the free pool, so large discards are split at block boundaries too */
+    queue->limits.discard_granularity = CALYPSO_BLOCK_SIZE;
+    blk_queue_max_discard_sectors(queue, round_down(UINT_MAX >> SECTOR_SHIFT, CALYPSO_BLOCK_SIZE >> SECTOR_SHIFT));
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, queue);
+
+    /* write zeroes carry no data, whole blocks of them are just unmapped */
+    blk_queue_max_write_zeroes_sectors(queue, round_down(UINT_MAX >> SECTOR_SHIFT, CALYPSO_BLOCK_SIZE >> SECTOR_SHIFT));
+
+    /* flushes and FUA writes need to reach the block cache, and the native device after it */
+    blk_queue_write_cache(queue, true, true);
+}
+
+/*
+ * Sets up the device with a blk-mq queue of nr_hw_queues hardware queues.
+ * Every request comes with cmd_size bytes for the driver, owned by the
+ * request's tag for as long as the request is in flight
+ */
 int calypso_dev_setup(struct calypso_blk_device *calypso_dev, 
                     struct block_device_operations *calypso_fops, 
                     struct blk_mq_ops *calypso_fops_req, 
                     const char *dev_name,
-                    int *calypso_major)
+                    int *calypso_major,
+                    unsigned int nr_hw_queues,
+                    unsigned int cmd_size)
 {
+    int ret;
     char part_name[80] = "";
 
     (*calypso_major) = register_blkdev((*calypso_major), dev_name);
@@ -232,17 +480,33 @@ int calypso_dev_setup(struct calypso_blk_device *calypso_dev,
 
     /* Get a request queue (here queue is created) */
     spin_lock_init(&(calypso_dev->lock));
-    calypso_dev->queue = blk_mq_init_sq_queue(&(calypso_dev->tag_set), calypso_fops_req, 128, BLK_MQ_F_SHOULD_MERGE);
+    calypso_dev->tag_set.ops = calypso_fops_req;
+    calypso_dev->tag_set.nr_hw_queues = nr_hw_queues;
+    calypso_dev->tag_set.queue_depth = CALYPSO_QUEUE_DEPTH;
+    calypso_dev->tag_set.numa_node = NUMA_NO_NODE;
+    calypso_dev->tag_set.cmd_size = cmd_size;
+    /* requests are remapped and submitted to the native device from queue_rq, which can sleep */
+    calypso_dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+    calypso_dev->tag_set.driver_data = calypso_dev;
+    ret = blk_mq_alloc_tag_set(&(calypso_dev->tag_set));
+    if (ret != 0) {
+        debug(KERN_ERR, __func__, "blk_mq_alloc_tag_set failure\n");
+        unregister_blkdev((*calypso_major), dev_name);
+        return ret;
+    }
+
+    calypso_dev->queue = blk_mq_init_queue(&(calypso_dev->tag_set));
     if (IS_ERR(calypso_dev->queue)) {
-        debug(KERN_ERR, __func__, "blk_mq_init_sq_queue failure\n");
-        calypso_memory_cleanup(calypso_dev);
+        debug(KERN_ERR, __func__, "blk_mq_init_queue failure\n");
+        calypso_dev->queue = NULL;
+        blk_mq_free_tag_set(&(calypso_dev->tag_set));
         unregister_blkdev((*calypso_major), dev_name);
         return -ENOMEM;
     }
-    /* sets logical block size for the queue */
     // TODO: understand what this function does if the block size continues to be 4096
-    /* this size just refers to the LBA, not the actual file system block size */
-    blk_queue_logical_block_size(calypso_dev->queue, KERNEL_SECTOR_SIZE);
+    calypso_dev_set_queue_limits(calypso_dev->queue);
+    /* the default of 255 sectors would split requests in the middle of a block */
+    blk_queue_max_hw_sectors(calypso_dev->queue, BLK_DEF_MAX_SECTORS);
     // TODO:
     debug_args(KERN_INFO, __func__, "calypso_dev->queue->limits.physical_block_size: %d\n", calypso_dev->queue->limits.physical_block_size);
     // blk_queue_physical_block_size(calypso_dev->queue, 512);
@@ -268,7 +532,8 @@ int calypso_dev_setup(struct calypso_blk_device *calypso_dev,
     {
         debug(KERN_ERR, __func__, "alloc_disk failure\n");
         blk_cleanup_queue(calypso_dev->queue);
-        calypso_memory_cleanup(calypso_dev);
+        calypso_dev->queue = NULL;
+        blk_mq_free_tag_set(&(calypso_dev->tag_set));
         unregister_blkdev((*calypso_major), dev_name);
         return -ENOMEM;
     }
@@ -347,8 +612,7 @@ int calypso_dev_no_queue_setup(struct calypso_blk_device *calypso_dev,
 
     blk_queue_make_request(calypso_dev->queue, calypso_make_request);
 
-    /* sets logical block size for the queue */
-    blk_queue_logical_block_size(calypso_dev->queue, KERNEL_SECTOR_SIZE);
+    calypso_dev_set_queue_limits(calypso_dev->queue);
     debug_args(KERN_INFO, __func__, "calypso_dev->queue->limits.physical_block_size: %d\n", calypso_dev->queue->limits.physical_block_size);
     // blk_queue_physical_block_size(calypso_dev->queue, 512);
 	calypso_dev->queue->queuedata = calypso_dev;
@@ -436,6 +700,11 @@ void calypso_dev_cleanup(struct calypso_blk_device *calypso_dev,
             calypso_dev->queue = NULL;
             debug(KERN_INFO, __func__, "Deleted request queue\n");
         }
+        /* only allocated for the blk-mq queue */
+        if (calypso_dev->tag_set.tags) {
+            blk_mq_free_tag_set(&(calypso_dev->tag_set));
+            debug(KERN_INFO, __func__, "Freed tag set\n");
+        }
     }
 
     calypso_memory_cleanup(calypso_dev);
@@ -469,7 +738,13 @@ void calypso_dev_physical_cleanup(struct calypso_blk_device *calypso_dev,
             calypso_dev->queue = NULL;
             debug(KERN_INFO, __func__, "Deleted request queue\n");
         }
-
+        /* only allocated for the blk-mq queue */
+        if (calypso_dev->tag_set.tags) {
+            blk_mq_free_tag_set(&(calypso_dev->tag_set));
+            debug(KERN_INFO, __func__, "Freed tag set\n");
+        }
+        /* no more requests to split once the queue is gone */
+        bioset_exit(&(calypso_dev->bio_set));
     }
 
     unregister_blkdev((*calypso_major), dev_name);
@@ -6,16 +6,58 @@
 #include <linux/fs.h>
 #include <linux/blkdev.h>
 #include <linux/blk-mq.h>
+#include <linux/hash.h>
 
 #include "ext4/ext4.h"
+#include "global.h"
 #include "block_encryption.h"
+#include "heatmap.h"
+#include "block_state.h"
+#include "block_reserve.h"
+#include "reverse_index.h"
+#include "extent_map.h"
+#include "mapping_cache.h"
+#include "sparse_map.h"
+#include "block_cache.h"
+#include "read_cache.h"
+#include "readahead.h"
+#include "relocation.h"
+#include "sysfs.h"
 
 
 #define CALYPSO_FIRST_MINOR 0
 #define CALYPSO_MINOR_CNT 1
 
-#define __REQ_CALYPSO   29
-#define REQ_CALYPSO		(1ULL << __REQ_CALYPSO)
+/* How the virtual to physical mappings are kept in memory */
+enum calypso_mapping_format {
+    /* one calypso_block_t per virtual block */
+    CALYPSO_MAPPINGS_ARRAY = 0,
+    /* runs of consecutive virtual blocks mapped to consecutive physical blocks */
+    CALYPSO_MAPPINGS_EXTENTS = 1,
+    /* pages of the array stored in hidden blocks, only some of them in memory */
+    CALYPSO_MAPPINGS_PAGED = 2,
+    /* only the blocks that were written, for virtual devices bigger than the data they hold */
+    CALYPSO_MAPPINGS_SPARSE = 3,
+};
+
+/* How requests to the Calypso device reach the driver */
+enum calypso_queue_mode {
+    /* every bio is remapped as soon as it is submitted */
+    CALYPSO_QUEUE_BIO = 0,
+    /* bios are merged into requests, dispatched from one hardware queue per CPU or per NUMA node */
+    CALYPSO_QUEUE_MQ = 1,
+};
+
+/* Tags per hardware queue */
+#define CALYPSO_QUEUE_DEPTH 128
+
+/*
+ * Updates of the virtual blocks in the same page of mappings take the same
+ * lock, so relocations in different parts of the device do not wait for
+ * each other. Lookups do not take it
+ */
+#define CALYPSO_MAPPING_LOCKS_BITS 6
+#define CALYPSO_MAPPING_LOCKS (1 << CALYPSO_MAPPING_LOCKS_BITS)
 
 /* 
  * The internal structure representation of our device
@@ -47,6 +89,8 @@ struct calypso_blk_device
 
     // TODO check if this can be int instead of long
     unsigned long metadata_nr_blocks;
+    /* metadata_nr_blocks may change between executions when the mappings are extents */
+    unsigned long metadata_max_blocks;
     unsigned long virtual_nr_blocks;
     unsigned long physical_nr_blocks;
     unsigned long high_entropy_blocks; /* amount of usable blocks in the native disk */ 
@@ -54,35 +98,58 @@ struct calypso_blk_device
     unsigned long bitmap_data_len;
     unsigned long mappings_data_len;
 
-    /* Bitmaps */
-    /* The bits set in this are all the unused blocks that have high entropy, 
-    thus can be used to hide information. These bits are to be unset when the corresponding 
-    passes from unused to used */
-    unsigned long *high_entropy_blocks_bitmap;
-    unsigned long *physical_blocks_bitmap;
+    /* Whether each physical block is free, and with which entropy, or used by the host or by Calypso.
+    Blocks Calypso can hide information in are the free high entropy ones, and stop being so
+    as soon as either the host or Calypso uses them */
+    struct calypso_block_state block_state;
 
     /* Amount of usable free blocks on the native disk due to having high entropy */
     unsigned long free_high_entropy_blocks;
 
+    /* Host writes per block group, to keep Calypso data away from where the host writes */
+    struct calypso_heatmap heatmap;
+
+    /* Serializes searching for and claiming free blocks */
+    spinlock_t alloc_lock;
+    /* Blocks already claimed for the submission path to take without locking */
+    struct calypso_block_reserve reserve;
+
     /* We only need to store this in memory since when we are executing
     Calypso after the first time, we need to use the same blocks that
     were assigned the first time, which we can obtain when we retrieve metadata */
-    unsigned long *metadata_to_physical_block_mapping;
+    calypso_block_t *metadata_to_physical_block_mapping;
 
     /* We are only going to persist the virtual to physical mappings
     since we can recover both from this one and it is the smaller one */
-    unsigned long *virtual_to_physical_block_mapping;
-    unsigned long *physical_to_virtual_block_mapping;
+    enum calypso_mapping_format mapping_format;
+    /* CALYPSO_MAPPINGS_ARRAY */
+    calypso_block_t *virtual_to_physical_block_mapping;
+    /* CALYPSO_MAPPINGS_EXTENTS */
+    struct calypso_extent_map extent_map;
+    /* CALYPSO_MAPPINGS_PAGED */
+    struct calypso_mapping_cache mapping_cache;
+    /* CALYPSO_MAPPINGS_SPARSE */
+    struct calypso_sparse_map sparse_map;
+    /* Sized to the blocks Calypso uses, not to the whole native partition */
+    struct calypso_reverse_index reverse_index;
+    /* Plaintext of recently written blocks, not written to the native device yet */
+    struct calypso_block_cache block_cache;
+    /* Data of recently read blocks */
+    struct calypso_read_cache read_cache;
+    /* Sequential reads, read ahead into the read cache */
+    struct calypso_readahead readahead;
+    /* Serialize mapping updates, taken from bio completion as well */
+    spinlock_t mapping_locks[CALYPSO_MAPPING_LOCKS];
+    /* Splits and clones of the requests to the Calypso device */
+    struct bio_set bio_set;
 
     sector_t first_physical_sector;
     sector_t last_physical_sector;
 
-    /* In case we need to copy data to another block due to overwrites */
-    unsigned long from_physical_block_pending_copy;
-    unsigned long to_physical_block_pending_copy;
-    struct bio *pending_bio;
-    struct page *pending_page;
-    char *pending_data;
+    /* Copies Calypso blocks the host is about to overwrite somewhere else */
+    struct calypso_relocation_engine relocation;
+
+    struct calypso_stats stats;
 
     /**
      * Crypto data
@@ -92,11 +159,90 @@ struct calypso_blk_device
     struct calypso_skcipher_def *cipher;
 };
 
-int calypso_dev_init_bitmaps(struct calypso_blk_device *calypso_dev);
-void calypso_dev_cleanup_bitmaps(struct calypso_blk_device *calypso_dev);
+int calypso_dev_init_block_state(struct calypso_blk_device *calypso_dev);
+void calypso_dev_cleanup_block_state(struct calypso_blk_device *calypso_dev);
 
 int calypso_dev_init_mappings(struct calypso_blk_device *calypso_dev);
 void calypso_dev_cleanup_mappings(struct calypso_blk_device *calypso_dev);
+size_t calypso_dev_mappings_memory_bytes(struct calypso_blk_device *calypso_dev);
+
+int calypso_dev_set_mapping(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long physical_block_nr);
+int calypso_dev_load_mapping(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long physical_block_nr);
+int calypso_dev_move_mapping(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long from_physical_block_nr, unsigned long to_physical_block_nr);
+calypso_block_t calypso_dev_unmap(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr);
+bool calypso_dev_is_range_unmapped(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long nr_blocks);
+
+static inline spinlock_t *calypso_dev_mapping_lock(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr)
+{
+    return &(calypso_dev->mapping_locks[hash_long(virtual_block_nr / CALYPSO_MAPPING_PAGE_ENTRIES, CALYPSO_MAPPING_LOCKS_BITS)]);
+}
+
+/*
+ * Physical block a virtual block is mapped to, or CALYPSO_UNMAPPED.
+ * Virtual blocks past the end of the device are reported as unmapped so
+ * that callers walking a request do not need to check the bounds themselves.
+ * 
+ * run_len is set to how many blocks from virtual_block_nr on are known to
+ * be mapped to consecutive physical blocks, which is always 1 for the array
+ *
+ * None of the formats take a lock here, so it can run concurrently with
+ * updates and sees either the old or the new mapping of a block
+ */
+static inline calypso_block_t calypso_lookup_physical_run(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long *run_len)
+{
+    unsigned long physical_block_nr;
+
+    *run_len = 1;
+    if (unlikely(virtual_block_nr >= calypso_dev->virtual_nr_blocks))
+        return CALYPSO_UNMAPPED;
+
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_EXTENTS)
+    {
+        if (calypso_extent_map_lookup(&(calypso_dev->extent_map), virtual_block_nr, &physical_block_nr, run_len) != 0)
+            return CALYPSO_UNMAPPED;
+        return physical_block_nr;
+    }
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        return calypso_mapping_cache_get(&(calypso_dev->mapping_cache), virtual_block_nr);
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_SPARSE)
+    {
+        if (calypso_sparse_map_lookup(&(calypso_dev->sparse_map), virtual_block_nr, &physical_block_nr) != 0)
+            return CALYPSO_UNMAPPED;
+        return physical_block_nr;
+    }
+    return READ_ONCE(calypso_dev->virtual_to_physical_block_mapping[virtual_block_nr]);
+}
+
+static inline calypso_block_t calypso_lookup_physical_block(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr)
+{
+    unsigned long run_len;
+
+    return calypso_lookup_physical_run(calypso_dev, virtual_block_nr, &run_len);
+}
+
+/*
+ * Makes sure the mappings of nr_blocks blocks from virtual_block_nr can be
+ * looked up until calypso_dev_put_mappings(). Returns -EAGAIN if they need
+ * to be read from disk first, and the bio is resubmitted once they are
+ */
+static inline int calypso_dev_get_mappings(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long nr_blocks, struct bio *bio)
+{
+    if (calypso_dev->mapping_format != CALYPSO_MAPPINGS_PAGED)
+        return 0;
+    return calypso_mapping_cache_get_range(&(calypso_dev->mapping_cache), virtual_block_nr, nr_blocks, bio);
+}
+
+static inline void calypso_dev_put_mappings(struct calypso_blk_device *calypso_dev, unsigned long virtual_block_nr, unsigned long nr_blocks)
+{
+    if (calypso_dev->mapping_format == CALYPSO_MAPPINGS_PAGED)
+        calypso_mapping_cache_put_range(&(calypso_dev->mapping_cache), virtual_block_nr, nr_blocks);
+}
+
+/* Unmapped entries are bigger than any valid block, so this is a single comparison */
+static inline bool calypso_is_block_mapped(struct calypso_blk_device *calypso_dev, calypso_block_t physical_block_nr)
+{
+    return physical_block_nr < calypso_dev->physical_nr_blocks;
+}
 
 void calypso_set_physical_partition_sector_ranges(struct calypso_blk_device *calypso_dev);
 
@@ -104,11 +250,10 @@ unsigned long calypso_get_block_nr_from_sector(sector_t cur_sector, sector_t fir
 sector_t calypso_get_sector_nr_from_block(unsigned long block, unsigned long offset);
 
 unsigned long calypso_get_free_blocks_group(unsigned long *bitmap, unsigned long last_block, unsigned int nblocks);
-int calypso_get_next_free_block(unsigned long *bitmap, unsigned long last_block, unsigned long *free_block);
+int calypso_get_next_free_block(struct calypso_block_state *block_state, unsigned long last_block, unsigned long *free_block);
 
 void calypso_set_bit(unsigned long *bitmap, unsigned long start);
 void calypso_clear_bit(unsigned long *bitmap, unsigned long start);
-void calypso_update_bitmaps(unsigned long *physical_blocks_bitmap, unsigned long *high_entropy_blocks_bitmap, unsigned long start);
 
 int calypso_dev_init(struct calypso_blk_device **calypso_dev);
 
@@ -116,7 +261,9 @@ int calypso_dev_setup(struct calypso_blk_device *calypso_dev,
                     struct block_device_operations *calypso_fops, 
                     struct blk_mq_ops *calypso_fops_req,
                     const char *dev_name,
-                    int *calypso_major);
+                    int *calypso_major,
+                    unsigned int nr_hw_queues,
+                    unsigned int cmd_size);
 
 int calypso_dev_no_queue_setup(struct calypso_blk_device *calypso_dev, 
                     struct block_device_operations *calypso_fops,